@@ -2,9 +2,43 @@
 #include <ctime>
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <future>
+#include <deque>
 #include <string.h>
 #include <stdio.h>
 #include <Windows.h>
+#include <Psapi.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MOTION_SIMD 1 // the SSE2 and AVX2 kernels of the motion detector are built, picked at run time
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 //#include <pthread.h>
 
 #define ALIGN_TO_WALL_CLOCK 1
@@ -29,76 +63,1029 @@ namespace FfmpegLibrary
 #include <libavdevice/avdevice.h>
 #include <libavutil/imgutils.h>
 #include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
 }
 
-	static enum AVPixelFormat get_hw_format(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts);
-	static enum AVPixelFormat m_hw_pix_fmt;
+// a borrowed view of a packet in the circular buffer, see CircularBuffer::peek_views
+// data points into the storage of the circular buffer and stays valid until the reader releases its views.
+struct PacketView
+{
+	const uint8_t* data;
+	int size;
+	int64_t pts;
+	int64_t dts;
+	int64_t duration;
+	int flags;
+	int stream_index;
+	int64_t time; // wall clock time of the packet in microseconds
+};
+
+// a slot of the circular buffer
+// seq holds the sequence number + 1 of the packet stored in the slot, 0 when the slot is empty.
+// SLOT_BUSY is set while the writer is releasing the packet, readers have to back off then.
+// SLOT_THINNED is set with the sequence number when the payload has been dropped to thin the GOP, readers skip the packet.
+// pins counts the readers that are referencing the packet of the slot at this moment.
+// view holds the fields of the packet as a PacketView for read_views, stored and loaded through atomics
+// since the writer rewrites the slot under the readers taking views.
+#define SLOT_BUSY (1ULL << 63)
+#define SLOT_THINNED (1ULL << 62)
+#define SLOTS_PER_SECOND 128 // packet slots reserved per second of time span
+#define MIN_SLOTS 256 // minimum number of packet slots
+// maximum number of readers opened at the same time, including the ones the buffer opens for itself
+// the spill thread, every running export or event and every snapshot source or decode worker take one each
+#ifndef MAX_READERS
+#define MAX_READERS 16
+#endif
+struct PacketSlot
+{
+	AVPacket pkt;
+	int64_t time; // wall clock time of the packet in microseconds, from its dts
+	std::atomic<uint64_t> seq;
+	std::atomic<int> pins;
+	std::atomic<uint64_t> view[sizeof(PacketView) / 8];
+};
+
+// an entry of the keyframe index, the sequence number and wall clock time of a keyframe in the circular buffer
+struct KeyframeEntry
+{
+	std::atomic<uint64_t> seq;
+	std::atomic<int64_t> time;
+};
+
+// a stream in the circular buffer
+// packets of multiple streams wait in the pending queues of their streams until they can be published in dts order
+#define MAX_STREAMS 4 // maximum number of streams in a circular buffer
+#define MAX_PENDING 64 // maximum number of packets of a stream waiting to be interleaved
+#define INTERLEAVE_DELAY 100000 // default maximum time in microseconds a packet waits for the packets of other streams
+struct BufferStream
+{
+	int index; // index of the stream in the input
+	AVStream* st; // local copy of the stream
+	AVCodecParameters* codecpar; // codec parameters of the stream
+	AVRational time_base; // time base of the stream
+	int64_t last_pts; // last valid pts
+	int64_t last_time; // wall clock time of the newest packet pushed, INT64_MIN before the first one
+	AVPacket pending[MAX_PENDING]; // packets waiting to be interleaved
+	int64_t pending_time[MAX_PENDING]; // wall clock time of the packets waiting
+	int pending_first; // index of the first packet waiting
+	int pending_count; // number of packets waiting
+};
+
+// a chunk of the payload arena, followed by the payload and its zeroed padding
+// refs is 1 held by the slot until the packet is evicted and no longer viewed, plus 1 per packet handed out to the readers.
+// The arena space is reclaimed in order, once the oldest chunk has no more references.
+#define ARENA_ALIGN 64
+struct ArenaChunk
+{
+	std::atomic<int> refs;
+	int size; // bytes taken by the chunk in the arena
+	uint64_t seq; // sequence number of the packet
+};
+
+// the storage of the arena, freed once the circular buffer and every packet handed out to the readers have let it go
+// refs is 1 held by the circular buffer until it is opened again or destroyed, plus 1 per packet handed out to the readers.
+// A reader may still unref its packets after that, the storage is freed by the last of them.
+struct ArenaStorage
+{
+	std::atomic<int> refs;
+	uint8_t* heap; // allocated with av_malloc
+	void* mapped; // mapped by map_storage
+	size_t mapped_size;
+	void* shared; // the mapping of the shared memory the arena is placed in
+	size_t shared_size;
+
+	ArenaStorage() : refs(1), heap(NULL), mapped(NULL), mapped_size(0), shared(NULL), shared_size(0)
+	{
+	}
+};
+
+// an evicted packet kept by the writer until no reader can be viewing it any more
+// The writer bumps the epoch after every retirement. A reader announces the epoch it saw before taking views,
+// so a packet retired in an epoch older than every announced one can no longer be reached and is freed.
+// A retired packet is never freed while a reader may view it. Only the packets in the range of sequence numbers a reader
+// has announced before taking its views are retired, the packets a stalled reader never reached are freed directly.
+// The retired packets still count in the size of the circular buffer, so the writer evicts more of the live packets for them.
+#define RETIRE_BATCH 32 // number of retirements before the writer tries to free the retired packets
+struct RetiredPacket
+{
+	AVPacket pkt;
+	uint64_t epoch; // the epoch the packet was retired in
+};
+
+// a reader of the circular buffer
+// seq is the sequence number of the next packet to read. It is only moved by the reader itself,
+// the writer never fixes up the readers on eviction. A reader behind the tail is moved to the tail when it reads next time.
+struct PacketReader
+{
+	std::atomic<bool> used; // the reader is opened
+	std::atomic<uint64_t> seq; // sequence number of next packet to read
+	std::atomic<int64_t> time; // wall clock time of the last packet read in microseconds
+	std::atomic<int64_t> lost; // number of packets evicted before the reader could read them
+	std::atomic<uint64_t> epoch; // the epoch the reader took its views in, 0 when it holds no view
+	std::atomic<uint64_t> view_first; // the first sequence number the reader may be viewing since it took its views
+	std::atomic<uint64_t> view_end; // the sequence number past the last one it may be viewing, 0 when it holds no view
+};
+
+// the wakeup signal of the threads waiting for new packets
+// A circular buffer has its own signal, several circular buffers can share one so that a thread can wait on all of them.
+// The writer only takes the mutex when waiters is not 0, so publishing costs no syscall while nobody is waiting.
+#define WAIT_SPINS 200 // times to check the heads again before going to sleep
+#define MAX_WAIT_BUFFERS 16 // maximum number of buffers waited on at the same time
+struct PacketSignal
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic<int> waiters; // number of threads sleeping or about to sleep on the signal
+	std::atomic<unsigned int> turn; // the buffer to check first by wait_packets, rotated to be fair
+};
+
+// an entry of the spill index, where the packet of a sequence number is in the spill file
+// seq is the sequence number + 1 of the packet, 0 when the packet was lost before it could be spilled.
+// pos is the position of the record counted from the beginning of the spilling, the offset in the file is pos % file size.
+#define SPILL_ALIGN 8
+#define SPILL_DEFAULT_SIZE (256LL * 1024 * 1024) // the file is mapped as one view, small enough for the address space of a 32-bit process
+#define SPILL_MAX_SIZE (sizeof(void*) < 8 ? 1024LL * 1024 * 1024 : 1LL << 40) // largest view asked for
+struct SpillEntry
+{
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> pos;
+	std::atomic<int64_t> time; // wall clock time of the packet in microseconds
+};
+
+// a packet record in the spill file, followed by the payload
+// its size is a multiple of SPILL_ALIGN, so that the payload is aligned for the word copies of store_words and load_words
+struct SpillRecord
+{
+	uint64_t seq;
+	int64_t pts;
+	int64_t dts;
+	int64_t duration;
+	int size;
+	int flags;
+	int stream_index;
+	int length; // bytes taken by the record in the file, aligned to SPILL_ALIGN
+};
+
+// the shared memory of a circular buffer, readable by other processes with a SharedReader
+// It holds the header, then the slot table at slots_offset, then the payload arena at arena_offset. Only the writer writes it,
+// the readers map it read only and keep their cursors to themselves, so a reader crashing leaves nothing behind.
+// A shared slot is read like a seqlock, its seq is checked before and after copying the fields. A payload stays good
+// as long as the tail has not passed its packet, the writer only reuses the arena room after moving the tail.
+// generation is odd while the writer changes the header, and changes every time the buffer is opened or its streams change.
+#define SHARED_MAGIC 0x4d534243 // "CBSM"
+#define SHARED_VERSION 1
+#define SHARED_ALIGN 64
+#define SHARED_EXTRADATA 512 // maximum bytes of extradata of a shared stream
+struct SharedStream
+{
+	int codec_type;
+	int codec_id;
+	int format;
+	int width;
+	int height;
+	int sample_rate;
+	int channels;
+	int64_t bit_rate;
+	AVRational time_base;
+	int extradata_size;
+	uint8_t extradata[SHARED_EXTRADATA];
+};
+
+struct SharedSlot
+{
+	std::atomic<uint64_t> seq; // sequence number + 1 of the packet, 0 or SLOT_BUSY while it is rewritten
+	int64_t offset; // offset of the payload in the arena, -1 when the payload was kept in the heap of the writer
+	int size;
+	int flags;
+	int stream_index;
+	int64_t pts;
+	int64_t dts;
+	int64_t duration;
+	int64_t time; // wall clock time of the packet in microseconds
+};
+
+struct SharedHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint64_t> generation;
+	std::atomic<int> state; // 1 while the writer has the buffer opened, 0 once it is closed
+	int64_t writer_pid; // the process of the writer
+	int64_t size; // size of the shared memory
+	uint64_t capacity; // number of slots, power of 2
+	int64_t slots_offset;
+	int64_t arena_offset;
+	int64_t arena_size;
+	int nb_streams;
+	int key_stream; // the stream whose keyframes a reader starts at
+	SharedStream streams[MAX_STREAMS];
+	std::atomic<uint64_t> head; // sequence number of the next packet to be published
+	std::atomic<uint64_t> tail; // sequence number of the oldest packet
+};
+
+// The thread tuning pins threads to chosen cores, and optionally runs them under the SCHED_FIFO real-time policy, so that the
+// capturing threads are not preempted by the muxing and the analytics. It is applied by the owners of the threads as they start them.
+// SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit, the thread runs on under the normal policy when it is refused.
+// Windows has no real-time policy for a thread, the priority is mapped to THREAD_PRIORITY_TIME_CRITICAL from 50, HIGHEST below.
+// A real-time thread that never blocks starves its core, it is only meant for the threads waiting on the sockets.
+#define MAX_TUNED_CPUS 1024 // cores a list can name
+class ThreadTuning
+{
+public:
+	ThreadTuning();
+
+	// set the cores, a list such as "2,3" or "4-7", empty for any core
+	int set_cpus(std::string value);
+
+	// set the real-time priority [1-99], 0 for the normal policy
+	int set_priority(std::string value);
+
+	// apply to the thread, index picks one core of the list for the index-th thread of a group, -1 for the whole list
+	// return 0 on success, negative when the system refuses, the thread runs on as it was then
+	int apply(std::thread& thread, int index = -1);
+
+	// check whether there is anything to apply
+	bool is_set();
+
+	// get the cores of the list, empty for any core
+	std::vector<int> get_cpus();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	std::vector<int> m_cpus;
+	int m_priority;
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// a histogram of latencies in microseconds, unless noted otherwise
+// bucket i counts the values of i bits, that is [2^(i-1), 2^i), so the percentiles are given as the upper bound of their buckets.
+// It is updated by one thread and can be read by any other thread at any time.
+#define HISTOGRAM_BUCKETS 40
+struct HistogramSnapshot
+{
+	int64_t count; // number of values added
+	int64_t sum; // sum of the values added
+	int64_t max; // the largest value added
+	int64_t buckets[HISTOGRAM_BUCKETS]; // number of values in every bucket
+};
 
+class Histogram
+{
+public:
+	Histogram();
+
+	// add a value into the histogram
+	void add(int64_t value);
+
+	// clear all the values
+	void reset();
+
+	// get the number of values added
+	int64_t get_count();
+
+	// get the sum of the values added
+	int64_t get_sum();
+
+	// get the largest value added
+	int64_t get_max();
+
+	// get the value below which the percent of the values fall, rounded up to the bucket bound
+	int64_t get_percentile(double percent);
+
+	// get the number of values in the bucket
+	int64_t get_bucket(int bucket);
+
+	// copy the values out, the copy is not atomic as a whole while values are being added
+	void get_snapshot(HistogramSnapshot* snapshot);
+
+protected:
+	std::atomic<int64_t> m_buckets[HISTOGRAM_BUCKETS];
+	std::atomic<int64_t> m_count;
+	std::atomic<int64_t> m_sum;
+	std::atomic<int64_t> m_max;
+};
+
+// a clip being exported by its worker thread, done is set once the result is given to the future
+// end_time is moved forward to extend an event, the worker swaps it to -1 when it completes so it cannot be extended any more
+#define EXPORT_BATCH 64 // packets pinned or muxed in a row by the export worker
+#define EXPORT_IDLE_TIMEOUT 5000000 // time in microseconds without a new packet before an export waiting for the live packets gives up
+struct ExportTask
+{
+	std::thread thread;
+	std::atomic<bool> done;
+	std::atomic<int64_t> end_time; // wall clock time in microseconds the export ends at, -1 once complete
+};
+
+// the metrics of a circular buffer at a moment, see CircularBuffer::get_metrics
+#define METRICS_SAMPLE 16 // push_packet is timed once every this many pushes
+struct BufferMetrics
+{
+	int packets; // packets in the buffer
+	int bytes; // size of the buffer
+	int64_t pushed; // packets pushed since open
+	int64_t pushed_bytes; // payload bytes pushed since open
+	int64_t evicted_time; // packets evicted for being out of the time span
+	int64_t evicted_size; // packets evicted to keep the size under the maximum size, or to make room in the arena
+	int64_t evicted_slots; // packets evicted because all the packet slots were occupied
+	int64_t thinned; // non-keyframes dropped from the old GOPs to keep the size under the maximum size
+	int readers; // number of readers opened, the first readers entries of the following arrays are valid
+	int reader[MAX_READERS]; // handle of the reader
+	int reader_lag[MAX_READERS]; // number of packets the reader is behind the newest packet
+	int64_t reader_lag_time[MAX_READERS]; // time in miliseconds the reader is behind the newest packet
+	int64_t reader_lost[MAX_READERS]; // number of packets evicted before the reader could read them
+	HistogramSnapshot push_latency; // time in nanoseconds push_packet takes, sampled every METRICS_SAMPLE pushes
+};
+
+// The circular buffer is a fixed capacity ring of packet slots.
+// There is a single writer (the capturing thread) and up to MAX_READERS readers, 16 unless the build defines it.
+// Every packet pushed gets a monotonically increasing sequence number, and the slot it lives in is seq & (capacity - 1).
+// The writer publishes new packets by advancing the head and retires old packets by advancing the tail, both with release ordering.
+// Every reader, opened by open_reader(), owns a sequence number pointing to the next packet it is going to read. 
+// No mutex is used, a reader only pins the slot while taking a reference of the packet.
+// The keyframes in the circular buffer are indexed in a second ring in the same way, which is binary searched to seek a reader by time.
+// Multiple streams share one timeline. Packets are published in dts order across the streams and evicted by a common wall clock horizon.
+// Optionally the packet payloads are copied into one preallocated arena of max_size bytes instead of being referenced,
+// then the readers get packets whose buffers point into the arena.
+// Optionally a spill file extends the history on disk. A spill thread follows the head like a reader and writes every packet
+// sequentially into a memory-mapped ring file, so evicting a packet from the memory never waits for the disk.
+// A reader behind the tail of the memory reads the packets from the spill file instead, seek covers both of them.
+// Optionally the slots and the arena are backed by hugepages, to spare the TLB misses of the readers spread over them, and
+// bound to the NUMA node of the core the capturing thread is pinned to.
+#define HUGEPAGES_NONE 0 // the normal pages
+#define HUGEPAGES_TRANSPARENT 1 // the mapping is aligned and advised to the kernel, which backs it with hugepages when it can
+#define HUGEPAGES_EXPLICIT 2 // the hugepages reserved in the pool of the system, the transparent ones when none is left
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 class CircularBuffer
 {
 public:
 	CircularBuffer();
 	~CircularBuffer();
 
+	// set the options for the circular buffer, has to be called before open
+	int set_options(std::string option, std::string value);
+
+	// open the circular buffer, all the streams added before are removed
+	// capacity is the number of packet slots, it is rounded up to the power of 2. 0 to derive it from the time span
+	void open(int time_span, int max_size, int capacity = 0);
+
 	// Add the stream into the circular buffer
-	//int add_stream(AVFormatContext* ifmt_Ctx, int stream_index = 0);
-	void open(int time_span, int max_size);
+	// non-negative return is the index of the stream in the circular buffer
 	int add_stream(AVStream * stream);
 
 	// push or add a packet to the circular buffer
-	// The pkt.stream_index is changed to 0
-	// positive return indicates the packet is added successfully. The number returned is the current total packets in the circular buffer.
-	// 0 return indicates that the packet is added successfully but the circular buffer has suffered oversized and been revised.
+	// The pkt.stream_index is changed to the index of the stream in the circular buffer when it is read
+	// non-negative return indicates the packet is added successfully. The number returned is the current total packets published
+	// in the circular buffer, not counting the packets waiting to be interleaved with the other streams.
+	// negative return indicates that the packet is not added
 	int push_packet(AVPacket* pkt);
 
-	// read a packet out of the circular buffer.
-	// read a packet using the background reader when isBackground is true
-	// read a packet using the main reader when isBackground is false
+	// open a new reader starting from the oldest keyframe in the circular buffer
+	// non-negative return is the handle of the reader, -2 when all the MAX_READERS handles are in use
+	// the spill thread, the exports and the events of the buffer take their handles from the same table
+	int open_reader();
+
+	// close the reader so that its handle can be used by others
+	int close_reader(int reader);
+
+	// read a packet out of the circular buffer using the specified reader
 	// a positive return indicates the packet is read. 
-	int peek_packet(AVPacket* pkt, bool isBackground=true);
+	int peek_packet(AVPacket* pkt, int reader);
+
+	// read a run of up to count packets out of the circular buffer using the specified reader, moving the reader once
+	// the packets have to be unreferenced by the caller. Return the number of packets read into pkts, 0 when there is no new packet
+	int peek_packets(AVPacket* pkts, int count, int reader);
+
+	// read a run of up to count views of the packets using the specified reader, moving the reader once
+	// A view borrows the payload from the storage of the circular buffer, no copy and no reference is taken. The views stay valid
+	// until release_views even if their packets are evicted meanwhile, the writer keeps the evicted packets until then.
+	// The packets kept count in the size, a reader holding its views for long leaves less of the live packets in the buffer.
+	// Return the number of views read, 0 when there is no new packet, -1 when the next packet is only in the spill file
+	int peek_views(PacketView* views, int count, int reader);
+
+	// release all the views taken by the reader, so that the writer can free the packets evicted since
+	// return 0 on success, negative when the handle is invalid
+	int release_views(int reader);
+
+	// read the newest keyframe using the specified reader, skipping every packet before it, and move the reader past it
+	// Only the keyframe index is looked at, the packets in between are never touched. The wall clock time of the keyframe
+	// in miliseconds is given in wallclock_ms when it is not NULL.
+	// a positive return indicates the keyframe is read, 0 when there is no keyframe newer than the reader
+	int peek_keyframe(AVPacket* pkt, int reader, int64_t* wallclock_ms = NULL);
+
+	// read a packet using the specified reader, waiting up to timeout miliseconds for the writer to push one. Negative timeout waits forever.
+	// a positive return indicates the packet is read, 0 on timeout, negative when the reader is invalid or closed while waiting
+	int wait_packet(AVPacket* pkt, int reader, int timeout);
+
+	// read a packet from the first of several circular buffers having one, waiting up to timeout miliseconds. Negative timeout waits forever.
+	// The buffers have to share one signal set by set_signal, the same buffer can be given several times with different readers.
+	// non-negative return is the position of the buffer whose packet is read, -1 on timeout, other negative values on errors
+	static int wait_packets(CircularBuffer** buffers, int* readers, int count, AVPacket* pkt, int timeout);
+
+	// share the wakeup signal with other circular buffers, NULL to use its own signal
+	// has to be called before pushing packets or waiting
+	void set_signal(PacketSignal* signal);
 
-	// reset the main reader to very beginning
-	void reset_main_reader();
+	// reset the reader to the oldest keyframe
+	int reset_reader(int reader);
+
+	// move the reader to the nearest keyframe at or before the wall clock time in miliseconds
+	// the reader is moved to the oldest keyframe when the time is older than that
+	// return 0 on success, negative when there is no keyframe in the circular buffer
+	int seek_reader(int reader, int64_t wallclock_ms);
+
+	// get the number of packets the reader is behind the newest packet
+	int get_reader_lag(int reader);
+
+	// get the time in miliseconds the reader is behind the newest packet
+	int64_t get_reader_lag_time(int reader);
+
+	// get the number of packets evicted before the reader could read them
+	int64_t get_reader_lost(int reader);
 
 	// get the stream codec parameters that defines the packet in the circular buffer
-	AVCodecParameters* get_stream_codecpar();
+	AVCodecParameters* get_stream_codecpar(int stream_index = 0);
 
 	// get the stream associated to the circular buffer
-	AVStream* get_stream();
+	AVStream* get_stream(int stream_index = 0);
 
 	// get the stream time base
-	AVRational get_time_base();
+	AVRational get_time_base(int stream_index = 0);
+
+	// get the number of streams in the circular buffer
+	int get_stream_count();
 
 	// get the circular buffer size
 	int get_size();
 
+	// get the number of packet slots of the circular buffer
+	int get_capacity();
+
+	// get the number of packets kept in the heap instead of the arena, because the arena space was still held by readers
+	int64_t get_arena_fallbacks();
+
+	// get the kind of pages the slots and the arena got at open, HUGEPAGES_NONE when they are allocated from the heap
+	int get_hugepages();
+
+	// get the number of packets in the spill file
+	int get_spilled_packets();
+
+	// get the number of packets evicted from the memory before they could be spilled
+	int64_t get_spill_lost();
+
+	// get the metrics of the circular buffer, can be called by any thread at any time
+	BufferMetrics get_metrics();
+
+	// export the packets between the wall clock times in miliseconds into a file, starting at the keyframe at or before t0
+	// The packets are pinned by taking references as soon as the worker thread reaches them, then muxed as fast as the disk allows.
+	// An end time in the future follows the live packets until it is reached. The writer is never held by the export.
+	// The future gives the number of packets written, or a negative error: -1 no keyframe or no packet in the range,
+	// -2 all the MAX_READERS readers are in use, -3 the file cannot be opened, -4 the muxing failed, -5 the export is stopped by open or destruction
+	std::future<int> export_range(int64_t t0_ms, int64_t t1_ms, std::string url);
+
+	// record an event from the keyframe pre_seconds back until post_seconds from now, or extend the event going on
+	// now is the time of the newest packet in the circular buffer
+	// The event is an export running in the background: the backlog is written as fast as the disk allows, then the live
+	// packets are followed until the end time. A trigger while the event is going on moves its end time further instead
+	// of opening another file, the file is named by the prefix and the start time.
+	// the options are set on the recorder of the event before it is opened, see VideoRecorder::set_options, the fragmented
+	// mp4 by default keeps the file playable when the power is cut during the event
+	// return 1 when a new event is started, 0 when the event going on is extended, negative as export_range
+	int trigger_event(int pre_seconds, int post_seconds, std::string prefix,
+		std::vector<std::pair<std::string, std::string> > options = { { "movflags", "frag_keyframe" } });
+
+	// get the result of the last event started once it is finished, the number of packets written or a negative error as export_range
+	// 0 while it is going on or no event has been started
+	int get_event_result();
+
+	// get the url of the file of the last event started, empty when no event has been started
+	std::string get_event_url();
+
 	// get the error message of last operation
 	std::string get_error_message();
 
 protected:
-	AVPacketList* first_pkt; // pointer to the first added packet in the circular buffer
-	AVPacketList* last_pkt; // pointer to the new added packet in the circular buffer
-	AVPacketList* bg_pkt; // the background reading pointer
-	AVPacketList* mn_pkt; // the main reading pointer
-	AVCodecParameters* m_codecpar; // The codec parameters of the bind stream
-	AVStream* m_st; // The assigned stream
-
-	int m_TotalPkts; // counter of total packets in the circular buffer
-	int m_size;  // total size of the packets in the buffer
+	// the export worker, pin the packets the reader can reach up to the end time of the task while muxing the pinned ones in order
+	int export_packets(int reader, int64_t start_time, ExportTask* task, std::string url, std::vector<std::pair<std::string, std::string> > options);
+
+	// start the worker thread of the export, the reader is opened and seeked already
+	// the result of the worker is given to the promise, the options are set on the recorder before it is opened
+	ExportTask* start_export(int reader, int64_t start_time, int64_t end_time, std::string url,
+		std::vector<std::pair<std::string, std::string> > options, std::promise<int> promise);
+
+	// stop the exports running and wait for their worker threads
+	void stop_exports();
+
+	// release the oldest packet in the circular buffer, only called by the writer
+	void evict_packet();
+
+	// release all the packets in the circular buffer
+	void clear();
+
+	// release the payload of an evicted packet, handing its arena chunk back
+	void unref_packet(AVPacket* pkt);
+
+	// release the payload of the slot marked busy, or retire it while a reader may be viewing it
+	void release_payload(PacketSlot* slot, uint64_t seq);
+
+	// thin the oldest complete GOPs down to their keyframes until the size is under the maximum size, only called by the writer
+	void thin_packets();
+
+	// free the retired packets no reader can be viewing any more, all of them when force is set
+	// return the number of packets freed
+	int free_retired(bool force);
+
+	// get the index in the circular buffer of the input stream, negative when the stream is not added
+	int find_stream(int index);
+
+	// publish the packet of the stream to the readers, then evict the packets that are out of the time span or the size
+	// return true when packets are evicted
+	bool publish_packet(AVPacket* pkt, int stream_index, int64_t time);
+
+	// publish the waiting packets in dts order
+	// a packet is published when all the other streams have packets waiting, or it has waited longer than the interleave delay
+	// a stream that has pushed nothing within the interleave delay, such as a muted audio track, is not waited for
+	// return true when packets are evicted
+	bool interleave_packets();
+
+	// store a copy of the packet into the empty slot
+	void store_packet(PacketSlot* slot, AVPacket* pkt, uint64_t seq);
+
+	// allocate a chunk in the arena for the packet, evicting the oldest packets when there is no room
+	// NULL when the arena is held by the readers or the packet is larger than the arena
+	ArenaChunk* arena_alloc(int size, uint64_t seq);
+
+	// advance the read offset of the arena over the chunks that are no longer referenced
+	void arena_reclaim();
+
+	// reference a packet whose payload is in the arena
+	void arena_ref(AVPacket* dst, AVPacket* src);
+
+	// called when a reader unrefs a packet whose payload is in the arena
+	static void arena_release(void* opaque, uint8_t* data);
+
+	// drop a reference to the storage of the arena, the last one frees it
+	static void release_arena(ArenaStorage* storage);
+
+	// read up to count packets from the sequence number specified by the reader, and move the reader forward once
+	// return the number of packets read, 0 when there is no new packet
+	int read_packets(PacketReader* reader, AVPacket* pkts, int count);
+
+	// take up to count views from the sequence number specified by the reader, and move the reader forward once
+	// return the number of views taken, 0 when there is no new packet, -1 when the next packet is only in the spill file
+	int read_views(PacketReader* reader, PacketView* views, int count);
+
+	// get the opened reader by its handle, NULL when the handle is invalid
+	PacketReader* get_reader(int reader);
+
+	// check if there is a packet the reader can read now
+	// a packet evicted from the memory and not spilled yet is not there until the spill thread has written it
+	bool has_packet(PacketReader* reader);
+
+	// wake up the threads waiting on the signal
+	void notify_waiters();
+
+	// binary search the keyframe index for the sequence number of the last keyframe at or before the wall clock time in microseconds
+	// the oldest keyframe is given when time is older than that, the oldest packet is given when there is no keyframe at all
+	uint64_t find_keyframe(int64_t time);
+
+	// get the sequence number of the oldest packet, in the spill file or in the memory
+	uint64_t get_oldest();
+
+	// create and map the spill file, then start the spill thread
+	int open_spill();
+
+	// stop the spill thread and unmap the spill file
+	void close_spill();
+
+	// the spill thread, write the packets read by the spill reader into the spill file
+	void spill_packets();
+
+	// create the shared memory and place the arena in it
+	int open_shared();
+
+	// allocate the slots, and the arena when it is used, with the hugepages and on the NUMA node set by the options
+	void alloc_storage();
+
+	// free the slots and the arena allocated by alloc_storage
+	void free_storage();
+
+	// mark the shared memory closed for the readers, then unmap and remove it
+	void close_shared();
+
+	// copy the streams into the header of the shared memory, and change its generation so that the readers attach again
+	void share_streams();
+
+	// copy the packet of the slot into the shared slot table, then publish it to the shared readers
+	void share_packet(PacketSlot* slot, uint64_t seq);
+
+	// write the packet of the sequence number into the spill file, NULL to mark the packet as lost
+	void write_spilled(AVPacket* pkt, uint64_t seq, int64_t time);
+
+	// read the packet of the sequence number out of the spill file
+	// return 1 when the packet is read, 0 when it is being spilled, -1 when it is not spilled at all, -2 when seq is moved to try again
+	int read_spilled(PacketReader* reader, uint64_t* seq, AVPacket* pkt, int64_t* time);
+
+	PacketSlot* m_slots; // the ring of packet slots
+	uint64_t m_capacity; // number of slots in the ring, always power of 2
+	uint64_t m_mask; // m_capacity - 1
+	std::atomic<uint64_t> m_head; // sequence number of the next packet to be pushed
+	std::atomic<uint64_t> m_tail; // sequence number of the oldest packet in the circular buffer
+	PacketReader m_readers[MAX_READERS]; // the readers
+	KeyframeEntry* m_keyframes; // the keyframe index, same capacity as the slots, or the spill index when it is larger
+	uint64_t m_key_mask; // capacity of the keyframe index - 1
+	std::atomic<uint64_t> m_key_head; // index of the next keyframe entry to be added
+	std::atomic<uint64_t> m_key_tail; // index of the oldest keyframe entry still in the circular buffer
+	BufferStream m_streams[MAX_STREAMS]; // the streams
+	int m_nb_streams; // number of streams added
+	int m_key_stream; // the stream whose keyframes are indexed, the first video stream
+	int64_t m_interleave_time; // wall clock time of the newest packet waiting to be interleaved
+	int64_t m_interleave_delay; // maximum time in microseconds a packet waits for the packets of other streams
+	PacketSignal m_own_signal; // the signal used when it is not shared
+	PacketSignal* m_signal; // the signal to wake up the waiting readers
+
+	std::atomic<int> m_TotalPkts; // counter of total packets in the circular buffer
+	std::atomic<int> m_size;  // total size of the packets in the buffer
 	int m_time_span;  // max time span in seconds
-	int64_t m_pts_span; // pts span
-	int64_t m_last_pts;  // last valid pts
-	AVRational m_time_base; // the time base of the bind stream
-	int m_stream_index; // the desired stream index
+	int64_t m_time_span_us; // max time span in microseconds
+	std::atomic<int64_t> m_last_time;  // wall clock time of the newest packet in microseconds
 	int m_MaxSize; // the maximum size allowed for the circular buffer 
+	bool m_thin; // thin the old GOPs down to their keyframes before evicting whole packets for the size
+	uint64_t m_thin_seq; // the packets before this sequence number are thinned already, owned by the writer
+
+	bool m_use_arena; // copy the payloads into the arena
+	uint8_t* m_arena; // the payload arena, m_MaxSize bytes
+	int m_arena_size; // size of the arena
+	int m_arena_read; // offset of the oldest chunk
+	int m_arena_write; // offset of the next chunk
+	int m_arena_end; // end of the chunks at the top of the arena when the write offset has wrapped, 0 otherwise
+	int m_arena_chunks; // number of chunks in the arena
+	std::atomic<int64_t> m_arena_fallbacks; // number of packets kept in the heap because the arena was held by readers
+	int m_hugepages; // the kind of pages asked for the slots and the arena
+	int m_hugepages_used; // the kind of pages they got
+	int m_numa_node; // the NUMA node they are bound to, -1 for the policy of the system
+	size_t m_slots_mapped; // bytes mapped for the slots, 0 when they are allocated from the heap
+	ArenaStorage* m_arena_storage; // the storage of the arena held by the circular buffer, NULL without arena
+
+	// once a reader has taken views, the evicted packets are retired instead of freed until the views are released
+	std::atomic<bool> m_views; // a reader may be holding views, cleared by the writer once no reader holds any
+	std::atomic<uint64_t> m_epoch; // the current epoch, bumped by the writer after every retirement
+	std::vector<RetiredPacket> m_retired; // the ring of retired packets in epoch order, owned by the writer, as many as the slots at least
+	size_t m_retired_first; // index of the oldest retired packet
+	size_t m_retired_count; // number of retired packets
+
+	std::string m_spill_url; // the spill file, empty when there is no spilling
+	int64_t m_spill_size; // size of the spill file
+	int m_spill_span; // max time span in seconds of the packets in the spill file
+	uint8_t* m_spill_map; // the spill file mapped into the memory, NULL when there is no spilling
+#ifdef _WIN32
+	HANDLE m_spill_file;
+	HANDLE m_spill_mapping;
+#else
+	int m_spill_fd;
+#endif
+	SpillEntry* m_spill_index; // where the spilled packets are in the file, indexed by their sequence numbers
+	uint64_t m_spill_capacity; // number of entries of the spill index, always power of 2
+	uint64_t m_spill_mask; // m_spill_capacity - 1
+	std::atomic<uint64_t> m_disk_head; // sequence number of the next packet to be spilled
+	std::atomic<uint64_t> m_disk_tail; // sequence number of the oldest packet in the spill file
+	std::atomic<uint64_t> m_spill_drop; // the packets before this sequence number are dropped from the spill file when cleared
+	uint64_t m_spill_pos; // position of the next record, owned by the spill thread
+	int m_spill_reader; // the reader of the spill thread
+	std::thread m_spill_thread; // the spill thread
+	std::atomic<bool> m_spill_stop; // ask the spill thread to stop
+	std::atomic<bool> m_spill_waited; // a waiter sleeps on a packet evicted from the memory and not spilled yet
+
+	std::string m_shared_name; // the name of the shared memory, empty when the buffer is not shared
+	std::string m_shared_path; // the name of the shared memory opened, removed when it is closed
+	int64_t m_shared_size; // size of the shared memory
+	uint8_t* m_shared_map; // the shared memory mapped, NULL when the buffer is not shared
+	SharedHeader* m_shared; // the header at the beginning of the shared memory
+	SharedSlot* m_shared_slots; // the slot table of the shared memory
+#ifdef _WIN32
+	HANDLE m_shared_mapping;
+#else
+	int m_shared_fd;
+#endif
+
+	// the metrics are only updated by the writer, the plain loads and stores of the counters cost no locked instruction
+	std::atomic<int64_t> m_pushed; // packets pushed since open
+	std::atomic<int64_t> m_pushed_bytes; // payload bytes pushed since open
+	std::atomic<int64_t> m_evicted_time; // packets evicted for being out of the time span
+	std::atomic<int64_t> m_evicted_size; // packets evicted for the size or the arena room
+	std::atomic<int64_t> m_evicted_slots; // packets evicted because all the slots were occupied
+	std::atomic<int64_t> m_thinned; // non-keyframes dropped from the old GOPs
+	Histogram m_push_latency; // time in nanoseconds push_packet takes, sampled
+
+	std::vector<ExportTask*> m_exports; // the exports started, the finished ones are cleaned up by the next export
+	std::mutex m_export_mutex; // protects the exports and the event
+	std::atomic<bool> m_export_stop; // ask the exports to stop
+	ExportTask* m_event; // the export of the last event, may be complete already
+	std::shared_future<int> m_event_result; // the result of the export of the last event
+	std::string m_event_url; // the file of the last event
+
+	// the error code and message are owned by the writer, readers report through the return value only
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// a reader of a circular buffer shared by another process, see the "shared_memory" option of the circular buffer
+// The shared memory is mapped read only and the cursor is kept by the reader, the writer never waits for it.
+// The views point into the shared memory with no copy, they are only good until the writer reuses their room,
+// which release_views tells afterwards. A consumer has to drop what it made of the views when they are reported overwritten.
+class SharedReader
+{
+public:
+	SharedReader();
+	~SharedReader();
+
+	// attach to the shared memory of a circular buffer by its name, starting from the oldest keyframe
+	int open(std::string name);
+
+	// detach from the shared memory
+	void close();
+
+	// take a run of up to count views of the packets
+	// return the number of views taken, 0 when there is no new packet, -1 when not attached,
+	// -2 when the writer has opened the buffer again or changed its streams, the reader has to be opened again
+	int peek_views(PacketView* views, int count);
+
+	// end the use of the views taken since the last release
+	// return 0 when they were all intact, -1 when the writer has reused the room of some of them meanwhile
+	int release_views();
+
+	// read a copy of the next packet, the packet has to be unreferenced by the caller
+	// the return is the same as peek_views, 1 when the packet is read
+	int peek_packet(AVPacket* pkt);
+
+	// move the reader to the oldest keyframe
+	int reset();
+
+	// get the number of streams of the circular buffer
+	int get_stream_count();
+
+	// get the codec parameters of the stream
+	AVCodecParameters* get_stream_codecpar(int stream_index = 0);
+
+	// get the time base of the stream
+	AVRational get_time_base(int stream_index = 0);
+
+	// get the number of packets overwritten before the reader could read them, or while it was using their views
+	int64_t get_lost();
+
+	// check the writer still has the buffer opened
+	bool is_writer_alive();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	uint8_t* m_map; // the shared memory mapped read only
+	int64_t m_size; // size of the mapping
+	const SharedHeader* m_header;
+	const SharedSlot* m_slots;
+	const uint8_t* m_arena;
+	uint64_t m_mask; // capacity of the slot table - 1
+	uint64_t m_generation; // generation of the shared memory when it was attached
+	uint64_t m_seq; // sequence number of the next packet to read
+	uint64_t m_view_seq; // sequence number of the oldest view not released yet, UINT64_MAX when there is none
+	int64_t m_lost;
+	int m_nb_streams;
+	AVCodecParameters* m_codecpar[MAX_STREAMS];
+	AVRational m_time_base[MAX_STREAMS];
+#ifdef _WIN32
+	HANDLE m_mapping;
+#else
+	int m_fd;
+#endif
 
 	int m_err; // the error code of last operation
 	std::string m_message; // the error message of last operation
+};
+
+
+// a task of the muxing thread of a recorder in async mode
+#define RECORD_PACKET 0 // write the packet
+#define RECORD_CHUNK 1 // make another chunked recording
+#define RECORD_CLOSE 2 // close the recording and stop the muxing thread
+#define RECORDER_QUEUE_SIZE 512 // default number of tasks waiting for the muxing thread
+struct RecorderTask
+{
+	int command;
+	int stream_index;
+	int64_t time; // wall clock time in miliseconds the task was queued, the muxing thread may run behind
+	AVPacket pkt;
+};
+
+// the statistics of the queue of a recorder in async mode
+struct RecorderStats
+{
+	int depth; // number of tasks in the queue
+	int max_depth; // the largest depth seen since open
+	int64_t packets; // number of packets queued since open
+	int64_t blocked; // number of packets that had to wait for room in the queue
+	int64_t blocked_time; // total time in microseconds spent waiting for room in the queue
+	int64_t max_write_time; // the longest time in microseconds the muxing thread spent on one task
+};
+
+// the metrics of a recorder at a moment, see VideoRecorder::get_metrics
+struct RecorderMetrics
+{
+	int64_t packets; // packets written since construction
+	int64_t bytes; // payload bytes written since construction
+	int64_t errors; // failed writes
+	int64_t rotations; // chunks rotated
+	int queue_depth; // number of tasks waiting for the muxing thread in async mode
+	int64_t blocked; // number of packets that had to wait for room in the queue
+	int64_t file_writes; // write system calls to the recording files opened by the recorder
+	int64_t syncs; // syncs of the recording files completed by the durability policy
+	int64_t sync_errors; // syncs failed
+	int64_t bytes_at_risk; // payload bytes recorded but not synced yet
+	HistogramSnapshot write_latency; // time in microseconds a packet takes to be written to the output
+	HistogramSnapshot rotation_latency; // time in microseconds the recording is held by the chunk rotations
+	HistogramSnapshot sync_latency; // time in microseconds a sync takes
+	HistogramSnapshot at_risk; // payload bytes at risk just before every sync completes
+};
+
+// The rescaler converts the time stamps of a stream from one time base to another, rounding to the nearest with the halves
+// away from zero, exactly as av_rescale_q does. The ratio of the time bases is reduced once when the rescaler is set, and a
+// path is picked for it: a copy when the time bases are the same, as when mp4 keeps the 90kHz of the camera, fixed ratios
+// known at compile time for 90kHz to and from miliseconds, and a generic path otherwise. The paths multiply and divide in
+// 64 bits while the product cannot overflow, larger time stamps go through av_rescale_rnd which works on 128 bits.
+#define RESCALE_COPY 0 // same time base
+#define RESCALE_90K_TO_MS 1 // 1/90000 to 1/1000
+#define RESCALE_MS_TO_90K 2 // 1/1000 to 1/90000
+#define RESCALE_GENERIC 3 // any other ratio
+class Rescaler
+{
+public:
+	Rescaler();
+
+	// set the input and output time bases
+	void set(AVRational from, AVRational to);
+
+	// rescale a time stamp, AV_NOPTS_VALUE is given back as it is
+	int64_t rescale(int64_t ts);
+
+	// rescale the pts and dts of the packet, and its duration when it is set
+	void rescale_packet(AVPacket* pkt);
+
+	// get the path picked for the time bases
+	int get_path();
+
+protected:
+	// rescale by a ratio fixed at compile time, so that the division is turned into a multiplication
+	template <int64_t MUL, int64_t DIV>
+	static int64_t rescale_fixed(int64_t ts);
 
-	bool flag_writing; // flag indicates adding new packet to the circular buffer
-	bool flag_reading; // flag indicates reading from the circular buffer
+	// rescale the fields of the packet by a fixed ratio
+	template <int64_t MUL, int64_t DIV>
+	static void rescale_fields(AVPacket* pkt);
+
+	// rescale by the ratio of the time bases
+	int64_t rescale_generic(int64_t ts);
+
+	int m_path;
+	int64_t m_mul; // numerator of the reduced ratio
+	int64_t m_div; // denominator of the reduced ratio
+	int64_t m_limit; // largest magnitude of a time stamp whose product does not overflow 64 bits
+};
+
+// The recording file is a write-back AVIOContext over a local file opened by the recorder, used in place of avio_open.
+// Its buffer is a multiple of the page and holds about a second of the stream instead of the 32KB of avio_open, so the small
+// writes of the muxer reach the file in a few large positioned writes. The file is preallocated to the expected size of the
+// chunk, so that it is laid out in one go rather than grown by every append, and it is truncated to the bytes written when
+// closed. The position is kept by the context, a seek of the muxer costs no system call.
+#define FILE_ALIGN 4096 // unit of the size of the buffer
+#define FILE_MIN_BUFFER (256 * 1024) // smallest buffer picked by the size of the stream
+#define FILE_MAX_BUFFER (8 * 1024 * 1024) // largest buffer picked by the size of the stream
+#define FILE_DEFAULT_BITRATE 4000000 // bits per second expected when the streams do not tell
+class FileSyncer;
+class RecordingFile
+{
+	friend class FileSyncer;
+
+public:
+	// open the file at url for writing and set up the context, with a buffer of buffer_size bytes
+	// prealloc bytes are allocated to the file up front, 0 for none. writes counts the write system calls, can be NULL
+	// return 0 on success, a negative AVERROR otherwise
+	static int open(AVIOContext** pb, std::string url, int buffer_size, int64_t prealloc, std::atomic<int64_t>* writes = NULL);
+
+	// flush the buffer, truncate the file to the bytes written and close it, pb is set to NULL
+	// with a syncer the file is queued to be synced before it is closed, durable up to mark bytes recorded
+	// a context not opened by the recording file is closed by avio_closep
+	static int closep(AVIOContext** pb, FileSyncer* syncer = NULL, int64_t mark = 0);
+
+	// flush the buffer into the file and queue the file to the syncer, the recording goes on while it is synced
+	// return 0 when queued, negative when the context is not a recording file or cannot be flushed
+	static int sync(AVIOContext* pb, FileSyncer* syncer, int64_t mark);
+
+	// check whether the url is a local file, other protocols are left to avio_open
+	static bool is_local(std::string url);
+
+	// get the buffer size for a stream of bitrate bits per second, about a second of it
+	static int get_buffer_size(int64_t bitrate);
+
+	// get the expected size of a chunk of seconds at bitrate bits per second, with room for the container
+	static int64_t get_expected_size(int64_t bitrate, int seconds);
+
+protected:
+	RecordingFile();
+	~RecordingFile();
+
+	// write the buffer of the context at the current position
+	static int write_packet(void* opaque, uint8_t* buf, int size);
+
+	// move the current position, or get the size of the file with AVSEEK_SIZE
+	static int64_t seek(void* opaque, int64_t offset, int whence);
+
+#ifdef _WIN32
+	HANDLE m_file;
+#else
+	int m_fd;
+#endif
+	int64_t m_pos; // position of the next write
+	int64_t m_size; // bytes written, the file is truncated to it
+	int m_err; // the first write error, the following writes fail with it
+	std::atomic<int64_t>* m_writes; // counts the write system calls
+};
+
+// a recording file waiting to be synced, by a duplicate of its handle that keeps it open until then
+struct SyncRequest
+{
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+	int64_t mark; // bytes recorded when the sync was requested, durable once it completes
+};
+
+// The file syncer makes the recording files durable in a background thread, so the writer never waits for the storage.
+// The writer flushes the buffer of the file into the system and hands over a duplicate of its handle, the file stays open
+// until it is synced even when the recording has moved on to the next chunk. The requests are synced in order.
+// The bytes at risk are the bytes recorded since the mark of the last completed sync, the data a power loss would take.
+// The time of every sync, and the bytes at risk just before it completes, are kept in histograms.
+class FileSyncer
+{
+public:
+	FileSyncer();
+	~FileSyncer();
+
+	// start the thread, written counts the bytes recorded, which the marks of the requests are taken from
+	void start(std::atomic<int64_t>* written);
+
+	// sync the files still queued, then stop the thread
+	void stop();
+
+	// queue the file to be synced by the thread
+	// return 0 when queued, negative when the syncer is not started or the handle cannot be duplicated
+	int request(RecordingFile* file, int64_t mark);
+
+	// get the mark of the last completed sync, the bytes recorded that are durable
+	int64_t get_synced();
+
+	// get the number of syncs completed since start
+	int64_t get_syncs();
+
+	// get the number of syncs failed since start
+	int64_t get_errors();
+
+	// get the histogram of the time in microseconds a sync takes
+	Histogram* get_latency();
+
+	// get the histogram of the bytes at risk just before every sync completes
+	Histogram* get_risk();
+
+protected:
+	// the syncing thread, sync the files queued in order until stopped
+	void sync_files();
+
+	std::thread m_thread;
+	std::mutex m_mutex; // protects the requests and the stop flag
+	std::condition_variable m_cond;
+	std::vector<SyncRequest> m_requests;
+	bool m_stop;
+	std::atomic<int64_t>* m_written; // bytes recorded, NULL before start
+	std::atomic<int64_t> m_synced; // mark of the last completed sync, kept from one start to the next
+	std::atomic<int64_t> m_syncs;
+	std::atomic<int64_t> m_errors;
+	Histogram m_latency;
+	Histogram m_risk;
 };
 
+// The recorder muxes the packets into a file, or a series of chunked files.
+// With the "rotation" option set to "keyframe", the next chunk is opened ahead of time by a segment thread.
+// The recording switches to it at the first video keyframe after the chunk time, so every chunk starts with a keyframe,
+// and the old chunk is finalized by the segment thread. The time taken by every rotation is kept in a histogram.
+// In async mode, set by the "async" option, record() only queues the packet and returns. A muxing thread does the rescaling,
+// writing and chunking in order. The queue is bounded, record() waits for room when the muxing thread falls behind.
+// Errors of the muxing thread are returned by the following record() calls, close() waits until all the queued packets are written.
+// The durability policy, set by the "sync_fragments", "sync_interval" and "sync_close" options, hands the recording files over to a
+// syncing thread every few fragments, every few miliseconds or when they are closed, so the writing never waits for the storage.
 class VideoRecorder
 {
 public:
@@ -123,8 +1110,12 @@ public:
 	int close();
 
 	// save the packet to the video recorder
-	// the stream index specify the audio or video
-	int record(AVPacket* pkt, int stream_index = 0); 
+	// the stream index specify the audio or video, negative to use the stream index of the packet
+	int record(AVPacket* pkt, int stream_index = -1); 
+
+	// save a borrowed view of a packet to the video recorder, the recorder never owns the payload
+	// in sync mode the payload is written straight out of the view, in async mode it has to be copied into the queue
+	int record_view(const PacketView* view, int stream_index = -1);
 
 	// set the options for video recorder, has to be called before open
 	int set_options(std::string option, std::string value); 
@@ -141,7 +1132,59 @@ public:
 	// get the recording filename or url
 	std::string get_url();
 
+	// get the statistics of the queue in async mode
+	RecorderStats get_stats();
+
+	// get the histogram of the time in microseconds the recording is held by the chunk rotations
+	Histogram* get_rotation_latency();
+
+	// get the metrics of the recorder, can be called by any thread at any time
+	RecorderMetrics get_metrics();
+
 protected:
+	// write the packet to the output, then chunk the recording when it is time
+	// time is the wall clock time in miliseconds the packet was recorded at
+	int mux_packet(AVPacket* pkt, int stream_index, int64_t time);
+
+	// close current recording in case there is one, then start another recording by chunk prefix
+	// the chunk is named after the wall clock time in miliseconds, 0 for the current time
+	int mux_chunk(int64_t time = 0);
+
+	// write the trailer and close the output
+	int mux_close();
+
+	// switch to the chunk opened ahead of time, and hand the current one over to the segment thread
+	// the chunk is named after the wall clock time in miliseconds of the keyframe it starts with
+	int rotate(int64_t time);
+
+	// get the next chunk time after the wall clock time in miliseconds, at x:xx:00 if wall clock alignment is set
+	// 0 for the current time
+	int64_t get_next_chunk_time(int64_t time = 0);
+
+	// reset the factors and offsets used to rescale the time stamps, after a new output is opened
+	void reset_time_stamps();
+
+	// open the output of a recording, local files are opened as recording files unless the "io_buffer" option is avio
+	int open_output(AVIOContext** pb, std::string url);
+
+	// queue the recording file to be synced when the durability policy says it is time, after a packet is written
+	void check_sync(bool keyframe, int64_t now);
+
+	// create the output of the next chunk with the same streams, the segment thread opens it
+	void prepare_segment();
+
+	// the segment thread, open the next chunk and finalize the old ones
+	void segment_tasks();
+
+	// finalize the old chunks, close the next chunk opened ahead of time and stop the segment thread
+	void close_segments();
+
+	// queue a task for the muxing thread, waiting for room when the queue is full
+	int queue_task(int command, AVPacket* pkt, int stream_index);
+
+	// the muxing thread, run the queued tasks in order until the recording is closed
+	void mux_tasks();
+
 	std::string m_url;
 	AVFormatContext* m_ofmt_Ctx;
 	AVDictionary* m_options;
@@ -154,11 +1197,12 @@ protected:
 	bool m_flag_interleaved;
 	bool m_flag_wclk;
 
-	AVRational m_tbf_video; // the factor to rescale the packet time stamp to fit output video stream
-	AVRational m_tbf_audio; // the factor to rescale the packet time stamp to fit output audio stream
+	Rescaler m_rescale_video; // rescale the time stamps of the input video stream to the output video stream
+	Rescaler m_rescale_audio; // rescale the time stamps of the input audio stream to the output audio stream
 	AVRational m_time_base_audio;  // the time base of input audio stream
 	AVRational m_time_base_video;  // the time base of input video stream
 
+	int64_t m_start_time; // wall clock time in microseconds of the first packet in the recording, shared by audio and video
 	int64_t m_pts_offset_video;
 	int64_t m_pts_offset_audio;
 	int64_t m_defalt_duration_audio;
@@ -168,6 +1212,68 @@ protected:
 	std::string m_message; // the error message of last operation
 	std::string m_chunk_prefix;
 	std::string m_format;
+	std::string m_muxer; // the name of the output container format, null to measure the recorder without muxing
+	int m_io_buffer; // bytes of the buffer of the recording files, 0 to size it by the bit rate, -1 to open the files by avio_open
+	int64_t m_bitrate; // bits per second expected, 0 to take it from the streams
+	int64_t m_stream_bitrate; // sum of the bit rates of the streams added, 0 when they do not tell
+	bool m_flag_preallocate; // preallocate the chunk files to their expected size
+	std::atomic<int64_t> m_file_writes; // write system calls to the recording files
+
+	int m_sync_fragments; // sync the recording file every this many fragments, cut at the video keyframes, 0 not to
+	int m_sync_interval; // sync the recording file every this many miliseconds, 0 not to
+	bool m_flag_sync_close; // sync the recording files when they are closed
+	int m_fragment_count; // fragments since the last sync request
+	bool m_flag_fragmented; // the muxer holds the current fragment in memory until the next video keyframe, set by the movflags
+	int64_t m_fragment_mark; // payload bytes written before the video keyframe that started the current fragment
+	int64_t m_sync_time; // relative time in microseconds of the last sync request
+	FileSyncer m_syncer; // syncs the recording files in its own thread
+
+	bool m_flag_async; // mux in a seperate thread
+	int m_queue_size; // capacity of the task queue
+	std::vector<RecorderTask> m_queue; // the tasks waiting for the muxing thread
+	int m_queue_first; // index of the first task in the queue
+	int m_queue_count; // number of tasks in the queue
+	std::mutex m_queue_mutex; // protects the queue, the statistics and the async error
+	std::condition_variable m_queue_not_empty;
+	std::condition_variable m_queue_not_full;
+	std::thread m_mux_thread; // the muxing thread, running between open and close in async mode
+	ThreadTuning m_tuning; // the cores of the muxing and the segment threads
+	RecorderStats m_stats;
+	std::atomic<int> m_async_err; // the first error of the muxing thread since open
+	std::string m_async_message; // the error message of the muxing thread
+	std::string m_async_url; // the url of the recording being written by the muxing thread
+
+	bool m_flag_keyframe_rotation; // rotate the chunks at keyframes with the next chunk opened ahead of time
+	std::thread m_segment_thread; // opens the next chunk and finalizes the old ones
+	std::mutex m_segment_mutex; // protects the segment tasks and the next chunk
+	std::condition_variable m_segment_cond; // wakes up the segment thread
+	std::condition_variable m_segment_done; // signals that the next chunk is opened
+	bool m_segment_stop; // ask the segment thread to stop
+	AVFormatContext* m_prepare_ctx; // the output of the next chunk to be opened by the segment thread
+	AVDictionary* m_prepare_options; // the options to open the next chunk
+	std::string m_prepare_url; // the url of the next chunk to be opened
+	std::vector<std::pair<AVFormatContext*, int64_t>> m_finalize; // the old chunks to be finalized, with the bytes recorded into them
+	AVFormatContext* m_next_ofmt_Ctx; // the next chunk opened ahead of time, NULL when it is not ready
+	std::string m_next_url; // the url of the next chunk
+	int m_segment_err; // the error code of the segment thread since last rotation
+	std::string m_segment_message; // the error message of the segment thread
+	Histogram m_rotation_latency; // time in microseconds the recording is held by the rotations
+
+	// the metrics are only updated by the thread writing the packets
+	std::atomic<int64_t> m_written; // packets written since construction
+	std::atomic<int64_t> m_written_bytes; // payload bytes written since construction
+	std::atomic<int64_t> m_write_errors; // failed writes
+	Histogram m_write_latency; // time in microseconds a packet takes to be written to the output
+};
+
+// the metrics of a camera at a moment, see Camera::get_metrics
+struct CameraMetrics
+{
+	int64_t packets; // packets read since open
+	int64_t bytes; // payload bytes read since open
+	int64_t errors; // failed reads, not counting the empty reads in non-blocking mode
+	HistogramSnapshot inter_arrival; // time in microseconds between the packets of the video stream, or the audio stream without video
+	HistogramSnapshot jitter; // change in microseconds of the inter-arrival time from one packet to the next
 };
 
 class Camera
@@ -182,9 +1288,18 @@ public:
 	// open the camera for reading
 	int open(std::string url = "");
 
+	// close the camera and open it again at the same url, with the same options and interrupt callback
+	// used when a read has stalled, the demuxer cannot be read any further once a read is aborted midway
+	int reconnect();
+
 	// read a packet from the camera
+	// with the "nonblock" option set, AVERROR(EAGAIN) is returned when no packet is ready yet
 	int read_packet(AVPacket* pkt);
 
+	// set the callback polled by the blocking operations of the camera, a nonzero return aborts them with AVERROR_EXIT
+	// has to be called before open
+	void set_interrupt_callback(int (*callback)(void*), void* opaque);
+
 	// get the input format context
 	AVFormatContext* get_input_format_context();
 
@@ -203,6 +1318,9 @@ public:
 	// negative return indicates no audio stream in the camera
 	int get_audio_index();
 
+	// get the metrics of the camera, can be called by any thread at any time
+	CameraMetrics get_metrics();
+
 	// get the error message of last operation
 	std::string get_error_message();
 
@@ -210,6 +1328,8 @@ protected:
 	std::string m_url;
 	AVFormatContext* m_ifmt_Ctx;
 	AVDictionary* m_options;
+	AVIOInterruptCB m_interrupt; // the interrupt callback, given again to the context opened by reconnect
+	bool m_nonblock; // the non-blocking flag, given again to the context opened by reconnect
 	int64_t m_start_time;  // hold the start time when the camera was opened
 	int m_index_video;
 	int m_index_audio;
@@ -218,36 +1338,625 @@ protected:
 	int m_err; // the error code of last operation
 	std::string m_message; // the error message of last operation
 	std::string m_format; // the camera format, can be rtsp, rtp, v4l2, dshow, file
+
+	// the metrics are only updated by the reading thread
+	std::atomic<int64_t> m_packets; // packets read since open
+	std::atomic<int64_t> m_bytes; // payload bytes read since open
+	std::atomic<int64_t> m_read_errors; // failed reads
+	int64_t m_last_arrival; // relative time in microseconds the last packet of the timed stream arrived, 0 before the first one
+	int64_t m_last_interval; // the last inter-arrival time in microseconds, negative before the second packet
+	Histogram m_inter_arrival; // time in microseconds between the packets of the timed stream
+	Histogram m_jitter; // change in microseconds of the inter-arrival time
 };
 
-class HWDecoder
+#define POOL_BURST 8 // packets read from one camera in a row before the thread moves on to the next camera
+#define POOL_READ_TIMEOUT 100 // default time in miliseconds a read may stall the shared thread before the camera is moved off it
+#define POOL_RECONNECT_TIMEOUT 10 // default time in seconds a reconnection or a read of a camera served by its own thread may stall
+#define POOL_IDLE_SLEEP 1000 // default time in microseconds a thread sleeps when none of its cameras has a packet ready
+class CameraPool;
+
+// a camera served by the camera pool
+struct PooledCamera
 {
-public:
-	HWDecoder();
-	~HWDecoder();
+	Camera* camera;
+	CircularBuffer* buffer; // the buffer the packets of the camera are pushed into
+	CameraPool* pool;
+	int thread; // the shared I/O thread serving the camera
+	std::thread worker; // the thread of its own serving the camera once a read has blocked
+	std::atomic<bool> dedicated; // the camera is served by its worker, the shared thread leaves it
+	int64_t deadline; // relative time in microseconds the current read or reconnection has to finish by, 0 when not reading
+	std::atomic<bool> finished; // end of the stream is reached, the camera is not read any more
+	std::atomic<int64_t> packets; // packets pushed into the buffer
+	std::atomic<int64_t> polls; // reads that found no packet ready
+	std::atomic<int64_t> reconnects; // reads stalled past their timeout, after which the camera is reconnected
+	std::atomic<int64_t> errors; // failed reads and pushes
+	std::atomic<int> last_error; // the error code of the last failure
+};
 
-	// open the decoder by type and the codec parameter specified in the stream
-	int open(AVStream* stream, std::string device = "h264-qsv");
+// the statistics of a camera in the camera pool
+struct CameraStats
+{
+	int64_t packets; // packets pushed into the buffer
+	int64_t polls; // reads that found no packet ready
+	int64_t reconnects; // reads stalled past their timeout, after which the camera is reconnected
+	int64_t errors; // failed reads and pushes
+	int last_error; // the error code of the last failure
+	bool finished; // end of the stream is reached
+	bool dedicated; // served by a thread of its own since a read blocked
+};
 
-	// send a packet to the decoder 
+// The camera pool reads many cameras with a few I/O threads, instead of one capturing thread per camera.
+// The cameras are opened in non-blocking mode, every thread walks through its cameras and reads the packets that are ready,
+// up to POOL_BURST in a row, then pushes them into the circular buffer of the camera. The thread sleeps for a while only
+// when none of its cameras had a packet. A read on the shared thread is aborted by the interrupt callback when it has stalled
+// for the read timeout, a few miliseconds, so one camera never holds the others of the thread for long.
+// A demuxer that blocks in spite of the non-blocking flag, such as RTSP over TCP in the middle of an interleaved frame,
+// cannot be read any further once aborted. The camera is then moved to a thread of its own, where it is reconnected and read
+// with blocking reads bounded by the reconnect timeout. Every reconnection is done by that thread, never by a shared one.
+// The cameras have to be added before they are opened, the interrupt callback and the non-blocking flag are taken at open.
+class CameraPool
+{
+public:
+	CameraPool();
+	~CameraPool();
+
+	// set the options of the pool, has to be called before start
+	int set_options(std::string option, std::string value);
+
+	// add a camera not opened yet, its packets are pushed into the buffer once the pool is started
+	// return the index of the camera in the pool
+	int add_camera(Camera* camera, CircularBuffer* buffer);
+
+	// start the I/O threads, the cameras are spread over them
+	int start();
+
+	// stop the I/O threads, the reads in progress are interrupted
+	int stop();
+
+	// get the number of cameras in the pool
+	int get_camera_count();
+
+	// get the statistics of the specified camera
+	CameraStats get_stats(int camera);
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	// the I/O thread, read the packets of its cameras until the pool is stopped
+	void run(int thread);
+
+	// the thread of a camera whose read has blocked, reconnect it and read it until the pool is stopped
+	void serve(PooledCamera* c);
+
+	// read up to count packets of the camera and push them into its buffer, with a deadline of timeout microseconds per read
+	// return the number of packets read, negative when the read has stalled and the camera has to be reconnected
+	int read_camera(PooledCamera* c, int count, int64_t timeout);
+
+	// the interrupt callback of the cameras, abort the read when it has stalled for the read timeout or the pool is stopping
+	static int interrupt(void* opaque);
+
+	std::vector<PooledCamera*> m_cameras;
+	std::vector<std::thread> m_threads;
+	int m_thread_count; // number of I/O threads
+	int64_t m_read_timeout; // time in microseconds a read may stall the shared thread
+	int64_t m_reconnect_timeout; // time in microseconds a reconnection or a read of a dedicated camera may stall
+	int64_t m_idle_sleep; // time in microseconds a thread sleeps when none of its cameras has a packet ready
+	ThreadTuning m_tuning; // the cores and the real-time priority of the I/O threads
+	std::atomic<bool> m_stop; // ask the I/O threads to stop, set while stopping
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// The metrics exporter writes the metrics of the circular buffers, cameras and recorders added to it into a file
+// in the Prometheus text format, for the textfile collector of node_exporter or any scraper reading the file.
+// The metrics are collected by the objects all the time with relaxed counters, the exporter only reads them when it dumps.
+// The file is written under a temporary name and renamed, so a scraper never reads it half written.
+class MetricsExporter
+{
+public:
+	MetricsExporter();
+	~MetricsExporter();
+
+	// add the objects to export, the name is given as the label of their metrics
+	void add_buffer(std::string name, CircularBuffer* buffer);
+	void add_camera(std::string name, Camera* camera);
+	void add_recorder(std::string name, VideoRecorder* recorder);
+
+	// dump the metrics into the file every interval seconds in a seperate thread, until stop is called
+	int start(std::string url, int interval);
+
+	// stop dumping the metrics
+	// return the error of the last dump of the thread, 0 when it succeeded
+	int stop();
+
+	// dump the metrics into the file once
+	int dump(std::string url);
+
+	// get the metrics in the Prometheus text format
+	std::string get_text();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	// the dumping thread, dump the metrics every interval until it is stopped
+	void dump_metrics();
+
+	// write the text into the file under a temporary name then rename it, the message is given on failure
+	static int write_file(std::string url, std::string text, std::string* message);
+
+	std::vector<std::pair<std::string, CircularBuffer*> > m_buffers;
+	std::vector<std::pair<std::string, Camera*> > m_cameras;
+	std::vector<std::pair<std::string, VideoRecorder*> > m_recorders;
+	std::string m_url; // the file the metrics are dumped into
+	int m_interval; // seconds between the dumps
+	std::thread m_thread; // the dumping thread
+	std::mutex m_mutex; // protects the objects added and the stop flag
+	std::condition_variable m_cond; // wakes up the dumping thread to stop
+	bool m_stop; // ask the dumping thread to stop
+	std::atomic<int> m_dump_err; // the error code of the last dump of the thread
+	std::string m_dump_message; // the error message of the last dump of the thread, only read after it stops
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// The packet generator is a synthetic video source for the benchmarks, no camera is needed.
+// It gives packets of a 1280x720 h264 stream at the set frame rate and bit rate, with a keyframe at the start of every GOP.
+// The keyframes are keyframe_size bytes, or 8 times the other frames when it is not set, and the other frames share the rest
+// of the bit rate. Every payload is allocated like the demuxer does, with the packet number stamped at its beginning.
+class PacketGenerator
+{
+public:
+	PacketGenerator();
+	~PacketGenerator();
+
+	// set the options of the generator, has to be called before the first packet
+	//  -fps value, frames per second, 30 by default
+	//  -bitrate value, bits per second, 4000000 by default
+	//  -gop value, frames from one keyframe to the next, 30 by default
+	//  -keyframe_size value, bytes of a keyframe, 0 to make it 8 times the other frames
+	//  -realtime value, true to wait until the packet is due at the frame rate, false to give it at once
+	int set_options(std::string option, std::string value);
+
+	// get the stream the packets belong to
+	AVStream* get_stream();
+
+	// give the next packet, the packet has to be unreferenced by the caller
+	// return the size of the packet
+	int next_packet(AVPacket* pkt);
+
+	// get the number of packets given so far
+	int64_t get_packets();
+
+	// get the number of payload bytes given so far
+	int64_t get_bytes();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	AVStream m_stream;
+	int m_fps;
+	int64_t m_bitrate;
+	int m_gop;
+	int m_keyframe_size; // bytes of a keyframe
+	int m_frame_size; // bytes of the other frames
+	bool m_realtime;
+	int64_t m_start_time; // relative time in microseconds the first packet is given
+	int64_t m_packets; // number of packets given so far
+	int64_t m_bytes; // payload bytes given so far
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// The decoder uses the hardware device when it is available, and falls back to the software decoder of libavcodec otherwise.
+// The software decoder runs with frame and slice threads, the frames come out a few packets later with frame threading.
+class HWDecoder
+{
+public:
+	HWDecoder();
+	~HWDecoder();
+
+	// set the options of the software decoder, has to be called before open
+	//  -threads value, number of decoding threads, 0 for as many as the cores
+	//  -thread_type value, frame, slice or both
+	int set_options(std::string option, std::string value);
+
+	// open the decoder by the hardware device type and the codec parameter specified in the stream
+	// the software decoder is opened when the device is empty, unsupported or fails to open
+	int open(AVStream* stream, std::string device = "qsv");
+
+	// send a packet to the decoder 
 	int send_packet(AVPacket* pkt);
 	
 	// get the decoded frame
 	int receive_frame(AVFrame* frame);
 
+	// drop the frames being decoded, after a seek or a gap in the packets
+	void flush();
+
+	// check if the decoding is done by the hardware device
+	bool is_hardware();
+
 	// get the error message of last operation
 	std::string get_error_message();
 
 protected:
+	// open the decoder of the codec on the hardware device
+	int open_hardware(AVStream* stream, std::string device);
+
+	// open the threaded software decoder of the codec
+	int open_software(AVStream* stream);
+
+	// pick the hardware surface format among the formats the decoder offers, the decoder is in the opaque of the context
+	static enum AVPixelFormat get_hw_format(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts);
 
 	AVCodecContext* m_decoder_Ctx;
-	AVCodec* m_decoder;
+	const AVCodec* m_decoder;
 	AVBufferRef* m_hw_device_Ctx;
+	enum AVPixelFormat m_hw_pix_fmt; // the hardware surface format, AV_PIX_FMT_NONE for the software decoder
+	AVFrame* m_hw_frame; // the frame on the hardware surface, before it is transferred to the memory
+	int m_threads; // number of threads of the software decoder
+	int m_thread_type; // FF_THREAD_FRAME and FF_THREAD_SLICE
 	
 	std::string m_message; // the error message of last operation
 	int m_err; // the error code of last operation
 };
 
+// the metrics of a decode worker at a moment, see DecodeWorker::get_metrics
+struct DecoderMetrics
+{
+	int64_t packets; // packets sent to the decoder
+	int64_t frames; // frames decoded
+	int64_t errors; // packets the decoder failed on
+	int64_t dropped; // decoded frames dropped because the consumer did not take them in time
+	int queue_depth; // frames waiting for the consumer
+	int frames_out; // frames of the pool held by the consumer or waiting for it
+	bool hardware; // the hardware device decodes
+	HistogramSnapshot decode_latency; // time in microseconds from sending a packet to receiving its frame
+};
+
+// The decode worker decodes a stream of a circular buffer in its own thread, with its own reader of the buffer.
+// The frames come from a bounded pool and are handed to the consumer through a queue, the consumer gives every frame back
+// with release_frame once done with it, so the decoding makes no allocation after the pool is filled. When all the frames
+// are out, the worker waits for one to be released, or drops the oldest frame waiting with the "overflow" option set to drop.
+// The time from sending a packet to receiving its frame is kept per frame in a histogram, matched by pts.
+#define DECODE_POOL_SIZE 8 // default number of frames in the pool
+#define DECODE_TIMES 64 // number of packets whose send time is kept to match their frames
+class DecodeWorker
+{
+public:
+	DecodeWorker();
+	~DecodeWorker();
+
+	// set the options for the decode worker, has to be called before open
+	//  -device value, the hardware device type, qsv by default, empty for the software decoder
+	//  -threads value, -thread_type value, the threading of the software decoder, see HWDecoder
+	//  -pool_size value, number of frames in the pool
+	//  -overflow value, wait for a frame to be released when they are all out, or drop the oldest frame waiting
+	//  -start value, newest to start at the newest keyframe, oldest to decode the whole buffer
+	int set_options(std::string option, std::string value);
+
+	// open the decoder on the stream of the circular buffer, then start the decoding thread
+	int open(CircularBuffer* buffer, int stream_index = 0);
+
+	// stop the decoding thread, the frames still held by the consumer have to be released before the worker is destroyed
+	int close();
+
+	// get the next decoded frame, waiting up to timeout miliseconds. Negative timeout waits forever.
+	// 1 when a frame is given, 0 on timeout, negative when the decoding has stopped on an error
+	int get_frame(AVFrame** frame, int timeout);
+
+	// give the frame back to the pool
+	void release_frame(AVFrame* frame);
+
+	// check if the decoding is done by the hardware device
+	bool is_hardware();
+
+	// get the metrics of the decode worker, can be called by any thread at any time
+	DecoderMetrics get_metrics();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	// the decoding thread, read the packets of the stream, decode them and queue the frames
+	void decode_frames();
+
+	// receive the frames ready in the decoder into the frames of the pool and queue them
+	// return negative when the worker is stopped or the decoder fails
+	int drain_frames();
+
+	// take a frame of the pool, waiting or dropping the oldest frame queued when they are all out, NULL when stopped
+	AVFrame* take_frame();
+
+	HWDecoder m_decoder;
+	CircularBuffer* m_buffer;
+	int m_reader; // the reader of the circular buffer
+	int m_stream_index; // the stream decoded
+	std::string m_device;
+	bool m_drop; // drop the oldest frame waiting instead of waiting for the consumer
+	bool m_start_newest; // start at the newest keyframe
+	int m_pool_size;
+
+	std::vector<AVFrame*> m_pool; // all the frames of the pool
+	std::vector<AVFrame*> m_free; // the frames free to decode into
+	std::deque<AVFrame*> m_queue; // the frames decoded, waiting for the consumer
+	std::mutex m_mutex; // protects the free frames, the queue and the stop flag
+	std::condition_variable m_frame_ready; // a frame is queued
+	std::condition_variable m_frame_free; // a frame is given back
+	bool m_stop; // ask the decoding thread to stop
+	std::thread m_thread;
+
+	int64_t m_send_pts[DECODE_TIMES]; // pts of the packets sent, to find the send time of a frame
+	int64_t m_send_time[DECODE_TIMES]; // relative time in microseconds the packets were sent
+	int m_send_next; // next entry of the send times to write
+	int64_t m_lost; // packets the reader had lost when last checked by the decoding thread
+	bool m_wait_keyframe; // skip the packets up to the next keyframe, after a gap in the packets read
+
+	// the metrics are only updated by the decoding thread
+	std::atomic<int64_t> m_packets;
+	std::atomic<int64_t> m_frames;
+	std::atomic<int64_t> m_errors;
+	std::atomic<int64_t> m_dropped;
+	std::atomic<int> m_frames_out; // frames of the pool given to the queue and not released yet
+	Histogram m_decode_latency;
+	std::atomic<int> m_thread_err; // the error the decoding thread stopped on, 0 while it runs
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// a thumbnail of a camera, a JPEG picture of a keyframe
+struct Snapshot
+{
+	int64_t time; // wall clock time of the keyframe in miliseconds
+	int width;
+	int height;
+	std::vector<uint8_t> jpeg; // the JPEG picture
+};
+
+// a camera served by the snapshot service
+// the reader and the codecs are only touched by the snapshot thread, the rest is protected by the mutex of the service
+struct SnapshotSource
+{
+	std::string name;
+	CircularBuffer* buffer;
+	int reader; // the reader of the circular buffer, only opened while subscribed
+	int subscribers;
+	int64_t next_time; // relative time in microseconds of the next snapshot
+	AVCodecContext* decoder; // single-threaded decoder of the keyframes
+	AVCodecContext* encoder; // JPEG encoder at the size of the thumbnail
+	struct SwsContext* scaler;
+	AVFrame* frame; // the decoded keyframe
+	AVFrame* thumbnail; // the scaled keyframe
+	std::deque<Snapshot> snapshots; // the newest snapshots, oldest first
+	int64_t taken; // snapshots taken
+	int64_t errors; // keyframes failing to decode or encode
+};
+
+// The snapshot service keeps a small cache of JPEG thumbnails of many cameras, taken every few seconds.
+// Only the keyframes are read out of the circular buffers, through the keyframe index, so nothing but one keyframe per
+// snapshot is decoded: a single-threaded decoder takes the keyframe alone and is flushed right after, no reference frame is kept.
+// The frame is scaled down and encoded to JPEG, then cached by camera and wall clock time.
+// One thread serves all the cameras. A camera costs nothing while it has no subscriber, its reader and codecs are released
+// and the thread sleeps as long as no camera is subscribed.
+#define SNAPSHOT_CACHE_SIZE 16 // default number of snapshots kept per camera
+#define SNAPSHOT_RETRY 200000 // time in microseconds to look again for a keyframe when there was no new one
+class SnapshotService
+{
+public:
+	SnapshotService();
+	~SnapshotService();
+
+	// set the options of the service, has to be called before start
+	//  -interval value, seconds between the snapshots of a camera, 5 by default
+	//  -width value, width of the thumbnails, 320 by default, the height keeps the aspect ratio
+	//  -quality value, JPEG quality scale from 2 (best) to 31, 5 by default
+	//  -cache_size value, number of snapshots kept per camera
+	int set_options(std::string option, std::string value);
+
+	// add a camera by name, the snapshots are taken from the keyframes of the circular buffer
+	// return the index of the camera in the service, negative when the name is already used
+	int add_camera(std::string name, CircularBuffer* buffer);
+
+	// start the snapshot thread
+	int start();
+
+	// stop the snapshot thread, the snapshots cached are kept
+	int stop();
+
+	// subscribe to the snapshots of the camera, the first subscriber takes a snapshot at once
+	// return the number of subscribers of the camera, negative when the camera is unknown
+	int subscribe(std::string name);
+
+	// unsubscribe from the snapshots of the camera, the camera is released once the last subscriber is gone
+	int unsubscribe(std::string name);
+
+	// get the newest snapshot of the camera taken at or before the wall clock time in miliseconds, 0 for the newest one
+	// return 0 on success, -1 when the camera is unknown, -2 when no such snapshot is cached
+	int get_snapshot(std::string name, int64_t wallclock_ms, Snapshot* snapshot);
+
+	// get the number of snapshots taken of the camera and the number of failures, negative when the camera is unknown
+	int64_t get_taken(std::string name);
+	int64_t get_errors(std::string name);
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	// the snapshot thread, take the snapshots of the subscribed cameras when they are due
+	void run();
+
+	// read the newest keyframe of the camera and make its snapshot
+	// return 1 when a snapshot is made, 0 when there is no new keyframe, negative on errors
+	int take_snapshot(SnapshotSource* source, Snapshot* snapshot);
+
+	// decode the keyframe alone into the frame of the camera
+	int decode_keyframe(SnapshotSource* source, AVPacket* pkt);
+
+	// scale the frame down and encode it into the snapshot
+	int encode_thumbnail(SnapshotSource* source, Snapshot* snapshot);
+
+	// release the reader and the codecs of the camera
+	void release_source(SnapshotSource* source);
+
+	// find the camera by name, NULL when unknown
+	SnapshotSource* find_source(std::string name);
+
+	std::vector<SnapshotSource*> m_sources;
+	int64_t m_interval; // time in microseconds between the snapshots of a camera
+	int m_width; // width of the thumbnails
+	int m_quality; // JPEG quality scale
+	int m_cache_size; // snapshots kept per camera
+	int m_subscribers; // subscribers of all the cameras
+	std::thread m_thread;
+	std::mutex m_mutex; // protects the cameras and the stop flag
+	std::condition_variable m_cond; // wakes up the snapshot thread on a subscription or to stop
+	bool m_stop; // ask the snapshot thread to stop
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+// The motion detector compares every luma frame with the previous one, both heavily downscaled, in cells of 8x8 pixels.
+// A pixel is changed when its luma differs by more than the threshold, a cell is active when the changed pixels are more than
+// the activity percentage of it, and the frame has motion when at least min_cells cells are active.
+// The counting kernel is picked at run time: AVX2 or SSE2 when the processor has them, the scalar one otherwise.
+// The SIMD kernels add up the changed pixels of 8 rows per byte lane, then sum them per cell with one SAD.
+#define MOTION_CELL 8 // width and height of a cell in pixels
+typedef void (*MotionKernel)(const uint8_t* cur, int cur_stride, const uint8_t* prev, int prev_stride, int width, int height, int threshold, uint16_t* cells);
+class MotionDetector
+{
+public:
+	MotionDetector();
+
+	// set the options for the motion detector
+	//  -threshold value, luma difference for a pixel to be changed, 25 by default
+	//  -activity value, percentage of changed pixels for a cell to be active, 25 by default
+	//  -min_cells value, number of active cells for a frame to have motion, 4 by default
+	//  -simd value, the kernel to use: auto, avx2, sse2 or scalar
+	int set_options(std::string option, std::string value);
+
+	// compare the luma plane with the previous one, the first frame and a change of size are compared with nothing
+	// return the number of active cells
+	int detect(const uint8_t* luma, int width, int height, int linesize);
+
+	// check if the last frame had motion
+	bool is_motion();
+
+	// get the name of the kernel in use
+	std::string get_kernel();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	MotionKernel m_kernel;
+	std::string m_kernel_name;
+	std::vector<uint8_t> m_prev; // the previous luma plane, packed
+	std::vector<uint16_t> m_cells; // changed pixels per cell of the last frame
+	int m_width;
+	int m_height;
+	int m_threshold;
+	int m_activity;
+	int m_min_cells;
+	int m_active; // active cells of the last frame
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
+#define MOTION_START 1 // motion has started, the recording has to start at the pre-roll
+#define MOTION_STOP 2 // no motion for the hold time, the recording can stop
+
+// the metrics of the motion trigger
+struct MotionMetrics
+{
+	int64_t frames; // frames analysed
+	int64_t events; // motion events started
+	int64_t kernel_time; // nanoseconds spent in the detector
+	int active_cells; // active cells of the last frame
+	bool motion; // a motion event is going on
+};
+
+// The motion trigger decodes a video stream of a circular buffer with a decode worker dropping the frames it cannot keep up with,
+// scales the luma down to a small gray frame and runs the motion detector on it in its own thread.
+// A motion event starts after motion in "frames" frames in a row and stops after "hold" seconds without motion.
+// The events are polled by the recording thread, the start event gives the wall clock time the recording has to start from,
+// "preroll" seconds before the motion, so that the recording is taken from the history in the circular buffer.
+class MotionTrigger
+{
+public:
+	MotionTrigger();
+	~MotionTrigger();
+
+	// set the options for the motion trigger, has to be called before open
+	//  -preroll value, seconds recorded before the motion, 5 by default
+	//  -hold value, seconds without motion before the event stops, 10 by default
+	//  -frames value, frames in a row with motion to start the event, 3 by default
+	//  -width value, width of the frames analysed, 160 by default, the height keeps the aspect ratio
+	//  -threshold, -activity, -min_cells, -simd, see MotionDetector
+	//  -device, -threads, -thread_type, see DecodeWorker
+	int set_options(std::string option, std::string value);
+
+	// start decoding and analysing the stream of the circular buffer from its newest keyframe
+	int open(CircularBuffer* buffer, int stream_index = 0);
+
+	// stop the analysis
+	int close();
+
+	// get the next event, MOTION_START with the wall clock time in miliseconds to record from, or MOTION_STOP
+	// return 0 when there is no event
+	int poll(int64_t* wallclock_ms);
+
+	// get the metrics of the motion trigger, can be called by any thread at any time
+	MotionMetrics get_metrics();
+
+	// get the seconds recorded before the motion and the seconds without motion before the event stops, as set by the options
+	int get_preroll();
+	int get_hold();
+
+	// get the error message of last operation
+	std::string get_error_message();
+
+protected:
+	// the analysis thread, take the decoded frames, scale them and detect motion
+	void analyse_frames();
+
+	// start or stop the event on the result of the frame
+	void update_event(bool motion, int64_t now);
+
+	DecodeWorker m_worker;
+	MotionDetector m_detector;
+	struct SwsContext* m_scaler;
+	std::vector<uint8_t> m_luma; // the scaled luma frame
+	int m_width;
+	int64_t m_preroll; // time in microseconds
+	int64_t m_hold; // time in microseconds
+	int m_frames; // frames in a row with motion to start
+	int m_motion_frames; // frames in a row with motion so far
+	int64_t m_last_motion; // wall clock time in microseconds of the last frame with motion
+	std::thread m_thread;
+	std::atomic<bool> m_stop;
+	std::mutex m_mutex; // protects the events
+	std::deque<std::pair<int, int64_t> > m_events; // the events not polled yet
+
+	// the metrics are only updated by the analysis thread
+	std::atomic<int64_t> m_analysed;
+	std::atomic<int64_t> m_started;
+	std::atomic<int64_t> m_kernel_time;
+	std::atomic<int> m_active_cells;
+	std::atomic<bool> m_motion;
+
+	int m_err; // the error code of last operation
+	std::string m_message; // the error message of last operation
+};
+
 char* av_err(int ret)
 {
 	// buffer to store error messages
@@ -260,9 +1969,10 @@ char* av_err(int ret)
 	return buf;
 }
 
-const std::string get_date_time()
+// format the wall clock time in miliseconds as yyyy-MM-dd-hhmmss, 0 for the current time
+const std::string get_date_time(int64_t time_ms = 0)
 {
-	time_t t = std::time(0); // get current time
+	time_t t = time_ms ? static_cast<time_t>(time_ms / 1000) : std::time(0);
 	char buf[50];
 	tm now;
 	localtime_s(&now, &t);
@@ -277,6 +1987,9 @@ HWDecoder::HWDecoder()
 	m_decoder = NULL;
 	m_hw_device_Ctx = NULL;
 	m_hw_pix_fmt = AV_PIX_FMT_NONE;
+	m_hw_frame = NULL;
+	m_threads = 0;
+	m_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
 	m_err = 0; 
 	m_message = "";
@@ -286,10 +1999,93 @@ HWDecoder::~HWDecoder()
 {
 	avcodec_free_context(&m_decoder_Ctx);
 	av_buffer_unref(&m_hw_device_Ctx);
+	av_frame_free(&m_hw_frame);
+}
+
+int HWDecoder::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (option == "threads")
+	{
+		int threads = atoi(value.c_str());
+		if (threads < 0)
+		{
+			m_message = "invalid value of '" + value + "' for 'threads' setting";
+			m_err = -1;
+			return m_err;
+		}
+		m_threads = threads;
+		return m_err;
+	}
+
+	if (option == "thread_type")
+	{
+		if (value == "frame")
+		{
+			m_thread_type = FF_THREAD_FRAME;
+		}
+		else if (value == "slice")
+		{
+			m_thread_type = FF_THREAD_SLICE;
+		}
+		else if (value == "both")
+		{
+			m_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'thread_type' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	m_err = -1;
+	m_message = "unknown option '" + option + "'";
+	return m_err;
 }
 
 // open the decoder by type and the codec parameter specified in the stream
+// the hardware device is tried first, the software decoder is opened when it is not available
 int HWDecoder::open(AVStream* stream, std::string device)
+{
+	avcodec_free_context(&m_decoder_Ctx);
+	av_buffer_unref(&m_hw_device_Ctx);
+	m_hw_pix_fmt = AV_PIX_FMT_NONE;
+	if (!stream || !stream->codecpar)
+	{
+		m_err = -1;
+		m_message = "Empty stream is not allowed.";
+		return m_err;
+	}
+
+	std::string hw_message;
+	if (!device.empty())
+	{
+		if (open_hardware(stream, device) >= 0)
+		{
+			return m_err;
+		}
+		hw_message = m_message;
+		avcodec_free_context(&m_decoder_Ctx);
+		av_buffer_unref(&m_hw_device_Ctx);
+		m_hw_pix_fmt = AV_PIX_FMT_NONE;
+	}
+
+	if (open_software(stream) < 0)
+	{
+		return m_err;
+	}
+
+	// keep the reason of the fallback
+	m_message = hw_message.empty() ? "software decoding" : "software decoding, " + hw_message;
+	return m_err;
+}
+
+// open the decoder on the hardware device, QSV has decoders of its own named after the codec
+int HWDecoder::open_hardware(AVStream* stream, std::string device)
 {
 	enum AVHWDeviceType type = av_hwdevice_find_type_by_name(device.c_str());
 	if (type == AV_HWDEVICE_TYPE_NONE)
@@ -299,24 +2095,26 @@ int HWDecoder::open(AVStream* stream, std::string device)
 		return m_err;
 	}
 
-	m_err = av_hwdevice_ctx_create(&m_hw_device_Ctx, type, "auto", NULL, 0);
+	m_err = av_hwdevice_ctx_create(&m_hw_device_Ctx, type, NULL, NULL, 0);
 	if (m_err < 0)
 	{
-		m_message = "Cannot open the hardware device";
+		m_message = "Cannot open the hardware device " + device;
 		return m_err;
 	}
 
-	if (stream->codecpar->codec_id == AV_CODEC_ID_H264)
+	m_decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+	if (m_decoder && type == AV_HWDEVICE_TYPE_QSV)
 	{
-		m_decoder = avcodec_find_decoder_by_name("h264_qsv");
+		m_decoder = avcodec_find_decoder_by_name((std::string(m_decoder->name) + "_qsv").c_str());
 	}
-	else
+	if (!m_decoder)
 	{
-		m_decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+		m_err = -1;
+		m_message = "No decoder of the codec for device " + device;
+		return m_err;
 	}
 
-	int i;
-	for (i = 0;; i++)
+	for (int i = 0;; i++)
 	{
 		const AVCodecHWConfig* config = avcodec_get_hw_config(m_decoder, i);
 		if (!config)
@@ -353,7 +2151,15 @@ int HWDecoder::open(AVStream* stream, std::string device)
 		return m_err;
 	}
 
-	m_decoder_Ctx->get_format = FfmpegLibrary::get_hw_format;
+	m_decoder_Ctx->opaque = this;
+	m_decoder_Ctx->get_format = get_hw_format;
+	m_decoder_Ctx->hw_device_ctx = av_buffer_ref(m_hw_device_Ctx);
+	if (!m_hw_frame && !(m_hw_frame = av_frame_alloc()))
+	{
+		m_err = AVERROR(ENOMEM);
+		m_message = "cannot allocate frame";
+		return m_err;
+	}
 
 	m_err = avcodec_open2(m_decoder_Ctx, m_decoder, NULL);
 	if (m_err < 0)
@@ -364,1192 +2170,9771 @@ int HWDecoder::open(AVStream* stream, std::string device)
 	return m_err;
 }
 
-static enum AVPixelFormat get_hw_format(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts)
+// open the software decoder with frame and slice threads
+int HWDecoder::open_software(AVStream* stream)
 {
-	const enum AVPixelFormat* p;
-	for (p = pix_fmts; *p != -1; p++)
+	m_decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+	if (!m_decoder)
 	{
-		if (*p == m_hw_pix_fmt)
-			return *p;
+		m_err = -1;
+		m_message = "No software decoder of the codec";
+		return m_err;
 	}
 
-	//HWDecoder::m_message = "failed to get HW surface format";
-	return AV_PIX_FMT_NONE;
-}
+	m_decoder_Ctx = avcodec_alloc_context3(m_decoder);
+	if (!m_decoder_Ctx)
+	{
+		m_err = -1;
+		m_message = " cannot allocate memory for ";
+		m_message.append(m_decoder->long_name);
+		return m_err;
+	}
 
-// send a packet to the decoder
-// an empty packet means to flush
-// return 0 on success
-// negative return means something 
-int HWDecoder::send_packet(AVPacket* pkt)
-{
-	m_err = avcodec_send_packet(m_decoder_Ctx, pkt);
+	m_err = avcodec_parameters_to_context(m_decoder_Ctx, stream->codecpar);
 	if (m_err < 0)
 	{
-		m_message = "error when sending packet to decoder";
+		m_message = "cannot assign decoder parameters";
+		return m_err;
 	}
-	return m_err;
+
+	m_decoder_Ctx->thread_count = m_threads;
+	m_decoder_Ctx->thread_type = m_thread_type;
+	m_err = avcodec_open2(m_decoder_Ctx, m_decoder, NULL);
+	if (m_err < 0)
+	{
+		m_message = "failed to open codec";
+	}
+
+	return m_err;
 }
 
-// try to receive the decoded frame
-// return 0 when the decoder has been flushed
-// return negative when there is an error
-// return 1 when get a frame,
-int HWDecoder::receive_frame(AVFrame* frame)
+enum AVPixelFormat HWDecoder::get_hw_format(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts)
 {
-	AVFrame* hw_frame = NULL;
-	uint8_t* buffer = NULL;
+	HWDecoder* decoder = static_cast<HWDecoder*>(ctx->opaque);
+	const enum AVPixelFormat* p;
+	for (p = pix_fmts; *p != -1; p++)
+	{
+		if (*p == decoder->m_hw_pix_fmt)
+			return *p;
+	}
+
+	//HWDecoder::m_message = "failed to get HW surface format";
+	return AV_PIX_FMT_NONE;
+}
 
-	if (!(hw_frame = av_frame_alloc()) || !(frame = av_frame_alloc()))
+// send a packet to the decoder
+// an empty packet means to flush
+// return 0 on success
+// negative return means something 
+int HWDecoder::send_packet(AVPacket* pkt)
+{
+	if (!m_decoder_Ctx)
 	{
 		m_err = -1;
-		m_message = "cannot allocate frame";
+		m_message = "the decoder is not opened";
+		return m_err;
 	}
 
-	while (1)
+	m_err = avcodec_send_packet(m_decoder_Ctx, pkt);
+	if (m_err < 0)
 	{
-		m_err = avcodec_receive_frame(m_decoder_Ctx, hw_frame);
-		if (m_err < 0)
-		{
-			m_message = "error while decoding";
-			return m_err;
-		}
-
-		// continue until the output is available
-		if (m_err == AVERROR(EAGAIN))
-		{
-			continue;
-		}
+		m_message = "error when sending packet to decoder";
+	}
+	return m_err;
+}
 
-		// check if the decoder has been flushed
-		if (m_err == AVERROR_EOF)
-		{
-			av_frame_free(&hw_frame);
-			av_frame_free(&frame);
+// try to receive the decoded frame, a frame on the hardware surface is transferred into the memory
+// return 1 when get a frame
+// return 0 when the decoder needs more packets to give the next frame
+// return AVERROR_EOF when the decoder has been flushed
+// return other negative when there is an error
+int HWDecoder::receive_frame(AVFrame* frame)
+{
+	if (!m_decoder_Ctx)
+	{
+		m_err = -1;
+		m_message = "the decoder is not opened";
+		return m_err;
+	}
 
-			m_err = 0;
-			m_message = "decoder get fully flushed";
-			return m_err;
-		}
+	AVFrame* target = m_hw_pix_fmt != AV_PIX_FMT_NONE ? m_hw_frame : frame;
+	m_err = avcodec_receive_frame(m_decoder_Ctx, target);
+	if (m_err == AVERROR(EAGAIN))
+	{
+		m_err = 0;
+		return m_err;
+	}
+	if (m_err == AVERROR_EOF)
+	{
+		m_message = "decoder get fully flushed";
+		return m_err;
+	}
+	if (m_err < 0)
+	{
+		m_message = "error while decoding";
+		return m_err;
+	}
 
-		if (hw_frame->format == m_hw_pix_fmt)
+	if (target == m_hw_frame)
+	{
+		if (m_hw_frame->format == m_hw_pix_fmt)
 		{
 			// retrieve data from GPU to CPU
-			m_err = av_hwframe_transfer_data(frame, hw_frame, 0);
-			av_frame_free(&hw_frame);
-			if (m_err < 0)
-			{
-				m_message = "error transferring the data from GPU to CPU";
-				av_frame_free(&frame);
-			}
-			else
+			m_err = av_hwframe_transfer_data(frame, m_hw_frame, 0);
+			if (m_err >= 0)
 			{
-				m_err = 1;
+				m_err = av_frame_copy_props(frame, m_hw_frame);
 			}
+		}
+		else
+		{
+			// the decoder gave a frame in the memory already
+			av_frame_move_ref(frame, m_hw_frame);
+		}
+		av_frame_unref(m_hw_frame);
+
+		if (m_err < 0)
+		{
+			m_message = "error transferring the data from GPU to CPU";
+			av_frame_unref(frame);
 			return m_err;
 		}
 	}
 
+	m_err = 1;
 	return m_err;
 }
 
-// get the error message of last operation
-std::string HWDecoder::get_error_message()
-{
-	return m_message;
-}
-
-Camera::Camera()
+void HWDecoder::flush()
 {
-	m_url = "";
-	m_ifmt_Ctx = NULL;
-	m_options = NULL;
-	m_index_video = -1;
-	m_index_audio = -1;
-
-	m_message = "";
-	m_err = avformat_network_init();
-	avdevice_register_all();
-	m_ifmt_Ctx = avformat_alloc_context();
-	m_format = "rtsp";
-	m_start_time = 0;
-	m_wclk_align = true;
+	if (m_decoder_Ctx)
+	{
+		avcodec_flush_buffers(m_decoder_Ctx);
+	}
 }
 
-Camera::~Camera()
+bool HWDecoder::is_hardware()
 {
-	avformat_free_context(m_ifmt_Ctx);
+	return m_hw_pix_fmt != AV_PIX_FMT_NONE;
 }
 
 // get the error message of last operation
-std::string Camera::get_error_message()
+std::string HWDecoder::get_error_message()
 {
 	return m_message;
 }
 
-AVFormatContext* Camera::get_input_format_context()
+DecodeWorker::DecodeWorker()
 {
-	m_err = 0;
-	m_message = "";
+	m_buffer = NULL;
+	m_reader = -1;
+	m_stream_index = 0;
+	m_device = "qsv";
+	m_drop = false;
+	m_start_newest = true;
+	m_pool_size = DECODE_POOL_SIZE;
+	m_stop = false;
+	m_send_next = 0;
+	for (int i = 0; i < DECODE_TIMES; i++)
+	{
+		m_send_pts[i] = AV_NOPTS_VALUE;
+		m_send_time[i] = 0;
+	}
+	m_lost = 0;
+	m_wait_keyframe = true;
 
-	return m_ifmt_Ctx;
-}
+	m_packets = 0;
+	m_frames = 0;
+	m_errors = 0;
+	m_dropped = 0;
+	m_frames_out = 0;
+	m_thread_err = 0;
 
-// get the stream time base of the camera
-AVRational Camera::get_stream_time_base(int stream_index)
-{
 	m_err = 0;
 	m_message = "";
+}
 
-	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ifmt_Ctx->nb_streams)
+DecodeWorker::~DecodeWorker()
+{
+	close();
+	for (AVFrame* frame : m_pool)
 	{
-		return m_ifmt_Ctx->streams[stream_index]->time_base;
+		av_frame_free(&frame);
 	}
+}
 
-	m_err = -1;
-	m_message = "Error. No input format context is found.";
-	return AVRational{ 1,1 };
-};
-
-// Set the options used to open a camera
-// additional options are
-//  -format value, specify the camera format. dshow for a Webcam in windows, v4l2 for a Webcam in linux
-//  -wall_clock value, wall clock alignment. true to get pts in epoch, false to get original pts
-int Camera::set_options(std::string option, std::string value)
+int DecodeWorker::set_options(std::string option, std::string value)
 {
 	m_err = 0;
 	m_message = "";
 
-	if (option == "format")
+	if (option == "device")
 	{
-		m_format = value;
-		m_message = "update the camera format to be " + value;
+		m_device = value;
+		return m_err;
 	}
-	else if (option == "wall_clock")
+
+	if (option == "threads" || option == "thread_type")
 	{
-		if (value == "false")
+		m_err = m_decoder.set_options(option, value);
+		m_message = m_decoder.get_error_message();
+		return m_err;
+	}
+
+	if (option == "pool_size")
+	{
+		int size = atoi(value.c_str());
+		if (size < 2)
 		{
-			m_wclk_align = false;
+			m_message = "the 'pool_size' setting has to be 2 at least";
+			m_err = -1;
+			return m_err;
+		}
+		m_pool_size = size;
+		return m_err;
+	}
 
-			m_err = 0;
-			m_message = "wall clock alignment is off";
+	if (option == "overflow")
+	{
+		if (value == "wait")
+		{
+			m_drop = false;
 		}
-		else if (value == "true")
+		else if (value == "drop")
 		{
-			m_wclk_align = true;
-
-			m_err = 0;
-			m_message = "wall clock alignment is on";
+			m_drop = true;
 		}
 		else
 		{
-			m_message = "unkown value of '" + value + "' for 'wall clock alignment' setting";
+			m_message = "unkown value of '" + value + "' for 'overflow' setting";
 			m_err = -1;
 		}
 		return m_err;
 	}
-	else
+
+	if (option == "start")
 	{
-		m_err = av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
-		m_message = "set the option '" + option + "' to be " + value;
+		if (value == "newest")
+		{
+			m_start_newest = true;
+		}
+		else if (value == "oldest")
+		{
+			m_start_newest = false;
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'start' setting";
+			m_err = -1;
+		}
+		return m_err;
 	}
+
+	m_err = -1;
+	m_message = "unknown option '" + option + "'";
 	return m_err;
 }
 
-// open/connect to the camera
-// return 0 on success
-int Camera::open(std::string url)
+// open the decoder and the reader, fill the pool, then start the decoding thread
+int DecodeWorker::open(CircularBuffer* buffer, int stream_index)
 {
-	// check if the url is empty
-	if (url.empty())
+	close();
+	m_err = 0;
+	m_message = "";
+
+	AVStream* stream = buffer ? buffer->get_stream(stream_index) : NULL;
+	if (!stream || stream_index >= buffer->get_stream_count())
 	{
 		m_err = -1;
-		m_message = "Error. Camera path is empty";
+		m_message = "No such stream in the circular buffer";
 		return m_err;
 	}
-	m_url = url;
 
-	// to determine the camera type
-	m_message = "IP Camera: ";
-	AVInputFormat* ifmt = NULL;
-	if (url.find("/dev/") != std::string::npos)
+	m_err = m_decoder.open(stream, m_device);
+	m_message = m_decoder.get_error_message();
+	if (m_err < 0)
 	{
-		ifmt = av_find_input_format("v4l2");
-		m_message = "v4l2: ";
+		return m_err;
 	}
-	else
+
+	// the frames of the pool are only allocated once, their buffers come from the pools of the decoder
+	while (static_cast<int>(m_pool.size()) < m_pool_size)
 	{
-		ifmt = av_find_input_format(m_format.c_str());
-		m_message = m_format + ": "; // "USB (Windows)";
+		AVFrame* frame = av_frame_alloc();
+		if (!frame)
+		{
+			m_err = AVERROR(ENOMEM);
+			m_message = "cannot allocate frame";
+			return m_err;
+		}
+		m_pool.push_back(frame);
 	}
+	m_free.assign(m_pool.begin(), m_pool.end());
+	m_queue.clear();
 
-	m_err = avformat_open_input(&m_ifmt_Ctx, m_url.c_str(), ifmt, &m_options);
-	if (m_err < 0)
+	m_reader = buffer->open_reader();
+	if (m_reader < 0)
 	{
-		m_message.append(av_err(m_err));
+		m_err = -2;
+		m_message = "No reader is available for decoding, all the " + std::to_string(MAX_READERS) + " readers of the circular buffer are in use";
 		return m_err;
 	}
-	m_start_time = av_gettime();  // hold global start time in microseconds
-
-	m_err = avformat_find_stream_info(m_ifmt_Ctx, 0);
-	if (m_err < 0)
+	if (m_start_newest)
 	{
-		m_message.append(av_err(m_err));
-		return m_err;
+		buffer->seek_reader(m_reader, av_gettime() / 1000);
 	}
 
-	m_err = 0;
-	m_message += " connected";
-
-	// find the index of video stream
-	AVStream* st;
-	for (int i = 0; static_cast <unsigned int>(i) < m_ifmt_Ctx->nb_streams; i++)
+	m_buffer = buffer;
+	m_stream_index = stream_index;
+	m_send_next = 0;
+	for (int i = 0; i < DECODE_TIMES; i++)
 	{
-		st = m_ifmt_Ctx->streams[i]; 
-
-		// modify the start time when required aligning to wall clock
-		if (m_wclk_align)
-		{
-			// calculate the correct time stamp for a very large epoch time
-			int64_t den = st->time_base.den;
-			int64_t num = st->time_base.num;
-			num *= 1000000;
-
-			int64_t gcd = av_const av_gcd(den, num);
-			if (gcd)
-			{
-				den /= gcd;
-				num /= gcd;
-			}
-
-			if (num > den)
-			{
-				st->start_time = m_start_time * den / num - st->start_time;
-			}
-			else
-			{
-				st->start_time = m_start_time / num * den - st->start_time;
-			}
-		}
-
-		if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-		{
-			m_index_video = i;
-			st->duration = st->time_base.den / st->time_base.num / 30; // default duration for video is 1/30s
-			m_message += ", video stream found";
-		}
+		m_send_pts[i] = AV_NOPTS_VALUE;
+	}
+	m_lost = buffer->get_reader_lost(m_reader);
+	m_wait_keyframe = true;
+	m_packets = 0;
+	m_frames = 0;
+	m_errors = 0;
+	m_dropped = 0;
+	m_frames_out = 0;
+	m_thread_err = 0;
+	m_decode_latency.reset();
+	m_stop = false;
+	m_thread = std::thread(&DecodeWorker::decode_frames, this);
+	return m_err;
+}
 
-		if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+// stop the decoding thread and close the reader, the frames still queued go back to the pool
+int DecodeWorker::close()
+{
+	if (m_thread.joinable())
+	{
 		{
-			m_index_audio = i;
-			st->duration = st->time_base.den / st->time_base.num / 100; // default duration for audio is 1/100s
-			m_message += ", audio stream found";
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
 		}
-		st->duration++; // make sure it is not 0
+		m_frame_free.notify_all();
+		m_frame_ready.notify_all();
+		m_buffer->close_reader(m_reader); // wake up the thread waiting for a packet
+		m_thread.join();
 	}
-
-	if (m_index_video < 0 && m_index_audio < 0)
+	else if (m_buffer && m_reader >= 0)
 	{
-		m_err = -2;
-		m_message += ", but no video nor audio stream";
+		m_buffer->close_reader(m_reader);
 	}
-	return m_err;
-}
+	m_buffer = NULL;
+	m_reader = -1;
 
-// read a packet from the camera
-// return 0 on success
-int Camera::read_packet(AVPacket* pkt)
-{
-	m_message = "";
-	m_err = av_read_frame(m_ifmt_Ctx, pkt); // read a frame from the camera
-
-	// handle the timeout
-	if (m_err < 0)
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (AVFrame* frame : m_queue)
 	{
-		m_message.assign(av_err(m_err));
-		m_message = "Time out while reading " + m_url + " with error " + m_message;
-		pkt = NULL;
-		return m_err;
+		av_frame_unref(frame);
+		m_free.push_back(frame);
+		m_frames_out.fetch_sub(1, std::memory_order_relaxed);
 	}
+	m_queue.clear();
+	return 0;
+}
 
-	if (!m_wclk_align)
+// the consumer side of the queue
+int DecodeWorker::get_frame(AVFrame** frame, int timeout)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto ready = [this] { return !m_queue.empty() || m_stop || m_thread_err.load(std::memory_order_relaxed) < 0; };
+	if (timeout < 0)
 	{
-		return m_err;
+		m_frame_ready.wait(lock, ready);
 	}
-
-	// Doing wall clock alignment
-	if (pkt->pts == AV_NOPTS_VALUE)
+	else if (!m_frame_ready.wait_for(lock, std::chrono::milliseconds(timeout), ready))
 	{
-		m_err = -1;
-		m_message = "no wall clock alignment for packet without pts value";
-		return m_err;
+		return 0;
 	}
 
-	// make pts and pds wall clock aligned
-	AVStream* st = m_ifmt_Ctx->streams[pkt->stream_index];
-	pkt->pts += st->start_time;
-	pkt->dts += st->start_time;
-	if (!pkt->duration)
+	if (m_queue.empty())
 	{
-		pkt->duration = st->duration; // assign duration to be the default duration
+		int err = m_thread_err.load(std::memory_order_relaxed);
+		return err < 0 ? err : -1;
 	}
 
-	return m_err;
-};
-
-// get the video stream index of the camera
-// negative return indicates no video stream in the camera
-int Camera::get_video_index()
-{
-	return m_index_video;
+	*frame = m_queue.front();
+	m_queue.pop_front();
+	return 1;
 }
 
-// get the audio stream index of the camera
-// negative return indicates no audio stream in the camera
-int Camera::get_audio_index()
+void DecodeWorker::release_frame(AVFrame* frame)
 {
-	return m_index_audio;
+	if (!frame)
+	{
+		return;
+	}
+
+	av_frame_unref(frame);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free.push_back(frame);
+	}
+	m_frames_out.fetch_sub(1, std::memory_order_relaxed);
+	m_frame_free.notify_one();
 }
 
-// get the specified stream
-// index can be video index or audio index
-AVStream* Camera::get_stream(int stream_index)
+// take a free frame, the oldest frame waiting for the consumer is taken back when dropping
+AVFrame* DecodeWorker::take_frame()
 {
-	if (stream_index < 0 || static_cast <unsigned int>(stream_index) >= m_ifmt_Ctx->nb_streams)
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_free.empty() && m_drop && !m_queue.empty())
+	{
+		AVFrame* frame = m_queue.front();
+		m_queue.pop_front();
+		av_frame_unref(frame);
+		m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_frames_out.fetch_sub(1, std::memory_order_relaxed);
+		return frame;
+	}
+
+	m_frame_free.wait(lock, [this] { return !m_free.empty() || m_stop; });
+	if (m_stop)
 	{
-		m_err = -1;
-		m_message = "In valid stream index specified";
 		return NULL;
 	}
-	
-	m_err = 0;
-	m_message = "get the stream";
-	return m_ifmt_Ctx->streams[stream_index];
+
+	AVFrame* frame = m_free.back();
+	m_free.pop_back();
+	return frame;
 }
 
-CircularBuffer::CircularBuffer()
+// the frames are matched to the send times of their packets by pts, the frames come out in presentation order
+int DecodeWorker::drain_frames()
 {
-	first_pkt = NULL;
-	last_pkt = NULL;
-	bg_pkt = NULL;
-	mn_pkt = NULL;
+	while (true)
+	{
+		AVFrame* frame = take_frame();
+		if (!frame)
+		{
+			return -1;
+		}
 
-	m_TotalPkts = 0;
-	m_size = 0;
-	m_time_span = 0;
-	m_MaxSize = 0;
-	m_codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
-	m_st = (AVStream *)av_mallocz(sizeof(AVStream));
-	m_pts_span = 0;
-	m_stream_index = 0;
-	m_time_base = AVRational{ 1, 2 };
+		int ret = m_decoder.receive_frame(frame);
+		if (ret <= 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(frame);
+			return ret == AVERROR_EOF ? 0 : ret;
+		}
 
-	m_err = 0;
-	m_message = "";
-	m_last_pts = 0;
-	
-	flag_writing = false;
-	flag_reading = false;
+		int64_t now = av_gettime_relative();
+		for (int i = 0; i < DECODE_TIMES; i++)
+		{
+			if (m_send_pts[i] == frame->pts && frame->pts != AV_NOPTS_VALUE)
+			{
+				m_decode_latency.add(now - m_send_time[i]);
+				m_send_pts[i] = AV_NOPTS_VALUE;
+				break;
+			}
+		}
+		m_frames.store(m_frames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_frames_out.fetch_add(1, std::memory_order_relaxed);
 
-	m_codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(frame);
+		}
+		m_frame_ready.notify_one();
+	}
 }
 
-void CircularBuffer::open(int time_span, int max_size)
+// The packets are sent as they come, the decoder is drained after every packet. A packet the decoder is too full
+// to take is sent again after draining. A failed packet is counted and skipped, the decoder recovers at the next keyframe.
+// When the reader has lost packets, the frames referring to them cannot be decoded. The decoder is flushed and the packets
+// are skipped up to the next keyframe, the same as at the start of the decoding.
+void DecodeWorker::decode_frames()
 {
-	first_pkt = NULL;
-	last_pkt = NULL;
-	bg_pkt = NULL;
-	mn_pkt = NULL;
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stop)
+				break;
+		}
 
-	//
-	m_TotalPkts = 0;
-	m_size = 0;
-	m_pts_span = 0;
-	m_time_span = time_span > 0 ? time_span : 0;
-	m_MaxSize = max_size > 0 ? max_size : 0;
-	m_stream_index = 0;
-	m_time_base = AVRational{ 1, 2 };
+		int ret = m_buffer->wait_packet(&pkt, m_reader, 100);
+		if (ret < 0)
+		{
+			// the reader is gone, the consumer waiting for a frame gets the error
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_stop)
+				m_thread_err = ret;
+			break;
+		}
+		if (ret == 0)
+		{
+			continue;
+		}
+		if (pkt.stream_index != m_stream_index)
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
 
-	m_err = 0;
-	m_message = "";
+		int64_t lost = m_buffer->get_reader_lost(m_reader);
+		if (lost != m_lost)
+		{
+			m_lost = lost;
+			m_decoder.flush();
+			for (int i = 0; i < DECODE_TIMES; i++)
+			{
+				m_send_pts[i] = AV_NOPTS_VALUE;
+			}
+			m_wait_keyframe = true;
+		}
+		if (m_wait_keyframe && !(pkt.flags & AV_PKT_FLAG_KEY))
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
+		m_wait_keyframe = false;
 
-	flag_writing = false;
-	flag_reading = false;
-}
+		m_send_pts[m_send_next] = pkt.pts;
+		m_send_time[m_send_next] = av_gettime_relative();
+		m_send_next = (m_send_next + 1) % DECODE_TIMES;
 
-CircularBuffer::~CircularBuffer()
-{
-	while (first_pkt)
-	{
-		AVPacketList* pktl = first_pkt;
-		av_packet_unref(&pktl->pkt);
-		first_pkt = pktl->next;
-		av_free(pktl);
+		ret = m_decoder.send_packet(&pkt);
+		if (ret == AVERROR(EAGAIN))
+		{
+			if (drain_frames() < 0)
+			{
+				av_packet_unref(&pkt);
+				break;
+			}
+			ret = m_decoder.send_packet(&pkt);
+		}
+		av_packet_unref(&pkt);
+		m_packets.store(m_packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (ret < 0)
+		{
+			m_errors.store(m_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			continue;
+		}
+
+		ret = drain_frames();
+		if (ret < 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stop)
+				break;
+			// a failure in the decoder is counted like a failed packet, the decoding goes on with the next one
+			m_errors.store(m_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
 	}
+	av_packet_unref(&pkt);
+	m_frame_ready.notify_all();
+}
 
-	avcodec_parameters_free(&m_codecpar);
+bool DecodeWorker::is_hardware()
+{
+	return m_decoder.is_hardware();
 }
 
-// Add the stream into the circular buffer
-//int CircularBuffer::add_stream(AVFormatContext* ifmt_ctx, int stream_index)
-int CircularBuffer::add_stream(AVStream *stream)
+// get the metrics of the decode worker, can be called by any thread at any time
+DecoderMetrics DecodeWorker::get_metrics()
 {
-	// check the stream
-	if (!stream)
+	DecoderMetrics metrics;
+	memset(&metrics, 0, sizeof(metrics));
+	metrics.packets = m_packets.load(std::memory_order_relaxed);
+	metrics.frames = m_frames.load(std::memory_order_relaxed);
+	metrics.errors = m_errors.load(std::memory_order_relaxed);
+	metrics.dropped = m_dropped.load(std::memory_order_relaxed);
+	metrics.frames_out = m_frames_out.load(std::memory_order_relaxed);
 	{
-		m_err = -1;
-		m_message = "Empty stream is not allowed.";
-		return m_err;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		metrics.queue_depth = static_cast<int>(m_queue.size());
 	}
+	metrics.hardware = m_decoder.is_hardware();
+	m_decode_latency.get_snapshot(&metrics.decode_latency);
+	return metrics;
+}
 
-	// copy the codec parameters to local
-	m_err = avcodec_parameters_copy(m_codecpar, stream->codecpar);
-	if (m_err < 0)
-	{
-		m_message.assign(av_err(m_err));
-		return m_err;
-	}
+std::string DecodeWorker::get_error_message()
+{
+	return m_message;
+}
 
-	// copy a couple of important parameters to local stream
-	m_st->codecpar = m_codecpar; // store the same codec parameters in the local stream
-	m_st->time_base = stream->time_base;
-	m_st->start_time = stream->start_time;
-	m_st->r_frame_rate = stream->r_frame_rate;
-	m_st->avg_frame_rate = stream->avg_frame_rate;
-	m_st->sample_aspect_ratio = stream->sample_aspect_ratio;
+SnapshotService::SnapshotService()
+{
+	m_interval = 5 * 1000000LL;
+	m_width = 320;
+	m_quality = 5;
+	m_cache_size = SNAPSHOT_CACHE_SIZE;
+	m_subscribers = 0;
+	m_stop = false;
 
-	m_time_base = stream->time_base;
-	m_stream_index = stream->index;
-	m_pts_span = m_time_span * m_time_base.den / m_time_base.num;
+	m_err = 0;
+	m_message = "";
+}
 
-	// clear the circular buffer in case the stream is changed
-	while (first_pkt)
+SnapshotService::~SnapshotService()
+{
+	stop();
+	for (SnapshotSource* source : m_sources)
 	{
-		AVPacketList* pktl = first_pkt;
-		av_packet_unref(&pktl->pkt);
-		first_pkt = pktl->next;
-		av_free(pktl);
+		release_source(source);
+		delete source;
 	}
+}
 
-	m_err = 0;
-	m_message = "";
-	return m_err;
-};
-
-// push a video or audio packet to the circular buffer, pts and dts are adjust to wall clock
-// positive return indicates the packet is added successfully. The number returned is the current total packets in the circular buffer.
-// 0 return indicates that the packet is added successfully but the circular buffer has suffered oversized and been revised.
-// negative return indicates that the packet is not added due to run out of memory
-int CircularBuffer::push_packet(AVPacket* pkt)
+int SnapshotService::set_options(std::string option, std::string value)
 {
 	m_err = 0;
 	m_message = "";
 
-	// empty packet is not allowed in the circular buffer
-	if (!pkt)
+	int v = atoi(value.c_str());
+	if (option == "interval" && v > 0)
 	{
-		m_err = -1;
-		m_message = "packet unacceptable: empty";
-		return m_err;
+		m_interval = v * 1000000LL;
 	}
-
-	// packet with different stream index is not accepted
-	if (pkt->stream_index != m_stream_index)
+	else if (option == "width" && v >= 16 && v <= 4096)
 	{
-		m_err = -2;
-		m_message = "packet unacceptable: stream index is different";
-		return m_err;
+		m_width = v & ~1;
 	}
-
-	// packet that cannot be reference is not allowed
-	if (av_packet_make_refcounted(pkt) < 0)
+	else if (option == "quality" && v >= 2 && v <= 31)
 	{
-		m_err = -3;
-		m_message = "packet unacceptable: cannot be referenced";
-		return m_err;
+		m_quality = v;
 	}
-
-	// packet that has no pts is not allowed
-	if (pkt->pts == AV_NOPTS_VALUE)
+	else if (option == "cache_size" && v > 0)
 	{
-		m_err = -4;
-		m_message = "packet unacceptable: has no valid pts";
-		return m_err;
+		m_cache_size = v;
 	}
-
-	// new a packet list, which is going to be freed when getting staled later
-	AVPacketList* pktl = (AVPacketList*)av_mallocz(sizeof(AVPacketList));
-	if (!pktl)
+	else
 	{
-		//av_packet_unref(pkt);
-		av_free(pktl);
-		m_err = -5;
-		m_message = "cannot allocate new packet list";
-		return m_err;
+		m_err = -1;
+		m_message = "unkown value of '" + value + "' for '" + option + "' setting";
 	}
 
-	// packet that is non monotonically increasing
-	if (m_last_pts == 0)
-	{
-		m_last_pts = pkt->pts;
-	}
+	return m_err;
+}
 
-	if (pkt->pts < m_last_pts)
+int SnapshotService::add_camera(std::string name, CircularBuffer* buffer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (find_source(name))
 	{
-		m_err = -6;
-		m_message = "packet unacceptable: non monotonically increasing";
+		m_err = -1;
+		m_message = "the camera '" + name + "' is already added";
+		return m_err;
 	}
 
-	// add the packet to the queue
-	av_packet_ref(&pktl->pkt, pkt);  // leave the pkt alone
-	//av_packet_move_ref(&pktl->pkt, pkt);  // this makes the pkt unref
-	pktl->next = NULL;
-
-	// set the writing flag to block unsafe reading
-	flag_writing = true;
-
-	// modify the pointers
-	if (!last_pkt)
-		first_pkt = pktl; // handle the first adding
-	else
-		last_pkt->next = pktl;
-	last_pkt = pktl; // the new added packet is always the last packet in the circular buffer
+	SnapshotSource* source = new SnapshotSource();
+	source->name = name;
+	source->buffer = buffer;
+	source->reader = -1;
+	source->subscribers = 0;
+	source->next_time = 0;
+	source->decoder = NULL;
+	source->encoder = NULL;
+	source->scaler = NULL;
+	source->frame = NULL;
+	source->thumbnail = NULL;
+	source->taken = 0;
+	source->errors = 0;
+	m_sources.push_back(source);
+	return static_cast<int>(m_sources.size()) - 1;
+}
 
-	m_TotalPkts++;
-	m_size += pktl->pkt.size + sizeof(*pktl);
+int SnapshotService::start()
+{
 	m_err = 0;
-
-	// do not update the pointers while actively reading
-	if (flag_reading)
+	m_message = "";
+	if (m_thread.joinable())
 	{
-		flag_writing = false; // clear the writing flag
-		m_message = "Warning: not modify the pointer for others are reading";
-		return m_TotalPkts;
+		m_err = -1;
+		m_message = "the snapshot service is already started";
+		return m_err;
 	}
 
-	// update the background reader when a new packet is added
-	if (!bg_pkt)
-	{
-		bg_pkt = last_pkt;
-	}
+	m_stop = false;
+	m_thread = std::thread(&SnapshotService::run, this);
+	return m_err;
+}
 
-	// update the main reader when a new packet is added
-	if (!mn_pkt)
+int SnapshotService::stop()
+{
+	if (!m_thread.joinable())
 	{
-		mn_pkt = last_pkt;
+		return 0;
 	}
 
-	// maintain the circular buffer by kicking out those overflowed packets
-	int64_t pts_bg = bg_pkt->pkt.pts;
-	int64_t pts_mn = mn_pkt->pkt.pts;
-	int64_t allowed_pts = last_pkt->pkt.pts - m_pts_span;
-	while ((first_pkt->pkt.pts < allowed_pts) || (m_size > m_MaxSize))
 	{
-		pktl = first_pkt;
-		m_TotalPkts--; // update the number of total packets
-		m_size -= first_pkt->pkt.size + sizeof(*first_pkt);  // update the size of the circular buffer
-
-		av_packet_unref(&first_pkt->pkt); // unref the first packet
-		first_pkt = first_pkt->next; // update the first packet list
-		av_freep(&pktl);  // free the unsed packet list
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
 	}
+	m_cond.notify_all();
+	m_thread.join();
+	return 0;
+}
 
-	// update the background reader in case it is behind the first packet
-	if (pts_bg < first_pkt->pkt.pts)
+int SnapshotService::subscribe(std::string name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SnapshotSource* source = find_source(name);
+	if (!source)
 	{
-		bg_pkt = first_pkt;
+		return -1;
 	}
 
-	// update the mn reader in case it is behind the first packet changed
-	if (pts_mn < first_pkt->pkt.pts)
+	if (!source->subscribers++)
 	{
-		mn_pkt = first_pkt;
+		source->next_time = 0;
 	}
-
-	flag_writing = false; // clear the writting flag
-	m_message = "Packet added";
-	return m_TotalPkts;
+	m_subscribers++;
+	m_cond.notify_all();
+	return source->subscribers;
 }
 
-// read a packet out of the circular buffer.
-// read a packet using the background reader when isBackground is true
-// read a packet using the main reader when isBackground is false
-// a positive return indicates the packet is read. 
-int CircularBuffer::peek_packet(AVPacket* pkt, bool isBackground)
+int SnapshotService::unsubscribe(std::string name)
 {
-	m_err = 0;
-	m_message = "";
-
-	// no reading while adding new packet
-	if (flag_writing)
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SnapshotSource* source = find_source(name);
+	if (!source)
 	{
-		pkt = NULL;
-		m_message = "Warning: not able to read while others are writting";
-		return m_err;
+		return -1;
 	}
 
-	flag_reading = true; // set the reading flag to stop the modify of packet list
-
-	if (isBackground && bg_pkt)
+	if (source->subscribers > 0)
 	{
-		av_packet_ref(pkt, &bg_pkt->pkt); // expose to the outside a copy of the packet
-		bg_pkt = bg_pkt->next; // update the reader packet
-		flag_reading = false;
-		m_message = "packet read for background recording";
-		return m_size; // return the number of total packets
+		source->subscribers--;
+		m_subscribers--;
+		m_cond.notify_all(); // let the thread release the camera
 	}
+	return source->subscribers;
+}
 
-	if (!isBackground && mn_pkt)
+int SnapshotService::get_snapshot(std::string name, int64_t wallclock_ms, Snapshot* snapshot)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SnapshotSource* source = find_source(name);
+	if (!source)
 	{
-		av_packet_ref(pkt, &mn_pkt->pkt); // expose to the outside a copy of the packet
-		mn_pkt = mn_pkt->next; // update the reader packet
-		flag_reading = false;
-		m_message = "packet read for main recording";
-		return m_size;
+		return -1;
 	}
 
-	pkt = NULL;
-	flag_reading = false;
-	m_message = "no packet available to read at this moment";
-	return 0;
-};
+	for (auto it = source->snapshots.rbegin(); it != source->snapshots.rend(); ++it)
+	{
+		if (wallclock_ms <= 0 || it->time <= wallclock_ms)
+		{
+			*snapshot = *it;
+			return 0;
+		}
+	}
+	return -2;
+}
 
-// get the time base of the circular buffer
-AVRational CircularBuffer::get_time_base()
+int64_t SnapshotService::get_taken(std::string name)
 {
-	m_err = 0;
-	m_message = "";
-
-	return m_time_base;
-};
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SnapshotSource* source = find_source(name);
+	return source ? source->taken : -1;
+}
 
-// get the size of the circular buffer
-int CircularBuffer::get_size()
+int64_t SnapshotService::get_errors(std::string name)
 {
-	m_err = 0;
-	m_message = "";
-
-	return m_size;
-};
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SnapshotSource* source = find_source(name);
+	return source ? source->errors : -1;
+}
 
-// get the codec parameters of the circular buffer
-AVCodecParameters* CircularBuffer::get_stream_codecpar()
+std::string SnapshotService::get_error_message()
 {
-	m_err = 0;
-	m_message = "";
+	return m_message;
+}
 
-	return m_codecpar;
-};
+// The thread sleeps until a camera is subscribed, then until the next snapshot is due.
+// The snapshots are taken without the lock, the subscriptions and the cache are only touched under the lock.
+void SnapshotService::run()
+{
+	std::vector<SnapshotSource*> due;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop)
+	{
+		int64_t now = av_gettime_relative();
+		int64_t wake = now + m_interval;
+		due.clear();
+		for (SnapshotSource* source : m_sources)
+		{
+			if (!source->subscribers)
+			{
+				release_source(source);
+			}
+			else if (source->next_time <= now)
+			{
+				due.push_back(source);
+			}
+			else
+			{
+				wake = std::min(wake, source->next_time);
+			}
+		}
 
-// get the stream assigned to the circular buffer
-AVStream* CircularBuffer::get_stream()
+		if (due.empty())
+		{
+			if (!m_subscribers)
+				m_cond.wait(lock);
+			else
+				m_cond.wait_for(lock, std::chrono::microseconds(wake - now));
+			continue;
+		}
+
+		lock.unlock();
+		for (SnapshotSource* source : due)
+		{
+			Snapshot snapshot;
+			int ret = take_snapshot(source, &snapshot);
+			int64_t next = av_gettime_relative() + (ret == 0 ? std::min(m_interval, (int64_t)SNAPSHOT_RETRY) : m_interval);
+
+			std::lock_guard<std::mutex> guard(m_mutex);
+			source->next_time = next;
+			if (ret > 0)
+			{
+				source->snapshots.push_back(std::move(snapshot));
+				while (static_cast<int>(source->snapshots.size()) > m_cache_size)
+				{
+					source->snapshots.pop_front();
+				}
+				source->taken++;
+			}
+			else if (ret < 0)
+			{
+				source->errors++;
+			}
+		}
+		lock.lock();
+	}
+}
+
+int SnapshotService::take_snapshot(SnapshotSource* source, Snapshot* snapshot)
+{
+	if (source->reader < 0)
+	{
+		source->reader = source->buffer->open_reader();
+		if (source->reader < 0)
+		{
+			return -1;
+		}
+	}
+
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	if (source->buffer->peek_keyframe(&pkt, source->reader, &snapshot->time) <= 0)
+	{
+		return 0;
+	}
+
+	int ret = decode_keyframe(source, &pkt);
+	av_packet_unref(&pkt);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	ret = encode_thumbnail(source, snapshot);
+	av_frame_unref(source->frame);
+	return ret < 0 ? ret : 1;
+}
+
+// the decoder is drained after the keyframe so the frame comes out at once whatever the reordering delay,
+// then flushed so that the next keyframe starts from a clean state
+int SnapshotService::decode_keyframe(SnapshotSource* source, AVPacket* pkt)
 {
-	return m_st;
+	if (!source->decoder)
+	{
+		AVCodecParameters* codecpar = source->buffer->get_stream_codecpar(pkt->stream_index);
+		const AVCodec* codec = codecpar ? avcodec_find_decoder(codecpar->codec_id) : NULL;
+		if (!codec || !(source->decoder = avcodec_alloc_context3(codec)))
+		{
+			return AVERROR(EINVAL);
+		}
+
+		source->decoder->thread_count = 1;
+		int ret = avcodec_parameters_to_context(source->decoder, codecpar);
+		if (ret >= 0)
+			ret = avcodec_open2(source->decoder, codec, NULL);
+		if (ret < 0)
+		{
+			avcodec_free_context(&source->decoder);
+			return ret;
+		}
+	}
+	if (!source->frame && !(source->frame = av_frame_alloc()))
+	{
+		return AVERROR(ENOMEM);
+	}
+
+	int ret = avcodec_send_packet(source->decoder, pkt);
+	if (ret >= 0)
+	{
+		avcodec_send_packet(source->decoder, NULL);
+		ret = avcodec_receive_frame(source->decoder, source->frame);
+	}
+	avcodec_flush_buffers(source->decoder);
+	return ret;
 }
 
-// get the error message of last operation
-std::string CircularBuffer::get_error_message()
+// the encoder and the thumbnail are made again when the size of the camera changes
+int SnapshotService::encode_thumbnail(SnapshotSource* source, Snapshot* snapshot)
 {
-	return m_message;
+	AVFrame* frame = source->frame;
+	if (frame->width <= 0 || frame->height <= 0)
+	{
+		return AVERROR(EINVAL);
+	}
+
+	int width = std::min(m_width, frame->width & ~1);
+	int height = std::max(2, static_cast<int>(static_cast<int64_t>(frame->height) * width / frame->width) & ~1);
+	if (source->encoder && (source->encoder->width != width || source->encoder->height != height))
+	{
+		avcodec_free_context(&source->encoder);
+		av_frame_free(&source->thumbnail);
+	}
+
+	if (!source->encoder)
+	{
+		const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+		if (!codec || !(source->encoder = avcodec_alloc_context3(codec)))
+		{
+			return AVERROR(EINVAL);
+		}
+
+		source->encoder->width = width;
+		source->encoder->height = height;
+		source->encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+		source->encoder->time_base = AVRational{ 1, 25 };
+		source->encoder->flags |= AV_CODEC_FLAG_QSCALE;
+		source->encoder->global_quality = m_quality * FF_QP2LAMBDA;
+		source->encoder->qmin = source->encoder->qmax = m_quality;
+		int ret = avcodec_open2(source->encoder, codec, NULL);
+		if (ret < 0)
+		{
+			avcodec_free_context(&source->encoder);
+			return ret;
+		}
+
+		source->thumbnail = av_frame_alloc();
+		if (!source->thumbnail)
+		{
+			avcodec_free_context(&source->encoder);
+			return AVERROR(ENOMEM);
+		}
+		source->thumbnail->format = AV_PIX_FMT_YUVJ420P;
+		source->thumbnail->width = width;
+		source->thumbnail->height = height;
+		ret = av_frame_get_buffer(source->thumbnail, 32);
+		if (ret < 0)
+		{
+			av_frame_free(&source->thumbnail);
+			avcodec_free_context(&source->encoder);
+			return ret;
+		}
+	}
+
+	source->scaler = sws_getCachedContext(source->scaler, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+		width, height, AV_PIX_FMT_YUVJ420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	int ret = source->scaler ? av_frame_make_writable(source->thumbnail) : AVERROR(EINVAL);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	sws_scale(source->scaler, frame->data, frame->linesize, 0, frame->height, source->thumbnail->data, source->thumbnail->linesize);
+
+	source->thumbnail->pict_type = AV_PICTURE_TYPE_I;
+	source->thumbnail->quality = source->encoder->global_quality;
+	ret = avcodec_send_frame(source->encoder, source->thumbnail);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	ret = avcodec_receive_packet(source->encoder, &pkt);
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	snapshot->width = width;
+	snapshot->height = height;
+	snapshot->jpeg.assign(pkt.data, pkt.data + pkt.size);
+	av_packet_unref(&pkt);
+	return 0;
+}
+
+void SnapshotService::release_source(SnapshotSource* source)
+{
+	if (source->reader >= 0)
+	{
+		source->buffer->close_reader(source->reader);
+		source->reader = -1;
+	}
+	if (source->decoder)
+		avcodec_free_context(&source->decoder);
+	if (source->encoder)
+		avcodec_free_context(&source->encoder);
+	if (source->scaler)
+	{
+		sws_freeContext(source->scaler);
+		source->scaler = NULL;
+	}
+	av_frame_free(&source->frame);
+	av_frame_free(&source->thumbnail);
+}
+
+SnapshotSource* SnapshotService::find_source(std::string name)
+{
+	for (SnapshotSource* source : m_sources)
+	{
+		if (source->name == name)
+		{
+			return source;
+		}
+	}
+	return NULL;
+}
+
+#ifdef _MSC_VER
+#define MOTION_TARGET(isa)
+#else
+#define MOTION_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// count the pixels changed by more than threshold in every cell, the cells have to be zeroed
+static void motion_cells_scalar(const uint8_t* cur, int cur_stride, const uint8_t* prev, int prev_stride, int width, int height, int threshold, uint16_t* cells)
+{
+	int cols = (width + MOTION_CELL - 1) / MOTION_CELL;
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t* a = cur + static_cast<int64_t>(y) * cur_stride;
+		const uint8_t* b = prev + static_cast<int64_t>(y) * prev_stride;
+		uint16_t* row = cells + (y / MOTION_CELL) * cols;
+		for (int x = 0; x < width; x++)
+		{
+			int d = a[x] - b[x];
+			row[x / MOTION_CELL] += (d > threshold || -d > threshold);
+		}
+	}
+}
+
+#ifdef MOTION_SIMD
+// the columns left over by the SIMD kernels, from x to the width
+static void motion_cells_tail(const uint8_t* cur, int cur_stride, const uint8_t* prev, int prev_stride, int x, int width, int height, int threshold, uint16_t* cells)
+{
+	if (x >= width)
+	{
+		return;
+	}
+
+	int cols = (width + MOTION_CELL - 1) / MOTION_CELL;
+	int first = x / MOTION_CELL;
+	std::vector<uint16_t> tail(static_cast<size_t>((height + MOTION_CELL - 1) / MOTION_CELL) * (cols - first), 0);
+	motion_cells_scalar(cur + x, cur_stride, prev + x, prev_stride, width - x, height, threshold, tail.data());
+	for (int y = 0; y < (height + MOTION_CELL - 1) / MOTION_CELL; y++)
+	{
+		for (int c = first; c < cols; c++)
+		{
+			cells[y * cols + c] += tail[y * (cols - first) + c - first];
+		}
+	}
+}
+
+// |a - b| > threshold gives 1 in the byte lane, added up over the 8 rows of a cell then summed per 8 lanes by the SAD
+MOTION_TARGET("sse2")
+static void motion_cells_sse2(const uint8_t* cur, int cur_stride, const uint8_t* prev, int prev_stride, int width, int height, int threshold, uint16_t* cells)
+{
+	int cols = (width + MOTION_CELL - 1) / MOTION_CELL;
+	int simd_width = width & ~15;
+	__m128i thr = _mm_set1_epi8(static_cast<char>(threshold));
+	__m128i zero = _mm_setzero_si128();
+	__m128i one = _mm_set1_epi8(1);
+	for (int y0 = 0; y0 < height; y0 += MOTION_CELL)
+	{
+		int rows = std::min(MOTION_CELL, height - y0);
+		uint16_t* row = cells + (y0 / MOTION_CELL) * cols;
+		for (int x = 0; x < simd_width; x += 16)
+		{
+			__m128i acc = zero;
+			for (int y = y0; y < y0 + rows; y++)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + static_cast<int64_t>(y) * cur_stride + x));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + static_cast<int64_t>(y) * prev_stride + x));
+				__m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+				acc = _mm_add_epi8(acc, _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(d, thr), zero), one));
+			}
+			__m128i sums = _mm_sad_epu8(acc, zero);
+			row[x / MOTION_CELL] += static_cast<uint16_t>(_mm_cvtsi128_si32(sums));
+			row[x / MOTION_CELL + 1] += static_cast<uint16_t>(_mm_extract_epi16(sums, 4));
+		}
+	}
+	motion_cells_tail(cur, cur_stride, prev, prev_stride, simd_width, width, height, threshold, cells);
+}
+
+MOTION_TARGET("avx2")
+static void motion_cells_avx2(const uint8_t* cur, int cur_stride, const uint8_t* prev, int prev_stride, int width, int height, int threshold, uint16_t* cells)
+{
+	int cols = (width + MOTION_CELL - 1) / MOTION_CELL;
+	int simd_width = width & ~31;
+	__m256i thr = _mm256_set1_epi8(static_cast<char>(threshold));
+	__m256i zero = _mm256_setzero_si256();
+	__m256i one = _mm256_set1_epi8(1);
+	for (int y0 = 0; y0 < height; y0 += MOTION_CELL)
+	{
+		int rows = std::min(MOTION_CELL, height - y0);
+		uint16_t* row = cells + (y0 / MOTION_CELL) * cols;
+		for (int x = 0; x < simd_width; x += 32)
+		{
+			__m256i acc = zero;
+			for (int y = y0; y < y0 + rows; y++)
+			{
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cur + static_cast<int64_t>(y) * cur_stride + x));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + static_cast<int64_t>(y) * prev_stride + x));
+				__m256i d = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+				acc = _mm256_add_epi8(acc, _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(d, thr), zero), one));
+			}
+			__m256i sums = _mm256_sad_epu8(acc, zero);
+			row[x / MOTION_CELL] += static_cast<uint16_t>(_mm256_extract_epi16(sums, 0));
+			row[x / MOTION_CELL + 1] += static_cast<uint16_t>(_mm256_extract_epi16(sums, 4));
+			row[x / MOTION_CELL + 2] += static_cast<uint16_t>(_mm256_extract_epi16(sums, 8));
+			row[x / MOTION_CELL + 3] += static_cast<uint16_t>(_mm256_extract_epi16(sums, 12));
+		}
+	}
+	motion_cells_tail(cur, cur_stride, prev, prev_stride, simd_width, width, height, threshold, cells);
+}
+
+// check the processor and the system for AVX2
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+MotionDetector::MotionDetector()
+{
+	m_kernel = motion_cells_scalar;
+	m_kernel_name = "scalar";
+	set_options("simd", "auto");
+	m_width = 0;
+	m_height = 0;
+	m_threshold = 25;
+	m_activity = 25;
+	m_min_cells = 4;
+	m_active = 0;
+
+	m_err = 0;
+	m_message = "";
 }
 
-// reset the main reader to the very beginning of the circular buffer
-void CircularBuffer::reset_main_reader()
+int MotionDetector::set_options(std::string option, std::string value)
 {
 	m_err = 0;
 	m_message = "";
 
-	mn_pkt = first_pkt;
+	if (option == "simd")
+	{
+#ifdef MOTION_SIMD
+		bool avx2 = cpu_has_avx2();
+		if ((value == "auto" && avx2) || (value == "avx2" && avx2))
+		{
+			m_kernel = motion_cells_avx2;
+			m_kernel_name = "avx2";
+			return m_err;
+		}
+		if (value == "auto" || value == "sse2")
+		{
+			m_kernel = motion_cells_sse2;
+			m_kernel_name = "sse2";
+			return m_err;
+		}
+#else
+		if (value == "auto")
+		{
+			m_kernel = motion_cells_scalar;
+			m_kernel_name = "scalar";
+			return m_err;
+		}
+#endif
+		if (value == "scalar")
+		{
+			m_kernel = motion_cells_scalar;
+			m_kernel_name = "scalar";
+			return m_err;
+		}
+
+		m_err = -1;
+		m_message = "unkown value of '" + value + "' for 'simd' setting, or not supported by the processor";
+		return m_err;
+	}
+
+	int v = atoi(value.c_str());
+	if (option == "threshold" && v >= 0 && v <= 255)
+	{
+		m_threshold = v;
+	}
+	else if (option == "activity" && v >= 0 && v <= 100)
+	{
+		m_activity = v;
+	}
+	else if (option == "min_cells" && v > 0)
+	{
+		m_min_cells = v;
+	}
+	else
+	{
+		m_err = -1;
+		m_message = "unkown value of '" + value + "' for '" + option + "' setting";
+	}
+
+	return m_err;
 }
 
-VideoRecorder::VideoRecorder()
+int MotionDetector::detect(const uint8_t* luma, int width, int height, int linesize)
 {
-	m_url = "";
-	m_ofmt_Ctx = NULL;
-	m_options = NULL;
-	m_index_video = -1;
-	m_index_audio = -1;
-	m_flag_interleaved = true;
-	m_flag_wclk = true;
-	m_tbf_video = AVRational{ 1,2 };
-	m_tbf_audio = AVRational{ 1,3 };
-	m_time_base_audio = AVRational{ 1,4 };
-	m_time_base_video = AVRational{ 1,5 };
-	m_pts_offset_video = 0;
-	m_pts_offset_audio = 0;
-	m_defalt_duration_audio = 0;
-	m_defalt_duration_video = 0;
+	int cols = (width + MOTION_CELL - 1) / MOTION_CELL;
+	int rows = (height + MOTION_CELL - 1) / MOTION_CELL;
+	m_active = 0;
+	if (width != m_width || height != m_height)
+	{
+		m_width = width;
+		m_height = height;
+		m_prev.resize(static_cast<size_t>(width) * height);
+		m_cells.resize(static_cast<size_t>(cols) * rows);
+	}
+	else
+	{
+		std::fill(m_cells.begin(), m_cells.end(), 0);
+		m_kernel(luma, linesize, m_prev.data(), width, width, height, m_threshold, m_cells.data());
+
+		// the cells at the right and bottom edges may be smaller
+		for (int y = 0; y < rows; y++)
+		{
+			int ch = std::min(MOTION_CELL, height - y * MOTION_CELL);
+			for (int x = 0; x < cols; x++)
+			{
+				int cw = std::min(MOTION_CELL, width - x * MOTION_CELL);
+				m_active += m_cells[y * cols + x] * 100 > m_activity * cw * ch;
+			}
+		}
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		memcpy(&m_prev[static_cast<size_t>(y) * width], luma + static_cast<int64_t>(y) * linesize, width);
+	}
+	return m_active;
+}
+
+bool MotionDetector::is_motion()
+{
+	return m_active >= m_min_cells;
+}
+
+std::string MotionDetector::get_kernel()
+{
+	return m_kernel_name;
+}
+
+std::string MotionDetector::get_error_message()
+{
+	return m_message;
+}
+
+MotionTrigger::MotionTrigger()
+{
+	m_scaler = NULL;
+	m_width = 160;
+	m_preroll = 5 * 1000000LL;
+	m_hold = 10 * 1000000LL;
+	m_frames = 3;
+	m_motion_frames = 0;
+	m_last_motion = 0;
+	m_stop = false;
+
+	m_analysed = 0;
+	m_started = 0;
+	m_kernel_time = 0;
+	m_active_cells = 0;
+	m_motion = false;
+
 	m_err = 0;
 	m_message = "";
-	m_chunk_time = 0; // chunk indicator
-	m_chunk_interval = 0;
-	m_chunk_prefix = "";
-	m_format = "mp4";
+
+	// the frames the trigger cannot keep up with are dropped, the newest frame is the one that matters
+	m_worker.set_options("overflow", "drop");
+	m_worker.set_options("pool_size", "4");
 }
 
-VideoRecorder::~VideoRecorder()
+MotionTrigger::~MotionTrigger()
 {
-	avformat_free_context(m_ofmt_Ctx);
-	av_dict_free(&m_options);
+	close();
+	if (m_scaler)
+	{
+		sws_freeContext(m_scaler);
+	}
 }
 
-int VideoRecorder::set_options(std::string option, std::string value)
+int MotionTrigger::set_options(std::string option, std::string value)
 {
 	m_err = 0;
 	m_message = "";
 
-	if (option == "wall_clock")
+	if (option == "threshold" || option == "activity" || option == "min_cells" || option == "simd")
+	{
+		m_err = m_detector.set_options(option, value);
+		m_message = m_detector.get_error_message();
+		return m_err;
+	}
+	if (option == "device" || option == "threads" || option == "thread_type")
+	{
+		m_err = m_worker.set_options(option, value);
+		m_message = m_worker.get_error_message();
+		return m_err;
+	}
+
+	int v = atoi(value.c_str());
+	if (option == "preroll" && v >= 0)
+	{
+		m_preroll = v * 1000000LL;
+	}
+	else if (option == "hold" && v >= 0)
+	{
+		m_hold = v * 1000000LL;
+	}
+	else if (option == "frames" && v > 0)
+	{
+		m_frames = v;
+	}
+	else if (option == "width" && v >= 16 && v <= 1920)
+	{
+		m_width = v & ~1;
+	}
+	else
+	{
+		m_err = -1;
+		m_message = "unkown value of '" + value + "' for '" + option + "' setting";
+	}
+
+	return m_err;
+}
+
+int MotionTrigger::open(CircularBuffer* buffer, int stream_index)
+{
+	close();
+
+	m_err = m_worker.open(buffer, stream_index);
+	m_message = m_worker.get_error_message();
+	if (m_err < 0)
+	{
+		return m_err;
+	}
+
+	m_motion_frames = 0;
+	m_last_motion = 0;
+	m_motion = false;
+	m_events.clear();
+	m_stop = false;
+	m_thread = std::thread(&MotionTrigger::analyse_frames, this);
+	return m_err;
+}
+
+int MotionTrigger::close()
+{
+	if (m_thread.joinable())
+	{
+		m_stop = true;
+		m_thread.join();
+	}
+	return m_worker.close();
+}
+
+int MotionTrigger::poll(int64_t* wallclock_ms)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_events.empty())
+	{
+		return 0;
+	}
+
+	int event = m_events.front().first;
+	if (wallclock_ms)
+	{
+		*wallclock_ms = m_events.front().second / 1000;
+	}
+	m_events.pop_front();
+	return event;
+}
+
+int MotionTrigger::get_preroll()
+{
+	return (int)(m_preroll / 1000000);
+}
+
+int MotionTrigger::get_hold()
+{
+	return (int)(m_hold / 1000000);
+}
+
+// get the metrics of the motion trigger, can be called by any thread at any time
+MotionMetrics MotionTrigger::get_metrics()
+{
+	MotionMetrics metrics;
+	metrics.frames = m_analysed.load(std::memory_order_relaxed);
+	metrics.events = m_started.load(std::memory_order_relaxed);
+	metrics.kernel_time = m_kernel_time.load(std::memory_order_relaxed);
+	metrics.active_cells = m_active_cells.load(std::memory_order_relaxed);
+	metrics.motion = m_motion.load(std::memory_order_relaxed);
+	return metrics;
+}
+
+std::string MotionTrigger::get_error_message()
+{
+	return m_message;
+}
+
+// only the luma plane is scaled, into a gray frame of the width set
+void MotionTrigger::analyse_frames()
+{
+	while (!m_stop)
+	{
+		AVFrame* frame = NULL;
+		int ret = m_worker.get_frame(&frame, 100);
+		if (ret < 0)
+		{
+			break;
+		}
+		if (ret == 0)
+		{
+			continue;
+		}
+
+		int width = std::min(m_width, frame->width & ~1);
+		int height = frame->width > 0 ? std::max(2, static_cast<int>(static_cast<int64_t>(frame->height) * width / frame->width) & ~1) : 0;
+		if (width <= 0 || height <= 0)
+		{
+			m_worker.release_frame(frame);
+			continue;
+		}
+
+		m_scaler = sws_getCachedContext(m_scaler, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+			width, height, AV_PIX_FMT_GRAY8, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+		if (!m_scaler)
+		{
+			m_worker.release_frame(frame);
+			break;
+		}
+		m_luma.resize(static_cast<size_t>(width) * height);
+		uint8_t* dst[4] = { m_luma.data(), NULL, NULL, NULL };
+		int dst_linesize[4] = { width, 0, 0, 0 };
+		sws_scale(m_scaler, frame->data, frame->linesize, 0, frame->height, dst, dst_linesize);
+		m_worker.release_frame(frame);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		int active = m_detector.detect(m_luma.data(), width, height, width);
+		m_kernel_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+		m_active_cells.store(active, std::memory_order_relaxed);
+		m_analysed.fetch_add(1, std::memory_order_relaxed);
+		update_event(m_detector.is_motion(), av_gettime());
+	}
+}
+
+void MotionTrigger::update_event(bool motion, int64_t now)
+{
+	m_motion_frames = motion ? m_motion_frames + 1 : 0;
+	if (motion)
+	{
+		m_last_motion = now;
+	}
+
+	if (!m_motion.load(std::memory_order_relaxed) && m_motion_frames >= m_frames)
+	{
+		m_motion.store(true, std::memory_order_relaxed);
+		m_started.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_events.push_back(std::make_pair(MOTION_START, now - m_preroll));
+	}
+	else if (m_motion.load(std::memory_order_relaxed) && now - m_last_motion > m_hold)
+	{
+		m_motion.store(false, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_events.push_back(std::make_pair(MOTION_STOP, now));
+	}
+}
+
+Camera::Camera()
+{
+	m_url = "";
+	m_ifmt_Ctx = NULL;
+	m_options = NULL;
+	m_index_video = -1;
+	m_index_audio = -1;
+
+	m_message = "";
+	m_err = avformat_network_init();
+	avdevice_register_all();
+	m_ifmt_Ctx = avformat_alloc_context();
+	m_interrupt.callback = NULL;
+	m_interrupt.opaque = NULL;
+	m_nonblock = false;
+	m_format = "rtsp";
+	m_start_time = 0;
+	m_wclk_align = true;
+
+	m_packets = 0;
+	m_bytes = 0;
+	m_read_errors = 0;
+	m_last_arrival = 0;
+	m_last_interval = -1;
+}
+
+Camera::~Camera()
+{
+	avformat_free_context(m_ifmt_Ctx);
+	av_dict_free(&m_options);
+}
+
+// get the error message of last operation
+std::string Camera::get_error_message()
+{
+	return m_message;
+}
+
+// set the callback polled by the blocking operations of the camera, a nonzero return aborts them with AVERROR_EXIT
+void Camera::set_interrupt_callback(int (*callback)(void*), void* opaque)
+{
+	m_interrupt.callback = callback;
+	m_interrupt.opaque = opaque;
+
+	// the context is freed by a failed open
+	if (!m_ifmt_Ctx)
+	{
+		return;
+	}
+	m_ifmt_Ctx->interrupt_callback.callback = callback;
+	m_ifmt_Ctx->interrupt_callback.opaque = opaque;
+}
+
+AVFormatContext* Camera::get_input_format_context()
+{
+	m_err = 0;
+	m_message = "";
+
+	return m_ifmt_Ctx;
+}
+
+// get the stream time base of the camera
+AVRational Camera::get_stream_time_base(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ifmt_Ctx->nb_streams)
+	{
+		return m_ifmt_Ctx->streams[stream_index]->time_base;
+	}
+
+	m_err = -1;
+	m_message = "Error. No input format context is found.";
+	return AVRational{ 1,1 };
+};
+
+// Set the options used to open a camera
+// additional options are
+//  -format value, specify the camera format. dshow for a Webcam in windows, v4l2 for a Webcam in linux
+//  -wall_clock value, wall clock alignment. true to get pts in epoch, false to get original pts
+//  -nonblock value, true to return AVERROR(EAGAIN) from read_packet instead of waiting for the next packet
+int Camera::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (option == "format")
+	{
+		m_format = value;
+		m_message = "update the camera format to be " + value;
+	}
+	else if (option == "wall_clock")
+	{
+		if (value == "false")
+		{
+			m_wclk_align = false;
+
+			m_err = 0;
+			m_message = "wall clock alignment is off";
+		}
+		else if (value == "true")
+		{
+			m_wclk_align = true;
+
+			m_err = 0;
+			m_message = "wall clock alignment is on";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'wall clock alignment' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+	else if (option == "nonblock")
+	{
+		if (value == "true")
+		{
+			m_nonblock = true;
+			m_ifmt_Ctx->flags |= AVFMT_FLAG_NONBLOCK;
+			m_message = "non-blocking read is on";
+		}
+		else if (value == "false")
+		{
+			m_nonblock = false;
+			m_ifmt_Ctx->flags &= ~AVFMT_FLAG_NONBLOCK;
+			m_message = "non-blocking read is off";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'nonblock' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+	else
+	{
+		m_err = av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
+		m_message = "set the option '" + option + "' to be " + value;
+	}
+	return m_err;
+}
+
+// open/connect to the camera
+// return 0 on success
+int Camera::open(std::string url)
+{
+	// check if the url is empty
+	if (url.empty())
+	{
+		m_err = -1;
+		m_message = "Error. Camera path is empty";
+		return m_err;
+	}
+	m_url = url;
+
+	// to determine the camera type
+	m_message = "IP Camera: ";
+	AVInputFormat* ifmt = NULL;
+	if (url.find("/dev/") != std::string::npos)
+	{
+		ifmt = av_find_input_format("v4l2");
+		m_message = "v4l2: ";
+	}
+	else
+	{
+		ifmt = av_find_input_format(m_format.c_str());
+		m_message = m_format + ": "; // "USB (Windows)";
+	}
+
+	// the options are given as a copy, so that reconnect can open the camera with all of them again
+	AVDictionary* options = NULL;
+	av_dict_copy(&options, m_options, 0);
+	m_err = avformat_open_input(&m_ifmt_Ctx, m_url.c_str(), ifmt, &options);
+	av_dict_free(&options);
+	if (m_err < 0)
+	{
+		m_message.append(av_err(m_err));
+		return m_err;
+	}
+	m_start_time = av_gettime();  // hold global start time in microseconds
+
+	m_err = avformat_find_stream_info(m_ifmt_Ctx, 0);
+	if (m_err < 0)
+	{
+		m_message.append(av_err(m_err));
+		return m_err;
+	}
+
+	m_err = 0;
+	m_message += " connected";
+
+	// find the index of video stream
+	AVStream* st;
+	for (int i = 0; static_cast <unsigned int>(i) < m_ifmt_Ctx->nb_streams; i++)
+	{
+		st = m_ifmt_Ctx->streams[i]; 
+
+		// modify the start time when required aligning to wall clock
+		if (m_wclk_align)
+		{
+			// calculate the correct time stamp for a very large epoch time
+			int64_t den = st->time_base.den;
+			int64_t num = st->time_base.num;
+			num *= 1000000;
+
+			int64_t gcd = av_const av_gcd(den, num);
+			if (gcd)
+			{
+				den /= gcd;
+				num /= gcd;
+			}
+
+			if (num > den)
+			{
+				st->start_time = m_start_time * den / num - st->start_time;
+			}
+			else
+			{
+				st->start_time = m_start_time / num * den - st->start_time;
+			}
+		}
+
+		if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+		{
+			m_index_video = i;
+			st->duration = st->time_base.den / st->time_base.num / 30; // default duration for video is 1/30s
+			m_message += ", video stream found";
+		}
+
+		if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+		{
+			m_index_audio = i;
+			st->duration = st->time_base.den / st->time_base.num / 100; // default duration for audio is 1/100s
+			m_message += ", audio stream found";
+		}
+		st->duration++; // make sure it is not 0
+	}
+
+	if (m_index_video < 0 && m_index_audio < 0)
+	{
+		m_err = -2;
+		m_message += ", but no video nor audio stream";
+	}
+	return m_err;
+}
+
+// close the camera and open it again at the same url, with the same options and interrupt callback
+// the streams are looked up again, the packets keep their wall clock alignment from the new start time
+// return 0 on success
+int Camera::reconnect()
+{
+	if (m_ifmt_Ctx && m_ifmt_Ctx->iformat)
+	{
+		avformat_close_input(&m_ifmt_Ctx);
+	}
+	else
+	{
+		avformat_free_context(m_ifmt_Ctx);
+	}
+	m_ifmt_Ctx = avformat_alloc_context();
+	if (!m_ifmt_Ctx)
+	{
+		m_err = AVERROR(ENOMEM);
+		m_message = "cannot allocate the input context to reconnect " + m_url;
+		return m_err;
+	}
+	m_ifmt_Ctx->interrupt_callback = m_interrupt;
+	if (m_nonblock)
+	{
+		m_ifmt_Ctx->flags |= AVFMT_FLAG_NONBLOCK;
+	}
+
+	m_index_video = -1;
+	m_index_audio = -1;
+	m_last_arrival = 0;
+	m_last_interval = -1;
+	return open(m_url);
+}
+
+// read a packet from the camera
+// return 0 on success
+int Camera::read_packet(AVPacket* pkt)
+{
+	m_message = "";
+	m_err = av_read_frame(m_ifmt_Ctx, pkt); // read a frame from the camera
+
+	// nothing to read yet in non-blocking mode, keep it cheap as it is polled
+	if (m_err == AVERROR(EAGAIN))
+	{
+		return m_err;
+	}
+
+	// handle the timeout
+	if (m_err < 0)
+	{
+		m_read_errors.store(m_read_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_message.assign(av_err(m_err));
+		m_message = "Time out while reading " + m_url + " with error " + m_message;
+		pkt = NULL;
+		return m_err;
+	}
+
+	// the arrival of the video packets, or the audio packets without video, tells the jitter of the camera
+	m_packets.store(m_packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_bytes.store(m_bytes.load(std::memory_order_relaxed) + pkt->size, std::memory_order_relaxed);
+	if (pkt->stream_index == (m_index_video >= 0 ? m_index_video : m_index_audio))
+	{
+		int64_t now = av_gettime_relative();
+		if (m_last_arrival)
+		{
+			int64_t interval = now - m_last_arrival;
+			m_inter_arrival.add(interval);
+			if (m_last_interval >= 0)
+			{
+				m_jitter.add(interval > m_last_interval ? interval - m_last_interval : m_last_interval - interval);
+			}
+			m_last_interval = interval;
+		}
+		m_last_arrival = now;
+	}
+
+	if (!m_wclk_align)
+	{
+		return m_err;
+	}
+
+	// Doing wall clock alignment
+	if (pkt->pts == AV_NOPTS_VALUE)
+	{
+		m_err = -1;
+		m_message = "no wall clock alignment for packet without pts value";
+		return m_err;
+	}
+
+	// make pts and pds wall clock aligned
+	AVStream* st = m_ifmt_Ctx->streams[pkt->stream_index];
+	pkt->pts += st->start_time;
+	pkt->dts += st->start_time;
+	if (!pkt->duration)
+	{
+		pkt->duration = st->duration; // assign duration to be the default duration
+	}
+
+	return m_err;
+};
+
+// get the metrics of the camera, can be called by any thread at any time
+CameraMetrics Camera::get_metrics()
+{
+	CameraMetrics metrics;
+	metrics.packets = m_packets.load(std::memory_order_relaxed);
+	metrics.bytes = m_bytes.load(std::memory_order_relaxed);
+	metrics.errors = m_read_errors.load(std::memory_order_relaxed);
+	m_inter_arrival.get_snapshot(&metrics.inter_arrival);
+	m_jitter.get_snapshot(&metrics.jitter);
+	return metrics;
+}
+
+// get the video stream index of the camera
+// negative return indicates no video stream in the camera
+int Camera::get_video_index()
+{
+	return m_index_video;
+}
+
+// get the audio stream index of the camera
+// negative return indicates no audio stream in the camera
+int Camera::get_audio_index()
+{
+	return m_index_audio;
+}
+
+// get the specified stream
+// index can be video index or audio index
+AVStream* Camera::get_stream(int stream_index)
+{
+	if (stream_index < 0 || static_cast <unsigned int>(stream_index) >= m_ifmt_Ctx->nb_streams)
+	{
+		m_err = -1;
+		m_message = "In valid stream index specified";
+		return NULL;
+	}
+	
+	m_err = 0;
+	m_message = "get the stream";
+	return m_ifmt_Ctx->streams[stream_index];
+}
+
+CameraPool::CameraPool()
+{
+	m_thread_count = 2;
+	m_read_timeout = POOL_READ_TIMEOUT * 1000LL;
+	m_reconnect_timeout = POOL_RECONNECT_TIMEOUT * 1000000LL;
+	m_idle_sleep = POOL_IDLE_SLEEP;
+	m_stop = false;
+	m_err = 0;
+	m_message = "";
+}
+
+CameraPool::~CameraPool()
+{
+	stop();
+	for (PooledCamera* c : m_cameras)
+	{
+		c->camera->set_interrupt_callback(NULL, NULL);
+		delete c;
+	}
+}
+
+// get the error message of last operation
+std::string CameraPool::get_error_message()
+{
+	return m_message;
+}
+
+// Set the options of the pool
+//  -threads value, number of I/O threads, 2 by default
+//  -read_timeout value, time in miliseconds a read may stall the shared thread before the camera is moved to its own, 100 by default
+//  -reconnect_timeout value, time in seconds a reconnection or a read of a camera on its own thread may stall, 10 by default
+//  -idle_sleep value, time in microseconds a thread sleeps when none of its cameras has a packet ready
+//  -cpus value, the cores the I/O threads are pinned to, one core each in turn, such as 2,3 or 4-7
+//  -realtime value, the SCHED_FIFO priority of the I/O threads [1-99], 0 for the normal policy
+int CameraPool::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (!m_threads.empty())
+	{
+		m_err = -1;
+		m_message = "the options cannot be changed while the pool is running";
+		return m_err;
+	}
+
+	int64_t v = atoll(value.c_str());
+	if (option == "threads")
+	{
+		if (v < 1 || v > 64)
+		{
+			m_err = -1;
+			m_message = "the number of threads has to be between 1 and 64";
+			return m_err;
+		}
+		m_thread_count = (int)v;
+		m_message = "the pool runs " + value + " threads";
+	}
+	else if (option == "read_timeout")
+	{
+		if (v < 1 || v > 10000)
+		{
+			m_err = -1;
+			m_message = "the read timeout has to be between 1 and 10000 miliseconds";
+			return m_err;
+		}
+		m_read_timeout = v * 1000;
+		m_message = "the read timeout is " + value + "ms";
+	}
+	else if (option == "reconnect_timeout")
+	{
+		if (v < 1 || v > 600)
+		{
+			m_err = -1;
+			m_message = "the reconnect timeout has to be between 1 and 600 seconds";
+			return m_err;
+		}
+		m_reconnect_timeout = v * 1000000;
+		m_message = "the reconnect timeout is " + value + "s";
+	}
+	else if (option == "idle_sleep")
+	{
+		if (v < 0)
+		{
+			m_err = -1;
+			m_message = "the idle sleep cannot be negative";
+			return m_err;
+		}
+		m_idle_sleep = v;
+		m_message = "the idle sleep is " + value + "us";
+	}
+	else if (option == "cpus")
+	{
+		m_err = m_tuning.set_cpus(value);
+		m_message = m_tuning.get_error_message();
+	}
+	else if (option == "realtime")
+	{
+		m_err = m_tuning.set_priority(value);
+		m_message = m_tuning.get_error_message();
+	}
+	else
+	{
+		m_err = -1;
+		m_message = "unknown option '" + option + "'";
+	}
+	return m_err;
+}
+
+// add a camera not opened yet, its packets are pushed into the buffer once the pool is started
+// return the index of the camera in the pool
+int CameraPool::add_camera(Camera* camera, CircularBuffer* buffer)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (!camera || !buffer)
+	{
+		m_err = -1;
+		m_message = "a camera and a circular buffer are required";
+		return m_err;
+	}
+	if (!m_threads.empty())
+	{
+		m_err = -2;
+		m_message = "no camera can be added while the pool is running";
+		return m_err;
+	}
+
+	PooledCamera* c = new PooledCamera();
+	c->camera = camera;
+	c->buffer = buffer;
+	c->pool = this;
+	c->thread = 0;
+	c->dedicated = false;
+	c->deadline = 0;
+	c->finished = false;
+	c->packets = 0;
+	c->polls = 0;
+	c->reconnects = 0;
+	c->errors = 0;
+	c->last_error = 0;
+	m_cameras.push_back(c);
+
+	camera->set_options("nonblock", "true");
+	camera->set_interrupt_callback(&CameraPool::interrupt, c);
+
+	m_message = "camera added";
+	return (int)m_cameras.size() - 1;
+}
+
+// start the I/O threads, the cameras are spread over them
+int CameraPool::start()
+{
+	m_err = 0;
+	m_message = "";
+
+	if (!m_threads.empty())
+	{
+		m_err = -1;
+		m_message = "the pool is running already";
+		return m_err;
+	}
+
+	int threads = std::max(1, std::min(m_thread_count, (int)m_cameras.size()));
+	for (size_t i = 0; i < m_cameras.size(); i++)
+	{
+		m_cameras[i]->thread = i % threads;
+	}
+
+	// a thread the tuning is refused for runs on as it is, the pool is started anyway
+	std::string tuning;
+	for (int i = 0; i < threads; i++)
+	{
+		m_threads.push_back(std::thread(&CameraPool::run, this, i));
+		if (m_tuning.is_set() && m_tuning.apply(m_threads.back(), i) < 0)
+		{
+			tuning = ", " + m_tuning.get_error_message();
+		}
+	}
+
+	// the cameras moved to their own threads before stay there, they are reconnected as the pool was stopped midway
+	for (PooledCamera* c : m_cameras)
+	{
+		if (c->dedicated.load(std::memory_order_relaxed) && !c->finished.load(std::memory_order_relaxed))
+		{
+			c->worker = std::thread(&CameraPool::serve, this, c);
+		}
+	}
+
+	m_message = "the pool is started with " + std::to_string(threads) + " threads for " + std::to_string(m_cameras.size()) + " cameras" + tuning;
+	return m_err;
+}
+
+// stop the I/O threads, the reads in progress are interrupted
+int CameraPool::stop()
+{
+	m_err = 0;
+	m_message = "";
+
+	m_stop = true;
+	for (std::thread& t : m_threads)
+	{
+		t.join();
+	}
+	m_threads.clear();
+
+	// the dedicated threads are started by the shared ones, they are all known once those are stopped
+	for (PooledCamera* c : m_cameras)
+	{
+		if (c->worker.joinable())
+		{
+			c->worker.join();
+		}
+	}
+	m_stop = false;
+
+	m_message = "the pool is stopped";
+	return m_err;
+}
+
+// get the number of cameras in the pool
+int CameraPool::get_camera_count()
+{
+	return (int)m_cameras.size();
+}
+
+// get the statistics of the specified camera
+CameraStats CameraPool::get_stats(int camera)
+{
+	CameraStats stats;
+	memset(&stats, 0, sizeof(stats));
+	if (camera < 0 || camera >= (int)m_cameras.size())
+	{
+		m_err = -1;
+		m_message = "invalid camera index";
+		return stats;
+	}
+
+	PooledCamera* c = m_cameras[camera];
+	stats.packets = c->packets.load(std::memory_order_relaxed);
+	stats.polls = c->polls.load(std::memory_order_relaxed);
+	stats.reconnects = c->reconnects.load(std::memory_order_relaxed);
+	stats.errors = c->errors.load(std::memory_order_relaxed);
+	stats.last_error = c->last_error.load(std::memory_order_relaxed);
+	stats.finished = c->finished.load(std::memory_order_relaxed);
+	stats.dedicated = c->dedicated.load(std::memory_order_relaxed);
+	m_err = 0;
+	m_message = "";
+	return stats;
+}
+
+// the interrupt callback of the cameras, abort the read when it has stalled for the read timeout or the pool is stopping
+// it is called by the demuxer in the I/O thread of the camera, and by open in the thread opening the camera
+int CameraPool::interrupt(void* opaque)
+{
+	PooledCamera* c = static_cast<PooledCamera*>(opaque);
+	if (c->deadline && av_gettime_relative() > c->deadline)
+	{
+		return 1;
+	}
+	return c->pool->m_stop.load(std::memory_order_relaxed) ? 1 : 0;
+}
+
+// the I/O thread, read the packets of its cameras until the pool is stopped
+// a camera is left once it has no packet ready, after POOL_BURST packets, or when the read has stalled.
+// A stalled camera is handed over to a thread of its own, which reconnects it, the shared thread never waits for it again.
+void CameraPool::run(int thread)
+{
+	// the cameras without video nor audio stream, such as the ones failed to open, are left out
+	std::vector<PooledCamera*> cameras;
+	for (PooledCamera* c : m_cameras)
+	{
+		if (c->thread != thread)
+		{
+			continue;
+		}
+		if (c->camera->get_video_index() < 0 && c->camera->get_audio_index() < 0)
+		{
+			c->finished = true;
+			continue;
+		}
+		cameras.push_back(c);
+	}
+
+	while (!m_stop.load(std::memory_order_relaxed))
+	{
+		bool idle = true;
+		for (PooledCamera* c : cameras)
+		{
+			if (c->finished.load(std::memory_order_relaxed) || c->dedicated.load(std::memory_order_relaxed))
+			{
+				continue;
+			}
+
+			int ret = read_camera(c, POOL_BURST, m_read_timeout);
+			if (ret < 0 && !m_stop.load(std::memory_order_relaxed))
+			{
+				c->reconnects.fetch_add(1, std::memory_order_relaxed);
+
+				// the thread of the camera is only started here, and joined by stop once the shared threads are gone
+				c->dedicated = true;
+				c->worker = std::thread(&CameraPool::serve, this, c);
+				if (m_tuning.is_set())
+				{
+					m_tuning.apply(c->worker, thread);
+				}
+			}
+			idle = idle && ret <= 0;
+		}
+
+		if (idle && m_idle_sleep)
+		{
+			av_usleep((unsigned)m_idle_sleep);
+		}
+	}
+}
+
+// the thread of a camera whose read has blocked, reconnect it and read it until the pool is stopped
+// The camera is opened again in blocking mode, so the thread sleeps in the demuxer until the next packet. A failed reconnection
+// is tried again after the reconnect timeout, the wait is cut short when the pool stops.
+void CameraPool::serve(PooledCamera* c)
+{
+	c->camera->set_options("nonblock", "false");
+	bool connected = false;
+	while (!m_stop.load(std::memory_order_relaxed) && !c->finished.load(std::memory_order_relaxed))
+	{
+		if (!connected)
+		{
+			c->deadline = av_gettime_relative() + m_reconnect_timeout;
+			int ret = c->camera->reconnect();
+			c->deadline = 0;
+			if (ret < 0)
+			{
+				c->errors.fetch_add(1, std::memory_order_relaxed);
+				c->last_error = ret;
+				int64_t retry = av_gettime_relative() + m_reconnect_timeout;
+				while (!m_stop.load(std::memory_order_relaxed) && av_gettime_relative() < retry)
+				{
+					av_usleep(10000);
+				}
+				continue;
+			}
+			connected = true;
+		}
+
+		// a failed read is not retried at once, the demuxer may keep failing
+		int ret = read_camera(c, POOL_BURST, m_reconnect_timeout);
+		if (ret < 0 && !m_stop.load(std::memory_order_relaxed))
+		{
+			c->reconnects.fetch_add(1, std::memory_order_relaxed);
+		}
+		else if (!ret && m_idle_sleep)
+		{
+			av_usleep((unsigned)m_idle_sleep);
+		}
+		connected = ret >= 0;
+	}
+}
+
+// read up to count packets of the camera and push them into its buffer, with a deadline of timeout microseconds per read
+// return the number of packets read, negative when the read has stalled and the camera has to be reconnected
+// An aborted demuxer is out of sync, so the camera is never read again before it is reconnected.
+int CameraPool::read_camera(PooledCamera* c, int count, int64_t timeout)
+{
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+
+	int index_video = c->camera->get_video_index();
+	int index_audio = c->camera->get_audio_index();
+	int n = 0;
+	for (; n < count; n++)
+	{
+		c->deadline = av_gettime_relative() + timeout;
+		int ret = c->camera->read_packet(&pkt);
+		c->deadline = 0;
+
+		if (ret == AVERROR(EAGAIN))
+		{
+			c->polls.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+		if (ret == AVERROR_EXIT)
+		{
+			return -1;
+		}
+		if (ret == AVERROR_EOF)
+		{
+			c->finished = true;
+			break;
+		}
+		if (ret < 0)
+		{
+			// a packet may be returned without the wall clock alignment, drop it as the capturing thread did
+			av_packet_unref(&pkt);
+			c->errors.fetch_add(1, std::memory_order_relaxed);
+			c->last_error = ret;
+			break;
+		}
+
+		if (pkt.stream_index == index_video || pkt.stream_index == index_audio)
+		{
+			ret = c->buffer->push_packet(&pkt);
+			if (ret < 0)
+			{
+				c->errors.fetch_add(1, std::memory_order_relaxed);
+				c->last_error = ret;
+			}
+			else
+			{
+				c->packets.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		av_packet_unref(&pkt);
+	}
+	return n;
+}
+
+// add the header of a metric family
+static void metric_family(std::string& text, const char* name, const char* type, const char* help)
+{
+	text += std::string("# HELP ") + name + " " + help + "\n";
+	text += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+// add a sample of a metric
+static void metric_sample(std::string& text, const char* name, std::string labels, int64_t value)
+{
+	text += std::string(name) + "{" + labels + "} " + std::to_string(value) + "\n";
+}
+
+// add the samples of a histogram, the buckets are cumulative and bounded by the largest value of the histogram buckets
+// only the buckets up to the last one having values are given, followed by +Inf
+static void metric_histogram(std::string& text, const char* name, std::string labels, HistogramSnapshot* h)
+{
+	int last = HISTOGRAM_BUCKETS - 1;
+	while (last > 0 && !h->buckets[last])
+	{
+		last--;
+	}
+
+	int64_t count = 0;
+	for (int i = 0; i <= last && i < HISTOGRAM_BUCKETS - 1; i++)
+	{
+		count += h->buckets[i];
+		int64_t bound = i ? (static_cast<int64_t>(1) << i) - 1 : 0;
+		text += std::string(name) + "_bucket{" + labels + ",le=\"" + std::to_string(bound) + "\"} " + std::to_string(count) + "\n";
+	}
+	text += std::string(name) + "_bucket{" + labels + ",le=\"+Inf\"} " + std::to_string(h->count) + "\n";
+	text += std::string(name) + "_sum{" + labels + "} " + std::to_string(h->sum) + "\n";
+	text += std::string(name) + "_count{" + labels + "} " + std::to_string(h->count) + "\n";
+}
+
+MetricsExporter::MetricsExporter()
+{
+	m_url = "";
+	m_interval = 10;
+	m_stop = false;
+	m_dump_err = 0;
+	m_dump_message = "";
+	m_err = 0;
+	m_message = "";
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	stop();
+}
+
+// get the error message of last operation
+std::string MetricsExporter::get_error_message()
+{
+	return m_message;
+}
+
+// add a circular buffer to export, the name is given as the label of its metrics
+void MetricsExporter::add_buffer(std::string name, CircularBuffer* buffer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_buffers.push_back(std::make_pair(name, buffer));
+}
+
+// add a camera to export, the name is given as the label of its metrics
+void MetricsExporter::add_camera(std::string name, Camera* camera)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cameras.push_back(std::make_pair(name, camera));
+}
+
+// add a recorder to export, the name is given as the label of its metrics
+void MetricsExporter::add_recorder(std::string name, VideoRecorder* recorder)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_recorders.push_back(std::make_pair(name, recorder));
+}
+
+// get the metrics in the Prometheus text format
+// the metrics of every object are read once, then the samples are grouped by the metric families
+std::string MetricsExporter::get_text()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	std::vector<std::pair<std::string, CircularBuffer*> > buffers = m_buffers;
+	std::vector<std::pair<std::string, Camera*> > cameras = m_cameras;
+	std::vector<std::pair<std::string, VideoRecorder*> > recorders = m_recorders;
+	lock.unlock();
+
+	std::vector<BufferMetrics> bm(buffers.size());
+	std::vector<CameraMetrics> cm(cameras.size());
+	std::vector<RecorderMetrics> rm(recorders.size());
+	std::vector<std::string> bl(buffers.size()), cl(cameras.size()), rl(recorders.size());
+	for (size_t i = 0; i < buffers.size(); i++)
+	{
+		bm[i] = buffers[i].second->get_metrics();
+		bl[i] = "buffer=\"" + buffers[i].first + "\"";
+	}
+	for (size_t i = 0; i < cameras.size(); i++)
+	{
+		cm[i] = cameras[i].second->get_metrics();
+		cl[i] = "camera=\"" + cameras[i].first + "\"";
+	}
+	for (size_t i = 0; i < recorders.size(); i++)
+	{
+		rm[i] = recorders[i].second->get_metrics();
+		rl[i] = "recorder=\"" + recorders[i].first + "\"";
+	}
+
+	std::string text;
+	if (!buffers.empty())
+	{
+		metric_family(text, "circularbuffer_packets", "gauge", "Packets in the circular buffer.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_sample(text, "circularbuffer_packets", bl[i], bm[i].packets);
+		metric_family(text, "circularbuffer_bytes", "gauge", "Size of the circular buffer in bytes.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_sample(text, "circularbuffer_bytes", bl[i], bm[i].bytes);
+		metric_family(text, "circularbuffer_pushed_packets_total", "counter", "Packets pushed into the circular buffer.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_sample(text, "circularbuffer_pushed_packets_total", bl[i], bm[i].pushed);
+		metric_family(text, "circularbuffer_pushed_bytes_total", "counter", "Payload bytes pushed into the circular buffer.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_sample(text, "circularbuffer_pushed_bytes_total", bl[i], bm[i].pushed_bytes);
+		metric_family(text, "circularbuffer_evicted_packets_total", "counter", "Packets evicted from the circular buffer by reason.");
+		for (size_t i = 0; i < bm.size(); i++)
+		{
+			metric_sample(text, "circularbuffer_evicted_packets_total", bl[i] + ",reason=\"time\"", bm[i].evicted_time);
+			metric_sample(text, "circularbuffer_evicted_packets_total", bl[i] + ",reason=\"size\"", bm[i].evicted_size);
+			metric_sample(text, "circularbuffer_evicted_packets_total", bl[i] + ",reason=\"slots\"", bm[i].evicted_slots);
+		}
+		metric_family(text, "circularbuffer_thinned_packets_total", "counter", "Non-keyframes dropped from the old GOPs of the circular buffer.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_sample(text, "circularbuffer_thinned_packets_total", bl[i], bm[i].thinned);
+		metric_family(text, "circularbuffer_reader_lag_packets", "gauge", "Packets the reader is behind the newest packet.");
+		for (size_t i = 0; i < bm.size(); i++)
+			for (int r = 0; r < bm[i].readers; r++)
+				metric_sample(text, "circularbuffer_reader_lag_packets", bl[i] + ",reader=\"" + std::to_string(bm[i].reader[r]) + "\"", bm[i].reader_lag[r]);
+		metric_family(text, "circularbuffer_reader_lag_milliseconds", "gauge", "Time the reader is behind the newest packet.");
+		for (size_t i = 0; i < bm.size(); i++)
+			for (int r = 0; r < bm[i].readers; r++)
+				metric_sample(text, "circularbuffer_reader_lag_milliseconds", bl[i] + ",reader=\"" + std::to_string(bm[i].reader[r]) + "\"", bm[i].reader_lag_time[r]);
+		metric_family(text, "circularbuffer_reader_lost_packets_total", "counter", "Packets evicted before the reader could read them.");
+		for (size_t i = 0; i < bm.size(); i++)
+			for (int r = 0; r < bm[i].readers; r++)
+				metric_sample(text, "circularbuffer_reader_lost_packets_total", bl[i] + ",reader=\"" + std::to_string(bm[i].reader[r]) + "\"", bm[i].reader_lost[r]);
+		metric_family(text, "circularbuffer_push_latency_nanoseconds", "histogram", "Time push_packet takes, sampled.");
+		for (size_t i = 0; i < bm.size(); i++)
+			metric_histogram(text, "circularbuffer_push_latency_nanoseconds", bl[i], &bm[i].push_latency);
+	}
+
+	if (!cameras.empty())
+	{
+		metric_family(text, "camera_packets_total", "counter", "Packets read from the camera.");
+		for (size_t i = 0; i < cm.size(); i++)
+			metric_sample(text, "camera_packets_total", cl[i], cm[i].packets);
+		metric_family(text, "camera_bytes_total", "counter", "Payload bytes read from the camera.");
+		for (size_t i = 0; i < cm.size(); i++)
+			metric_sample(text, "camera_bytes_total", cl[i], cm[i].bytes);
+		metric_family(text, "camera_read_errors_total", "counter", "Failed reads of the camera.");
+		for (size_t i = 0; i < cm.size(); i++)
+			metric_sample(text, "camera_read_errors_total", cl[i], cm[i].errors);
+		metric_family(text, "camera_inter_arrival_microseconds", "histogram", "Time between the packets of the camera.");
+		for (size_t i = 0; i < cm.size(); i++)
+			metric_histogram(text, "camera_inter_arrival_microseconds", cl[i], &cm[i].inter_arrival);
+		metric_family(text, "camera_jitter_microseconds", "histogram", "Change of the time between the packets of the camera.");
+		for (size_t i = 0; i < cm.size(); i++)
+			metric_histogram(text, "camera_jitter_microseconds", cl[i], &cm[i].jitter);
+	}
+
+	if (!recorders.empty())
+	{
+		metric_family(text, "recorder_packets_total", "counter", "Packets written by the recorder.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_packets_total", rl[i], rm[i].packets);
+		metric_family(text, "recorder_bytes_total", "counter", "Payload bytes written by the recorder.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_bytes_total", rl[i], rm[i].bytes);
+		metric_family(text, "recorder_write_errors_total", "counter", "Failed writes of the recorder.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_write_errors_total", rl[i], rm[i].errors);
+		metric_family(text, "recorder_rotations_total", "counter", "Chunk rotations of the recorder.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_rotations_total", rl[i], rm[i].rotations);
+		metric_family(text, "recorder_queue_depth", "gauge", "Tasks waiting for the muxing thread.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_queue_depth", rl[i], rm[i].queue_depth);
+		metric_family(text, "recorder_blocked_packets_total", "counter", "Packets that had to wait for room in the queue.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_blocked_packets_total", rl[i], rm[i].blocked);
+		metric_family(text, "recorder_file_writes_total", "counter", "Write system calls to the recording files.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_file_writes_total", rl[i], rm[i].file_writes);
+		metric_family(text, "recorder_syncs_total", "counter", "Syncs of the recording files by the durability policy.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_syncs_total", rl[i], rm[i].syncs);
+		metric_family(text, "recorder_sync_errors_total", "counter", "Failed syncs of the recording files.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_sync_errors_total", rl[i], rm[i].sync_errors);
+		metric_family(text, "recorder_bytes_at_risk", "gauge", "Payload bytes recorded but not synced yet.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_sample(text, "recorder_bytes_at_risk", rl[i], rm[i].bytes_at_risk);
+		metric_family(text, "recorder_write_latency_microseconds", "histogram", "Time a packet takes to be written.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_histogram(text, "recorder_write_latency_microseconds", rl[i], &rm[i].write_latency);
+		metric_family(text, "recorder_rotation_latency_microseconds", "histogram", "Time the recording is held by the chunk rotations.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_histogram(text, "recorder_rotation_latency_microseconds", rl[i], &rm[i].rotation_latency);
+		metric_family(text, "recorder_sync_latency_microseconds", "histogram", "Time a sync of the recording file takes.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_histogram(text, "recorder_sync_latency_microseconds", rl[i], &rm[i].sync_latency);
+		metric_family(text, "recorder_at_risk_bytes", "histogram", "Payload bytes at risk just before every sync completes.");
+		for (size_t i = 0; i < rm.size(); i++)
+			metric_histogram(text, "recorder_at_risk_bytes", rl[i], &rm[i].at_risk);
+	}
+
+	return text;
+}
+
+// write the text into the file under a temporary name then rename it, the message is given on failure
+int MetricsExporter::write_file(std::string url, std::string text, std::string* message)
+{
+	std::string temp = url + ".tmp";
+	FILE* fp = fopen(temp.c_str(), "wb");
+	if (!fp)
+	{
+		*message = "cannot create " + temp;
+		return -1;
+	}
+	size_t written = fwrite(text.data(), 1, text.size(), fp);
+	fclose(fp);
+	if (written != text.size())
+	{
+		remove(temp.c_str());
+		*message = "cannot write " + temp;
+		return -2;
+	}
+
+#ifdef _WIN32
+	bool renamed = MoveFileExA(temp.c_str(), url.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool renamed = rename(temp.c_str(), url.c_str()) == 0;
+#endif
+	if (!renamed)
+	{
+		remove(temp.c_str());
+		*message = "cannot replace " + url;
+		return -3;
+	}
+
+	*message = "metrics dumped into " + url;
+	return 0;
+}
+
+// dump the metrics into the file once
+// return 0 on success
+int MetricsExporter::dump(std::string url)
+{
+	m_err = write_file(url, get_text(), &m_message);
+	return m_err;
+}
+
+// dump the metrics into the file every interval seconds in a seperate thread, until stop is called
+int MetricsExporter::start(std::string url, int interval)
+{
+	if (m_thread.joinable())
+	{
+		m_err = -1;
+		m_message = "the metrics are being dumped already";
+		return m_err;
+	}
+	if (url.empty() || interval < 1)
+	{
+		m_err = -2;
+		m_message = "a file and an interval of at least 1s are required";
+		return m_err;
+	}
+
+	m_url = url;
+	m_interval = interval;
+	m_stop = false;
+	m_dump_err = 0;
+	m_dump_message = "";
+	m_thread = std::thread(&MetricsExporter::dump_metrics, this);
+
+	m_err = 0;
+	m_message = "dumping the metrics into " + url + " every " + std::to_string(interval) + "s";
+	return m_err;
+}
+
+// stop dumping the metrics, the last dump is done before the thread stops
+int MetricsExporter::stop()
+{
+	if (m_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+
+		m_err = m_dump_err;
+		m_message = m_dump_message;
+		return m_err;
+	}
+
+	m_err = 0;
+	m_message = "the metrics are not dumped";
+	return m_err;
+}
+
+// the dumping thread, dump the metrics every interval until it is stopped
+void MetricsExporter::dump_metrics()
+{
+	bool stopping = false;
+	while (!stopping)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			stopping = m_cond.wait_for(lock, std::chrono::seconds(m_interval), [this] { return m_stop; });
+		}
+		m_dump_err = write_file(m_url, get_text(), &m_dump_message);
+	}
+}
+
+PacketGenerator::PacketGenerator()
+{
+	memset(&m_stream, 0, sizeof(AVStream));
+	m_stream.codecpar = avcodec_parameters_alloc();
+	m_stream.codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	m_stream.codecpar->codec_id = AV_CODEC_ID_H264;
+	m_stream.codecpar->width = 1280;
+	m_stream.codecpar->height = 720;
+	m_stream.time_base = AVRational{ 1, 90000 };
+
+	m_fps = 30;
+	m_bitrate = 4000000;
+	m_gop = 30;
+	m_keyframe_size = 0;
+	m_frame_size = 0;
+	m_realtime = false;
+	m_start_time = 0;
+	m_packets = 0;
+	m_bytes = 0;
+	m_err = 0;
+	m_message = "";
+}
+
+PacketGenerator::~PacketGenerator()
+{
+	avcodec_parameters_free(&m_stream.codecpar);
+}
+
+// get the error message of last operation
+std::string PacketGenerator::get_error_message()
+{
+	return m_message;
+}
+
+// set the options of the generator, has to be called before the first packet
+int PacketGenerator::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	int64_t v = atoll(value.c_str());
+	if (option == "fps" && v >= 1 && v <= 1000)
+	{
+		m_fps = (int)v;
+	}
+	else if (option == "bitrate" && v >= 8000)
+	{
+		m_bitrate = v;
+	}
+	else if (option == "gop" && v >= 1)
+	{
+		m_gop = (int)v;
+	}
+	else if (option == "keyframe_size" && v >= 0 && v <= 100 * 1000 * 1000)
+	{
+		m_keyframe_size = (int)v;
+	}
+	else if (option == "realtime" && (value == "true" || value == "false"))
+	{
+		m_realtime = value == "true";
+	}
+	else
+	{
+		m_err = -1;
+		m_message = "invalid value '" + value + "' for the option '" + option + "'";
+		return m_err;
+	}
+
+	m_message = "'" + option + "' option is set to be " + value;
+	return m_err;
+}
+
+// get the stream the packets belong to
+AVStream* PacketGenerator::get_stream()
+{
+	return &m_stream;
+}
+
+// give the next packet, the packet has to be unreferenced by the caller
+// return the size of the packet
+int PacketGenerator::next_packet(AVPacket* pkt)
+{
+	// split the bytes of a GOP between the keyframe and the other frames
+	if (!m_frame_size)
+	{
+		int64_t gop_bytes = m_bitrate / 8 * m_gop / m_fps;
+		int64_t frame = m_keyframe_size ? (gop_bytes - m_keyframe_size) / std::max(m_gop - 1, 1) : gop_bytes / (m_gop + 7);
+		m_frame_size = (int)std::max<int64_t>(frame, 16);
+		m_keyframe_size = m_keyframe_size ? m_keyframe_size : m_frame_size * 8;
+		m_start_time = av_gettime_relative();
+	}
+
+	int64_t due = m_start_time + m_packets * 1000000 / m_fps;
+	if (m_realtime && av_gettime_relative() < due)
+	{
+		av_usleep((unsigned)(due - av_gettime_relative()));
+	}
+
+	bool key = !(m_packets % m_gop);
+	int size = key ? m_keyframe_size : m_frame_size;
+	m_err = av_new_packet(pkt, size);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+	memcpy(pkt->data, &m_packets, std::min<int>(size, sizeof(m_packets)));
+	pkt->pts = pkt->dts = m_packets * 90000 / m_fps;
+	pkt->duration = 90000 / m_fps;
+	pkt->flags = key ? AV_PKT_FLAG_KEY : 0;
+	pkt->stream_index = 0;
+
+	m_packets++;
+	m_bytes += size;
+	m_err = 0;
+	return size;
+}
+
+// get the number of packets given so far
+int64_t PacketGenerator::get_packets()
+{
+	return m_packets;
+}
+
+// get the number of payload bytes given so far
+int64_t PacketGenerator::get_bytes()
+{
+	return m_bytes;
+}
+
+// parse a list of cores such as "0,2,4-7" into cpus, return false when it is malformed
+static bool parse_cpu_list(std::string value, std::vector<int>* cpus)
+{
+	cpus->clear();
+	size_t pos = 0;
+	while (pos < value.size())
+	{
+		size_t end = value.find(',', pos);
+		std::string item = value.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+		pos = end == std::string::npos ? value.size() : end + 1;
+
+		int first, last;
+		char extra;
+		int fields = sscanf(item.c_str(), "%d-%d%c", &first, &last, &extra);
+		if (fields == 1)
+		{
+			last = first;
+		}
+		else if (fields != 2)
+		{
+			return false;
+		}
+		if (first < 0 || last < first || last >= MAX_TUNED_CPUS)
+		{
+			return false;
+		}
+		for (int cpu = first; cpu <= last; cpu++)
+		{
+			cpus->push_back(cpu);
+		}
+	}
+	return true;
+}
+
+// get the NUMA node of the core, -1 when it cannot be told
+int get_cpu_node(int cpu)
+{
+#ifdef _WIN32
+	PROCESSOR_NUMBER processor;
+	memset(&processor, 0, sizeof(processor));
+	processor.Group = static_cast<WORD>(cpu / 64);
+	processor.Number = static_cast<BYTE>(cpu % 64);
+	USHORT node;
+	return cpu >= 0 && GetNumaProcessorNodeEx(&processor, &node) ? node : -1;
+#else
+	for (int node = 0; node < 64; node++)
+	{
+		char path[64];
+		char line[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* fp = fopen(path, "r");
+		if (!fp)
+		{
+			continue;
+		}
+		bool found = false;
+		std::vector<int> cpus;
+		if (fgets(line, sizeof(line), fp) && parse_cpu_list(std::string(line, strcspn(line, "\n")), &cpus))
+		{
+			found = std::find(cpus.begin(), cpus.end(), cpu) != cpus.end();
+		}
+		fclose(fp);
+		if (found)
+		{
+			return node;
+		}
+	}
+	return -1;
+#endif
+}
+
+// map size bytes for a storage, backed by the hugepages asked for and bound to the NUMA node when it is not negative
+// The explicit hugepages fall back to the transparent ones when none is left in the pool, hugepages is set to the kind got.
+// The binding is a preference, the pages are taken on the node wherever the thread touching them first runs, and elsewhere
+// when the node is full. Return NULL on failure, mapped is set to the bytes mapped.
+void* map_storage(size_t size, int* hugepages, int node, size_t* mapped)
+{
+	void* p = NULL;
+	size_t length = (size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+#ifdef _WIN32
+	// the large pages need the SeLockMemoryPrivilege, and are never transparent
+	SIZE_T large = GetLargePageMinimum();
+	if (*hugepages == HUGEPAGES_EXPLICIT && large)
+	{
+		length = (size + large - 1) / large * large;
+		p = VirtualAllocExNuma(GetCurrentProcess(), NULL, length, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE,
+			node >= 0 ? node : NUMA_NO_PREFERRED_NODE);
+	}
+	if (!p)
+	{
+		*hugepages = HUGEPAGES_NONE;
+		length = size;
+		p = VirtualAllocExNuma(GetCurrentProcess(), NULL, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node >= 0 ? node : NUMA_NO_PREFERRED_NODE);
+	}
+#else
+#ifdef MAP_HUGETLB
+	if (*hugepages == HUGEPAGES_EXPLICIT)
+	{
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		p = p == MAP_FAILED ? NULL : p;
+	}
+#endif
+	if (!p)
+	{
+		// the transparent hugepages need the mapping aligned to the hugepage, one more is mapped and the ends are trimmed
+		*hugepages = *hugepages == HUGEPAGES_NONE ? HUGEPAGES_NONE : HUGEPAGES_TRANSPARENT;
+		size_t extra = *hugepages == HUGEPAGES_TRANSPARENT ? HUGEPAGE_SIZE : 0;
+		void* raw = mmap(NULL, length + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED)
+		{
+			return NULL;
+		}
+		uint8_t* start = static_cast<uint8_t*>(raw);
+		uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(start) + extra - 1) & ~(static_cast<uintptr_t>(HUGEPAGE_SIZE) - 1));
+		if (extra)
+		{
+			if (aligned > start)
+				munmap(start, aligned - start);
+			if (start + extra > aligned)
+				munmap(aligned + length, start + extra - aligned);
+		}
+		p = extra ? aligned : raw;
+#ifdef MADV_HUGEPAGE
+		if (*hugepages == HUGEPAGES_TRANSPARENT && madvise(p, length, MADV_HUGEPAGE))
+		{
+			*hugepages = HUGEPAGES_NONE;
+		}
+#endif
+	}
+#ifdef __linux__
+	if (node >= 0 && node < 64)
+	{
+		const int preferred = 1; // MPOL_PREFERRED of the kernel, numaif.h is not needed for it
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, p, length, preferred, &mask, sizeof(mask) * 8, 0);
+	}
+#endif
+#endif
+	*mapped = length;
+	return p;
+}
+
+// unmap a storage mapped by map_storage
+void unmap_storage(void* p, size_t mapped)
+{
+	if (!p)
+	{
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, mapped);
+#endif
+}
+
+ThreadTuning::ThreadTuning()
+{
+	m_priority = 0;
+	m_err = 0;
+	m_message = "";
+}
+
+int ThreadTuning::set_cpus(std::string value)
+{
+	m_err = 0;
+	m_message = "";
+	std::vector<int> cpus;
+	if (!parse_cpu_list(value, &cpus))
+	{
+		m_err = -1;
+		m_message = value + " is invalid for 'cpus' setting, shall be a list of cores such as 2,3 or 4-7";
+		return m_err;
+	}
+	m_cpus = cpus;
+	m_message = "the threads are pinned to " + (value.empty() ? std::string("any core") : "cores " + value);
+	return m_err;
+}
+
+int ThreadTuning::set_priority(std::string value)
+{
+	m_err = 0;
+	m_message = "";
+	int priority = atoi(value.c_str());
+	if (priority < 0 || priority > 99)
+	{
+		m_err = -1;
+		m_message = value + " is invalid for 'realtime' setting, shall be [1-99], 0 for the normal policy";
+		return m_err;
+	}
+	m_priority = priority;
+	m_message = priority ? "the threads run under SCHED_FIFO at priority " + value : "the threads run under the normal policy";
+	return m_err;
+}
+
+int ThreadTuning::apply(std::thread& thread, int index)
+{
+	m_err = 0;
+	m_message = "";
+	std::vector<int> cpus = m_cpus;
+	if (index >= 0 && !cpus.empty())
+	{
+		cpus.assign(1, m_cpus[index % m_cpus.size()]);
+	}
+
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+	for (int cpu : cpus)
+	{
+		mask |= cpu < 64 ? static_cast<DWORD_PTR>(1) << cpu : 0;
+	}
+	if (mask && !SetThreadAffinityMask(thread.native_handle(), mask))
+	{
+		m_err = -1;
+		m_message = "cannot pin the thread, error " + std::to_string(GetLastError());
+	}
+	if (m_priority && !SetThreadPriority(thread.native_handle(), m_priority >= 50 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST))
+	{
+		m_err = -2;
+		m_message = "cannot raise the priority of the thread, error " + std::to_string(GetLastError());
+	}
+#elif defined(__linux__)
+	if (!cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus)
+		{
+			CPU_SET(cpu, &set);
+		}
+		int err = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+		if (err)
+		{
+			m_err = -1;
+			m_message = std::string("cannot pin the thread, ") + strerror(err);
+		}
+	}
+	if (m_priority)
+	{
+		sched_param param;
+		param.sched_priority = m_priority;
+		int err = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param);
+		if (err)
+		{
+			m_err = -2;
+			m_message = std::string("cannot run the thread under SCHED_FIFO, ") + strerror(err);
+		}
+	}
+#else
+	if (is_set())
+	{
+		m_err = -3;
+		m_message = "the thread tuning is not supported on this system";
+	}
+#endif
+	return m_err;
+}
+
+bool ThreadTuning::is_set()
+{
+	return !m_cpus.empty() || m_priority;
+}
+
+std::vector<int> ThreadTuning::get_cpus()
+{
+	return m_cpus;
+}
+
+std::string ThreadTuning::get_error_message()
+{
+	return m_message;
+}
+
+CircularBuffer::CircularBuffer()
+{
+	m_slots = NULL;
+	m_capacity = 0;
+	m_mask = 0;
+	m_head = 0;
+	m_tail = 0;
+	m_keyframes = NULL;
+	m_key_head = 0;
+	m_key_tail = 0;
+	for (int i = 0; i < MAX_READERS; i++)
+	{
+		m_readers[i].used = false;
+		m_readers[i].seq = 0;
+		m_readers[i].time = 0;
+		m_readers[i].lost = 0;
+		m_readers[i].epoch = 0;
+		m_readers[i].view_first = 0;
+		m_readers[i].view_end = 0;
+	}
+
+	for (int i = 0; i < MAX_STREAMS; i++)
+	{
+		BufferStream* bs = &m_streams[i];
+		bs->index = -1;
+		bs->codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
+		bs->st = (AVStream*)av_mallocz(sizeof(AVStream));
+		bs->st->codecpar = bs->codecpar; // store the same codec parameters in the local stream
+		bs->time_base = AVRational{ 1, 2 };
+		bs->last_pts = 0;
+		bs->last_time = INT64_MIN;
+		for (int j = 0; j < MAX_PENDING; j++)
+		{
+			memset(&bs->pending[j], 0, sizeof(AVPacket));
+			av_init_packet(&bs->pending[j]);
+		}
+		bs->pending_first = 0;
+		bs->pending_count = 0;
+	}
+	m_nb_streams = 0;
+	m_key_stream = 0;
+	m_interleave_time = 0;
+	m_interleave_delay = INTERLEAVE_DELAY;
+	m_own_signal.waiters = 0;
+	m_own_signal.turn = 0;
+	m_signal = &m_own_signal;
+
+	m_TotalPkts = 0;
+	m_size = 0;
+	m_time_span = 0;
+	m_MaxSize = 0;
+	m_time_span_us = 0;
+	m_last_time = 0;
+	m_use_arena = false;
+	m_hugepages = HUGEPAGES_NONE;
+	m_hugepages_used = HUGEPAGES_NONE;
+	m_numa_node = -1;
+	m_slots_mapped = 0;
+	m_arena_storage = NULL;
+	m_thin = false;
+	m_thin_seq = 0;
+	m_arena = NULL;
+	m_arena_size = 0;
+	m_arena_read = 0;
+	m_arena_write = 0;
+	m_arena_end = 0;
+	m_arena_chunks = 0;
+	m_arena_fallbacks = 0;
+	m_views = false;
+	m_epoch = 1;
+	m_retired_first = 0;
+	m_retired_count = 0;
+
+	m_pushed = 0;
+	m_pushed_bytes = 0;
+	m_evicted_time = 0;
+	m_evicted_size = 0;
+	m_evicted_slots = 0;
+	m_thinned = 0;
+	m_export_stop = false;
+	m_event = NULL;
+	m_event_url = "";
+
+	m_spill_url = "";
+	m_spill_size = SPILL_DEFAULT_SIZE;
+	m_spill_span = 600;
+	m_spill_map = NULL;
+#ifdef _WIN32
+	m_spill_file = INVALID_HANDLE_VALUE;
+	m_spill_mapping = NULL;
+#else
+	m_spill_fd = -1;
+#endif
+	m_spill_index = NULL;
+	m_spill_capacity = 0;
+	m_spill_mask = 0;
+	m_disk_head = 0;
+	m_disk_tail = 0;
+	m_spill_drop = 0;
+	m_spill_pos = 0;
+	m_spill_reader = -1;
+	m_spill_stop = false;
+	m_spill_waited = false;
+	m_key_mask = 0;
+
+	m_shared_size = 0;
+	m_shared_map = NULL;
+	m_shared = NULL;
+	m_shared_slots = NULL;
+#ifdef _WIN32
+	m_shared_mapping = NULL;
+#else
+	m_shared_fd = -1;
+#endif
+
+	m_err = 0;
+	m_message = "";
+}
+
+// Set the options of the circular buffer, has to be called before open
+//  -arena value, true to copy the packet payloads into a preallocated arena of max_size bytes, false to reference them in the heap
+//  -hugepages value, none, transparent or explicit, the pages backing the slots and the arena
+//  -numa_node value, the NUMA node the slots and the arena are allocated on, -1 for the policy of the system
+int CircularBuffer::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (option == "arena")
+	{
+		if (value == "false")
+		{
+			m_use_arena = false;
+			m_message = "payload arena is off";
+		}
+		else if (value == "true")
+		{
+			m_use_arena = true;
+			m_message = "payload arena is on";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'arena' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	// maximum time in miliseconds a packet of one stream waits for the packets of the other streams before it is published
+	// Readers, the live edge and the motion trigger see the packets that much later at worst. A stream that has pushed nothing
+	// for that long is not waited for at all.
+	if (option == "interleave_delay")
+	{
+		int delay = atoi(value.c_str());
+		if (delay < 0 || delay > 10000)
+		{
+			m_message = "invalid value of '" + value + "' for 'interleave_delay' setting, shall be [0-10000] miliseconds";
+			m_err = -1;
+			return m_err;
+		}
+		m_interleave_delay = delay * 1000LL;
+		return m_err;
+	}
+
+	// explicit hugepages have to be reserved first, such as by vm.nr_hugepages on Linux
+	if (option == "hugepages")
+	{
+		if (value == "none")
+		{
+			m_hugepages = HUGEPAGES_NONE;
+		}
+		else if (value == "transparent")
+		{
+			m_hugepages = HUGEPAGES_TRANSPARENT;
+		}
+		else if (value == "explicit")
+		{
+			m_hugepages = HUGEPAGES_EXPLICIT;
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'hugepages' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	// the node of the core the capturing thread is pinned to, see get_cpu_node
+	if (option == "numa_node")
+	{
+		int node = atoi(value.c_str());
+		if (node < -1 || node > 63)
+		{
+			m_message = "invalid value of '" + value + "' for 'numa_node' setting, shall be [0-63], -1 for the policy of the system";
+			m_err = -1;
+			return m_err;
+		}
+		m_numa_node = node;
+		return m_err;
+	}
+
+	// what to drop when the size is over the maximum size: "evict" the oldest packets, or "thin" the old GOPs first
+	// Thinning drops the non-keyframes of the key stream from the oldest complete GOPs, whole GOPs at a time so that
+	// what is left stays decodable, then evicts as usual when it is not enough. The newest GOP is never thinned.
+	// It is not done with the arena, whose room is only reclaimed in order, nor with the spill file, which keeps every packet.
+	if (option == "retention")
+	{
+		if (value == "evict")
+		{
+			m_thin = false;
+		}
+		else if (value == "thin")
+		{
+			m_thin = true;
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'retention' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	// the name of the shared memory to share the buffer with other processes, empty to keep it private
+	// The payloads are kept in the arena placed in the shared memory, so sharing turns the arena on.
+	// On Linux the name is the one of a POSIX shared memory object, starting with a slash, such as /camera1.
+	// The buffer stays private when another writer running shares a buffer under the same name.
+	if (option == "shared_memory")
+	{
+		m_shared_name = value;
+		return m_err;
+	}
+
+	// the file to spill the packets evicted from the memory, empty to turn the spilling off
+	if (option == "spill_file")
+	{
+		m_spill_url = value;
+		return m_err;
+	}
+
+	// size of the spill file in bytes, at most 1G in a 32-bit process
+	if (option == "spill_size")
+	{
+		int64_t size = atoll(value.c_str());
+		if (size < 1024 * 1024 || size > SPILL_MAX_SIZE)
+		{
+			m_message = "the 'spill_size' setting has to be between 1M and " + std::to_string(SPILL_MAX_SIZE >> 20) + "M";
+			m_err = -1;
+			return m_err;
+		}
+		m_spill_size = size;
+		return m_err;
+	}
+
+	// max time span in seconds of the packets kept in the spill file
+	if (option == "spill_span")
+	{
+		int span = atoi(value.c_str());
+		if (span <= 0)
+		{
+			m_message = "invalid value of '" + value + "' for 'spill_span' setting";
+			m_err = -1;
+			return m_err;
+		}
+		m_spill_span = span;
+		return m_err;
+	}
+
+	m_err = -1;
+	m_message = "unknown option '" + option + "'";
+	return m_err;
+}
+
+void CircularBuffer::open(int time_span, int max_size, int capacity)
+{
+	// release the slots of previous opening
+	stop_exports();
+	close_spill();
+	clear();
+	free_retired(true);
+	delete[] m_keyframes;
+	close_shared();
+	free_storage();
+
+	//
+	m_TotalPkts = 0;
+	m_size = 0;
+	m_time_span = time_span > 0 ? time_span : 0;
+	m_time_span_us = static_cast<int64_t>(m_time_span) * 1000000;
+	m_MaxSize = max_size > 0 ? max_size : 0;
+	m_nb_streams = 0;
+	m_key_stream = 0;
+	m_interleave_time = 0;
+
+	// derive the capacity from the time span, then round it up to power of 2
+	uint64_t slots = capacity > 0 ? capacity : static_cast<uint64_t>(m_time_span + 1) * SLOTS_PER_SECOND;
+	m_capacity = MIN_SLOTS;
+	while (m_capacity < slots)
+	{
+		m_capacity <<= 1;
+	}
+	m_mask = m_capacity - 1;
+
+	// reserve the slots and the arena, the readers may still hold packets of the previous arena, it is freed after them
+	m_arena_size = m_use_arena || !m_shared_name.empty() ? m_MaxSize : 0;
+	alloc_storage();
+	for (uint64_t i = 0; i < m_capacity; i++)
+	{
+		memset(&m_slots[i].pkt, 0, sizeof(AVPacket));
+		av_init_packet(&m_slots[i].pkt);
+		m_slots[i].seq.store(0, std::memory_order_relaxed);
+		m_slots[i].pins.store(0, std::memory_order_relaxed);
+	}
+	// the spill index is derived from the spill time span in the same way, the keyframe index covers the larger of both
+	m_spill_capacity = 0;
+	if (!m_spill_url.empty())
+	{
+		uint64_t entries = static_cast<uint64_t>(m_spill_span + 1) * SLOTS_PER_SECOND;
+		m_spill_capacity = MIN_SLOTS;
+		while (m_spill_capacity < entries)
+		{
+			m_spill_capacity <<= 1;
+		}
+	}
+	m_spill_mask = m_spill_capacity ? m_spill_capacity - 1 : 0;
+	m_key_mask = std::max(m_capacity, m_spill_capacity) - 1;
+	m_keyframes = new KeyframeEntry[m_key_mask + 1];
+
+	m_arena_read = 0;
+	m_arena_write = 0;
+	m_arena_end = 0;
+	m_arena_chunks = 0;
+	m_arena_fallbacks = 0;
+	m_views = false;
+	m_epoch = 1;
+	m_retired_first = 0;
+	m_retired_count = 0;
+
+	m_pushed = 0;
+	m_pushed_bytes = 0;
+	m_evicted_time = 0;
+	m_evicted_size = 0;
+	m_evicted_slots = 0;
+	m_thinned = 0;
+	m_push_latency.reset();
+
+	m_head = 0;
+	m_tail = 0;
+	m_key_head = 0;
+	m_key_tail = 0;
+	m_thin_seq = 0;
+	m_last_time = 0;
+	for (int i = 0; i < MAX_READERS; i++)
+	{
+		m_readers[i].seq = 0;
+		m_readers[i].time = 0;
+		m_readers[i].lost = 0;
+		m_readers[i].epoch = 0;
+		m_readers[i].view_first = 0;
+		m_readers[i].view_end = 0;
+	}
+
+	m_err = 0;
+	m_message = "";
+
+	// share the buffer, the empty arena is swapped for the one in the shared memory, the buffer stays private when it fails
+	if (!m_shared_name.empty())
+	{
+		open_shared();
+	}
+
+	// start spilling, the circular buffer is still usable in the memory when it fails
+	if (m_spill_capacity)
+	{
+		open_spill();
+	}
+}
+
+// the slots are constructed in place in the mapping, the storage is taken from the heap as before when nothing is asked
+// a failed mapping falls back to the heap too, the buffer works the same, only get_hugepages tells
+void CircularBuffer::alloc_storage()
+{
+	m_hugepages_used = HUGEPAGES_NONE;
+	if (m_hugepages != HUGEPAGES_NONE || m_numa_node >= 0)
+	{
+		int kind = m_hugepages;
+		void* slots = map_storage(m_capacity * sizeof(PacketSlot), &kind, m_numa_node, &m_slots_mapped);
+		int arena_kind = m_hugepages;
+		size_t arena_mapped = 0;
+		void* arena = m_arena_size && slots ? map_storage(m_arena_size, &arena_kind, m_numa_node, &arena_mapped) : NULL;
+		if (slots && (arena || !m_arena_size))
+		{
+			m_slots = static_cast<PacketSlot*>(slots);
+			for (uint64_t i = 0; i < m_capacity; i++)
+			{
+				new (&m_slots[i]) PacketSlot();
+			}
+			m_arena = static_cast<uint8_t*>(arena);
+			if (m_arena)
+			{
+				m_arena_storage = new ArenaStorage();
+				m_arena_storage->mapped = arena;
+				m_arena_storage->mapped_size = arena_mapped;
+			}
+			m_hugepages_used = m_arena_size ? std::min(kind, arena_kind) : kind;
+			return;
+		}
+		unmap_storage(slots, m_slots_mapped);
+		m_slots_mapped = 0;
+	}
+
+	m_slots = new PacketSlot[m_capacity];
+	m_arena = m_arena_size ? (uint8_t*)av_malloc(m_arena_size) : NULL;
+	if (m_arena)
+	{
+		m_arena_storage = new ArenaStorage();
+		m_arena_storage->heap = m_arena;
+	}
+}
+
+// drop a reference to the storage of the arena, the last one frees it
+void CircularBuffer::release_arena(ArenaStorage* storage)
+{
+	if (!storage || storage->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+	{
+		return;
+	}
+
+	av_free(storage->heap);
+	unmap_storage(storage->mapped, storage->mapped_size);
+	if (storage->shared)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(storage->shared);
+#else
+		munmap(storage->shared, storage->shared_size);
+#endif
+	}
+	delete storage;
+}
+
+void CircularBuffer::free_storage()
+{
+	if (m_slots_mapped)
+	{
+		for (uint64_t i = 0; i < m_capacity; i++)
+		{
+			m_slots[i].~PacketSlot();
+		}
+		unmap_storage(m_slots, m_slots_mapped);
+	}
+	else
+	{
+		delete[] m_slots;
+	}
+	// the readers still holding packets of the arena free it when they unref the last of them
+	release_arena(m_arena_storage);
+	m_slots = NULL;
+	m_arena = NULL;
+	m_arena_storage = NULL;
+	m_slots_mapped = 0;
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	stop_exports();
+	close_spill();
+	clear();
+	free_retired(true);
+	delete[] m_keyframes;
+	close_shared();
+	free_storage();
+
+	for (int i = 0; i < MAX_STREAMS; i++)
+	{
+		av_freep(&m_streams[i].st);
+		avcodec_parameters_free(&m_streams[i].codecpar);
+	}
+}
+
+// release all the packets in the circular buffer, including those waiting to be interleaved
+void CircularBuffer::clear()
+{
+	for (int i = 0; i < MAX_STREAMS; i++)
+	{
+		BufferStream* bs = &m_streams[i];
+		for (; bs->pending_count; bs->pending_count--)
+		{
+			av_packet_unref(&bs->pending[bs->pending_first]);
+			bs->pending_first = (bs->pending_first + 1) % MAX_PENDING;
+		}
+	}
+
+	while (m_slots && m_tail.load(std::memory_order_relaxed) < m_head.load(std::memory_order_relaxed))
+	{
+		evict_packet();
+	}
+
+	// the spill thread drops the packets from the spill file as well
+	m_spill_drop.store(m_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// get the index in the circular buffer of the input stream, negative when the stream is not added
+int CircularBuffer::find_stream(int index)
+{
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		if (m_streams[i].index == index)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// release the oldest packet in the circular buffer
+// the tail is advanced first so that no reader will start on the packet, then the slot is marked busy.
+// the writer only waits for the readers that have pinned the slot, which is as short as an av_packet_ref.
+void CircularBuffer::evict_packet()
+{
+	uint64_t tail = m_tail.load(std::memory_order_relaxed);
+	PacketSlot* slot = &m_slots[tail & m_mask];
+
+	m_tail.store(tail + 1, std::memory_order_release);
+	if (m_shared)
+	{
+		m_shared->tail.store(tail + 1, std::memory_order_release);
+	}
+
+	// drop the keyframe from the index once it is no longer in the circular buffer, the keyframes in the spill file are dropped on publishing
+	uint64_t key_tail = m_key_tail.load(std::memory_order_relaxed);
+	if (!m_spill_map && key_tail < m_key_head.load(std::memory_order_relaxed) && m_keyframes[key_tail & m_key_mask].seq.load(std::memory_order_relaxed) <= tail)
+	{
+		m_key_tail.store(key_tail + 1, std::memory_order_release);
+	}
+
+	slot->seq.store(SLOT_BUSY, std::memory_order_seq_cst);
+	while (slot->pins.load(std::memory_order_seq_cst))
+	{
+		std::this_thread::yield();
+	}
+
+	// the counters are only modified by the writer, no read-modify-write is needed
+	m_TotalPkts.store(m_TotalPkts.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed); // update the number of total packets
+	m_size.store(m_size.load(std::memory_order_relaxed) - slot->pkt.size - static_cast<int>(sizeof(PacketSlot)), std::memory_order_relaxed);  // update the size of the circular buffer
+
+	release_payload(slot, tail);
+	slot->seq.store(0, std::memory_order_release);
+}
+
+// release the payload of the slot
+// a reader taking views may still be looking at the payload, retire the packet until the views of the epoch are released.
+// The slot is marked busy before checking the ranges of the readers, so a reader announcing its range now sees the packet is gone
+// The retired packet and its entry count in the size of the circular buffer until it is freed, so the writer evicts
+// more live packets for it. The ring starts with as many entries as the slots, it only grows while a reader holds its views
+// for long, up to the entries the maximum size can take.
+void CircularBuffer::release_payload(PacketSlot* slot, uint64_t seq)
+{
+	// the end of the range is loaded first, the reader stores it after the first
+	bool viewed = false;
+	for (int i = 0; i < MAX_READERS && !viewed && m_views.load(std::memory_order_seq_cst); i++)
+	{
+		viewed = seq < m_readers[i].view_end.load(std::memory_order_seq_cst) && m_readers[i].view_first.load(std::memory_order_seq_cst) <= seq;
+	}
+
+	if (viewed)
+	{
+		size_t entries = std::max<size_t>(m_capacity, RETIRE_BATCH * 2);
+		if (m_retired.size() < entries && !m_retired_count)
+		{
+			m_retired.assign(entries, RetiredPacket());
+			m_retired_first = 0;
+		}
+		if (m_retired_count == m_retired.size() && !free_retired(false))
+		{
+			std::vector<RetiredPacket> ring(m_retired.size() * 2);
+			for (size_t i = 0; i < m_retired_count; i++)
+			{
+				ring[i] = m_retired[(m_retired_first + i) % m_retired.size()];
+			}
+			m_retired.swap(ring);
+			m_retired_first = 0;
+		}
+
+		uint64_t epoch = m_epoch.load(std::memory_order_relaxed);
+		RetiredPacket* retired = &m_retired[(m_retired_first + m_retired_count) % m_retired.size()];
+		retired->pkt = slot->pkt;
+		retired->epoch = epoch;
+		m_retired_count++;
+		m_size.store(m_size.load(std::memory_order_relaxed) + retired->pkt.size + static_cast<int>(sizeof(RetiredPacket)), std::memory_order_relaxed);
+		memset(&slot->pkt, 0, sizeof(AVPacket));
+		av_init_packet(&slot->pkt);
+		m_epoch.store(epoch + 1, std::memory_order_seq_cst);
+
+		// try every RETIRE_BATCH retirements even with few packets retired, so that the views are turned off once released
+		if (m_retired_count >= RETIRE_BATCH || !(epoch & (RETIRE_BATCH - 1)))
+		{
+			free_retired(false);
+		}
+	}
+	else
+	{
+		unref_packet(&slot->pkt);
+	}
+}
+
+// thin the GOPs from the thin cursor, dropping the payloads of the non-keyframes of the key stream
+// A GOP is always thinned to its end, so the cursor stays at a keyframe and no GOP is left with a hole in the middle.
+// The slots are kept with their sequence numbers marked thinned, the readers skip them and the keyframe index is untouched.
+void CircularBuffer::thin_packets()
+{
+	uint64_t key_head = m_key_head.load(std::memory_order_relaxed);
+	if (key_head == m_key_tail.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+
+	uint64_t newest = m_keyframes[(key_head - 1) & m_key_mask].seq.load(std::memory_order_relaxed);
+	uint64_t seq = std::max(m_thin_seq, m_tail.load(std::memory_order_relaxed));
+	for (; seq < newest; seq++)
+	{
+		PacketSlot* slot = &m_slots[seq & m_mask];
+		if (slot->pkt.stream_index != m_key_stream || !slot->pkt.data)
+		{
+			continue;
+		}
+		if (slot->pkt.flags & AV_PKT_FLAG_KEY)
+		{
+			if (m_size.load(std::memory_order_relaxed) <= m_MaxSize)
+			{
+				break;
+			}
+			continue;
+		}
+
+		slot->seq.store(SLOT_BUSY, std::memory_order_seq_cst);
+		while (slot->pins.load(std::memory_order_seq_cst))
+		{
+			std::this_thread::yield();
+		}
+
+		// keep the time stamps of the packet, only the payload goes
+		AVPacket props = slot->pkt;
+		m_size.store(m_size.load(std::memory_order_relaxed) - props.size, std::memory_order_relaxed);
+		release_payload(slot, seq);
+		slot->pkt.pts = props.pts;
+		slot->pkt.dts = props.dts;
+		slot->pkt.duration = props.duration;
+		slot->pkt.flags = props.flags;
+		slot->pkt.stream_index = props.stream_index;
+		slot->seq.store((seq + 1) | SLOT_THINNED, std::memory_order_release);
+		m_thinned.store(m_thinned.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	m_thin_seq = seq;
+}
+
+// release the payload of an evicted packet
+// the arena chunk is reclaimed later, once the readers have released it
+void CircularBuffer::unref_packet(AVPacket* pkt)
+{
+	if (!pkt->buf && pkt->data && m_arena)
+	{
+		reinterpret_cast<ArenaChunk*>(pkt->data - sizeof(ArenaChunk))->refs.fetch_sub(1, std::memory_order_release);
+	}
+	av_packet_unref(pkt);
+}
+
+// free the retired packets older than the epoch of every reader holding views
+// a reader announcing a newer epoch saw the packet marked evicted, so it never took a view of it
+// Once no reader holds views and nothing is retired, the views are turned off so the packets are freed directly again.
+// The readers are checked again after that, a reader announcing its epoch meanwhile turns them back on, see read_views.
+int CircularBuffer::free_retired(bool force)
+{
+	uint64_t oldest = UINT64_MAX;
+	for (int i = 0; i < MAX_READERS && !force; i++)
+	{
+		uint64_t epoch = m_readers[i].epoch.load(std::memory_order_seq_cst);
+		if (epoch)
+		{
+			oldest = std::min(oldest, epoch);
+		}
+	}
+
+	int n = 0;
+	while (m_retired_count && m_retired[m_retired_first].epoch < oldest)
+	{
+		m_size.store(m_size.load(std::memory_order_relaxed) - m_retired[m_retired_first].pkt.size - static_cast<int>(sizeof(RetiredPacket)), std::memory_order_relaxed);
+		unref_packet(&m_retired[m_retired_first].pkt);
+		m_retired_first = (m_retired_first + 1) % m_retired.size();
+		m_retired_count--;
+		n++;
+	}
+
+	if (!force && oldest == UINT64_MAX && !m_retired_count && m_views.load(std::memory_order_relaxed))
+	{
+		m_views.store(false, std::memory_order_seq_cst);
+		for (int i = 0; i < MAX_READERS; i++)
+		{
+			if (m_readers[i].epoch.load(std::memory_order_seq_cst))
+			{
+				m_views.store(true, std::memory_order_seq_cst);
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+// Add the stream into the circular buffer
+// the stream replaces the one added before with the same index
+// non-negative return is the index of the stream in the circular buffer
+int CircularBuffer::add_stream(AVStream *stream)
+{
+	// check the stream
+	if (!stream)
+	{
+		m_err = -1;
+		m_message = "Empty stream is not allowed.";
+		return m_err;
+	}
+
+	int i = find_stream(stream->index);
+	if (i < 0 && m_nb_streams >= MAX_STREAMS)
+	{
+		m_err = -2;
+		m_message = "Too many streams in the circular buffer.";
+		return m_err;
+	}
+	BufferStream* bs = &m_streams[i < 0 ? m_nb_streams : i];
+
+	// copy the codec parameters to local
+	m_err = avcodec_parameters_copy(bs->codecpar, stream->codecpar);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	if (i < 0)
+	{
+		i = m_nb_streams++;
+	}
+
+	// copy a couple of important parameters to local stream
+	bs->st->index = i;
+	bs->st->time_base = stream->time_base;
+	bs->st->start_time = stream->start_time;
+	bs->st->r_frame_rate = stream->r_frame_rate;
+	bs->st->avg_frame_rate = stream->avg_frame_rate;
+	bs->st->sample_aspect_ratio = stream->sample_aspect_ratio;
+
+	bs->index = stream->index;
+	bs->time_base = stream->time_base;
+	bs->last_pts = 0;
+	bs->last_time = INT64_MIN;
+
+	// keyframes of the first video stream are indexed
+	m_key_stream = 0;
+	for (int j = m_nb_streams - 1; j >= 0; j--)
+	{
+		if (m_streams[j].codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+		{
+			m_key_stream = j;
+		}
+	}
+
+	// clear the circular buffer in case the stream is changed
+	clear();
+	share_streams();
+
+	m_err = 0;
+	m_message = "";
+	return i;
+};
+
+// push a video or audio packet to the circular buffer, pts and dts are adjust to wall clock
+// non-negative return indicates the packet is added successfully. The number returned is the current total packets published in the
+// circular buffer, the packets still waiting to be interleaved are not counted, so it can be 0 while the first packets wait.
+// whether packets were evicted to make room is given by the message and by the evicted counters of get_metrics.
+// negative return indicates that the packet is not added
+int CircularBuffer::push_packet(AVPacket* pkt)
+{
+	m_err = 0;
+	m_message = "";
+
+	// time one push out of METRICS_SAMPLE, so that reading the clock costs next to nothing
+	int64_t pushed = m_pushed.load(std::memory_order_relaxed);
+	bool timed = !(pushed & (METRICS_SAMPLE - 1));
+	std::chrono::steady_clock::time_point t0;
+	if (timed)
+	{
+		t0 = std::chrono::steady_clock::now();
+	}
+
+	// empty packet is not allowed in the circular buffer
+	if (!pkt)
+	{
+		m_err = -1;
+		m_message = "packet unacceptable: empty";
+		return m_err;
+	}
+
+	// packet of the stream not added is not accepted
+	int stream_index = find_stream(pkt->stream_index);
+	if (stream_index < 0)
+	{
+		m_err = -2;
+		m_message = "packet unacceptable: stream is not added";
+		return m_err;
+	}
+
+	// packet that cannot be reference is not allowed, packets are copied into the arena instead when it is used
+	if (!m_use_arena && av_packet_make_refcounted(pkt) < 0)
+	{
+		m_err = -3;
+		m_message = "packet unacceptable: cannot be referenced";
+		return m_err;
+	}
+
+	// packet that has no pts is not allowed
+	if (pkt->pts == AV_NOPTS_VALUE)
+	{
+		m_err = -4;
+		m_message = "packet unacceptable: has no valid pts";
+		return m_err;
+	}
+
+	// the circular buffer has to be opened first
+	if (!m_slots)
+	{
+		m_err = -5;
+		m_message = "circular buffer is not opened";
+		return m_err;
+	}
+
+	// packet that is non monotonically increasing
+	BufferStream* bs = &m_streams[stream_index];
+	if (bs->last_pts == 0)
+	{
+		bs->last_pts = pkt->pts;
+	}
+
+	if (pkt->pts < bs->last_pts)
+	{
+		m_err = -6;
+		m_message = "packet unacceptable: non monotonically increasing";
+	}
+
+	// the streams share the timeline in wall clock
+	int64_t time = av_rescale_q(pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts, bs->time_base, AVRational{ 1, 1000000 });
+	bool revised = false;
+	if (m_nb_streams == 1)
+	{
+		revised = publish_packet(pkt, stream_index, time);
+	}
+	else
+	{
+		// publish the oldest packet of the stream when its pending queue is full
+		if (bs->pending_count == MAX_PENDING)
+		{
+			revised = publish_packet(&bs->pending[bs->pending_first], stream_index, bs->pending_time[bs->pending_first]);
+			av_packet_unref(&bs->pending[bs->pending_first]);
+			bs->pending_first = (bs->pending_first + 1) % MAX_PENDING;
+			bs->pending_count--;
+		}
+
+		int last = (bs->pending_first + bs->pending_count) % MAX_PENDING;
+		av_packet_ref(&bs->pending[last], pkt);
+		bs->pending_time[last] = time;
+		bs->pending_count++;
+		bs->last_time = time;
+		m_interleave_time = std::max(m_interleave_time, time);
+
+		revised = interleave_packets() || revised;
+	}
+
+	m_pushed.store(pushed + 1, std::memory_order_relaxed);
+	m_pushed_bytes.store(m_pushed_bytes.load(std::memory_order_relaxed) + pkt->size, std::memory_order_relaxed);
+	if (timed)
+	{
+		m_push_latency.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+	}
+
+	// readers behind the tail are moved forward when they read next time
+	m_err = 0;
+	m_message = revised ? "Packet added, circular buffer revised" : "Packet added";
+	return m_TotalPkts;
+}
+
+// publish the waiting packets in dts order
+// a packet is published when all the other streams have packets waiting, or it has waited longer than the interleave delay
+// a stream that has pushed nothing within the interleave delay, such as a muted audio track, is not waited for
+// return true when packets are evicted
+bool CircularBuffer::interleave_packets()
+{
+	bool revised = false;
+	while (true)
+	{
+		// find the oldest waiting packet
+		int oldest = -1;
+		bool all_waiting = true;
+		for (int i = 0; i < m_nb_streams; i++)
+		{
+			BufferStream* bs = &m_streams[i];
+			if (!bs->pending_count)
+			{
+				all_waiting = all_waiting && bs->last_time <= m_interleave_time - m_interleave_delay;
+			}
+			else if (oldest < 0 || bs->pending_time[bs->pending_first] < m_streams[oldest].pending_time[m_streams[oldest].pending_first])
+			{
+				oldest = i;
+			}
+		}
+
+		if (oldest < 0)
+		{
+			break;
+		}
+
+		BufferStream* bs = &m_streams[oldest];
+		if (!all_waiting && bs->pending_time[bs->pending_first] > m_interleave_time - m_interleave_delay)
+		{
+			break;
+		}
+
+		revised = publish_packet(&bs->pending[bs->pending_first], oldest, bs->pending_time[bs->pending_first]) || revised;
+		av_packet_unref(&bs->pending[bs->pending_first]);
+		bs->pending_first = (bs->pending_first + 1) % MAX_PENDING;
+		bs->pending_count--;
+	}
+
+	return revised;
+}
+
+// copy size bytes with relaxed atomic stores of 8 bytes, dst is aligned to 8 bytes
+// the readers copy the spill records and the views of the slots out while the writer may be rewriting them, they check
+// the disk tail or the slot afterwards to drop a torn copy, so both sides go through atomics and the overlap is no data race
+static void store_words(uint8_t* dst, const void* src, size_t size)
+{
+	std::atomic<uint64_t>* words = reinterpret_cast<std::atomic<uint64_t>*>(dst);
+	const uint8_t* bytes = static_cast<const uint8_t*>(src);
+	for (size_t i = 0; i < size; i += 8)
+	{
+		uint64_t word = 0;
+		memcpy(&word, bytes + i, std::min<size_t>(8, size - i));
+		words[i / 8].store(word, std::memory_order_relaxed);
+	}
+}
+
+// copy size bytes out with relaxed atomic loads of 8 bytes, src is aligned to 8 bytes
+static void load_words(void* dst, const uint8_t* src, size_t size)
+{
+	const std::atomic<uint64_t>* words = reinterpret_cast<const std::atomic<uint64_t>*>(src);
+	uint8_t* bytes = static_cast<uint8_t*>(dst);
+	for (size_t i = 0; i < size; i += 8)
+	{
+		uint64_t word = words[i / 8].load(std::memory_order_relaxed);
+		memcpy(bytes + i, &word, std::min<size_t>(8, size - i));
+	}
+}
+
+// publish the packet of the stream to the readers, then evict the packets that are out of the time span or the size
+// return true when packets are evicted
+bool CircularBuffer::publish_packet(AVPacket* pkt, int stream_index, int64_t time)
+{
+	// make room for the new packet when all the slots are occupied
+	uint64_t head = m_head.load(std::memory_order_relaxed);
+	bool revised = false;
+	while (head - m_tail.load(std::memory_order_relaxed) >= m_capacity)
+	{
+		evict_packet();
+		m_evicted_slots.store(m_evicted_slots.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		revised = true;
+	}
+
+	// the slot is empty now, no reader is going to touch its packet until seq is published
+	PacketSlot* slot = &m_slots[head & m_mask];
+	store_packet(slot, pkt, head);
+	slot->pkt.stream_index = stream_index;
+	slot->time = time;
+	PacketView view = { slot->pkt.data, slot->pkt.size, slot->pkt.pts, slot->pkt.dts, slot->pkt.duration, slot->pkt.flags, stream_index, time };
+	store_words(reinterpret_cast<uint8_t*>(slot->view), &view, sizeof(PacketView));
+	slot->seq.store(head + 1, std::memory_order_release);
+
+	// drop the keyframes that have left both the memory and the spill file, or whose entries are to be reused
+	uint64_t key_head = m_key_head.load(std::memory_order_relaxed);
+	if (m_spill_map)
+	{
+		uint64_t key_tail = m_key_tail.load(std::memory_order_relaxed);
+		uint64_t oldest = get_oldest();
+		while (key_tail < key_head && (key_head - key_tail > m_key_mask || m_keyframes[key_tail & m_key_mask].seq.load(std::memory_order_relaxed) < oldest))
+		{
+			key_tail++;
+		}
+		m_key_tail.store(key_tail, std::memory_order_release);
+	}
+
+	// index the keyframe before publishing the packet, so that a seek never misses it
+	if (stream_index == m_key_stream && (pkt->flags & AV_PKT_FLAG_KEY))
+	{
+		m_keyframes[key_head & m_key_mask].seq.store(head, std::memory_order_relaxed);
+		m_keyframes[key_head & m_key_mask].time.store(time, std::memory_order_relaxed);
+		m_key_head.store(key_head + 1, std::memory_order_release);
+	}
+
+	m_last_time.store(time, std::memory_order_relaxed);
+	m_TotalPkts.store(m_TotalPkts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_size.store(m_size.load(std::memory_order_relaxed) + slot->pkt.size + static_cast<int>(sizeof(PacketSlot)), std::memory_order_relaxed);
+	m_head.store(head + 1, std::memory_order_release); // publish the new packet to the readers
+	if (m_shared)
+	{
+		share_packet(slot, head);
+	}
+
+	// the head is stored before waiters is checked, paired with the waiter that counts itself before checking the head,
+	// so that either the waiter sees the new packet or the writer sees the waiter
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_signal->waiters.load(std::memory_order_relaxed) > 0)
+	{
+		notify_waiters();
+	}
+
+	// thin the old GOPs first when the retention allows it
+	if (m_thin && !m_arena && !m_spill_map && m_size.load(std::memory_order_relaxed) > m_MaxSize)
+	{
+		thin_packets();
+	}
+
+	// maintain the circular buffer by kicking out those overflowed packets, the newest packet is always kept
+	int64_t allowed_time = time - m_time_span_us;
+	uint64_t tail = m_tail.load(std::memory_order_relaxed);
+	while (tail < head && (m_slots[tail & m_mask].time < allowed_time || m_size.load(std::memory_order_relaxed) > m_MaxSize))
+	{
+		std::atomic<int64_t>* evicted = m_slots[tail & m_mask].time < allowed_time ? &m_evicted_time : &m_evicted_size;
+		evict_packet();
+		evicted->store(evicted->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		tail++;
+		revised = true;
+	}
+
+	return revised;
+}
+
+// store a copy of the packet into the empty slot
+// the payload is copied into the arena when it is used, otherwise the packet is referenced
+// a packet that cannot fit into the arena is referenced in the heap as well
+void CircularBuffer::store_packet(PacketSlot* slot, AVPacket* pkt, uint64_t seq)
+{
+	ArenaChunk* chunk = m_arena ? arena_alloc(pkt->size, seq) : NULL;
+	if (!chunk)
+	{
+		if (m_arena)
+		{
+			m_arena_fallbacks.fetch_add(1, std::memory_order_relaxed);
+		}
+		av_packet_ref(&slot->pkt, pkt);  // leave the pkt alone
+		return;
+	}
+
+	// the room may still be read by a shared reader, which checks the tail after copying, so the tail moved has to be seen first
+	if (m_shared)
+	{
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+	uint8_t* data = reinterpret_cast<uint8_t*>(chunk) + sizeof(ArenaChunk);
+	memcpy(data, pkt->data, pkt->size);
+	memset(data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	av_packet_copy_props(&slot->pkt, pkt);
+	slot->pkt.data = data;
+	slot->pkt.size = pkt->size;
+}
+
+// allocate a chunk in the arena for the packet, evicting the oldest packets when there is no room
+// NULL when the arena is held by the readers or the packet is larger than the arena
+ArenaChunk* CircularBuffer::arena_alloc(int size, uint64_t seq)
+{
+	int need = (sizeof(ArenaChunk) + size + AV_INPUT_BUFFER_PADDING_SIZE + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (need > m_arena_size)
+	{
+		return NULL;
+	}
+
+	while (true)
+	{
+		arena_reclaim();
+
+		// find the room after the write offset, or wrap to the bottom of the arena
+		int offset = -1;
+		if (m_arena_end)
+		{
+			if (m_arena_write + need <= m_arena_read)
+				offset = m_arena_write;
+		}
+		else if (m_arena_write + need <= m_arena_size)
+		{
+			offset = m_arena_write;
+		}
+		else if (need <= m_arena_read)
+		{
+			m_arena_end = m_arena_write;
+			offset = 0;
+		}
+
+		if (offset >= 0)
+		{
+			ArenaChunk* chunk = reinterpret_cast<ArenaChunk*>(m_arena + offset);
+			chunk->refs.store(1, std::memory_order_relaxed);
+			chunk->size = need;
+			chunk->seq = seq;
+			m_arena_write = offset + need;
+			m_arena_chunks++;
+			return chunk;
+		}
+
+		// evicting more packets does not help when the oldest chunk is already evicted but still held by a reader,
+		// unless it is only retired and the views on it have been released
+		uint64_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_relaxed) || 
+			(m_arena_chunks && reinterpret_cast<ArenaChunk*>(m_arena + m_arena_read)->seq < tail))
+		{
+			if (free_retired(false))
+			{
+				continue;
+			}
+			return NULL;
+		}
+		evict_packet();
+		m_evicted_size.store(m_evicted_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+// advance the read offset of the arena over the chunks that are no longer referenced
+// eviction of the arena is just a move of the read offset
+void CircularBuffer::arena_reclaim()
+{
+	while (m_arena_chunks)
+	{
+		ArenaChunk* chunk = reinterpret_cast<ArenaChunk*>(m_arena + m_arena_read);
+		if (chunk->refs.load(std::memory_order_acquire))
+		{
+			break;
+		}
+
+		m_arena_read += chunk->size;
+		m_arena_chunks--;
+		if (m_arena_end && m_arena_read == m_arena_end)
+		{
+			m_arena_read = 0;
+			m_arena_end = 0;
+		}
+	}
+
+	// start over from the bottom when the arena is empty
+	if (!m_arena_chunks)
+	{
+		m_arena_read = 0;
+		m_arena_write = 0;
+		m_arena_end = 0;
+	}
+}
+
+// reference a packet whose payload is in the arena
+// the buffer of the new packet points into the arena, the chunk is held until the packet is unref
+// the slot is pinned by the caller, so the chunk cannot be released in between
+void CircularBuffer::arena_ref(AVPacket* dst, AVPacket* src)
+{
+	ArenaChunk* chunk = reinterpret_cast<ArenaChunk*>(src->data - sizeof(ArenaChunk));
+	chunk->refs.fetch_add(1, std::memory_order_relaxed);
+	m_arena_storage->refs.fetch_add(1, std::memory_order_relaxed);
+
+	AVBufferRef* buf = av_buffer_create(src->data, src->size + AV_INPUT_BUFFER_PADDING_SIZE, arena_release, m_arena_storage, AV_BUFFER_FLAG_READONLY);
+	if (!buf)
+	{
+		// copy the payload out of the arena when running out of memory
+		chunk->refs.fetch_sub(1, std::memory_order_release);
+		m_arena_storage->refs.fetch_sub(1, std::memory_order_relaxed);
+		av_packet_ref(dst, src);
+		return;
+	}
+
+	av_packet_copy_props(dst, src);
+	dst->buf = buf;
+	dst->data = src->data;
+	dst->size = src->size;
+}
+
+// called when a reader unrefs a packet whose payload is in the arena
+// the storage is released after the chunk, it may be the last reference when the buffer was opened again or destroyed
+void CircularBuffer::arena_release(void* opaque, uint8_t* data)
+{
+	reinterpret_cast<ArenaChunk*>(data - sizeof(ArenaChunk))->refs.fetch_sub(1, std::memory_order_release);
+	release_arena(static_cast<ArenaStorage*>(opaque));
+}
+
+// read up to count packets from the sequence number specified by the reader, and move the reader forward once
+// a reader behind the tail reads from the spill file, it is moved to the tail when the packets are not there
+// each slot is pinned while referencing its packet, the sequence of the slot is checked after pinning to catch the eviction in between
+// the head is loaded once for the whole run of packets, the reader is only stored at the end
+// return the number of packets read, 0 when there is no new packet
+int CircularBuffer::read_packets(PacketReader* reader, AVPacket* pkts, int count)
+{
+	uint64_t seq = reader->seq.load(std::memory_order_relaxed);
+	uint64_t head = m_head.load(std::memory_order_acquire);
+	uint64_t tail = m_tail.load(std::memory_order_acquire);
+	bool spilled = m_spill_map && reader != &m_readers[m_spill_reader];
+	int64_t time = 0;
+	int n = 0;
+	while (n < count && seq < head)
+	{
+		// check the tail again from time to time, the writer may overrun a long run of packets
+		if ((seq & 63) == 0)
+		{
+			tail = m_tail.load(std::memory_order_acquire);
+		}
+
+		if (seq < tail)
+		{
+			// the packet is no longer in the memory, look for it in the spill file
+			int ret = spilled ? read_spilled(reader, &seq, &pkts[n], &time) : -1;
+			if (ret > 0)
+			{
+				seq++;
+				n++;
+			}
+			else if (ret == 0)
+			{
+				break;
+			}
+			else if (ret == -1)
+			{
+				reader->lost.fetch_add(tail - seq, std::memory_order_relaxed);
+				seq = tail;
+			}
+			continue;
+		}
+
+		PacketSlot* slot = &m_slots[seq & m_mask];
+		slot->pins.fetch_add(1, std::memory_order_seq_cst);
+		uint64_t slot_seq = slot->seq.load(std::memory_order_seq_cst);
+		if (slot_seq == ((seq + 1) | SLOT_THINNED))
+		{
+			// the packet has been thinned out, the rest of its GOP is thinned as well
+			slot->pins.fetch_sub(1, std::memory_order_release);
+			seq++;
+			continue;
+		}
+		if (slot_seq != seq + 1)
+		{
+			// the packet has just been evicted, the tail has been moved past it already
+			slot->pins.fetch_sub(1, std::memory_order_release);
+			tail = m_tail.load(std::memory_order_acquire);
+			continue;
+		}
+
+		// expose to the outside a copy of the packet
+		if (slot->pkt.buf || !m_arena)
+			av_packet_ref(&pkts[n], &slot->pkt);
+		else
+			arena_ref(&pkts[n], &slot->pkt);
+		time = slot->time;
+		slot->pins.fetch_sub(1, std::memory_order_release);
+		seq++;
+		n++;
+	}
+
+	reader->seq.store(seq, std::memory_order_relaxed);
+	if (n)
+	{
+		reader->time.store(time, std::memory_order_relaxed);
+	}
+	return n;
+}
+
+// take views of the packets from the sequence number of the reader
+// The reader announces its epoch before looking at any slot, then reads the slots like a seqlock: the slot sequence number
+// is checked before and after copying the fields, so a view is only kept when the slot was not evicted or reused meanwhile.
+// No reference is taken and the slot is not pinned, the writer never waits for the views.
+int CircularBuffer::read_views(PacketReader* reader, PacketView* views, int count)
+{
+	// the epoch is announced before the views are turned on, paired with free_retired turning them off then checking the epochs
+	uint64_t seq = reader->seq.load(std::memory_order_relaxed);
+	if (!reader->epoch.load(std::memory_order_relaxed))
+	{
+		reader->epoch.store(m_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+		reader->view_first.store(seq, std::memory_order_seq_cst);
+	}
+	else if (seq < reader->view_first.load(std::memory_order_relaxed))
+	{
+		// moved back by a seek while holding views, the end is stored again after the first
+		reader->view_first.store(seq, std::memory_order_seq_cst);
+		reader->view_end.store(reader->view_end.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+	}
+	if (!m_views.load(std::memory_order_seq_cst))
+	{
+		m_views.store(true, std::memory_order_seq_cst);
+	}
+
+	uint64_t head = m_head.load(std::memory_order_acquire);
+	uint64_t tail = m_tail.load(std::memory_order_acquire);
+	uint64_t end = reader->view_end.load(std::memory_order_relaxed);
+	int n = 0;
+	while (n < count && seq < head)
+	{
+		// the range is extended before looking at the slots, paired with release_payload marking the slot busy then checking it
+		if (seq >= end)
+		{
+			end = seq + (count - n);
+			reader->view_end.store(end, std::memory_order_seq_cst);
+		}
+
+		if ((seq & 63) == 0)
+		{
+			tail = m_tail.load(std::memory_order_acquire);
+		}
+
+		if (seq < tail)
+		{
+			// the spilled packets are read by peek_packets, the spill file is rewritten under the views
+			if (m_spill_map && reader != &m_readers[m_spill_reader] && get_oldest() <= seq)
+			{
+				if (!n)
+				{
+					reader->seq.store(seq, std::memory_order_relaxed);
+					return -1;
+				}
+				break;
+			}
+			reader->lost.fetch_add(tail - seq, std::memory_order_relaxed);
+			seq = tail;
+			continue;
+		}
+
+		PacketSlot* slot = &m_slots[seq & m_mask];
+		uint64_t slot_seq = slot->seq.load(std::memory_order_seq_cst);
+		if (slot_seq == ((seq + 1) | SLOT_THINNED))
+		{
+			seq++;
+			continue;
+		}
+		if (slot_seq != seq + 1)
+		{
+			tail = m_tail.load(std::memory_order_acquire);
+			continue;
+		}
+
+		load_words(&views[n], reinterpret_cast<const uint8_t*>(slot->view), sizeof(PacketView));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->seq.load(std::memory_order_relaxed) != seq + 1)
+		{
+			// the packet has been evicted or thinned while copying, the fields may be torn
+			tail = m_tail.load(std::memory_order_acquire);
+			continue;
+		}
+		seq++;
+		n++;
+	}
+
+	reader->seq.store(seq, std::memory_order_relaxed);
+	if (n)
+	{
+		reader->time.store(views[n - 1].time, std::memory_order_relaxed);
+	}
+	return n;
+}
+
+// get the opened reader by its handle, NULL when the handle is invalid
+PacketReader* CircularBuffer::get_reader(int reader)
+{
+	if (reader < 0 || reader >= MAX_READERS || !m_readers[reader].used.load(std::memory_order_acquire))
+	{
+		return NULL;
+	}
+
+	return &m_readers[reader];
+}
+
+// binary search the keyframe index for the sequence number of the last keyframe at or before the wall clock time in microseconds
+// the oldest keyframe is given when time is older than that, the oldest packet is given when there is no keyframe at all
+// the entries may be overwritten by the writer while searching, the search is repeated when the tail of the index moves past the result
+uint64_t CircularBuffer::find_keyframe(int64_t time)
+{
+	while (m_keyframes)
+	{
+		uint64_t low = m_key_tail.load(std::memory_order_acquire);
+		uint64_t high = m_key_head.load(std::memory_order_acquire);
+		if (low >= high)
+		{
+			break;
+		}
+
+		// find the first entry newer than time in [low, high)
+		uint64_t first = low;
+		while (low < high)
+		{
+			uint64_t mid = low + (high - low) / 2;
+			if (m_keyframes[mid & m_key_mask].time.load(std::memory_order_relaxed) <= time)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		uint64_t found = low > first ? low - 1 : first;
+		uint64_t seq = m_keyframes[found & m_key_mask].seq.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (found >= m_key_tail.load(std::memory_order_relaxed))
+		{
+			return seq;
+		}
+	}
+
+	return get_oldest();
+}
+
+// get the sequence number of the oldest packet, in the spill file or in the memory
+uint64_t CircularBuffer::get_oldest()
+{
+	uint64_t tail = m_tail.load(std::memory_order_acquire);
+	return m_spill_map ? std::min(tail, m_disk_tail.load(std::memory_order_acquire)) : tail;
+}
+
+// create and map the spill file, then start the spill thread
+// return 0 on success, negative when the spill file cannot be used
+int CircularBuffer::open_spill()
+{
+	uint8_t* map = NULL;
+	std::string step = "open";
+#ifdef _WIN32
+	m_spill_file = CreateFileA(m_spill_url.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_spill_file != INVALID_HANDLE_VALUE)
+	{
+		step = "size";
+		m_spill_mapping = CreateFileMappingA(m_spill_file, NULL, PAGE_READWRITE, static_cast<DWORD>(m_spill_size >> 32), static_cast<DWORD>(m_spill_size & 0xffffffff), NULL);
+		if (m_spill_mapping)
+		{
+			step = "map";
+			map = static_cast<uint8_t*>(MapViewOfFile(m_spill_mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(m_spill_size)));
+		}
+	}
+	std::string reason = "error " + std::to_string(GetLastError());
+#else
+	m_spill_fd = ::open(m_spill_url.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_spill_fd >= 0)
+	{
+		step = "size";
+		if (ftruncate(m_spill_fd, m_spill_size) == 0)
+		{
+			step = "map";
+			void* addr = mmap(NULL, static_cast<size_t>(m_spill_size), PROT_READ | PROT_WRITE, MAP_SHARED, m_spill_fd, 0);
+			map = addr == MAP_FAILED ? NULL : static_cast<uint8_t*>(addr);
+		}
+	}
+	std::string reason = strerror(errno);
+#endif
+	if (!map)
+	{
+		// a failed map is mostly the address space, a smaller spill_size fits
+		close_spill();
+		m_err = -1;
+		m_message = "Cannot " + step + " the spill file " + m_spill_url + " of " + std::to_string(m_spill_size >> 20) + "MB, " + reason;
+		return m_err;
+	}
+
+	m_spill_index = new SpillEntry[m_spill_capacity];
+	for (uint64_t i = 0; i < m_spill_capacity; i++)
+	{
+		m_spill_index[i].seq.store(0, std::memory_order_relaxed);
+		m_spill_index[i].pos.store(0, std::memory_order_relaxed);
+		m_spill_index[i].time.store(0, std::memory_order_relaxed);
+	}
+	m_disk_head = m_head.load(std::memory_order_relaxed);
+	m_disk_tail = m_disk_head.load(std::memory_order_relaxed);
+	m_spill_drop = 0;
+	m_spill_pos = 0;
+
+	// the spill reader starts from the head, it is not counted as one of the readers by the others
+	m_spill_reader = open_reader();
+	if (m_spill_reader < 0)
+	{
+		close_spill();
+		m_err = -2;
+		m_message = "No reader is available for spilling, all the " + std::to_string(MAX_READERS) + " readers are in use";
+		return m_err;
+	}
+	m_readers[m_spill_reader].seq.store(m_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	m_spill_map = map;
+	m_spill_stop = false;
+	m_spill_waited = false;
+	m_spill_thread = std::thread(&CircularBuffer::spill_packets, this);
+	return 0;
+}
+
+// stop the spill thread and unmap the spill file
+void CircularBuffer::close_spill()
+{
+	if (m_spill_thread.joinable())
+	{
+		m_spill_stop.store(true, std::memory_order_release);
+		notify_waiters();
+		m_spill_thread.join();
+	}
+	if (m_spill_reader >= 0)
+	{
+		close_reader(m_spill_reader);
+		m_spill_reader = -1;
+	}
+
+#ifdef _WIN32
+	if (m_spill_map)
+		UnmapViewOfFile(m_spill_map);
+	if (m_spill_mapping)
+		CloseHandle(m_spill_mapping);
+	if (m_spill_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_spill_file);
+	m_spill_mapping = NULL;
+	m_spill_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_spill_map)
+		munmap(m_spill_map, static_cast<size_t>(m_spill_size));
+	if (m_spill_fd >= 0)
+		::close(m_spill_fd);
+	m_spill_fd = -1;
+#endif
+	m_spill_map = NULL;
+	delete[] m_spill_index;
+	m_spill_index = NULL;
+}
+
+// the spill thread, write the packets read by the spill reader into the spill file
+// the spill reader is woken up by the writer like any other reader, the writer never waits for the disk
+void CircularBuffer::spill_packets()
+{
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	PacketReader* rd = &m_readers[m_spill_reader];
+	while (!m_spill_stop.load(std::memory_order_acquire))
+	{
+		if (wait_packet(&pkt, m_spill_reader, 100) <= 0)
+		{
+			continue;
+		}
+
+		write_spilled(&pkt, rd->seq.load(std::memory_order_relaxed) - 1, rd->time.load(std::memory_order_relaxed));
+		av_packet_unref(&pkt);
+
+		// wake up the readers waiting for the packets just spilled, see has_packet
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_spill_waited.load(std::memory_order_relaxed) && m_spill_waited.exchange(false, std::memory_order_relaxed))
+		{
+			notify_waiters();
+		}
+	}
+}
+
+// write the packet of the sequence number into the spill file, NULL to mark the packet as lost
+// the records are written one after another and never wrap in the middle.
+// The disk tail is moved past the records to be overwritten before writing, readers check it again after copying a record.
+void CircularBuffer::write_spilled(AVPacket* pkt, uint64_t seq, int64_t time)
+{
+	uint64_t head = m_disk_head.load(std::memory_order_relaxed);
+	if (seq > head && pkt)
+	{
+		// mark the packets the spill reader has lost, the older ones are not in the index anymore
+		for (head = std::max(head, seq > m_spill_capacity ? seq - m_spill_capacity : 0); head < seq; head++)
+		{
+			write_spilled(NULL, head, time);
+		}
+	}
+
+	uint64_t size = static_cast<uint64_t>(m_spill_size);
+	int length = 0;
+	uint64_t pos = m_spill_pos;
+	if (pkt)
+	{
+		length = (static_cast<int>(sizeof(SpillRecord)) + pkt->size + SPILL_ALIGN - 1) & ~(SPILL_ALIGN - 1);
+		if (static_cast<uint64_t>(length) > size)
+		{
+			pkt = NULL;
+			length = 0;
+		}
+		else if (pos % size + length > size)
+		{
+			pos += size - pos % size;
+		}
+	}
+
+	// drop the records in the way of the new one, out of the time span, or whose index entries are to be reused
+	uint64_t tail = std::max(m_disk_tail.load(std::memory_order_relaxed), std::min(m_spill_drop.load(std::memory_order_relaxed), seq));
+	int64_t allowed_time = time - static_cast<int64_t>(m_spill_span) * 1000000;
+	while (tail < seq)
+	{
+		SpillEntry* entry = &m_spill_index[tail & m_spill_mask];
+		if (seq - tail < m_spill_capacity && entry->pos.load(std::memory_order_relaxed) + size >= pos + length &&
+			entry->time.load(std::memory_order_relaxed) >= allowed_time)
+		{
+			break;
+		}
+		tail++;
+	}
+	m_disk_tail.store(tail, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (pkt)
+	{
+		SpillRecord record;
+		record.seq = seq;
+		record.pts = pkt->pts;
+		record.dts = pkt->dts;
+		record.duration = pkt->duration;
+		record.size = pkt->size;
+		record.flags = pkt->flags;
+		record.stream_index = pkt->stream_index;
+		record.length = length;
+		store_words(m_spill_map + pos % size, &record, sizeof(SpillRecord));
+		store_words(m_spill_map + pos % size + sizeof(SpillRecord), pkt->data, pkt->size);
+	}
+
+	SpillEntry* entry = &m_spill_index[seq & m_spill_mask];
+	entry->seq.store(pkt ? seq + 1 : 0, std::memory_order_relaxed);
+	entry->pos.store(pos, std::memory_order_relaxed);
+	entry->time.store(time, std::memory_order_relaxed);
+	m_spill_pos = pos + length;
+	m_disk_head.store(seq + 1, std::memory_order_release);
+}
+
+// read the packet of the sequence number out of the spill file
+// the record is copied first through load_words, then checked against the disk tail in case the spill thread has overwritten it meanwhile.
+// return 1 when the packet is read, 0 when it is being spilled, -1 when it is not spilled at all, -2 when seq is moved to try again
+int CircularBuffer::read_spilled(PacketReader* reader, uint64_t* seq, AVPacket* pkt, int64_t* time)
+{
+	uint64_t tail = m_disk_tail.load(std::memory_order_acquire);
+	if (*seq < tail)
+	{
+		reader->lost.fetch_add(tail - *seq, std::memory_order_relaxed);
+		*seq = tail;
+		return -2;
+	}
+	if (*seq >= m_disk_head.load(std::memory_order_acquire))
+	{
+		// the spill reader has taken the packet but not written it yet
+		return *seq < m_readers[m_spill_reader].seq.load(std::memory_order_relaxed) ? 0 : -1;
+	}
+
+	SpillEntry* entry = &m_spill_index[*seq & m_spill_mask];
+	uint64_t size = static_cast<uint64_t>(m_spill_size);
+	uint64_t pos = entry->pos.load(std::memory_order_relaxed);
+	int64_t t = entry->time.load(std::memory_order_relaxed);
+	SpillRecord record;
+	load_words(&record, m_spill_map + pos % size, sizeof(SpillRecord));
+	bool valid = entry->seq.load(std::memory_order_relaxed) == *seq + 1 && record.seq == *seq &&
+		record.size >= 0 && static_cast<uint64_t>(record.size) + sizeof(SpillRecord) <= size - pos % size;
+	if (valid && av_new_packet(pkt, record.size) == 0)
+	{
+		load_words(pkt->data, m_spill_map + pos % size + sizeof(SpillRecord), record.size);
+	}
+	else
+	{
+		valid = false;
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (*seq < m_disk_tail.load(std::memory_order_relaxed))
+	{
+		// overwritten while copying
+		av_packet_unref(pkt);
+		return -2;
+	}
+	if (!valid)
+	{
+		// lost before it could be spilled
+		av_packet_unref(pkt);
+		reader->lost.fetch_add(1, std::memory_order_relaxed);
+		(*seq)++;
+		return -2;
+	}
+
+	pkt->pts = record.pts;
+	pkt->dts = record.dts;
+	pkt->duration = record.duration;
+	pkt->flags = record.flags;
+	pkt->stream_index = record.stream_index;
+	*time = t;
+	return 1;
+}
+
+// open a new reader starting from the oldest keyframe in the circular buffer
+// non-negative return is the handle of the reader, -2 when all the MAX_READERS handles are in use
+int CircularBuffer::open_reader()
+{
+	for (int i = 0; i < MAX_READERS; i++)
+	{
+		bool used = false;
+		if (m_readers[i].used.compare_exchange_strong(used, true, std::memory_order_acq_rel))
+		{
+			m_readers[i].seq.store(find_keyframe(INT64_MIN), std::memory_order_relaxed);
+			m_readers[i].time.store(0, std::memory_order_relaxed);
+			m_readers[i].lost.store(0, std::memory_order_relaxed);
+			return i;
+		}
+	}
+
+	return -2;
+}
+
+// close the reader so that its handle can be used by others
+// return 0 on success, negative when the handle is invalid
+int CircularBuffer::close_reader(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	rd->view_end.store(0, std::memory_order_release);
+	rd->epoch.store(0, std::memory_order_release);
+	rd->used.store(false, std::memory_order_release);
+	notify_waiters(); // let a thread waiting on the reader return
+	return 0;
+}
+
+// read a packet out of the circular buffer using the specified reader
+// a positive return indicates the packet is read. 
+int CircularBuffer::peek_packet(AVPacket* pkt, int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!m_slots || !rd || !read_packets(rd, pkt, 1))
+	{
+		return 0;
+	}
+
+	return m_size; // return the size of the circular buffer
+};
+
+// read the newest keyframe using the specified reader, skipping every packet before it
+// The entry is read from the index like find_keyframe does, then the packet is read by read_packets from its sequence number.
+// The keyframe may be evicted meanwhile, the reader then lands on the tail and the packet read is not taken.
+int CircularBuffer::peek_keyframe(AVPacket* pkt, int reader, int64_t* wallclock_ms)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!m_slots || !m_keyframes || !rd)
+	{
+		return 0;
+	}
+
+	uint64_t seq = 0;
+	while (true)
+	{
+		uint64_t tail = m_key_tail.load(std::memory_order_acquire);
+		uint64_t head = m_key_head.load(std::memory_order_acquire);
+		if (tail >= head)
+		{
+			return 0;
+		}
+
+		seq = m_keyframes[(head - 1) & m_key_mask].seq.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (head - 1 >= m_key_tail.load(std::memory_order_relaxed))
+		{
+			break;
+		}
+	}
+
+	if (seq < rd->seq.load(std::memory_order_relaxed))
+	{
+		return 0;
+	}
+
+	rd->seq.store(seq, std::memory_order_relaxed);
+	if (!read_packets(rd, pkt, 1))
+	{
+		return 0;
+	}
+	if (!(pkt->flags & AV_PKT_FLAG_KEY) || pkt->stream_index != m_key_stream)
+	{
+		av_packet_unref(pkt);
+		return 0;
+	}
+
+	if (wallclock_ms)
+	{
+		*wallclock_ms = rd->time.load(std::memory_order_relaxed) / 1000;
+	}
+	return m_size;
+}
+
+// read a run of up to count packets out of the circular buffer using the specified reader
+// return the number of packets read into pkts, 0 when there is no new packet or the reader is invalid
+int CircularBuffer::peek_packets(AVPacket* pkts, int count, int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!m_slots || !rd || count <= 0)
+	{
+		return 0;
+	}
+
+	return read_packets(rd, pkts, count);
+}
+
+// read a run of views of the packets, the payloads are borrowed from the circular buffer
+int CircularBuffer::peek_views(PacketView* views, int count, int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!m_slots || !rd || count <= 0)
+	{
+		return 0;
+	}
+
+	return read_views(rd, views, count);
+}
+
+// release the views of the reader, the packets retired since its epoch can be freed by the writer
+int CircularBuffer::release_views(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	rd->view_end.store(0, std::memory_order_seq_cst);
+	rd->epoch.store(0, std::memory_order_seq_cst);
+	return 0;
+}
+
+// read a packet using the specified reader, waiting up to timeout miliseconds for the writer to push one. Negative timeout waits forever.
+// a positive return indicates the packet is read, 0 on timeout, negative when the reader is invalid or closed while waiting
+int CircularBuffer::wait_packet(AVPacket* pkt, int reader, int timeout)
+{
+	CircularBuffer* buffer = this;
+	int ret = wait_packets(&buffer, &reader, 1, pkt, timeout);
+	if (ret == -1)
+	{
+		return 0;
+	}
+
+	return ret < 0 ? ret : m_size.load(std::memory_order_relaxed);
+}
+
+// read a packet from the first of several circular buffers having one, waiting up to timeout miliseconds. Negative timeout waits forever.
+// The packet is read without any syscall when it is already there or arrives while spinning for a short while,
+// otherwise the thread sleeps on the shared signal until a writer publishes a packet.
+// non-negative return is the position of the buffer whose packet is read, -1 on timeout, other negative values on errors
+int CircularBuffer::wait_packets(CircularBuffer** buffers, int* readers, int count, AVPacket* pkt, int timeout)
+{
+	if (count <= 0 || count > MAX_WAIT_BUFFERS)
+	{
+		return -2;
+	}
+
+	PacketReader* rds[MAX_WAIT_BUFFERS];
+	PacketSignal* signal = buffers[0]->m_signal;
+	for (int i = 0; i < count; i++)
+	{
+		rds[i] = buffers[i]->get_reader(readers[i]);
+		if (!buffers[i]->m_slots || !rds[i])
+		{
+			return -3;
+		}
+		if (buffers[i]->m_signal != signal)
+		{
+			return -4;
+		}
+	}
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout < 0 ? 0 : timeout);
+	unsigned int first = count > 1 ? signal->turn.fetch_add(1, std::memory_order_relaxed) : 0;
+	int spins = 0;
+	while (true)
+	{
+		// the fast path, start from a different buffer every call so that a busy buffer does not starve the others
+		for (int k = 0; k < count; k++)
+		{
+			int i = (first + k) % count;
+			if (buffers[i]->read_packets(rds[i], pkt, 1))
+			{
+				return i;
+			}
+			if (!rds[i]->used.load(std::memory_order_acquire))
+			{
+				return -5;
+			}
+		}
+
+		if (spins < WAIT_SPINS)
+		{
+			spins++;
+			continue;
+		}
+
+		// count this thread as a waiter before checking the heads again under the mutex,
+		// the writer notifies under the same mutex so the wakeup cannot be missed
+		std::unique_lock<std::mutex> lock(signal->mutex);
+		signal->waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool ready = false;
+		for (int i = 0; i < count && !ready; i++)
+		{
+			ready = buffers[i]->has_packet(rds[i]) || !rds[i]->used.load(std::memory_order_acquire);
+		}
+		bool timedout = false;
+		if (!ready)
+		{
+			if (timeout < 0)
+				signal->cond.wait(lock);
+			else
+				timedout = signal->cond.wait_until(lock, deadline) == std::cv_status::timeout;
+		}
+		signal->waiters.fetch_sub(1, std::memory_order_relaxed);
+		lock.unlock();
+
+		if (timedout)
+		{
+			// the last chance in case a packet arrived just at the deadline
+			for (int k = 0; k < count; k++)
+			{
+				int i = (first + k) % count;
+				if (buffers[i]->read_packets(rds[i], pkt, 1))
+				{
+					return i;
+				}
+			}
+			return -1;
+		}
+		spins = WAIT_SPINS; // go back to sleep directly after a spurious wakeup
+	}
+}
+
+// share the wakeup signal with other circular buffers, NULL to use its own signal
+// has to be called before pushing packets or waiting
+void CircularBuffer::set_signal(PacketSignal* signal)
+{
+	m_signal = signal ? signal : &m_own_signal;
+}
+
+// check if there is a packet the reader can read now
+// a reader behind the tail waits for the spill thread when its packet is being spilled, read_packets would return nothing.
+// The flag is raised before the disk head is checked, paired with the spill thread that stores the disk head before checking
+// the flag, so that either the waiter sees the packet written or the spill thread wakes it up.
+bool CircularBuffer::has_packet(PacketReader* reader)
+{
+	uint64_t seq = reader->seq.load(std::memory_order_relaxed);
+	if (seq >= m_head.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+	if (!m_spill_map || reader == &m_readers[m_spill_reader] || seq >= m_tail.load(std::memory_order_acquire))
+	{
+		return true;
+	}
+
+	m_spill_waited.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return seq < m_disk_head.load(std::memory_order_relaxed) || seq >= m_readers[m_spill_reader].seq.load(std::memory_order_relaxed);
+}
+
+// wake up the threads waiting on the signal
+// the mutex is taken so that a waiter in between checking the heads and sleeping is not missed
+void CircularBuffer::notify_waiters()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_signal->mutex);
+	}
+	m_signal->cond.notify_all();
+}
+
+// reset the reader to the oldest keyframe of the circular buffer
+// return 0 on success, negative when the handle is invalid
+int CircularBuffer::reset_reader(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	rd->seq.store(find_keyframe(INT64_MIN), std::memory_order_relaxed);
+	return 0;
+}
+
+// move the reader to the nearest keyframe at or before the wall clock time in miliseconds
+// the reader is moved to the oldest keyframe when the time is older than that
+// return 0 on success, negative when the handle is invalid or there is no keyframe in the circular buffer
+int CircularBuffer::seek_reader(int reader, int64_t wallclock_ms)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	if (m_key_tail.load(std::memory_order_acquire) >= m_key_head.load(std::memory_order_acquire))
+	{
+		return -2;
+	}
+
+	rd->seq.store(find_keyframe(wallclock_ms * 1000), std::memory_order_relaxed);
+	return 0;
+}
+
+// get the number of packets the reader is behind the newest packet
+// negative return indicates the handle is invalid
+int CircularBuffer::get_reader_lag(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	uint64_t head = m_head.load(std::memory_order_acquire);
+	uint64_t seq = std::max(rd->seq.load(std::memory_order_relaxed), get_oldest());
+	return seq < head ? static_cast<int>(head - seq) : 0;
+}
+
+// get the time in miliseconds the reader is behind the newest packet
+// negative return indicates the handle is invalid
+int64_t CircularBuffer::get_reader_lag_time(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	int64_t time = rd->time.load(std::memory_order_relaxed);
+	if (!time || !get_reader_lag(reader))
+	{
+		return 0;
+	}
+
+	return (m_last_time.load(std::memory_order_relaxed) - time) / 1000;
+}
+
+// get the number of packets evicted before the reader could read them
+// negative return indicates the handle is invalid
+int64_t CircularBuffer::get_reader_lost(int reader)
+{
+	PacketReader* rd = get_reader(reader);
+	if (!rd)
+	{
+		return -1;
+	}
+
+	return rd->lost.load(std::memory_order_relaxed);
+}
+
+// get the time base of the stream in the circular buffer
+AVRational CircularBuffer::get_time_base(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (stream_index < 0 || stream_index >= m_nb_streams)
+	{
+		m_err = -1;
+		m_message = "Invalid stream index specified";
+		return AVRational{ 1, 1 };
+	}
+
+	return m_streams[stream_index].time_base;
+};
+
+// get the size of the circular buffer
+int CircularBuffer::get_size()
+{
+	m_err = 0;
+	m_message = "";
+
+	return m_size;
+};
+
+// get the codec parameters of the stream in the circular buffer
+AVCodecParameters* CircularBuffer::get_stream_codecpar(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (stream_index < 0 || stream_index >= m_nb_streams)
+	{
+		m_err = -1;
+		m_message = "Invalid stream index specified";
+		return NULL;
+	}
+
+	return m_streams[stream_index].codecpar;
+};
+
+// get the stream assigned to the circular buffer
+AVStream* CircularBuffer::get_stream(int stream_index)
+{
+	if (stream_index < 0 || stream_index >= m_nb_streams)
+	{
+		return NULL;
+	}
+
+	return m_streams[stream_index].st;
+}
+
+// get the number of streams in the circular buffer
+int CircularBuffer::get_stream_count()
+{
+	return m_nb_streams;
+}
+
+// get the error message of last operation
+std::string CircularBuffer::get_error_message()
+{
+	return m_message;
+}
+
+// get the number of packet slots of the circular buffer
+int CircularBuffer::get_capacity()
+{
+	return static_cast<int>(m_capacity);
+}
+
+// get the kind of pages the slots and the arena got at open, one of HUGEPAGES_NONE, HUGEPAGES_TRANSPARENT or HUGEPAGES_EXPLICIT
+int CircularBuffer::get_hugepages()
+{
+	return m_hugepages_used;
+}
+
+// get the number of packets kept in the heap instead of the arena, because the arena space was still held by readers
+int64_t CircularBuffer::get_arena_fallbacks()
+{
+	return m_arena_fallbacks.load(std::memory_order_relaxed);
+}
+
+// export the packets between the wall clock times in miliseconds into a file, starting at the keyframe at or before t0
+// the reader of the export is opened and seeked here, so the clip starts where it was asked for even if the worker starts late
+std::future<int> CircularBuffer::export_range(int64_t t0_ms, int64_t t1_ms, std::string url)
+{
+	std::promise<int> promise;
+	std::future<int> result = promise.get_future();
+
+	int reader = open_reader();
+	if (reader < 0)
+	{
+		promise.set_value(-2);
+		return result;
+	}
+	if (t1_ms < t0_ms || seek_reader(reader, t0_ms) < 0)
+	{
+		close_reader(reader);
+		promise.set_value(-1);
+		return result;
+	}
+
+	std::lock_guard<std::mutex> lock(m_export_mutex);
+	start_export(reader, t0_ms * 1000, t1_ms * 1000, url, {}, std::move(promise));
+	return result;
+}
+
+// A trigger extends the event by moving its end time with a CAS, as long as the worker has not swapped it to -1.
+// Once the worker has completed the event, the trigger starts another one in a new file.
+int CircularBuffer::trigger_event(int pre_seconds, int post_seconds, std::string prefix,
+	std::vector<std::pair<std::string, std::string> > options)
+{
+	// the times are taken on the clock of the packets, from the newest one
+	int64_t now = m_last_time.load(std::memory_order_relaxed);
+	int64_t end_time = now + post_seconds * 1000000LL;
+
+	std::lock_guard<std::mutex> lock(m_export_mutex);
+	if (m_event)
+	{
+		int64_t current = m_event->end_time.load(std::memory_order_acquire);
+		while (current >= 0)
+		{
+			if (current >= end_time || m_event->end_time.compare_exchange_weak(current, end_time, std::memory_order_acq_rel))
+			{
+				return 0;
+			}
+		}
+	}
+
+	int reader = open_reader();
+	if (reader < 0)
+	{
+		return -2;
+	}
+	int64_t start_ms = now / 1000 - pre_seconds * 1000LL;
+	if (seek_reader(reader, start_ms) < 0)
+	{
+		close_reader(reader);
+		return -1;
+	}
+
+	std::promise<int> promise;
+	m_event_result = promise.get_future().share();
+	m_event_url = prefix + get_date_time() + ".mp4";
+	m_event = start_export(reader, start_ms * 1000, end_time, m_event_url, options, std::move(promise));
+	return 1;
+}
+
+// get the result of the last event started once it is finished
+int CircularBuffer::get_event_result()
+{
+	std::lock_guard<std::mutex> lock(m_export_mutex);
+	if (!m_event_result.valid() || m_event_result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+	{
+		return 0;
+	}
+	return m_event_result.get();
+}
+
+// get the url of the file of the last event started
+std::string CircularBuffer::get_event_url()
+{
+	std::lock_guard<std::mutex> lock(m_export_mutex);
+	return m_event_url;
+}
+
+// start the worker thread of the export, the finished exports are cleaned up first, called with the exports locked
+ExportTask* CircularBuffer::start_export(int reader, int64_t start_time, int64_t end_time, std::string url,
+	std::vector<std::pair<std::string, std::string> > options, std::promise<int> promise)
+{
+	for (size_t i = 0; i < m_exports.size();)
+	{
+		if (m_exports[i]->done)
+		{
+			if (m_exports[i] == m_event)
+			{
+				m_event = NULL;
+			}
+			m_exports[i]->thread.join();
+			delete m_exports[i];
+			m_exports.erase(m_exports.begin() + i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	ExportTask* task = new ExportTask();
+	task->done = false;
+	task->end_time = end_time;
+	m_exports.push_back(task);
+	task->thread = std::thread([this, task, reader, start_time, url, options](std::promise<int> promise)
+	{
+		promise.set_value(export_packets(reader, start_time, task, url, options));
+		task->done = true;
+	}, std::move(promise));
+	return task;
+}
+
+// stop the exports running and wait for their worker threads
+void CircularBuffer::stop_exports()
+{
+	std::lock_guard<std::mutex> lock(m_export_mutex);
+	m_export_stop = true;
+	for (ExportTask* task : m_exports)
+	{
+		task->thread.join();
+		delete task;
+	}
+	m_exports.clear();
+	m_event = NULL;
+	m_export_stop = false;
+}
+
+// the export worker, pin the packets the reader can reach up to the end time while muxing the pinned ones in order
+// The reader is drained into the pinned queue every EXPORT_BATCH packets muxed, so it never falls behind the tail
+// while the disk is slow. The recording is opened at the first packet, no file is left when there is nothing to export.
+// When the start time is newer than the newest packet, the reader starts at the newest keyframe, so the pinned packets are
+// dropped at every keyframe up to the start time, and the muxing only begins once a packet at the start time is pinned.
+int CircularBuffer::export_packets(int reader, int64_t start_time, ExportTask* task, std::string url,
+	std::vector<std::pair<std::string, std::string> > options)
+{
+	std::deque<AVPacket> pinned;
+	AVPacket batch[EXPORT_BATCH];
+	memset(batch, 0, sizeof(batch));
+	VideoRecorder* recorder = NULL;
+	int64_t written = 0;
+	int64_t last_packet = av_gettime_relative();
+	bool started = false;
+	bool complete = false;
+	int err = 0;
+
+	// complete the export unless the end time has been moved past the time meanwhile
+	auto reach_end = [&](int64_t time)
+	{
+		int64_t end_time = task->end_time.load(std::memory_order_acquire);
+		while (end_time >= 0 && time > end_time)
+		{
+			if (task->end_time.compare_exchange_weak(end_time, -1, std::memory_order_acq_rel))
+			{
+				end_time = -1;
+			}
+		}
+		return end_time < 0;
+	};
+
+	// keep the packets up to the end time, the first packet after it completes the export
+	auto pin = [&](AVPacket* pkt)
+	{
+		BufferStream* bs = &m_streams[pkt->stream_index];
+		int64_t time = av_rescale_q(pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts, bs->time_base, AVRational{ 1, 1000000 });
+		if (complete || reach_end(time))
+		{
+			complete = true;
+			av_packet_unref(pkt);
+			return;
+		}
+		if (!started && time <= start_time && pkt->stream_index == m_key_stream && (pkt->flags & AV_PKT_FLAG_KEY))
+		{
+			for (AVPacket& p : pinned)
+			{
+				av_packet_unref(&p);
+			}
+			pinned.clear();
+		}
+		started = started || time >= start_time;
+		pinned.push_back(*pkt);
+		memset(pkt, 0, sizeof(AVPacket));
+	};
+
+	while (!err)
+	{
+		if (m_export_stop)
+		{
+			err = -5;
+			break;
+		}
+
+		// pin all the packets the reader can reach
+		while (!complete)
+		{
+			int n = peek_packets(batch, EXPORT_BATCH, reader);
+			for (int i = 0; i < n; i++)
+			{
+				pin(&batch[i]);
+			}
+			if (n > 0)
+			{
+				last_packet = av_gettime_relative();
+			}
+			if (n < EXPORT_BATCH)
+			{
+				break;
+			}
+		}
+
+		// wait for the live packets when everything pinned is written, or the start time is not reached yet
+		if (pinned.empty() || (!started && !complete))
+		{
+			if (complete)
+			{
+				break;
+			}
+
+			int ret = wait_packet(&batch[0], reader, 100);
+			if (ret > 0)
+			{
+				pin(&batch[0]);
+				last_packet = av_gettime_relative();
+			}
+			else if (ret < 0)
+			{
+				err = -5;
+			}
+			else if (av_gettime_relative() - last_packet > EXPORT_IDLE_TIMEOUT)
+			{
+				complete = reach_end(INT64_MAX);
+			}
+			continue;
+		}
+
+		// open the recording with the streams of the buffer, in the same order so the stream index of the packets is kept
+		if (!recorder)
+		{
+			recorder = new VideoRecorder();
+			for (int i = 0; i < m_nb_streams; i++)
+			{
+				recorder->add_stream(m_streams[i].st);
+			}
+			for (auto& option : options)
+			{
+				recorder->set_options(option.first, option.second);
+			}
+			if (recorder->open(url) < 0)
+			{
+				err = -3;
+				break;
+			}
+		}
+
+		// mux a run of the pinned packets
+		for (int i = 0; i < EXPORT_BATCH && !pinned.empty(); i++)
+		{
+			AVPacket pkt = pinned.front();
+			pinned.pop_front();
+			if (recorder->record(&pkt) < 0)
+			{
+				av_packet_unref(&pkt);
+				err = -4;
+				break;
+			}
+			written++;
+		}
+	}
+
+	// an event cannot be extended once its worker has given up
+	task->end_time.store(-1, std::memory_order_release);
+	for (AVPacket& pkt : pinned)
+	{
+		av_packet_unref(&pkt);
+	}
+	close_reader(reader);
+
+	if (recorder)
+	{
+		if (recorder->close() < 0 && !err)
+		{
+			err = -4;
+		}
+		delete recorder;
+		if (err < 0)
+		{
+			remove(url.c_str());
+		}
+	}
+
+	if (!err && !written)
+	{
+		err = -1;
+	}
+	return err < 0 ? err : static_cast<int>(std::min<int64_t>(written, INT32_MAX));
+}
+
+// the writer of the shared memory is alive while the buffer is opened and its process is running, a crashed writer never clears the state
+static bool shared_writer_alive(const SharedHeader* header)
+{
+	if (header->magic != SHARED_MAGIC || !header->state.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(header->writer_pid));
+	DWORD code = 0;
+	bool alive = process && GetExitCodeProcess(process, &code) && code == STILL_ACTIVE;
+	if (process)
+		CloseHandle(process);
+	return alive;
+#else
+	return kill(static_cast<pid_t>(header->writer_pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+// create the shared memory sized for the slots and the arena, then move the arena into it
+// A shared memory of the same name is only taken over when its writer is gone, such as one left by a crash.
+// return 0 on success, -2 when another writer running has it, -1 when the shared memory cannot be used
+int CircularBuffer::open_shared()
+{
+	int64_t slots_offset = (sizeof(SharedHeader) + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+	int64_t arena_offset = (slots_offset + static_cast<int64_t>(m_capacity * sizeof(SharedSlot)) + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+	int64_t size = arena_offset + m_arena_size;
+	if (!m_arena_size)
+	{
+		m_err = -1;
+		m_message = "The shared memory needs the maximum size of the circular buffer";
+		return m_err;
+	}
+
+	uint8_t* map = NULL;
+	bool existing = false;
+#ifdef _WIN32
+	// a mapping of the same name lives on while its writer or any reader has it open, it cannot be removed. It is reused
+	// when its writer is gone, the map fails when it is too small. The readers still attached see the generation change.
+	m_shared_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xffffffff), m_shared_name.c_str());
+	existing = m_shared_mapping && GetLastError() == ERROR_ALREADY_EXISTS;
+	if (m_shared_mapping)
+	{
+		map = static_cast<uint8_t*>(MapViewOfFile(m_shared_mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(size)));
+	}
+	if (map && existing && shared_writer_alive(reinterpret_cast<SharedHeader*>(map)))
+	{
+		UnmapViewOfFile(map);
+		CloseHandle(m_shared_mapping);
+		m_shared_mapping = NULL;
+		m_err = -2;
+		m_message = "The shared memory " + m_shared_name + " is used by another writer running";
+		return m_err;
+	}
+#else
+	// the shared memory left by a writer that is gone is removed, its readers keep the old one until they attach again
+	int fd = shm_open(m_shared_name.c_str(), O_RDONLY, 0);
+	if (fd >= 0)
+	{
+		struct stat st;
+		bool alive = false;
+		if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(SharedHeader)))
+		{
+			void* addr = mmap(NULL, sizeof(SharedHeader), PROT_READ, MAP_SHARED, fd, 0);
+			if (addr != MAP_FAILED)
+			{
+				alive = shared_writer_alive(static_cast<SharedHeader*>(addr));
+				munmap(addr, sizeof(SharedHeader));
+			}
+		}
+		::close(fd);
+		if (alive)
+		{
+			m_err = -2;
+			m_message = "The shared memory " + m_shared_name + " is used by another writer running";
+			return m_err;
+		}
+		shm_unlink(m_shared_name.c_str());
+	}
+	m_shared_fd = shm_open(m_shared_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (m_shared_fd >= 0 && ftruncate(m_shared_fd, size) == 0)
+	{
+		void* addr = mmap(NULL, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, m_shared_fd, 0);
+		map = addr == MAP_FAILED ? NULL : static_cast<uint8_t*>(addr);
+	}
+#endif
+	m_shared_path = m_shared_name;
+	m_shared_size = size;
+	if (!map)
+	{
+		close_shared();
+		m_err = -1;
+		m_message = "Cannot map the shared memory " + m_shared_name;
+		return m_err;
+	}
+
+	// a new shared memory is zeroed, so every slot starts empty, the slots of one taken over are emptied
+	// the generation of one taken over goes on from the old one, so that its readers attach again
+	m_shared_map = map;
+	m_shared = reinterpret_cast<SharedHeader*>(map);
+	m_shared_slots = reinterpret_cast<SharedSlot*>(map + slots_offset);
+	uint64_t generation = 1;
+	if (existing)
+	{
+		generation = (m_shared->generation.load(std::memory_order_relaxed) | 1) + 1;
+		m_shared->generation.store(generation - 1, std::memory_order_relaxed);
+		for (uint64_t i = 0; i < m_capacity; i++)
+		{
+			m_shared_slots[i].seq.store(0, std::memory_order_relaxed);
+		}
+	}
+	m_shared->magic = SHARED_MAGIC;
+	m_shared->version = SHARED_VERSION;
+	m_shared->generation.store(generation, std::memory_order_relaxed);
+#ifdef _WIN32
+	m_shared->writer_pid = GetCurrentProcessId();
+#else
+	m_shared->writer_pid = getpid();
+#endif
+	m_shared->size = size;
+	m_shared->capacity = m_capacity;
+	m_shared->slots_offset = slots_offset;
+	m_shared->arena_offset = arena_offset;
+	m_shared->arena_size = m_arena_size;
+	m_shared->head.store(m_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m_shared->tail.store(m_tail.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m_shared->state.store(1, std::memory_order_relaxed);
+	share_streams();
+
+	// the arena allocated at open is swapped for the one in the shared memory, the mapping is then held by the arena storage
+	release_arena(m_arena_storage);
+	m_arena_storage = new ArenaStorage();
+	m_arena_storage->shared = map;
+	m_arena_storage->shared_size = static_cast<size_t>(m_shared_size);
+	m_arena = map + arena_offset;
+	return 0;
+}
+
+// mark the shared memory closed, the readers still attached keep their mapping until they detach
+void CircularBuffer::close_shared()
+{
+	if (m_shared)
+	{
+		m_shared->state.store(0, std::memory_order_release);
+	}
+
+	// the mapping holding the arena is unmapped once the readers in this process have released its packets
+	if (m_shared_map && m_arena_storage && m_arena_storage->shared == m_shared_map)
+	{
+		release_arena(m_arena_storage);
+		m_arena_storage = NULL;
+		m_arena = NULL;
+		m_shared_map = NULL;
+	}
+
+#ifdef _WIN32
+	if (m_shared_map)
+		UnmapViewOfFile(m_shared_map);
+	if (m_shared_mapping)
+		CloseHandle(m_shared_mapping);
+	m_shared_mapping = NULL;
+#else
+	if (m_shared_map)
+		munmap(m_shared_map, static_cast<size_t>(m_shared_size));
+	if (m_shared_fd >= 0)
+	{
+		::close(m_shared_fd);
+		shm_unlink(m_shared_path.c_str());
+	}
+	m_shared_fd = -1;
+#endif
+	m_shared_map = NULL;
+	m_shared = NULL;
+	m_shared_slots = NULL;
+}
+
+// the header is changed under an odd generation, a reader copying the streams meanwhile tries again
+void CircularBuffer::share_streams()
+{
+	if (!m_shared)
+	{
+		return;
+	}
+
+	uint64_t generation = m_shared->generation.load(std::memory_order_relaxed) | 1;
+	m_shared->generation.store(generation, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		AVCodecParameters* codecpar = m_streams[i].codecpar;
+		SharedStream* ss = &m_shared->streams[i];
+		ss->codec_type = codecpar->codec_type;
+		ss->codec_id = codecpar->codec_id;
+		ss->format = codecpar->format;
+		ss->width = codecpar->width;
+		ss->height = codecpar->height;
+		ss->sample_rate = codecpar->sample_rate;
+		ss->channels = codecpar->channels;
+		ss->bit_rate = codecpar->bit_rate;
+		ss->time_base = m_streams[i].time_base;
+
+		// an extradata too large to be shared is left out, the readers get it in band with the keyframes then
+		ss->extradata_size = codecpar->extradata && codecpar->extradata_size <= SHARED_EXTRADATA ? codecpar->extradata_size : 0;
+		if (ss->extradata_size)
+		{
+			memcpy(ss->extradata, codecpar->extradata, ss->extradata_size);
+		}
+	}
+	m_shared->nb_streams = m_nb_streams;
+	m_shared->key_stream = m_key_stream;
+
+	m_shared->generation.store(generation + 1, std::memory_order_release);
+}
+
+// the shared slot is rewritten like a seqlock, marked busy first, then published with the sequence number
+void CircularBuffer::share_packet(PacketSlot* slot, uint64_t seq)
+{
+	SharedSlot* shared = &m_shared_slots[seq & m_mask];
+	shared->seq.store(SLOT_BUSY, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	// the payloads kept in the heap because the arena was held are not in the shared memory
+	shared->offset = !slot->pkt.buf && slot->pkt.data ? slot->pkt.data - m_arena : -1;
+	shared->size = slot->pkt.size;
+	shared->flags = slot->pkt.flags;
+	shared->stream_index = slot->pkt.stream_index;
+	shared->pts = slot->pkt.pts;
+	shared->dts = slot->pkt.dts;
+	shared->duration = slot->pkt.duration;
+	shared->time = slot->time;
+
+	shared->seq.store(seq + 1, std::memory_order_release);
+	m_shared->head.store(seq + 1, std::memory_order_release);
+}
+
+// get the metrics of the circular buffer, can be called by any thread at any time
+// the counters are read one by one, they may be a few packets apart while the writer is pushing
+BufferMetrics CircularBuffer::get_metrics()
+{
+	BufferMetrics metrics;
+	memset(&metrics, 0, sizeof(metrics));
+	metrics.packets = m_TotalPkts.load(std::memory_order_relaxed);
+	metrics.bytes = m_size.load(std::memory_order_relaxed);
+	metrics.pushed = m_pushed.load(std::memory_order_relaxed);
+	metrics.pushed_bytes = m_pushed_bytes.load(std::memory_order_relaxed);
+	metrics.evicted_time = m_evicted_time.load(std::memory_order_relaxed);
+	metrics.evicted_size = m_evicted_size.load(std::memory_order_relaxed);
+	metrics.evicted_slots = m_evicted_slots.load(std::memory_order_relaxed);
+	metrics.thinned = m_thinned.load(std::memory_order_relaxed);
+	for (int i = 0; i < MAX_READERS; i++)
+	{
+		if (!m_readers[i].used.load(std::memory_order_relaxed))
+		{
+			continue;
+		}
+		metrics.reader[metrics.readers] = i;
+		metrics.reader_lag[metrics.readers] = std::max(get_reader_lag(i), 0);
+		metrics.reader_lag_time[metrics.readers] = std::max<int64_t>(get_reader_lag_time(i), 0);
+		metrics.reader_lost[metrics.readers] = std::max<int64_t>(get_reader_lost(i), 0);
+		metrics.readers++;
+	}
+	m_push_latency.get_snapshot(&metrics.push_latency);
+	return metrics;
+}
+
+// get the number of packets in the spill file
+int CircularBuffer::get_spilled_packets()
+{
+	uint64_t tail = m_disk_tail.load(std::memory_order_acquire);
+	uint64_t head = m_disk_head.load(std::memory_order_acquire);
+	return m_spill_map && tail < head ? static_cast<int>(head - tail) : 0;
+}
+
+// get the number of packets evicted from the memory before they could be spilled
+int64_t CircularBuffer::get_spill_lost()
+{
+	return m_spill_map ? m_readers[m_spill_reader].lost.load(std::memory_order_relaxed) : 0;
+}
+
+Histogram::Histogram()
+{
+	reset();
+}
+
+// add a value into the histogram
+void Histogram::add(int64_t value)
+{
+	int bucket = 0;
+	for (int64_t v = value; v > 0 && bucket < HISTOGRAM_BUCKETS - 1; v >>= 1)
+	{
+		bucket++;
+	}
+
+	m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(value, std::memory_order_relaxed);
+	if (value > m_max.load(std::memory_order_relaxed))
+	{
+		m_max.store(value, std::memory_order_relaxed);
+	}
+}
+
+// clear all the values
+void Histogram::reset()
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+	m_count.store(0, std::memory_order_relaxed);
+	m_sum.store(0, std::memory_order_relaxed);
+	m_max.store(0, std::memory_order_relaxed);
+}
+
+// get the number of values added
+int64_t Histogram::get_count()
+{
+	return m_count.load(std::memory_order_relaxed);
+}
+
+// get the sum of the values added
+int64_t Histogram::get_sum()
+{
+	return m_sum.load(std::memory_order_relaxed);
+}
+
+// get the largest value added
+int64_t Histogram::get_max()
+{
+	return m_max.load(std::memory_order_relaxed);
+}
+
+// get the value below which the percent of the values fall, rounded up to the bucket bound
+// 0 when there is no value
+int64_t Histogram::get_percentile(double percent)
+{
+	int64_t count = get_count();
+	int64_t rank = static_cast<int64_t>(count * percent / 100);
+	int64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS && count; i++)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen > rank)
+		{
+			return std::min<int64_t>(i ? (static_cast<int64_t>(1) << i) - 1 : 0, get_max());
+		}
+	}
+
+	return get_max();
+}
+
+// get the number of values in the bucket
+int64_t Histogram::get_bucket(int bucket)
+{
+	return bucket >= 0 && bucket < HISTOGRAM_BUCKETS ? m_buckets[bucket].load(std::memory_order_relaxed) : 0;
+}
+
+// copy the values out, the copy is not atomic as a whole while values are being added
+void Histogram::get_snapshot(HistogramSnapshot* snapshot)
+{
+	snapshot->count = get_count();
+	snapshot->sum = get_sum();
+	snapshot->max = get_max();
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		snapshot->buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+SharedReader::SharedReader()
+{
+	m_map = NULL;
+	m_size = 0;
+	m_header = NULL;
+	m_slots = NULL;
+	m_arena = NULL;
+	m_mask = 0;
+	m_generation = 0;
+	m_seq = 0;
+	m_view_seq = UINT64_MAX;
+	m_lost = 0;
+	m_nb_streams = 0;
+	for (int i = 0; i < MAX_STREAMS; i++)
+	{
+		m_codecpar[i] = avcodec_parameters_alloc();
+		m_time_base[i] = AVRational{ 1, 2 };
+	}
+#ifdef _WIN32
+	m_mapping = NULL;
+#else
+	m_fd = -1;
+#endif
+
+	m_err = 0;
+	m_message = "";
+}
+
+SharedReader::~SharedReader()
+{
+	close();
+	for (int i = 0; i < MAX_STREAMS; i++)
+	{
+		avcodec_parameters_free(&m_codecpar[i]);
+	}
+}
+
+// map the shared memory read only, then copy the streams out of the header while its generation stays the same
+// return 0 on success, negative when the shared memory cannot be attached
+int SharedReader::open(std::string name)
+{
+	close();
+	m_err = 0;
+	m_message = "";
+
+#ifdef _WIN32
+	m_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+	if (m_mapping)
+	{
+		m_map = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		MEMORY_BASIC_INFORMATION info;
+		m_size = m_map && VirtualQuery(m_map, &info, sizeof(info)) ? static_cast<int64_t>(info.RegionSize) : 0;
+	}
+#else
+	m_fd = shm_open(name.c_str(), O_RDONLY, 0);
+	struct stat st;
+	if (m_fd >= 0 && fstat(m_fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(SharedHeader)))
+	{
+		void* addr = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, m_fd, 0);
+		m_map = addr == MAP_FAILED ? NULL : static_cast<uint8_t*>(addr);
+		m_size = st.st_size;
+	}
+#endif
+	m_header = reinterpret_cast<const SharedHeader*>(m_map);
+	if (!m_map || m_header->magic != SHARED_MAGIC || m_header->version != SHARED_VERSION || m_header->size > m_size)
+	{
+		close();
+		m_err = -1;
+		m_message = "Cannot attach the shared memory " + name;
+		return m_err;
+	}
+
+	m_slots = reinterpret_cast<const SharedSlot*>(m_map + m_header->slots_offset);
+	m_arena = m_map + m_header->arena_offset;
+	m_mask = m_header->capacity - 1;
+
+	// the writer may be changing the streams, try again for a while
+	for (int tries = 0; tries < 100; tries++)
+	{
+		uint64_t generation = m_header->generation.load(std::memory_order_acquire);
+		if (!(generation & 1))
+		{
+			m_nb_streams = std::min(m_header->nb_streams, MAX_STREAMS);
+			for (int i = 0; i < m_nb_streams; i++)
+			{
+				const SharedStream* ss = &m_header->streams[i];
+				AVCodecParameters* codecpar = m_codecpar[i];
+				av_freep(&codecpar->extradata);
+				codecpar->codec_type = static_cast<enum AVMediaType>(ss->codec_type);
+				codecpar->codec_id = static_cast<enum AVCodecID>(ss->codec_id);
+				codecpar->format = ss->format;
+				codecpar->width = ss->width;
+				codecpar->height = ss->height;
+				codecpar->sample_rate = ss->sample_rate;
+				codecpar->channels = ss->channels;
+				codecpar->bit_rate = ss->bit_rate;
+				m_time_base[i] = ss->time_base;
+				int size = std::min(std::max(ss->extradata_size, 0), SHARED_EXTRADATA);
+				codecpar->extradata_size = 0;
+				if (size)
+				{
+					codecpar->extradata = (uint8_t*)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+					memcpy(codecpar->extradata, ss->extradata, size);
+					codecpar->extradata_size = size;
+				}
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_header->generation.load(std::memory_order_relaxed) == generation)
+			{
+				m_generation = generation;
+				return reset();
+			}
+		}
+		av_usleep(1000);
+	}
+
+	close();
+	m_err = -2;
+	m_message = "The streams of the shared memory " + name + " keep changing";
+	return m_err;
+}
+
+// unmap the shared memory, nothing is left behind in it
+void SharedReader::close()
+{
+#ifdef _WIN32
+	if (m_map)
+		UnmapViewOfFile(m_map);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	m_mapping = NULL;
+#else
+	if (m_map)
+		munmap(m_map, static_cast<size_t>(m_size));
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+#endif
+	m_map = NULL;
+	m_size = 0;
+	m_header = NULL;
+	m_slots = NULL;
+	m_arena = NULL;
+	m_nb_streams = 0;
+	m_view_seq = UINT64_MAX;
+}
+
+// take views of the packets from the cursor of the reader
+// The shared slot is checked before and after copying its fields, then the view points at the payload in the arena.
+// The packets whose payload was kept in the heap of the writer are not shared, they are counted as lost.
+int SharedReader::peek_views(PacketView* views, int count)
+{
+	if (!m_header)
+	{
+		m_err = -1;
+		m_message = "The reader is not attached";
+		return m_err;
+	}
+	if (m_header->generation.load(std::memory_order_acquire) != m_generation)
+	{
+		m_err = -2;
+		m_message = "The circular buffer has been opened again or its streams have changed";
+		return m_err;
+	}
+
+	uint64_t head = m_header->head.load(std::memory_order_acquire);
+	uint64_t tail = m_header->tail.load(std::memory_order_acquire);
+	int n = 0;
+	while (n < count && m_seq < head)
+	{
+		if (m_seq < tail)
+		{
+			m_lost += tail - m_seq;
+			m_seq = tail;
+			continue;
+		}
+
+		const SharedSlot* slot = &m_slots[m_seq & m_mask];
+		uint64_t slot_seq = slot->seq.load(std::memory_order_acquire);
+		if (slot_seq != m_seq + 1)
+		{
+			// the slot is being rewritten, the tail has moved past the packet or is about to
+			tail = m_header->tail.load(std::memory_order_acquire);
+			if (m_seq >= tail)
+				break;
+			continue;
+		}
+
+		PacketView view;
+		int64_t offset = slot->offset;
+		view.size = slot->size;
+		view.pts = slot->pts;
+		view.dts = slot->dts;
+		view.duration = slot->duration;
+		view.flags = slot->flags;
+		view.stream_index = slot->stream_index;
+		view.time = slot->time;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->seq.load(std::memory_order_relaxed) != slot_seq)
+		{
+			continue;
+		}
+
+		if (offset < 0 || view.size < 0 || offset + view.size > m_header->arena_size)
+		{
+			m_lost++;
+			m_seq++;
+			continue;
+		}
+		view.data = m_arena + offset;
+		views[n++] = view;
+		if (m_view_seq == UINT64_MAX)
+		{
+			m_view_seq = m_seq;
+		}
+		m_seq++;
+	}
+
+	return n;
+}
+
+// the room of the views is only reused by the writer after the tail has passed them
+int SharedReader::release_views()
+{
+	if (!m_header || m_view_seq == UINT64_MAX)
+	{
+		return 0;
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t tail = m_header->tail.load(std::memory_order_relaxed);
+	uint64_t first = m_view_seq;
+	m_view_seq = UINT64_MAX;
+	if (tail > first)
+	{
+		m_lost += std::min(tail, m_seq) - first;
+		return -1;
+	}
+
+	return 0;
+}
+
+// read a copy of the next packet, a packet overwritten while it is copied is dropped and the next one is read
+int SharedReader::peek_packet(AVPacket* pkt)
+{
+	PacketView view;
+	while (true)
+	{
+		int ret = peek_views(&view, 1);
+		if (ret <= 0)
+		{
+			return ret;
+		}
+
+		ret = av_new_packet(pkt, view.size);
+		if (ret < 0)
+		{
+			release_views();
+			m_err = ret;
+			m_message.assign(av_err(ret));
+			return ret;
+		}
+		memcpy(pkt->data, view.data, view.size);
+		pkt->pts = view.pts;
+		pkt->dts = view.dts;
+		pkt->duration = view.duration;
+		pkt->flags = view.flags;
+		pkt->stream_index = view.stream_index;
+		if (release_views() == 0)
+		{
+			return 1;
+		}
+		av_packet_unref(pkt);
+	}
+}
+
+// move to the oldest keyframe of the key stream, or the oldest packet when there is none
+int SharedReader::reset()
+{
+	if (!m_header)
+	{
+		m_err = -1;
+		m_message = "The reader is not attached";
+		return m_err;
+	}
+
+	uint64_t head = m_header->head.load(std::memory_order_acquire);
+	uint64_t tail = m_header->tail.load(std::memory_order_acquire);
+	int key_stream = m_header->key_stream;
+	m_view_seq = UINT64_MAX;
+	m_seq = tail;
+	for (uint64_t seq = tail; seq < head; seq++)
+	{
+		const SharedSlot* slot = &m_slots[seq & m_mask];
+		uint64_t slot_seq = slot->seq.load(std::memory_order_acquire);
+		bool key = slot->stream_index == key_stream && (slot->flags & AV_PKT_FLAG_KEY);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot_seq == seq + 1 && slot->seq.load(std::memory_order_relaxed) == slot_seq && key)
+		{
+			m_seq = seq;
+			break;
+		}
+	}
+
+	m_err = 0;
+	m_message = "";
+	return 0;
+}
+
+int SharedReader::get_stream_count()
+{
+	return m_nb_streams;
+}
+
+AVCodecParameters* SharedReader::get_stream_codecpar(int stream_index)
+{
+	return stream_index >= 0 && stream_index < m_nb_streams ? m_codecpar[stream_index] : NULL;
+}
+
+AVRational SharedReader::get_time_base(int stream_index)
+{
+	return stream_index >= 0 && stream_index < m_nb_streams ? m_time_base[stream_index] : AVRational{ 1, 2 };
+}
+
+int64_t SharedReader::get_lost()
+{
+	return m_lost;
+}
+
+// the writer is alive while the buffer is opened and its process is running, a crashed writer never clears the state
+bool SharedReader::is_writer_alive()
+{
+	return m_header && shared_writer_alive(m_header);
+}
+
+std::string SharedReader::get_error_message()
+{
+	return m_message;
+}
+
+Rescaler::Rescaler()
+{
+	m_path = RESCALE_COPY;
+	m_mul = 1;
+	m_div = 1;
+	m_limit = INT64_MAX;
+}
+
+void Rescaler::set(AVRational from, AVRational to)
+{
+	int64_t mul = static_cast<int64_t>(from.num) * to.den;
+	int64_t div = static_cast<int64_t>(from.den) * to.num;
+	int64_t gcd = av_gcd(mul, div);
+	if (gcd > 0)
+	{
+		mul /= gcd;
+		div /= gcd;
+	}
+	if (div < 0)
+	{
+		mul = -mul;
+		div = -div;
+	}
+
+	m_mul = mul;
+	m_div = div;
+	m_limit = mul > 0 && div > 0 ? (INT64_MAX - div / 2) / mul : -1; // an invalid time base is left to av_rescale_rnd
+	if (mul == 1 && div == 1)
+		m_path = RESCALE_COPY;
+	else if (mul == 1 && div == 90)
+		m_path = RESCALE_90K_TO_MS;
+	else if (mul == 90 && div == 1)
+		m_path = RESCALE_MS_TO_90K;
+	else
+		m_path = RESCALE_GENERIC;
+}
+
+int64_t Rescaler::rescale(int64_t ts)
+{
+	if (ts == AV_NOPTS_VALUE)
+	{
+		return ts;
+	}
+
+	switch (m_path)
+	{
+	case RESCALE_COPY:
+		return ts;
+	case RESCALE_90K_TO_MS:
+		return rescale_fixed<1, 90>(ts);
+	case RESCALE_MS_TO_90K:
+		return rescale_fixed<90, 1>(ts);
+	default:
+		return rescale_generic(ts);
+	}
+}
+
+// the path is picked once for the three fields
+void Rescaler::rescale_packet(AVPacket* pkt)
+{
+	switch (m_path)
+	{
+	case RESCALE_COPY:
+		return;
+	case RESCALE_90K_TO_MS:
+		rescale_fields<1, 90>(pkt);
+		return;
+	case RESCALE_MS_TO_90K:
+		rescale_fields<90, 1>(pkt);
+		return;
+	default:
+		pkt->pts = rescale(pkt->pts);
+		pkt->dts = rescale(pkt->dts);
+		if (pkt->duration)
+		{
+			pkt->duration = rescale_generic(pkt->duration);
+		}
+	}
+}
+
+int Rescaler::get_path()
+{
+	return m_path;
+}
+
+template <int64_t MUL, int64_t DIV>
+void Rescaler::rescale_fields(AVPacket* pkt)
+{
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pkt->pts = rescale_fixed<MUL, DIV>(pkt->pts);
+	if (pkt->dts != AV_NOPTS_VALUE)
+		pkt->dts = rescale_fixed<MUL, DIV>(pkt->dts);
+	if (pkt->duration)
+		pkt->duration = rescale_fixed<MUL, DIV>(pkt->duration);
+}
+
+template <int64_t MUL, int64_t DIV>
+int64_t Rescaler::rescale_fixed(int64_t ts)
+{
+	const int64_t limit = (INT64_MAX - DIV / 2) / MUL;
+	if (ts >= 0 && ts <= limit)
+	{
+		return (ts * MUL + DIV / 2) / DIV;
+	}
+	if (ts < 0 && ts >= -limit)
+	{
+		return -((-ts * MUL + DIV / 2) / DIV);
+	}
+	return av_rescale_rnd(ts, MUL, DIV, AV_ROUND_NEAR_INF);
+}
+
+// the halves are rounded away from zero, so a negative time stamp is rounded as its magnitude
+int64_t Rescaler::rescale_generic(int64_t ts)
+{
+	if (ts >= 0 && ts <= m_limit)
+	{
+		return (ts * m_mul + m_div / 2) / m_div;
+	}
+	if (ts < 0 && ts >= -m_limit)
+	{
+		return -((-ts * m_mul + m_div / 2) / m_div);
+	}
+	return av_rescale_rnd(ts, m_mul, m_div, AV_ROUND_NEAR_INF);
+}
+
+RecordingFile::RecordingFile()
+{
+#ifdef _WIN32
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	m_fd = -1;
+#endif
+	m_pos = 0;
+	m_size = 0;
+	m_err = 0;
+	m_writes = NULL;
+}
+
+RecordingFile::~RecordingFile()
+{
+#ifdef _WIN32
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+#else
+	if (m_fd >= 0)
+		::close(m_fd);
+#endif
+}
+
+int RecordingFile::open(AVIOContext** pb, std::string url, int buffer_size, int64_t prealloc, std::atomic<int64_t>* writes)
+{
+	*pb = NULL;
+	if (!url.compare(0, 5, "file:"))
+	{
+		url.erase(0, 5);
+	}
+	buffer_size = std::max((buffer_size + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN, FILE_ALIGN);
+
+	// the preallocation is only a hint, the file still grows by the writes when the filesystem cannot reserve the space
+	RecordingFile* file = new RecordingFile();
+	file->m_writes = writes;
+#ifdef _WIN32
+	// shared for deleting too, so that a chunk opened ahead of time can be renamed when it is rotated in
+	file->m_file = CreateFileA(url.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file->m_file == INVALID_HANDLE_VALUE)
+	{
+		delete file;
+		return AVERROR(EACCES);
+	}
+	if (prealloc > 0)
+	{
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = prealloc;
+		SetFileInformationByHandle(file->m_file, FileAllocationInfo, &info, sizeof(info));
+	}
+#else
+	file->m_fd = ::open(url.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->m_fd < 0)
+	{
+		int err = AVERROR(errno);
+		delete file;
+		return err;
+	}
+#ifdef __linux__
+	// the size is kept, so a reader of the growing file sees no zeros past the data
+	if (prealloc > 0)
+	{
+		fallocate(file->m_fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+	}
+#endif
+#endif
+
+	// the buffer belongs to the context, which may replace it, it is freed from the context when closed
+	uint8_t* buffer = static_cast<uint8_t*>(av_malloc(buffer_size));
+	*pb = buffer ? avio_alloc_context(buffer, buffer_size, 1, file, NULL, write_packet, seek) : NULL;
+	if (!*pb)
+	{
+		av_free(buffer);
+		delete file;
+		return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+
+int RecordingFile::closep(AVIOContext** pb, FileSyncer* syncer, int64_t mark)
+{
+	if (!*pb || (*pb)->write_packet != write_packet)
+	{
+		return avio_closep(pb);
+	}
+
+	avio_flush(*pb);
+	RecordingFile* file = static_cast<RecordingFile*>((*pb)->opaque);
+	int err = (*pb)->error < 0 ? (*pb)->error : file->m_err;
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+
+	// the space preallocated past the data is given back
+#ifdef _WIN32
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = file->m_size;
+	if (!SetFileInformationByHandle(file->m_file, FileEndOfFileInfo, &info, sizeof(info)) && !err)
+	{
+		err = AVERROR(EIO);
+	}
+#else
+	if (ftruncate(file->m_fd, file->m_size) && !err)
+	{
+		err = AVERROR(errno);
+	}
+#endif
+	if (syncer && !err)
+	{
+		syncer->request(file, mark);
+	}
+	delete file;
+	return err;
+}
+
+int RecordingFile::sync(AVIOContext* pb, FileSyncer* syncer, int64_t mark)
+{
+	if (!pb || pb->write_packet != write_packet)
+	{
+		return AVERROR(ENOSYS);
+	}
+
+	avio_flush(pb);
+	RecordingFile* file = static_cast<RecordingFile*>(pb->opaque);
+	if (pb->error < 0 || file->m_err)
+	{
+		return pb->error < 0 ? pb->error : file->m_err;
+	}
+	return syncer->request(file, mark);
+}
+
+// a url with any other scheme before a colon, like pipe:1, is not a file. A single letter is the drive of a path on Windows
+bool RecordingFile::is_local(std::string url)
+{
+	if (!url.compare(0, 5, "file:"))
+	{
+		return true;
+	}
+	size_t colon = url.find(':');
+	if (colon == std::string::npos || colon < 2 || !isalpha(static_cast<unsigned char>(url[0])))
+	{
+		return true;
+	}
+	for (size_t i = 1; i < colon; i++)
+	{
+		char c = url[i];
+		if (!isalnum(static_cast<unsigned char>(c)) && c != '+' && c != '-' && c != '.')
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+int RecordingFile::get_buffer_size(int64_t bitrate)
+{
+	int64_t size = (bitrate / 8 + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+	return static_cast<int>(std::min<int64_t>(std::max<int64_t>(size, FILE_MIN_BUFFER), FILE_MAX_BUFFER));
+}
+
+// an eighth more than the stream, for the container and the peaks of the bit rate
+int64_t RecordingFile::get_expected_size(int64_t bitrate, int seconds)
+{
+	int64_t size = bitrate / 8 * seconds;
+	return (size + size / 8 + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+}
+
+// a partial write is carried on at the new position, every call to the system is counted
+int RecordingFile::write_packet(void* opaque, uint8_t* buf, int size)
+{
+	RecordingFile* file = static_cast<RecordingFile*>(opaque);
+	if (file->m_err)
+	{
+		return file->m_err;
+	}
+
+	int done = 0;
+	while (done < size)
+	{
+		if (file->m_writes)
+		{
+			file->m_writes->fetch_add(1, std::memory_order_relaxed);
+		}
+#ifdef _WIN32
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = static_cast<DWORD>(file->m_pos & 0xffffffff);
+		overlapped.OffsetHigh = static_cast<DWORD>(file->m_pos >> 32);
+		DWORD written = 0;
+		int64_t n = WriteFile(file->m_file, buf + done, size - done, &written, &overlapped) ? written : 0;
+		int err = AVERROR(EIO);
+#else
+		int64_t n = pwrite(file->m_fd, buf + done, size - done, file->m_pos);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		int err = n < 0 ? AVERROR(errno) : AVERROR(EIO);
+#endif
+		if (n <= 0)
+		{
+			file->m_err = err;
+			return err;
+		}
+		done += static_cast<int>(n);
+		file->m_pos += n;
+	}
+	file->m_size = std::max(file->m_size, file->m_pos);
+	return size;
+}
+
+int64_t RecordingFile::seek(void* opaque, int64_t offset, int whence)
+{
+	RecordingFile* file = static_cast<RecordingFile*>(opaque);
+	switch (whence & ~AVSEEK_FORCE)
+	{
+	case AVSEEK_SIZE:
+		return file->m_size;
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += file->m_pos;
+		break;
+	case SEEK_END:
+		offset += file->m_size;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (offset < 0)
+	{
+		return AVERROR(EINVAL);
+	}
+	file->m_pos = offset;
+	return offset;
+}
+
+FileSyncer::FileSyncer()
+{
+	m_stop = false;
+	m_written = NULL;
+	m_synced = 0;
+	m_syncs = 0;
+	m_errors = 0;
+}
+
+FileSyncer::~FileSyncer()
+{
+	stop();
+}
+
+void FileSyncer::start(std::atomic<int64_t>* written)
+{
+	if (m_thread.joinable())
+	{
+		return;
+	}
+	m_written = written;
+	m_stop = false;
+	m_thread = std::thread(&FileSyncer::sync_files, this);
+}
+
+void FileSyncer::stop()
+{
+	if (!m_thread.joinable())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+int FileSyncer::request(RecordingFile* file, int64_t mark)
+{
+	if (!m_thread.joinable())
+	{
+		return -1;
+	}
+
+	SyncRequest request;
+	request.mark = mark;
+#ifdef _WIN32
+	if (!DuplicateHandle(GetCurrentProcess(), file->m_file, GetCurrentProcess(), &request.file, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		return AVERROR(EIO);
+	}
+#else
+	request.fd = dup(file->m_fd);
+	if (request.fd < 0)
+	{
+		return AVERROR(errno);
+	}
+#endif
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_requests.push_back(request);
+	}
+	m_cond.notify_one();
+	return 0;
+}
+
+int64_t FileSyncer::get_synced()
+{
+	return m_synced.load(std::memory_order_relaxed);
+}
+
+int64_t FileSyncer::get_syncs()
+{
+	return m_syncs.load(std::memory_order_relaxed);
+}
+
+int64_t FileSyncer::get_errors()
+{
+	return m_errors.load(std::memory_order_relaxed);
+}
+
+Histogram* FileSyncer::get_latency()
+{
+	return &m_latency;
+}
+
+Histogram* FileSyncer::get_risk()
+{
+	return &m_risk;
+}
+
+// the requests queued at stop are still synced, the data has been handed over already
+// only the data of the file is synced, its metadata is left to the system unless the size has changed
+void FileSyncer::sync_files()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+		if (m_requests.empty())
+		{
+			break;
+		}
+		SyncRequest request = m_requests.front();
+		m_requests.erase(m_requests.begin());
+		lock.unlock();
+
+		int64_t t0 = av_gettime_relative();
+#ifdef _WIN32
+		bool synced = FlushFileBuffers(request.file) != 0;
+		CloseHandle(request.file);
+#elif defined(__linux__)
+		bool synced = fdatasync(request.fd) == 0;
+		::close(request.fd);
+#else
+		bool synced = fsync(request.fd) == 0;
+		::close(request.fd);
+#endif
+		m_latency.add(av_gettime_relative() - t0);
+		if (synced)
+		{
+			m_risk.add(std::max<int64_t>(m_written->load(std::memory_order_relaxed) - m_synced.load(std::memory_order_relaxed), 0));
+			m_synced.store(std::max(m_synced.load(std::memory_order_relaxed), request.mark), std::memory_order_relaxed);
+			m_syncs.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			m_errors.fetch_add(1, std::memory_order_relaxed);
+		}
+		lock.lock();
+	}
+}
+
+VideoRecorder::VideoRecorder()
+{
+	m_url = "";
+	m_ofmt_Ctx = NULL;
+	m_options = NULL;
+	m_index_video = -1;
+	m_index_audio = -1;
+	m_flag_interleaved = true;
+	m_flag_wclk = true;
+	m_time_base_audio = AVRational{ 1,4 };
+	m_time_base_video = AVRational{ 1,5 };
+	m_start_time = AV_NOPTS_VALUE;
+	m_pts_offset_video = 0;
+	m_pts_offset_audio = 0;
+	m_defalt_duration_audio = 0;
+	m_defalt_duration_video = 0;
+	m_err = 0;
+	m_message = "";
+	m_chunk_time = 0; // chunk indicator
+	m_chunk_interval = 0;
+	m_chunk_prefix = "";
+	m_format = "mp4";
+	m_muxer = "mp4";
+	m_io_buffer = 0;
+	m_bitrate = 0;
+	m_stream_bitrate = 0;
+	m_flag_preallocate = true;
+	m_file_writes = 0;
+	m_sync_fragments = 0;
+	m_sync_interval = 0;
+	m_flag_sync_close = false;
+	m_fragment_count = 0;
+	m_flag_fragmented = false;
+	m_fragment_mark = 0;
+	m_sync_time = 0;
+	m_flag_async = false;
+	m_queue_size = RECORDER_QUEUE_SIZE;
+	m_queue_first = 0;
+	m_queue_count = 0;
+	memset(&m_stats, 0, sizeof(RecorderStats));
+	m_async_err = 0;
+	m_async_message = "";
+	m_async_url = "";
+	m_flag_keyframe_rotation = false;
+	m_segment_stop = false;
+	m_prepare_ctx = NULL;
+	m_prepare_options = NULL;
+	m_prepare_url = "";
+	m_next_ofmt_Ctx = NULL;
+	m_next_url = "";
+	m_segment_err = 0;
+	m_segment_message = "";
+	m_written = 0;
+	m_written_bytes = 0;
+	m_write_errors = 0;
+}
+
+VideoRecorder::~VideoRecorder()
+{
+	// flush the packets still queued
+	if (m_mux_thread.joinable())
+	{
+		close();
+	}
+	close_segments();
+	m_syncer.stop();
+
+	avformat_free_context(m_ofmt_Ctx);
+	av_dict_free(&m_options);
+}
+
+int VideoRecorder::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (option == "wall_clock")
+	{
+		if (value == "false")
+		{
+			m_flag_wclk = false;
+
+			m_err = 0;
+			m_message = "'wall clock alignment' flag is set to false";
+		}
+		else if (value == "true")
+		{ 
+			m_flag_wclk = true;
+
+			m_err = 0;
+			m_message = "'wall clock alignment' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'wall clock alignment' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "interleaved_write")
+	{
+		if (value == "false")
+		{
+			m_flag_interleaved = false;
+
+			m_err = 0;
+			m_message = "'interleaved writting' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_interleaved = true;
+
+			m_err = 0;
+			m_message = "'interleaved writting' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'interleaved writting' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "async")
+	{
+		if (value == "false")
+		{
+			m_flag_async = false;
+			m_message = "'async' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_async = true;
+			m_message = "'async' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'async' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "rotation")
+	{
+		if (value == "clock")
+		{
+			m_flag_keyframe_rotation = false;
+			m_message = "chunks are rotated at the chunk time";
+		}
+		else if (value == "keyframe")
+		{
+			m_flag_keyframe_rotation = true;
+			m_message = "chunks are rotated at the first keyframe after the chunk time";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'rotation' setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "queue_size")
+	{
+		int size = atoi(value.c_str());
+		if (size < 2 || size > 100000)
+		{
+			m_err = -1;
+			m_message = value + " is invalid for 'queue size' option setting, shall be [2-100000]";
+		}
+		else
+		{
+			m_queue_size = size;
+			m_message = "'queue size' option is set to be " + value;
+		}
+		return m_err;
+	}
+
+	if (option == "format")
+	{
+		if (value.length() < 1 || value.length() > 10)
+		{
+			m_format = "mp4";
+
+			m_err = -1;
+			m_message = value + " is invalid for 'file format' option setting";
+		}
+		else
+		{
+			m_format = value;
+			m_message = "'file format' option is set to be " + value;
+			m_err = 0;
+		}
+
+		return m_err;
+	}
+
+	// the buffer of the recording files, auto to size it by the bit rate, a size in KB, or avio for the files of avio_open
+	if (option == "io_buffer")
+	{
+		int size = atoi(value.c_str());
+		if (value == "auto")
+		{
+			m_io_buffer = 0;
+			m_message = "the buffer of the recording files is sized by the bit rate";
+		}
+		else if (value == "avio")
+		{
+			m_io_buffer = -1;
+			m_message = "the recording files are opened by avio_open";
+		}
+		else if (size < 4 || size > 65536)
+		{
+			m_err = -1;
+			m_message = value + " is invalid for 'io buffer' option setting, shall be auto, avio or [4-65536] KB";
+		}
+		else
+		{
+			m_io_buffer = size * 1024;
+			m_message = "'io buffer' option is set to be " + value + "KB";
+		}
+		return m_err;
+	}
+
+	// the bits per second expected, to size the buffer of the recording files and preallocate the chunks
+	if (option == "bitrate")
+	{
+		int64_t bitrate = atoll(value.c_str());
+		if (bitrate < 0 || bitrate > 1000000000)
+		{
+			m_err = -1;
+			m_message = value + " is invalid for 'bitrate' option setting, shall be [0-1000000000], 0 to take it from the streams";
+		}
+		else
+		{
+			m_bitrate = bitrate;
+			m_message = "'bitrate' option is set to be " + value;
+		}
+		return m_err;
+	}
+
+	if (option == "preallocate")
+	{
+		if (value == "false")
+		{
+			m_flag_preallocate = false;
+			m_message = "'preallocate' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_preallocate = true;
+			m_message = "'preallocate' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'preallocate' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	// the durability policy, every how many fragments or miliseconds the recording file is synced, 0 not to
+	if (option == "sync_fragments" || option == "sync_interval")
+	{
+		int count = atoi(value.c_str());
+		if (count < 0 || count > 3600000)
+		{
+			m_err = -1;
+			m_message = value + " is invalid for '" + option + "' option setting, shall be [0-3600000]";
+		}
+		else
+		{
+			(option == "sync_fragments" ? m_sync_fragments : m_sync_interval) = count;
+			m_message = "'" + option + "' option is set to be " + value;
+		}
+		return m_err;
+	}
+
+	if (option == "sync_close")
+	{
+		if (value == "false")
+		{
+			m_flag_sync_close = false;
+			m_message = "'sync on close' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_sync_close = true;
+			m_message = "'sync on close' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'sync on close' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	// the cores the muxing and the segment threads are pinned to, such as 4-7, empty for any core
+	if (option == "cpus")
+	{
+		m_err = m_tuning.set_cpus(value);
+		m_message = m_tuning.get_error_message();
+		return m_err;
+	}
+
+	// the container format, has to be set before the first stream is added
+	if (option == "muxer")
+	{
+		if (m_ofmt_Ctx)
+		{
+			m_err = -1;
+			m_message = "'muxer' option has to be set before the streams are added";
+		}
+		else
+		{
+			m_muxer = value;
+			m_message = "'muxer' option is set to be " + value;
+		}
+		return m_err;
+	}
+
+	// the fragments cut at the keyframes are only written out when the next one starts, which the durability marks follow
+	if (option == "movflags")
+	{
+		m_flag_fragmented = value.find("frag_keyframe") != std::string::npos;
+	}
+	return av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
+}
+
+int VideoRecorder::add_stream(AVStream* stream)
+{
+	m_err = 0;
+	m_message = "";
+
+	// return an error code when no stream can be found
+	if (!stream)
+	{
+		m_err = -1;
+		m_message = "Error. Empty stream cannot be added";
+		return m_err;
+	}
+
+	// Create a new format context for the output container format when the first stream is added
+	m_err = m_ofmt_Ctx ? 0 : avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, m_muxer.c_str(), NULL);
+	if (m_err < 0)
+	{
+		//m_message = "Error. Could not allocate output format context.";
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	//m_ifmt_Ctx = ifmt_Ctx;
+	AVStream* out_stream = avformat_new_stream(m_ofmt_Ctx, NULL);
+	if (!out_stream)
+	{
+		m_err = -2;
+		m_message = "Error. Failed allocating output stream.";
+		return m_err;
+	}
+
+	m_err = avcodec_parameters_copy(out_stream->codecpar, stream->codecpar);
+	if (m_err < 0)
+	{
+		m_err = -3;
+		//m_message = "Error. Failed to copy the stream codec parameters.";
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	out_stream->id = m_ofmt_Ctx->nb_streams - 1;
+	out_stream->codecpar->codec_tag = 0;
+	m_stream_bitrate += std::max<int64_t>(stream->codecpar->bit_rate, 0);
+
+	if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		m_index_video = out_stream->id;
+		m_time_base_video = stream->time_base;
+		m_video_stream = out_stream;
+	}
+	else if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+	{
+		m_index_audio = out_stream->id;
+		m_time_base_audio = stream->time_base;
+		m_audio_stream = out_stream;
+	}
+
+	m_message = "stream is added to the recorder";
+	return m_err;
+}
+
+int VideoRecorder::open(std::string url, int chunk_interval)
+{
+	// flush the recording still being written by the muxing thread
+	if (m_mux_thread.joinable())
+	{
+		close();
+	}
+
+	if (url.empty())
+	{
+		m_err = -1;
+		m_message = "url cannot be empty";
+		return m_err;
+	}
+
+	// validate the input chunk interval
+	if (chunk_interval < 0 || chunk_interval > 3600)
+	{
+		m_err = -1;
+		m_message = "'chunk interval' setting shall be [0-3600]";
+		return m_err;
+	}
+
+	// positive chunk interval indicates segmentally recording, url is considered to be the file prefix of segmental files
+	if (chunk_interval > 0)
+	{
+		m_chunk_prefix = url;
+		m_chunk_interval = chunk_interval * 1000;  // convert the interval into miliseconds
+		m_message = "chunked recording is set to be " + m_chunk_prefix + "yyyy-MM-dd-hhmmss" + m_chunk_prefix;
+	}
+	else
+	{
+		m_url = url;  // url is the full path of the recording video file
+		m_chunk_interval = 0; 
+		m_chunk_prefix = "";
+		m_message = "normal recording";
+	}
+
+	// the syncing thread runs until close when any durability policy is set
+	if (m_sync_fragments || m_sync_interval || m_flag_sync_close)
+	{
+		m_syncer.start(&m_written_bytes);
+	}
+	m_fragment_count = 0;
+	m_fragment_mark = m_written_bytes.load(std::memory_order_relaxed);
+	m_sync_time = av_gettime_relative();
+
+	m_chunk_time = 0;
+	if (mux_chunk() < 0)
+	{
+		return m_err;
+	}
+
+	// open the next chunk ahead of time
+	if (m_flag_keyframe_rotation)
+	{
+		m_segment_stop = false;
+		m_segment_err = 0;
+		m_segment_thread = std::thread(&VideoRecorder::segment_tasks, this);
+		if (m_tuning.is_set())
+		{
+			m_tuning.apply(m_segment_thread);
+		}
+		prepare_segment();
+	}
+
+	if (!m_flag_async)
+	{
+		return m_err;
+	}
+
+	// start the muxing thread with an empty queue
+	m_queue.resize(m_queue_size);
+	for (int i = 0; i < m_queue_size; i++)
+	{
+		memset(&m_queue[i].pkt, 0, sizeof(AVPacket));
+		av_init_packet(&m_queue[i].pkt);
+	}
+	m_queue_first = 0;
+	m_queue_count = 0;
+	memset(&m_stats, 0, sizeof(RecorderStats));
+	m_async_err = 0;
+	m_async_message = "";
+	m_async_url = m_url;
+	m_mux_thread = std::thread(&VideoRecorder::mux_tasks, this);
+	if (m_tuning.is_set() && m_tuning.apply(m_mux_thread) < 0)
+	{
+		m_message = m_tuning.get_error_message();
+	}
+	return m_err;
+}
+
+// make another chunked recording
+// first stop current recording in case there is one. Then start another recording by chunk prefix.
+// in async mode the chunking is queued after the packets recorded before
+// return 0 on success
+int VideoRecorder::chunk()
+{
+	if (m_mux_thread.joinable())
+	{
+		return queue_task(RECORD_CHUNK, NULL, -1);
+	}
+
+	return mux_chunk();
+}
+
+// close current recording in case there is one, then start another recording by chunk prefix
+// return 0 on success
+int VideoRecorder::mux_chunk(int64_t time)
+{
+	// to check the chunk setting, a normal recording is only opened once at its url
+	bool chunked = !m_chunk_prefix.empty() && m_chunk_interval;
+	if (!chunked && (m_url.empty() || m_ofmt_Ctx->pb))
+	{
+		m_err = -1;
+		m_message = "Invalid chunk settings.";
+		return m_err;
+	}
+
+	// uses m_chunk_time as an indicateor of first recording
+	if (m_chunk_time)
+	{
+		mux_close();
+
+		if (m_err)
+		{
+			return m_err;
+		}
+	}
+
+	if (chunked)
+	{
+		// set next chunk time, at x:xx:00 if wall clock alignment is set
+		m_chunk_time = get_next_chunk_time(time);
+
+		// file name is set as <prefix><yyyy-MM-dd-hhmmss>.<ext>
+		m_url = m_chunk_prefix + get_date_time(time) + "." + m_format;
+	}
+
+	// try to solve the 
+	AVStream* st;
+	for (int i = 0; static_cast <unsigned int>(i) < m_ofmt_Ctx->nb_streams; i++)
+	{
+		st = m_ofmt_Ctx->streams[i];
+		//m_ofmt_Ctx->streams[i]->start_time = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->duration = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->first_dts = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->cur_dts = AV_NOPTS_VALUE;
+		st->start_time = AV_NOPTS_VALUE;
+		st->duration = static_cast<int64_t>(m_chunk_interval) * 90;
+		st->first_dts = AV_NOPTS_VALUE;
+		st->cur_dts = 0;
+	}
+	m_ofmt_Ctx->output_ts_offset = 0;
+
+	// the muxers without a file, such as null, write nowhere
+	if (!(m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		m_err = open_output(&m_ofmt_Ctx->pb, m_url);
+		if (m_err < 0)
+		{
+			m_message.assign(av_err(m_err));
+			m_message = "Could not open " + m_url + " with error " + m_message;
+			return m_err;
+		}
+	}
+
+	//m_err = avformat_write_header(m_ofmt_Ctx, &dictionary);
+	m_err = avformat_write_header(m_ofmt_Ctx, &m_options);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		m_message += " Could not open " + m_url;
+		return m_err;
+	}
+
+	m_message = m_url + " is openned with return code " + std::to_string(m_err);
+	m_err = 0;
+
+	reset_time_stamps();
+	return m_err;
+}
+
+// get the next chunk time after the wall clock time in miliseconds, at x:xx:00 if wall clock alignment is set
+int64_t VideoRecorder::get_next_chunk_time(int64_t time)
+{
+	int64_t now = time ? time : av_gettime() / 1000;
+	return m_flag_wclk ? (now / m_chunk_interval + 1) * m_chunk_interval : now + m_chunk_interval;
+}
+
+// reset the factors and offsets used to rescale the time stamps, after a new output is opened
+void VideoRecorder::reset_time_stamps()
+{
+	// build the rescalers of the time stamps of input packets to the output streams
+	m_defalt_duration_audio = 440;
+	m_defalt_duration_video = 3000;
+	
+	if (m_index_audio >= 0)
+	{
+		m_rescale_audio.set(m_time_base_audio, m_ofmt_Ctx->streams[m_index_audio]->time_base);
+		m_defalt_duration_audio = m_ofmt_Ctx->streams[m_index_audio]->time_base.den / m_ofmt_Ctx->streams[m_index_audio]->time_base.num / 44000;
+	}
+
+	if (m_index_video >= 0)
+	{
+		m_rescale_video.set(m_time_base_video, m_ofmt_Ctx->streams[m_index_video]->time_base);
+		m_defalt_duration_video = m_ofmt_Ctx->streams[m_index_video]->time_base.den / m_ofmt_Ctx->streams[m_index_video]->time_base.num / 30;
+	}
+	m_start_time = AV_NOPTS_VALUE;
+	m_pts_offset_audio = 0;
+	m_pts_offset_video = 0;
+}
+
+// save the packet to the video recorder, the packet is unreferenced
+// in async mode the packet is queued for the muxing thread, a negative return is the error of the muxing thread on earlier packets
+int VideoRecorder::record(AVPacket* pkt, int stream_index)
+{
+	if (stream_index < 0)
+	{
+		stream_index = pkt->stream_index;
+	}
+
+	if (m_mux_thread.joinable())
+	{
+		return queue_task(RECORD_PACKET, pkt, stream_index);
+	}
+
+	return mux_packet(pkt, stream_index, av_gettime() / 1000);
+}
+
+// save a view of a packet to the video recorder, the view can be released as soon as it returns
+int VideoRecorder::record_view(const PacketView* view, int stream_index)
+{
+	// a packet without buffer borrowing the payload
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	pkt.data = const_cast<uint8_t*>(view->data);
+	pkt.size = view->size;
+	pkt.pts = view->pts;
+	pkt.dts = view->dts;
+	pkt.duration = view->duration;
+	pkt.flags = view->flags;
+	pkt.stream_index = view->stream_index;
+	if (stream_index < 0)
+	{
+		stream_index = view->stream_index;
+	}
+
+	if (m_mux_thread.joinable())
+	{
+		// the view does not live long enough for the muxing thread
+		AVPacket copy;
+		memset(&copy, 0, sizeof(AVPacket));
+		av_init_packet(&copy);
+		int ret = av_packet_ref(&copy, &pkt);
+		if (ret < 0)
+		{
+			return ret;
+		}
+		return queue_task(RECORD_PACKET, &copy, stream_index);
+	}
+
+	return mux_packet(&pkt, stream_index, av_gettime() / 1000);
+}
+
+// write the packet to the output, then chunk the recording when it is time
+// the chunk time is checked against the time the packet was recorded at, not the time the muxing thread gets to it
+int VideoRecorder::mux_packet(AVPacket* pkt, int stream_index, int64_t time)
+{
+	m_err = 0;
+	m_message = "";
+
+	// rotate at the first keyframe after the chunk time, so that the next chunk starts with it
+	if (m_flag_keyframe_rotation && m_chunk_time && (pkt->flags & AV_PKT_FLAG_KEY) && (stream_index == m_index_video || m_index_video < 0) &&
+		time >= m_chunk_time && rotate(time) < 0)
+	{
+		av_packet_unref(pkt);
+		return m_err;
+	}
+
+	// the recording starts at the first packet of any stream, audio and video are offset by the same time to stay in sync
+	if (m_start_time == AV_NOPTS_VALUE)
+	{
+		m_start_time = av_rescale_q(pkt->pts, stream_index == m_index_audio ? m_time_base_audio : m_time_base_video, AVRational{ 1, 1000000 });
+		if (m_index_audio >= 0)
+		{
+			m_pts_offset_audio = -av_rescale_q(m_start_time, AVRational{ 1, 1000000 }, m_ofmt_Ctx->streams[m_index_audio]->time_base);
+		}
+		if (m_index_video >= 0)
+		{
+			m_pts_offset_video = -av_rescale_q(m_start_time, AVRational{ 1, 1000000 }, m_ofmt_Ctx->streams[m_index_video]->time_base);
+		}
+	}
+
+	// rescale the time stamp to the output stream, a missing time stamp stays missing
+	if (stream_index == m_index_audio || stream_index == m_index_video)
+	{
+		bool audio = stream_index == m_index_audio;
+		int64_t offset = audio ? m_pts_offset_audio : m_pts_offset_video;
+		(audio ? m_rescale_audio : m_rescale_video).rescale_packet(pkt);
+		if (!pkt->duration)
+		{
+			pkt->duration = audio ? m_defalt_duration_audio : m_defalt_duration_video;
+		}
+		if (pkt->pts != AV_NOPTS_VALUE)
+		{
+			pkt->pts += offset;
+		}
+		if (pkt->dts != AV_NOPTS_VALUE)
+		{
+			pkt->dts += offset;
+		}
+	}
+
+	pkt->stream_index = stream_index;
+	pkt->pos = -1;
+	
+	// check the interleaved flag, a borrowed packet is written as it is since interleaving would copy it
+	// the packets borrowed from a circular buffer are in dts order already
+	int size = pkt->size;
+	bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+	int64_t t0 = av_gettime_relative();
+	if (m_flag_interleaved && pkt->buf)
+	{
+		m_err = av_interleaved_write_frame(m_ofmt_Ctx, pkt); // interleaved write will handle the packet unref
+	}
+	else
+	{
+		m_err = av_write_frame(m_ofmt_Ctx, pkt);
+	}
+	av_packet_unref(pkt);
+	m_write_latency.add(av_gettime_relative() - t0);
+
+	m_message = "packet written";
+	if (m_err)
+	{
+		m_write_errors.store(m_write_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+	m_written.store(m_written.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (key && stream_index == m_index_video)
+	{
+		m_fragment_mark = m_written_bytes.load(std::memory_order_relaxed);
+	}
+	m_written_bytes.store(m_written_bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+	check_sync(key && stream_index == m_index_video, t0);
+
+	m_err = 0;
+	if (!m_flag_keyframe_rotation && m_chunk_time && time >= m_chunk_time)
+	{
+		int64_t t0 = av_gettime_relative();
+		m_err = mux_chunk(time);
+		m_rotation_latency.add(av_gettime_relative() - t0);
+	}
+	//m_err = m_chunk_time && av_gettime() / 1000 >= m_chunk_time ? re_open() : 0;
+
+	return m_err;
+}
+
+// close the video recorder
+// in async mode all the packets queued are written before closing, the muxing thread is stopped then
+int VideoRecorder::close()
+{
+	if (m_mux_thread.joinable())
+	{
+		queue_task(RECORD_CLOSE, NULL, -1);
+		m_mux_thread.join();
+
+		// the muxing thread is gone, hand its error over
+		m_err = m_async_err;
+		m_message = m_err < 0 ? m_async_message : m_message;
+		close_segments();
+		m_syncer.stop();
+		return m_err;
+	}
+
+	mux_close();
+	close_segments();
+	m_syncer.stop();
+	return m_err;
+}
+
+// write the trailer and close the output
+int VideoRecorder::mux_close()
+{
+	m_err = av_write_trailer(m_ofmt_Ctx);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	m_err = RecordingFile::closep(&m_ofmt_Ctx->pb, m_flag_sync_close ? &m_syncer : NULL, m_written_bytes.load(std::memory_order_relaxed));
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		m_message = "Could not close " + m_url + " with error " + m_message;
+		return m_err;
+	}
+
+	m_message = m_url + " is closed.";
+	return m_err;
+}
+
+// open the output of a recording, local files are opened as recording files unless the "io_buffer" option is avio
+// the chunks are preallocated to the size expected at the bit rate, a normal recording has no known length
+int VideoRecorder::open_output(AVIOContext** pb, std::string url)
+{
+	if (m_io_buffer < 0 || !RecordingFile::is_local(url))
+	{
+		return avio_open(pb, url.c_str(), AVIO_FLAG_WRITE);
+	}
+
+	int64_t bitrate = m_bitrate ? m_bitrate : m_stream_bitrate ? m_stream_bitrate : FILE_DEFAULT_BITRATE;
+	int buffer_size = m_io_buffer ? m_io_buffer : RecordingFile::get_buffer_size(bitrate);
+	int64_t prealloc = m_flag_preallocate && m_chunk_interval ? RecordingFile::get_expected_size(bitrate, m_chunk_interval / 1000) : 0;
+	return RecordingFile::open(pb, url, buffer_size, prealloc, &m_file_writes);
+}
+
+// queue the recording file to be synced when the durability policy says it is time, after a packet is written
+// the fragments are counted at the video keyframes, where the muxer cuts them with the frag_keyframe flag.
+// The fragment going on is still in the memory of the muxer, so the mark of a fragmented recording only counts the bytes
+// before its keyframe. The marks of the files closed are all the bytes written, the trailer has flushed the last fragment.
+void VideoRecorder::check_sync(bool keyframe, int64_t now)
+{
+	m_fragment_count += keyframe;
+	if (!(m_sync_fragments && m_fragment_count >= m_sync_fragments) && !(m_sync_interval && now - m_sync_time >= m_sync_interval * 1000LL))
+	{
+		return;
+	}
+
+	m_fragment_count = 0;
+	m_sync_time = now;
+	RecordingFile::sync(m_ofmt_Ctx->pb, &m_syncer, m_flag_fragmented ? m_fragment_mark : m_written_bytes.load(std::memory_order_relaxed));
+}
+
+// get the stream codec parameter
+AVFormatContext* VideoRecorder::get_output_format_context()
+{
+	m_err = 0;
+	m_message = "";
+
+	return m_ofmt_Ctx;
+};
+
+// get the stream time base
+AVRational VideoRecorder::get_stream_time_base(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ofmt_Ctx->nb_streams)
+	{
+		return m_ofmt_Ctx->streams[stream_index]->time_base;
+	}
+
+	return AVRational{ 1,1 };
+};
+
+// get the error message of last operation
+// the message of the muxing thread is given in async mode
+std::string VideoRecorder::get_error_message()
+{
+	if (m_mux_thread.joinable())
+	{
+		std::lock_guard<std::mutex> lock(m_queue_mutex);
+		return m_async_message;
+	}
+
+	return m_message;
+}
+
+// get the recording filename or url
+std::string VideoRecorder::get_url()
+{
+	if (m_mux_thread.joinable())
+	{
+		std::lock_guard<std::mutex> lock(m_queue_mutex);
+		return m_async_url;
+	}
+
+	return m_url;
+}
+
+// get the histogram of the time in microseconds the recording is held by the chunk rotations
+Histogram* VideoRecorder::get_rotation_latency()
+{
+	return &m_rotation_latency;
+}
+
+// switch to the chunk opened ahead of time, and hand the current one over to the segment thread
+// the chunk is rotated inline like the clock rotation when the next chunk could not be opened
+// return 0 on success
+int VideoRecorder::rotate(int64_t time)
+{
+	int64_t t0 = av_gettime_relative();
+	std::unique_lock<std::mutex> lock(m_segment_mutex);
+
+	// the next chunk is normally ready long before, wait in case it is still being opened
+	m_segment_done.wait(lock, [this] { return !m_prepare_ctx; });
+	AVFormatContext* next = m_next_ofmt_Ctx;
+	m_next_ofmt_Ctx = NULL;
+	int err = m_segment_err;
+	std::string message = m_segment_message;
+	m_segment_err = 0;
+	if (next)
+	{
+		m_finalize.push_back(std::make_pair(m_ofmt_Ctx, m_written_bytes.load(std::memory_order_relaxed)));
+		m_ofmt_Ctx = next;
+		m_url = m_next_url;
+		m_chunk_time = get_next_chunk_time(time);
+	}
+	lock.unlock();
+	m_segment_cond.notify_one();
+
+	if (next)
+	{
+		// the chunk was named after the chunk time when opened ahead, name it after the keyframe it starts with as mux_chunk does
+		// the scheduled name is kept when the file cannot be renamed while open, such as one opened by avio_open on Windows
+		std::string url = m_chunk_prefix + get_date_time(time) + "." + m_format;
+		if (url != m_url && !(m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE) && !rename(m_url.c_str(), url.c_str()))
+		{
+			m_url = url;
+		}
+
+		reset_time_stamps();
+		m_err = 0;
+		m_message = m_url + " is rotated in";
+	}
+	else
+	{
+		mux_chunk(time);
+	}
+
+	// open the chunk after
+	if (!m_err)
+	{
+		prepare_segment();
+	}
+	m_rotation_latency.add(av_gettime_relative() - t0);
+
+	// report the failure of the segment thread, the recording goes on
+	if (!m_err && err < 0)
+	{
+		m_err = err;
+		m_message = message;
+	}
+	return m_err;
+}
+
+// create the output of the next chunk with the same streams, the segment thread opens it
+// the file is named after the chunk time it is going to start at, rotate renames it after the keyframe it actually starts at
+void VideoRecorder::prepare_segment()
+{
+	AVFormatContext* ctx = NULL;
+	if (avformat_alloc_output_context2(&ctx, NULL, m_muxer.c_str(), NULL) < 0)
+	{
+		return;
+	}
+
+	for (unsigned int i = 0; i < m_ofmt_Ctx->nb_streams; i++)
+	{
+		AVStream* out_stream = avformat_new_stream(ctx, NULL);
+		if (!out_stream || avcodec_parameters_copy(out_stream->codecpar, m_ofmt_Ctx->streams[i]->codecpar) < 0)
+		{
+			avformat_free_context(ctx);
+			return;
+		}
+		out_stream->id = i;
+		out_stream->codecpar->codec_tag = 0;
+		out_stream->duration = static_cast<int64_t>(m_chunk_interval) * 90;
+	}
+
+	std::lock_guard<std::mutex> lock(m_segment_mutex);
+	m_prepare_ctx = ctx;
+	m_prepare_url = m_chunk_prefix + get_date_time(m_chunk_time) + "." + m_format;
+	av_dict_free(&m_prepare_options);
+	av_dict_copy(&m_prepare_options, m_options, 0);
+	m_segment_cond.notify_one();
+}
+
+// the segment thread, open the next chunk and finalize the old ones
+// opening goes first since a rotation may be waiting for it
+void VideoRecorder::segment_tasks()
+{
+	std::unique_lock<std::mutex> lock(m_segment_mutex);
+	while (true)
+	{
+		m_segment_cond.wait(lock, [this] { return m_segment_stop || m_prepare_ctx || !m_finalize.empty(); });
+		if (m_prepare_ctx)
+		{
+			AVFormatContext* ctx = m_prepare_ctx;
+			AVDictionary* options = m_prepare_options;
+			std::string url = m_prepare_url;
+			m_prepare_options = NULL;
+			lock.unlock();
+
+			int err = ctx->oformat->flags & AVFMT_NOFILE ? 0 : open_output(&ctx->pb, url);
+			if (err >= 0)
+			{
+				err = avformat_write_header(ctx, &options);
+			}
+			av_dict_free(&options);
+			if (err < 0)
+			{
+				RecordingFile::closep(&ctx->pb);
+				avformat_free_context(ctx);
+				ctx = NULL;
+			}
+
+			lock.lock();
+			if (err < 0)
+			{
+				m_segment_err = err;
+				m_segment_message.assign(av_err(err));
+				m_segment_message = "Could not open " + url + " ahead of time with error " + m_segment_message;
+			}
+			m_next_ofmt_Ctx = ctx;
+			m_next_url = url;
+			m_prepare_ctx = NULL;
+			m_segment_done.notify_all();
+			continue;
+		}
+
+		if (!m_finalize.empty())
+		{
+			AVFormatContext* ctx = m_finalize.front().first;
+			int64_t mark = m_finalize.front().second;
+			m_finalize.erase(m_finalize.begin());
+			lock.unlock();
+
+			int err = av_write_trailer(ctx);
+			int closed = RecordingFile::closep(&ctx->pb, m_flag_sync_close ? &m_syncer : NULL, mark);
+			err = err < 0 ? err : closed;
+			avformat_free_context(ctx);
+
+			lock.lock();
+			if (err < 0)
+			{
+				m_segment_err = err;
+				m_segment_message.assign(av_err(err));
+				m_segment_message = "Could not finalize the chunk with error " + m_segment_message;
+			}
+			continue;
+		}
+
+		if (m_segment_stop)
+		{
+			break;
+		}
+	}
+}
+
+// finalize the old chunks, close the next chunk opened ahead of time and stop the segment thread
+// the next chunk has got nothing but the header, its file is removed
+void VideoRecorder::close_segments()
+{
+	if (!m_segment_thread.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		m_segment_stop = true;
+	}
+	m_segment_cond.notify_one();
+	m_segment_thread.join();
+
+	if (m_next_ofmt_Ctx)
+	{
+		RecordingFile::closep(&m_next_ofmt_Ctx->pb);
+		avformat_free_context(m_next_ofmt_Ctx);
+		m_next_ofmt_Ctx = NULL;
+		remove(m_next_url.c_str());
+	}
+	av_dict_free(&m_prepare_options);
+}
+
+// get the metrics of the recorder, can be called by any thread at any time
+RecorderMetrics VideoRecorder::get_metrics()
+{
+	RecorderMetrics metrics;
+	RecorderStats stats = get_stats();
+	metrics.packets = m_written.load(std::memory_order_relaxed);
+	metrics.bytes = m_written_bytes.load(std::memory_order_relaxed);
+	metrics.errors = m_write_errors.load(std::memory_order_relaxed);
+	metrics.rotations = m_rotation_latency.get_count();
+	metrics.queue_depth = stats.depth;
+	metrics.blocked = stats.blocked;
+	metrics.file_writes = m_file_writes.load(std::memory_order_relaxed);
+	metrics.syncs = m_syncer.get_syncs();
+	metrics.sync_errors = m_syncer.get_errors();
+	metrics.bytes_at_risk = std::max<int64_t>(metrics.bytes - m_syncer.get_synced(), 0);
+	m_syncer.get_latency()->get_snapshot(&metrics.sync_latency);
+	m_syncer.get_risk()->get_snapshot(&metrics.at_risk);
+	m_write_latency.get_snapshot(&metrics.write_latency);
+	m_rotation_latency.get_snapshot(&metrics.rotation_latency);
+	return metrics;
+}
+
+// get the statistics of the queue in async mode
+RecorderStats VideoRecorder::get_stats()
+{
+	std::lock_guard<std::mutex> lock(m_queue_mutex);
+	RecorderStats stats = m_stats;
+	stats.depth = m_queue_count;
+	return stats;
+}
+
+// queue a task for the muxing thread, waiting for room when the queue is full
+// the packet is moved into the queue. Return 0 when queued, or the first error of the muxing thread
+int VideoRecorder::queue_task(int command, AVPacket* pkt, int stream_index)
+{
+	int err = m_async_err.load(std::memory_order_relaxed);
+	if (err < 0 && command == RECORD_PACKET)
+	{
+		// the recording is broken, drop the packet
+		av_packet_unref(pkt);
+		return err;
+	}
+
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+	if (m_queue_count >= m_queue_size)
+	{
+		int64_t t0 = av_gettime_relative();
+		m_queue_not_full.wait(lock, [this] { return m_queue_count < m_queue_size; });
+		m_stats.blocked++;
+		m_stats.blocked_time += av_gettime_relative() - t0;
+	}
+
+	RecorderTask* task = &m_queue[(m_queue_first + m_queue_count) % m_queue_size];
+	task->command = command;
+	task->stream_index = stream_index;
+	task->time = av_gettime() / 1000;
+	if (pkt)
+	{
+		av_packet_move_ref(&task->pkt, pkt);
+		m_stats.packets++;
+	}
+	m_queue_count++;
+	m_stats.max_depth = std::max(m_stats.max_depth, m_queue_count);
+	lock.unlock();
+
+	m_queue_not_empty.notify_one();
+	return err;
+}
+
+// the muxing thread, run the queued tasks in order until the recording is closed
+// m_err and m_message belong to this thread while it is running, the first error is kept for the caller
+void VideoRecorder::mux_tasks()
+{
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	av_init_packet(&pkt);
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		m_queue_not_empty.wait(lock, [this] { return m_queue_count > 0; });
+		RecorderTask* task = &m_queue[m_queue_first];
+		int command = task->command;
+		int stream_index = task->stream_index;
+		int64_t time = task->time;
+		av_packet_move_ref(&pkt, &task->pkt);
+		m_queue_first = (m_queue_first + 1) % m_queue_size;
+		m_queue_count--;
+		lock.unlock();
+		m_queue_not_full.notify_one();
+
+		// drop the packets once the recording is broken, but still run the chunking and closing
+		int64_t t0 = av_gettime_relative();
+		int err = 0;
+		if (command == RECORD_PACKET && m_async_err < 0)
+			av_packet_unref(&pkt);
+		else if (command == RECORD_PACKET)
+			err = mux_packet(&pkt, stream_index, time);
+		else if (command == RECORD_CHUNK)
+			err = mux_chunk(time);
+		else
+			err = mux_close();
+		int64_t t = av_gettime_relative() - t0;
+
+		lock.lock();
+		m_stats.max_write_time = std::max(m_stats.max_write_time, t);
+		m_async_url = m_url;
+		if (err < 0 && m_async_err == 0)
+		{
+			m_async_message = m_message;
+			m_async_err = err;
+		}
+		lock.unlock();
+
+		if (command == RECORD_CLOSE)
+		{
+			break;
+		}
+	}
+}
+}
+
+
+// global variables
+FfmpegLibrary::CircularBuffer* cbuf; // global shared the circular buffer
+FfmpegLibrary::Camera* ipCam; // global shared IP camera
+FfmpegLibrary::CameraPool* pool; // reads the camera into the circular buffer
+//AVFormatContext* ifmt_Ctx = NULL;  // global shared input format context
+int64_t lastReadPacktTime = 0; // global shared time stamp for call back
+std::string prefix_videofile = "C:\\Users\\georges\\Documents\\CopTraxTemp\\";
+int Debug = 2;
+
+// get the current and the peak resident memory of the process in bytes
+void get_memory_usage(int64_t* rss, int64_t* peak)
+{
+	*rss = 0;
+	*peak = 0;
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		*rss = pmc.WorkingSetSize;
+		*peak = pmc.PeakWorkingSetSize;
+	}
+#else
+	FILE* fp = fopen("/proc/self/status", "r");
+	char line[256];
+	while (fp && fgets(line, sizeof(line), fp))
+	{
+		if (!strncmp(line, "VmRSS:", 6))
+			*rss = atoll(line + 6) * 1024;
+		else if (!strncmp(line, "VmHWM:", 6))
+			*peak = atoll(line + 6) * 1024;
+	}
+	if (fp)
+		fclose(fp);
+#endif
+}
+
+// count the heap allocations made through new by the C++ code, reported by the benchmarks
+// the global new and delete are only replaced in a build with BENCH_ALLOC_COUNT defined, the normal build keeps the default allocator
+// the allocations made inside the FFmpeg libraries do not go through it and are not counted
+std::atomic<int64_t> heap_allocations(0);
+#ifdef BENCH_ALLOC_COUNT
+void* operator new(size_t size)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	free(p);
+}
+
+#ifdef __cpp_aligned_new
+// the over-aligned forms get their own allocation, freed with the matching function
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+	return _aligned_malloc(size ? size : 1, static_cast<size_t>(align));
+#else
+	void* p = NULL;
+	if (posix_memalign(&p, std::max(static_cast<size_t>(align), sizeof(void*)), size ? size : 1))
+		return NULL;
+	return p;
+#endif
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+	void* p = operator new(size, align, std::nothrow);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return operator new(size, align);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, align, tag);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+void operator delete[](void* p, std::align_val_t align) noexcept
+{
+	operator delete(p, align);
+}
+
+void operator delete(void* p, size_t, std::align_val_t align) noexcept
+{
+	operator delete(p, align);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t align) noexcept
+{
+	operator delete(p, align);
+}
+
+void operator delete(void* p, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	operator delete(p, align);
+}
+
+void operator delete[](void* p, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	operator delete(p, align);
+}
+#endif
+#endif
+
+// format the number of allocations per operation counted by a benchmark, when the build counts them
+std::string format_allocations(int64_t allocs, int64_t count, const char* operation)
+{
+	char text[64];
+#ifdef BENCH_ALLOC_COUNT
+	snprintf(text, sizeof(text), "%.2f new per %s", static_cast<double>(allocs) / std::max<int64_t>(count, 1), operation);
+#else
+	snprintf(text, sizeof(text), "new per %s not counted", operation);
+#endif
+	return text;
+}
+
+// get the cpu time in microseconds used by the process so far, and the number of context switches where available
+void get_cpu_usage(int64_t* cpu_time, int64_t* switches)
+{
+	*cpu_time = 0;
+	*switches = 0;
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		ULARGE_INTEGER k, u;
+		k.LowPart = kernel.dwLowDateTime;
+		k.HighPart = kernel.dwHighDateTime;
+		u.LowPart = user.dwLowDateTime;
+		u.HighPart = user.dwHighDateTime;
+		*cpu_time = (k.QuadPart + u.QuadPart) / 10;
+	}
+#else
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage))
+	{
+		*cpu_time = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+		*switches = usage.ru_nvcsw + usage.ru_nivcsw;
+	}
+#endif
+}
+
+// get the number of write system calls made by the process so far, -1 where it is not available
+int64_t get_write_calls()
+{
+#ifdef _WIN32
+	IO_COUNTERS counters;
+	return GetProcessIoCounters(GetCurrentProcess(), &counters) ? static_cast<int64_t>(counters.WriteOperationCount) : -1;
+#else
+	int64_t calls = -1;
+	char line[256];
+	FILE* fp = fopen("/proc/self/io", "r");
+	while (fp && fgets(line, sizeof(line), fp))
+	{
+		if (!strncmp(line, "syscw:", 6))
+			calls = atoll(line + 6);
+	}
+	if (fp)
+		fclose(fp);
+	return calls;
+#endif
+}
+
+// count the data TLB misses of the calling thread from start to stop, -1 where the counter cannot be opened
+class TlbCounter
+{
+public:
+	TlbCounter()
+	{
+		m_fd = -1;
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+	}
+
+	~TlbCounter()
+	{
+#ifdef __linux__
+		if (m_fd >= 0)
+			::close(m_fd);
+#endif
+	}
+
+	void start()
+	{
+#ifdef __linux__
+		if (m_fd >= 0)
+		{
+			ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	int64_t stop()
+	{
+		int64_t count = -1;
+#ifdef __linux__
+		if (m_fd >= 0)
+		{
+			ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+				count = -1;
+		}
+#endif
+		return count;
+	}
+
+protected:
+	int m_fd;
+};
+
+// The thread tuning benchmark, the wake-up jitter of a capturing thread under load, then the TLB misses with every kind of pages
+// A thread wakes up every period microseconds like a capturing thread waiting on its socket, while one thread per core
+// copies memory around like the muxing and the analytics. It runs untuned, pinned to the last core, pinned there with the load
+// kept off that core, and under SCHED_FIFO. Then the storage of mb megabytes is mapped with every kind of pages, read at random
+// offsets like the readers spread over the buffer, and a circular buffer with its arena on those pages is filled.
+int benchmark_tuning(int seconds, int period, int mb)
+{
+	int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	std::string last = std::to_string(cores - 1);
+	std::string others = cores > 1 ? "0-" + std::to_string(cores - 2) : "";
+	const char* names[4] = { "untuned", "pinned", "pinned, load elsewhere", "SCHED_FIFO" };
+	for (int pass = 0; pass < 4; pass++)
+	{
+		std::atomic<bool> stop(false);
+		std::vector<std::thread> load;
+		FfmpegLibrary::ThreadTuning load_tuning;
+		load_tuning.set_cpus(pass == 2 ? others : "");
+		for (int i = 0; i < cores; i++)
+		{
+			load.push_back(std::thread([&stop]()
+			{
+				std::vector<uint8_t> from(8 * 1024 * 1024, 1), to(8 * 1024 * 1024);
+				while (!stop.load(std::memory_order_relaxed))
+				{
+					memcpy(to.data(), from.data(), from.size());
+					from[to[12345] & 0xffff]++;
+				}
+			}));
+			load_tuning.apply(load.back());
+		}
+
+		FfmpegLibrary::Histogram lateness;
+		std::thread capture([&]()
+		{
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+			for (int64_t i = 0; i < static_cast<int64_t>(seconds) * 1000000 / period; i++)
+			{
+				next += std::chrono::microseconds(period);
+				std::this_thread::sleep_until(next);
+				lateness.add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - next).count());
+			}
+		});
+		FfmpegLibrary::ThreadTuning tuning;
+		tuning.set_cpus(pass ? last : "");
+		tuning.set_priority(pass == 3 ? "50" : "0");
+		std::string refused = tuning.apply(capture) < 0 ? " (" + tuning.get_error_message() + ")" : "";
+		capture.join();
+		stop = true;
+		for (std::thread& t : load)
+		{
+			t.join();
+		}
+		fprintf(stderr, "%s%s: wake-up lateness median %lldus, 99%% %lldus, 99.9%% %lldus, max %lldus\n", names[pass], refused.c_str(),
+			lateness.get_percentile(50), lateness.get_percentile(99), lateness.get_percentile(99.9), lateness.get_max());
+	}
+
+	const char* kinds[3] = { "normal pages", "transparent hugepages", "explicit hugepages" };
+	size_t size = static_cast<size_t>(mb) * 1024 * 1024;
+	int reads = 20000000;
+	for (int kind = HUGEPAGES_NONE; kind <= HUGEPAGES_EXPLICIT; kind++)
+	{
+		int got = kind;
+		size_t mapped = 0;
+		uint8_t* p = static_cast<uint8_t*>(FfmpegLibrary::map_storage(size, &got, -1, &mapped));
+		if (!p)
+		{
+			fprintf(stderr, "%s: cannot map %dMB\n", kinds[kind], mb);
+			continue;
+		}
+		memset(p, 1, size);
+
+		uint64_t seed = 88172645463325252ULL;
+		int64_t sum = 0;
+		TlbCounter tlb;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		tlb.start();
+		for (int i = 0; i < reads; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			sum += p[seed % size];
+		}
+		int64_t misses = tlb.stop();
+		int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		FfmpegLibrary::unmap_storage(p, mapped);
+
+		// the circular buffer with its arena on the same kind of pages, filled with the generator packets
+		FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+		FfmpegLibrary::PacketGenerator generator;
+		FfmpegLibrary::AVPacket* pkt = FfmpegLibrary::av_packet_alloc();
+		cb->set_options("arena", "true");
+		cb->set_options("hugepages", kind == HUGEPAGES_EXPLICIT ? "explicit" : kind ? "transparent" : "none");
+		cb->open(3600, static_cast<int>(std::min<size_t>(size, INT32_MAX)), 1 << 16);
+		cb->add_stream(generator.get_stream());
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		while (generator.get_bytes() < static_cast<int64_t>(size) * 2)
+		{
+			generator.next_packet(pkt);
+			cb->push_packet(pkt);
+			FfmpegLibrary::av_packet_unref(pkt);
+		}
+		int64_t push = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t1).count();
+		fprintf(stderr, "%s, got %s: %.1fns per random read, %lld dTLB misses per 1000 reads (%lld), buffer got %s, %.0fns per push%s\n",
+			kinds[kind], kinds[got], static_cast<double>(elapsed) / reads, misses < 0 ? -1LL : misses * 1000 / reads, sum & 1,
+			kinds[cb->get_hugepages()], static_cast<double>(push) / generator.get_packets(), misses < 0 ? ", no TLB counter" : "");
+		FfmpegLibrary::av_packet_free(&pkt);
+		delete cb;
+	}
+	return 0;
+}
+
+// The durability benchmark, the generator packets recorded in real time into 5s chunks with every durability policy
+// The recorder runs in sync mode so the time of record() includes the sync requests, while the syncs are done by the syncing
+// thread. The bytes at risk are sampled at every packet, the histograms of the syncs are taken from the recorder at the end.
+int benchmark_sync(int seconds, std::string prefix)
+{
+	const char* policies[5][2] = { { "sync", "none" }, { "sync_fragments", "1" }, { "sync_fragments", "5" }, { "sync_interval", "500" }, { "sync_close", "true" } };
+	for (int pass = 0; pass < 5; pass++)
 	{
-		if (value == "false")
+		FfmpegLibrary::PacketGenerator generator;
+		generator.set_options("fps", "30");
+		generator.set_options("gop", "30");
+		generator.set_options("realtime", "true");
+		FfmpegLibrary::VideoRecorder* recorder = new FfmpegLibrary::VideoRecorder();
+		recorder->add_stream(generator.get_stream());
+		recorder->set_options("movflags", "frag_keyframe");
+		if (pass)
 		{
-			m_flag_wclk = false;
-
-			m_err = 0;
-			m_message = "'wall clock alignment' flag is set to false";
+			recorder->set_options(policies[pass][0], policies[pass][1]);
+		}
+		if (recorder->open(prefix + "sync-", 5) < 0)
+		{
+			fprintf(stderr, "Cannot open the recorder: %s\n", recorder->get_error_message().c_str());
+			delete recorder;
+			return 1;
 		}
-		else if (value == "true")
-		{ 
-			m_flag_wclk = true;
 
-			m_err = 0;
-			m_message = "'wall clock alignment' flag is set to true";
+		FfmpegLibrary::Histogram record_time;
+		int64_t max_risk = 0;
+		std::vector<std::string> chunks(1, recorder->get_url());
+		FfmpegLibrary::AVPacket* pkt = FfmpegLibrary::av_packet_alloc();
+		for (int i = 0; i < seconds * 30; i++)
+		{
+			generator.next_packet(pkt);
+			int64_t t = FfmpegLibrary::av_gettime_relative();
+			recorder->record(pkt);
+			record_time.add(FfmpegLibrary::av_gettime_relative() - t);
+			max_risk = std::max(max_risk, recorder->get_metrics().bytes_at_risk);
+			if (recorder->get_url() != chunks.back())
+			{
+				chunks.push_back(recorder->get_url());
+			}
 		}
-		else
+		FfmpegLibrary::av_packet_free(&pkt);
+		int64_t risk = recorder->get_metrics().bytes_at_risk;
+		recorder->close();
+
+		FfmpegLibrary::RecorderMetrics metrics = recorder->get_metrics();
+		FfmpegLibrary::HistogramSnapshot* sync = &metrics.sync_latency;
+		fprintf(stderr, "%s %s: record median %lldus, 99%% %lldus, max %lldus; %lld syncs, %lld failed, average %lldus, max %lldus; "
+			"at risk max %lldKB, %lldKB before close, %lldKB after\n",
+			policies[pass][0], policies[pass][1], record_time.get_percentile(50), record_time.get_percentile(99), record_time.get_max(),
+			metrics.syncs, metrics.sync_errors, sync->count ? sync->sum / sync->count : 0, sync->max, max_risk / 1024, risk / 1024,
+			metrics.bytes_at_risk / 1024);
+		delete recorder;
+		for (std::string& url : chunks)
 		{
-			m_message = "unkown value of '" + value + "' for 'wall clock alignment' flag setting.";
-			m_err = -1;
+			remove(url.c_str());
 		}
-		return m_err;
 	}
+	return 0;
+}
 
-	if (option == "interleaved_write")
+// The recording file benchmark, a chunk of seconds of the generator packets written the way the mp4 muxer does, through
+// avio_open, then through the recording file without and with the preallocation. The muxer writes the header, every packet
+// as it comes, and at the trailer goes back to patch the size of the media data before appending the index.
+// The write system calls are counted by the system, the packets are given at once so only the output is measured.
+int benchmark_file(int seconds, int64_t bitrate, std::string url)
+{
+	const char* names[3] = { "avio_open", "recording file", "recording file, preallocated" };
+	std::vector<uint8_t> index(4096, 0);
+	for (int pass = 0; pass < 3; pass++)
 	{
-		if (value == "false")
+		FfmpegLibrary::PacketGenerator generator;
+		generator.set_options("bitrate", std::to_string(bitrate));
+		generator.set_options("realtime", "false");
+		int64_t packets = static_cast<int64_t>(seconds) * 30;
+		int buffer_size = FfmpegLibrary::RecordingFile::get_buffer_size(bitrate);
+		int64_t prealloc = pass == 2 ? FfmpegLibrary::RecordingFile::get_expected_size(bitrate, seconds) : 0;
+
+		int64_t calls = get_write_calls();
+		std::atomic<int64_t> writes(0);
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		FfmpegLibrary::AVIOContext* pb = NULL;
+		int err = pass ? FfmpegLibrary::RecordingFile::open(&pb, url, buffer_size, prealloc, &writes) : FfmpegLibrary::avio_open(&pb, url.c_str(), AVIO_FLAG_WRITE);
+		if (err < 0)
 		{
-			m_flag_interleaved = false;
+			fprintf(stderr, "cannot open %s: %s\n", url.c_str(), FfmpegLibrary::av_err(err));
+			return 1;
+		}
 
-			m_err = 0;
-			m_message = "'interleaved writting' flag is set to false";
+		FfmpegLibrary::AVPacket* pkt = FfmpegLibrary::av_packet_alloc();
+		FfmpegLibrary::avio_write(pb, index.data(), 48); // ftyp and the header of mdat
+		for (int64_t i = 0; i < packets; i++)
+		{
+			generator.next_packet(pkt);
+			FfmpegLibrary::avio_write(pb, pkt->data, pkt->size);
+			FfmpegLibrary::av_packet_unref(pkt);
 		}
-		else if (value == "true")
+		FfmpegLibrary::av_packet_free(&pkt);
+		int64_t end = FfmpegLibrary::avio_seek(pb, 0, SEEK_CUR);
+		FfmpegLibrary::avio_seek(pb, 40, SEEK_SET);
+		FfmpegLibrary::avio_write(pb, index.data(), 8);
+		FfmpegLibrary::avio_seek(pb, end, SEEK_SET);
+		for (int64_t i = 0; i < packets; i += 256) // about 16 bytes of the index per sample
 		{
-			m_flag_interleaved = true;
-
-			m_err = 0;
-			m_message = "'interleaved writting' flag is set to true";
+			FfmpegLibrary::avio_write(pb, index.data(), static_cast<int>(index.size()));
 		}
-		else
+		err = pass ? FfmpegLibrary::RecordingFile::closep(&pb) : FfmpegLibrary::avio_closep(&pb);
+		int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		calls = calls < 0 ? -1 : get_write_calls() - calls;
+
+		int64_t size = -1;
+		int64_t allocated = -1;
+#ifndef _WIN32
+		struct stat st;
+		if (!stat(url.c_str(), &st))
 		{
-			m_message = "unkown value of '" + value + "' for 'interleaved writting' flag setting.";
-			m_err = -1;
+			size = st.st_size;
+			allocated = static_cast<int64_t>(st.st_blocks) * 512;
+		}
+#endif
+		fprintf(stderr, "%s, %ds at %lldbps, buffer %dKB, preallocated %lldKB: %lld write calls (%lld counted by the file), %lldms, size %lld, allocated %lld%s\n",
+			names[pass], seconds, bitrate, pass ? buffer_size / 1024 : 32, prealloc / 1024, calls, pass ? writes.load() : -1LL,
+			elapsed / 1000, size, allocated, err < 0 ? ", failed" : "");
+		remove(url.c_str());
+		if (err < 0)
+		{
+			return 1;
 		}
-		return m_err;
 	}
+	return 0;
+}
 
-	if (option == "format")
+// The rescaler benchmark, the accuracy of every path against av_rescale_q_rnd then the time to rescale a packet
+// The time stamps checked are random ones of every magnitude, the halves of the ratio, and the edges of the 64-bit paths.
+// The throughput compares the old integer factor, av_rescale_q on every field, and the rescaler.
+int benchmark_rescale(int packets)
+{
+	FfmpegLibrary::AVRational bases[][2] = {
+		{ { 1, 90000 }, { 1, 90000 } }, { { 1, 90000 }, { 1, 1000 } }, { { 1, 1000 }, { 1, 90000 } },
+		{ { 1, 90000 }, { 1, 15360 } }, { { 1, 48000 }, { 1, 44100 } }, { { 1001, 30000 }, { 1, 90000 } },
+		{ { 1, 1000000 }, { 1, 90000 } }, { { 1, 3 }, { 1, 1000000007 } }, { { 7, 1000000007 }, { 1, 3 } } };
+	int count = sizeof(bases) / sizeof(bases[0]);
+	uint64_t seed = 88172645463325252ULL;
+	auto next = [&seed]()
 	{
-		if (value.length() < 1 || value.length() > 10)
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		return seed;
+	};
+
+	int64_t mismatches = 0;
+	int64_t checked = 0;
+	for (int b = 0; b < count; b++)
+	{
+		FfmpegLibrary::Rescaler rescaler;
+		rescaler.set(bases[b][0], bases[b][1]);
+		std::vector<int64_t> values = { 0, 1, -1, INT64_MAX, INT64_MIN + 1, INT64_MAX / 2, INT64_MIN / 2 };
+		int64_t div = static_cast<int64_t>(bases[b][0].den) * bases[b][1].num;
+		for (int64_t k = -3; k <= 3; k++)
 		{
-			m_format = "mp4";
-
-			m_err = -1;
-			m_message = value + " is invalid for 'file format' option setting";
+			values.push_back(k * div + div / 2); // the halves
+			values.push_back(k * div + div / 2 + 1);
 		}
-		else
+		for (int i = 0; i < 200000; i++)
 		{
-			m_format = value;
-			m_message = "'file format' option is set to be " + value;
-			m_err = 0;
+			int64_t v = static_cast<int64_t>(next());
+			values.push_back(v >> (next() % 63)); // every magnitude, both signs
 		}
 
-		return m_err;
+		int64_t wrong = 0;
+		for (int64_t v : values)
+		{
+			if (v == AV_NOPTS_VALUE)
+				continue;
+			int64_t expected = FfmpegLibrary::av_rescale_q_rnd(v, bases[b][0], bases[b][1], FfmpegLibrary::AV_ROUND_NEAR_INF);
+			wrong += rescaler.rescale(v) != expected;
+			checked++;
+		}
+		mismatches += wrong;
+		fprintf(stderr, "%d/%d -> %d/%d, path %d: %d time stamps checked, %lld wrong\n", bases[b][0].num, bases[b][0].den,
+			bases[b][1].num, bases[b][1].den, rescaler.get_path(), static_cast<int>(values.size()), wrong);
 	}
-	return av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
+	fprintf(stderr, "accuracy: %lld time stamps checked, %lld wrong\n", checked, mismatches);
+
+	// the throughput on a packet of 30fps video, rescaled from 90kHz into each output time base
+	FfmpegLibrary::AVRational outputs[3] = { { 1, 90000 }, { 1, 1000 }, { 1, 15360 } };
+	for (int o = 0; o < 3; o++)
+	{
+		FfmpegLibrary::AVRational in = { 1, 90000 };
+		FfmpegLibrary::AVRational factor = { in.num * outputs[o].den, in.den * outputs[o].num };
+		FfmpegLibrary::Rescaler rescaler;
+		rescaler.set(in, outputs[o]);
+
+		int64_t elapsed[3];
+		int64_t sum[3] = { 0, 0, 0 };
+		for (int pass = 0; pass < 3; pass++)
+		{
+			FfmpegLibrary::AVPacket pkt;
+			memset(&pkt, 0, sizeof(pkt));
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			for (int i = 0; i < packets; i++)
+			{
+				pkt.pts = i * 3000LL + 6000;
+				pkt.dts = i * 3000LL;
+				pkt.duration = 3000;
+				if (pass == 0)
+				{
+					pkt.pts *= factor.num / factor.den;
+					pkt.dts *= factor.num / factor.den;
+					pkt.duration *= factor.num / factor.den;
+				}
+				else if (pass == 1)
+				{
+					pkt.pts = FfmpegLibrary::av_rescale_q(pkt.pts, in, outputs[o]);
+					pkt.dts = FfmpegLibrary::av_rescale_q(pkt.dts, in, outputs[o]);
+					pkt.duration = FfmpegLibrary::av_rescale_q(pkt.duration, in, outputs[o]);
+				}
+				else
+				{
+					rescaler.rescale_packet(&pkt);
+				}
+				sum[pass] += pkt.pts + pkt.dts + pkt.duration;
+			}
+			elapsed[pass] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		}
+		fprintf(stderr, "90kHz -> 1/%d, %d packets: integer factor %.2fns (%s), av_rescale_q %.2fns, rescaler %.2fns per packet\n",
+			outputs[o].den, packets, static_cast<double>(elapsed[0]) / packets, sum[0] == sum[1] ? "exact" : "wrong",
+			static_cast<double>(elapsed[1]) / packets, static_cast<double>(elapsed[2]) / packets);
+		if (sum[2] != sum[1])
+		{
+			mismatches++;
+		}
+	}
+
+	return mismatches ? 1 : 0;
 }
 
-int VideoRecorder::add_stream(AVStream* stream)
+// The event benchmark, an event triggered on a buffer filled with the generator packets and still fed in real time
+// The backlog of pre seconds is written at once, then the live packets are followed. The event is triggered again every
+// 500ms for a while, which only extends it, so it ends post seconds after the last trigger in a single file.
+// The time to drain the pre-roll alone is measured with an export of the same range.
+int benchmark_event(int pre, int post, std::string prefix)
 {
-	m_err = 0;
-	m_message = "";
+	FfmpegLibrary::PacketGenerator gen;
+	FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+	cb->open(30, 100 * 1000 * 1000);
+	cb->add_stream(gen.get_stream());
 
-	// return an error code when no stream can be found
-	if (!stream)
+	// fill the history at once, then push in real time
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&pkt);
+	for (int i = 0; i < (pre + 5) * 30; i++)
 	{
-		m_err = -1;
-		m_message = "Error. Empty stream cannot be added";
-		return m_err;
+		gen.next_packet(&pkt);
+		cb->push_packet(&pkt);
+		FfmpegLibrary::av_packet_unref(&pkt);
 	}
-
-	// Create a new format context for the output container format.
-	m_err = avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, "mp4", NULL);
-	if (m_err < 0)
+	std::atomic<bool> stop(false);
+	std::thread writer([&]
 	{
-		//m_message = "Error. Could not allocate output format context.";
-		m_message.assign(av_err(m_err));
-		return m_err;
+		FfmpegLibrary::AVPacket live;
+		FfmpegLibrary::av_init_packet(&live);
+		while (!stop)
+		{
+			FfmpegLibrary::av_usleep(1000000 / 30);
+			gen.next_packet(&live);
+			cb->push_packet(&live);
+			FfmpegLibrary::av_packet_unref(&live);
+		}
+	});
+
+	// the pre-roll alone, drained as fast as the disk allows, the packet times start at 0
+	int64_t newest = cb->get_metrics().pushed * 1000 / 30;
+	int64_t t0 = FfmpegLibrary::av_gettime_relative();
+	int drained = cb->export_range(newest - pre * 1000, newest, prefix + "preroll.mp4").get();
+	int64_t drain_time = FfmpegLibrary::av_gettime_relative() - t0;
+	fprintf(stderr, "pre-roll of %ds: %d packets written in %lldms\n", pre, drained, drain_time / 1000);
+
+	// one event, extended by the triggers every 500ms during 2s
+	t0 = FfmpegLibrary::av_gettime_relative();
+	int started = 0;
+	int extended = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		int ret = cb->trigger_event(pre, post, prefix + "event-");
+		started += ret > 0;
+		extended += ret == 0;
+		if (i < 4)
+			FfmpegLibrary::av_usleep(500000);
 	}
-
-	//m_ifmt_Ctx = ifmt_Ctx;
-	AVStream* out_stream = avformat_new_stream(m_ofmt_Ctx, NULL);
-	if (!out_stream)
+	int result = 0;
+	while (!(result = cb->get_event_result()))
 	{
-		m_err = -2;
-		m_message = "Error. Failed allocating output stream.";
-		return m_err;
+		FfmpegLibrary::av_usleep(10000);
 	}
+	int64_t event_time = FfmpegLibrary::av_gettime_relative() - t0;
+	fprintf(stderr, "event: %d started, %d extended, %d packets written, ended %lldms after the first trigger (%dms expected)\n",
+		started, extended, result, event_time / 1000, 2000 + post * 1000);
+
+	stop = true;
+	writer.join();
+	remove((prefix + "preroll.mp4").c_str());
+	remove(cb->get_event_url().c_str());
+	delete cb;
+	return 0;
+}
 
-	m_err = avcodec_parameters_copy(out_stream->codecpar, stream->codecpar);
-	if (m_err < 0)
+// The motion detector benchmark, the time the detector takes per frame with every kernel the processor has
+// The frames are synthetic luma planes with noise and a moving square. The analysed size is given, the full 1080p luma plane
+// is measured as well to show what the downscaling saves. The cost is given as the share of a core at the frame rate,
+// and the active cells of every kernel have to match the scalar kernel.
+int benchmark_motion(int width, int height, int frames, int fps)
+{
+	const char* kernels[3] = { "scalar", "sse2", "avx2" };
+	int sizes[2][2] = { { width, height }, { 1920, 1080 } };
+	frames = std::max(frames, 2);
+	for (int s = 0; s < 2; s++)
 	{
-		m_err = -3;
-		//m_message = "Error. Failed to copy the stream codec parameters.";
-		m_message.assign(av_err(m_err));
-		return m_err;
-	}
+		int w = sizes[s][0];
+		int h = sizes[s][1];
+		int stride = (w + 63) & ~63;
+
+		// a few frames with noise and a square moving over them, replayed in a loop
+		std::vector<std::vector<uint8_t> > planes(8, std::vector<uint8_t>(static_cast<size_t>(stride) * h));
+		unsigned int seed = 1;
+		for (int f = 0; f < 8; f++)
+		{
+			for (int y = 0; y < h; y++)
+			{
+				for (int x = 0; x < w; x++)
+				{
+					seed = seed * 1103515245 + 12345;
+					planes[f][static_cast<size_t>(y) * stride + x] = static_cast<uint8_t>(96 + ((seed >> 16) & 15) + x * 32 / w);
+				}
+			}
+			int size = std::max(8, h / 6);
+			int x0 = f * (w - size) / 8;
+			int y0 = (h - size) / 2;
+			for (int y = y0; y < y0 + size; y++)
+			{
+				memset(&planes[f][static_cast<size_t>(y) * stride + x0], 230, size);
+			}
+		}
 
-	out_stream->id = m_ofmt_Ctx->nb_streams - 1;
-	out_stream->codecpar->codec_tag = 0;
+		fprintf(stderr, "%dx%d luma, %d frames:\n", w, h, frames);
+		int64_t reference = -1;
+		for (int k = 0; k < 3; k++)
+		{
+			FfmpegLibrary::MotionDetector detector;
+			if (detector.set_options("simd", kernels[k]) < 0)
+			{
+				fprintf(stderr, "  %-6s not supported\n", kernels[k]);
+				continue;
+			}
 
-	if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-	{
-		m_index_video = out_stream->id;
-		m_time_base_video = stream->time_base;
-		m_video_stream = out_stream;
-	}
-	else if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-	{
-		m_index_audio = out_stream->id;
-		m_time_base_audio = stream->time_base;
-		m_audio_stream = out_stream;
-	}
+			int64_t active = 0;
+			int motion = 0;
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			for (int f = 0; f < frames; f++)
+			{
+				active += detector.detect(planes[f & 7].data(), w, h, stride);
+				motion += detector.is_motion();
+			}
+			int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+			if (reference < 0)
+			{
+				reference = active;
+			}
 
-	m_message = "stream is added to the recorder";
-	return m_err;
+			int64_t per_frame = elapsed / frames;
+			fprintf(stderr, "  %-6s %8lldns per frame, %6.3f%% of a core at %dfps, %lld active cells, %d frames with motion%s\n",
+				kernels[k], per_frame, per_frame * fps / 1e7, fps, active, motion, active == reference ? "" : ", MISMATCH with scalar");
+		}
+	}
+	return 0;
 }
 
-int VideoRecorder::open(std::string url, int chunk_interval)
+// The shared memory benchmark, the generator packets are pushed in real time into a circular buffer shared with other processes
+// The readers are forked processes attaching with a SharedReader and reading views, checking the packet numbers stamped in
+// the payloads. The first reader is killed half way, the push time before and after shows that a crashing reader costs nothing.
+int benchmark_shared(int readers, int seconds, int fps)
 {
-	if (url.empty())
+#ifdef _WIN32
+	fprintf(stderr, "The shared memory benchmark forks the readers, it runs on Linux only\n");
+	return -1;
+#else
+	std::string name = "/circularbuf-bench-" + std::to_string(getpid());
+	FfmpegLibrary::PacketGenerator gen;
+	gen.set_options("fps", std::to_string(fps));
+	gen.set_options("realtime", "true");
+
+	FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+	cb->set_options("shared_memory", name);
+	cb->open(10, 100 * 1000 * 1000);
+	if (!cb->get_error_message().empty())
 	{
-		m_err = -1;
-		m_message = "url cannot be empty";
-		return m_err;
+		fprintf(stderr, "%s\n", cb->get_error_message().c_str());
+		delete cb;
+		return -1;
 	}
+	cb->add_stream(gen.get_stream());
 
-	// validate the input chunk interval
-	if (chunk_interval < 0 || chunk_interval > 3600)
+	std::vector<pid_t> pids;
+	for (int r = 0; r < readers; r++)
 	{
-		m_err = -1;
-		m_message = "'chunk interval' setting shall be [0-3600]";
-		return m_err;
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			FfmpegLibrary::SharedReader reader;
+			if (reader.open(name) < 0)
+			{
+				fprintf(stderr, "reader %d: %s\n", r, reader.get_error_message().c_str());
+				_exit(1);
+			}
+
+			FfmpegLibrary::PacketView views[64];
+			int64_t n = 0, overwritten = 0, disorder = 0, last = -1;
+			while (true)
+			{
+				int ret = reader.peek_views(views, 64);
+				if (ret < 0)
+					break;
+				for (int i = 0; i < ret; i++)
+				{
+					int64_t number;
+					memcpy(&number, views[i].data, sizeof(number));
+					disorder += number <= last;
+					last = number;
+				}
+				if (reader.release_views() < 0)
+					overwritten++;
+				n += ret;
+				if (!ret)
+				{
+					if (!reader.is_writer_alive())
+						break;
+					FfmpegLibrary::av_usleep(1000);
+				}
+			}
+			fprintf(stderr, "reader %d: %lld packets, %lld runs overwritten while read, %lld lost, %lld out of order\n",
+				r, n, overwritten, reader.get_lost(), disorder);
+			_exit(disorder ? 2 : 0);
+		}
+		if (pid > 0)
+			pids.push_back(pid);
 	}
 
-	// positive chunk interval indicates segmentally recording, url is considered to be the file prefix of segmental files
-	if (chunk_interval > 0)
+	FfmpegLibrary::AVPacket pkt;
+	memset(&pkt, 0, sizeof(pkt));
+	FfmpegLibrary::av_init_packet(&pkt);
+	int packets = seconds * fps;
+	int64_t t_push[2] = { 0, 0 };
+	for (int i = 0; i < packets; i++)
 	{
-		m_chunk_prefix = url;
-		m_chunk_interval = chunk_interval * 1000;  // convert the interval into miliseconds
-		m_message = "chunked recording is set to be " + m_chunk_prefix + "yyyy-MM-dd-hhmmss" + m_chunk_prefix;
+		if (i == packets / 2 && !pids.empty())
+		{
+			kill(pids[0], SIGKILL);
+		}
+		gen.next_packet(&pkt);
+		auto t = std::chrono::steady_clock::now();
+		cb->push_packet(&pkt);
+		t_push[i >= packets / 2] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+		FfmpegLibrary::av_packet_unref(&pkt);
 	}
-	else
+	delete cb;
+
+	int failed = 0;
+	for (size_t r = 0; r < pids.size(); r++)
 	{
-		m_url = url;  // url is the full path of the recording video file
-		m_chunk_interval = 0; 
-		m_chunk_prefix = "";
-		m_message = "normal recording";
+		int status = 0;
+		waitpid(pids[r], &status, 0);
+		if (r > 0 && (!WIFEXITED(status) || WEXITSTATUS(status)))
+			failed++;
 	}
-
-	m_chunk_time = 0;
-	return chunk();
+	fprintf(stderr, "%d packets pushed at %d fps, push %lldns/op before killing reader 0, %lldns/op after, %d readers failed\n",
+		packets, fps, t_push[0] / std::max(packets / 2, 1), t_push[1] / std::max(packets - packets / 2, 1), failed);
+	return failed ? -1 : 0;
+#endif
 }
 
-// make another chunked recording
-// first stop current recording in case there is one. Then start another recording by chunk prefix.
-// return 0 on success
-int VideoRecorder::chunk()
+// The benchmark suite of the circular buffer driven by the synthetic packet generator, no camera is needed
+// The options are given as name=value, the ones not listed are passed to the generator (fps, bitrate, gop, keyframe_size, realtime)
+//  -packets, number of packets per phase, 30000 by default
+//  -readers, number of reader threads in the readers phase, 2 by default
+//  -span, -size, the time span in seconds and the maximum size in bytes of the buffer, 30 and 100000000 by default
+//  -arena, true to copy the payloads into the arena
+//  -mux, none by default, null to run the recorder with the null muxer, or a file prefix such as /dev/shm/bench- for tmpfs
+//  -views, true to read borrowed views instead of references in the readers and record phases
+//  -retention, evict by default, thin to thin the old GOPs before evicting for the size
+// The phases are push alone, push with the reader threads draining, peek and view alone, then push, peek and record of every packet
+// so that the cost of the buffer and the cost of the muxing are given apart.
+// The heap allocations per operation are only counted in a build with BENCH_ALLOC_COUNT defined.
+int benchmark_suite(std::vector<std::string> args)
 {
-	// to check the chunk setting
-	if (m_chunk_prefix.empty() || !m_chunk_interval)
-	{
-		m_err = -1;
-		m_message = "Invalid chunk settings.";
-		return m_err;
-	}
-
-	// uses m_chunk_time as an indicateor of first recording
-	if (m_chunk_time)
+	int packets = 30000, readers = 2, span = 30, size = 100 * 1000 * 1000;
+	std::string arena = "false", mux = "none", retention = "evict";
+	bool views = false;
+	FfmpegLibrary::PacketGenerator gen;
+	for (std::string& arg : args)
 	{
-		close();
-
-		if (m_err)
+		size_t eq = arg.find('=');
+		std::string name = arg.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+		if (name == "packets")
+			packets = std::max(atoi(value.c_str()), 100);
+		else if (name == "readers")
+			readers = std::max(std::min(atoi(value.c_str()), MAX_READERS - 1), 1);
+		else if (name == "span")
+			span = std::max(atoi(value.c_str()), 1);
+		else if (name == "size")
+			size = std::max(atoi(value.c_str()), 1000000);
+		else if (name == "arena")
+			arena = value;
+		else if (name == "mux")
+			mux = value;
+		else if (name == "views")
+			views = value == "true" || value == "1";
+		else if (name == "retention")
+			retention = value;
+		else if (gen.set_options(name, value) < 0)
 		{
-			return m_err;
+			fprintf(stderr, "%s\n", gen.get_error_message().c_str());
+			return -1;
 		}
 	}
 
-	// set next chunk time, at x:xx:00 if wall clock alignment is set
-	m_chunk_time = m_flag_wclk ? (av_gettime() / 1000 / m_chunk_interval + 1) * m_chunk_interval : av_gettime() / 1000 + m_chunk_interval; 
-		
-	// file name is set as <prefix><yyyy-MM-dd-hhmmss>.<ext>
-	m_url = m_chunk_prefix + get_date_time() + "." + m_format;
+	FfmpegLibrary::AVPacket pkt;
+	memset(&pkt, 0, sizeof(pkt));
+	FfmpegLibrary::av_init_packet(&pkt);
+	int64_t rss0, peak0, rss, peak;
+	get_memory_usage(&rss0, &peak0);
+	fprintf(stderr, "%d packets per phase, %ds/%dM buffer, arena %s, %s\n", packets, span, size / 1000000, arena.c_str(), views ? "views" : "references");
 
-	// try to solve the 
-	AVStream* st;
-	for (int i = 0; static_cast <unsigned int>(i) < m_ofmt_Ctx->nb_streams; i++)
+	// push alone, the pushes that evicted packets are timed apart to give the cost of the eviction
 	{
-		st = m_ofmt_Ctx->streams[i];
-		//m_ofmt_Ctx->streams[i]->start_time = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->duration = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->first_dts = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->cur_dts = AV_NOPTS_VALUE;
-		st->start_time = AV_NOPTS_VALUE;
-		st->duration = static_cast<int64_t>(m_chunk_interval) * 90;
-		st->first_dts = AV_NOPTS_VALUE;
-		st->cur_dts = 0;
+		FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+		cb->set_options("arena", arena);
+		if (cb->set_options("retention", retention) < 0)
+		{
+			fprintf(stderr, "%s\n", cb->get_error_message().c_str());
+			delete cb;
+			return -1;
+		}
+		cb->open(span, size);
+		cb->add_stream(gen.get_stream());
+		int64_t t_plain = 0, t_evict = 0, n_plain = 0, n_evict = 0, t_all = 0;
+		int64_t allocs = heap_allocations.load();
+		int last = 0;
+		for (int i = 0; i < packets; i++)
+		{
+			gen.next_packet(&pkt);
+			auto t = std::chrono::steady_clock::now();
+			int ret = cb->push_packet(&pkt);
+			int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+			FfmpegLibrary::av_packet_unref(&pkt);
+			t_all += dt;
+			if (ret <= last)
+			{
+				t_evict += dt;
+				n_evict++;
+			}
+			else
+			{
+				t_plain += dt;
+				n_plain++;
+			}
+			last = ret;
+		}
+		allocs = heap_allocations.load() - allocs;
+		FfmpegLibrary::BufferMetrics m = cb->get_metrics();
+		int64_t evicted = m.evicted_time + m.evicted_size + m.evicted_slots;
+		get_memory_usage(&rss, &peak);
+		fprintf(stderr, "push: %lldns/op, %.0f packets/s, %s, %lldk resident\n",
+			t_all / packets, packets * 1e9 / std::max<int64_t>(t_all, 1), format_allocations(allocs, packets, "push").c_str(), rss / 1024);
+		if (n_plain && n_evict && evicted)
+		{
+			fprintf(stderr, "eviction: %lld pushes without eviction at %lldns, %lld pushes evicting %lld packets (%lld time, %lld size, %lld slots) at %lldns, %lldns per packet evicted\n",
+				n_plain, t_plain / n_plain, n_evict, evicted, m.evicted_time, m.evicted_size, m.evicted_slots, t_evict / n_evict,
+				std::max<int64_t>(t_evict / n_evict - t_plain / n_plain, 0) * n_evict / evicted);
+		}
+
+		// the history kept from the oldest keyframe, shorter than the span when the size is the limit
+		int reader = cb->open_reader();
+		if (cb->peek_packet(&pkt, reader) > 0)
+			FfmpegLibrary::av_packet_unref(&pkt);
+		fprintf(stderr, "retention (%s): %lldms of history from the oldest keyframe, %d packets, %lld thinned\n",
+			retention.c_str(), cb->get_reader_lag_time(reader), cb->get_reader_lag(reader), m.thinned);
+		delete cb;
 	}
-	m_ofmt_Ctx->output_ts_offset = 0;
 
-	if (!(m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE))
+	// push with the reader threads draining the buffer as fast as they can
 	{
-		m_err = avio_open(&m_ofmt_Ctx->pb, m_url.c_str(), AVIO_FLAG_WRITE);
-		if (m_err < 0)
+		FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+		cb->set_options("arena", arena);
+		cb->open(span, size);
+		cb->add_stream(gen.get_stream());
+		std::vector<int> handles(readers);
+		std::vector<int64_t> read(readers, 0);
+		std::vector<std::thread> threads;
+		std::atomic<bool> stop(false);
+		for (int r = 0; r < readers; r++)
 		{
-			m_message.assign(av_err(m_err));
-			m_message = "Could not open " + m_url + " with error " + m_message;
-			return m_err;
+			handles[r] = cb->open_reader();
+			threads.push_back(std::thread([&, r]()
+			{
+				FfmpegLibrary::AVPacket p;
+				memset(&p, 0, sizeof(p));
+				FfmpegLibrary::av_init_packet(&p);
+				FfmpegLibrary::PacketView v[64];
+				while (!stop || cb->get_reader_lag(handles[r]) > 0)
+				{
+					if (views)
+					{
+						int n = cb->peek_views(v, 64, handles[r]);
+						cb->release_views(handles[r]);
+						if (n > 0)
+							read[r] += n;
+						else
+							std::this_thread::yield();
+					}
+					else if (cb->wait_packet(&p, handles[r], 10) > 0)
+					{
+						read[r]++;
+						FfmpegLibrary::av_packet_unref(&p);
+					}
+				}
+			}));
 		}
-	}
-	else
-	{
-		m_err = -1;
-		m_message = "Error: Previous recording is not closed.";
-		return m_err;
-	}
 
-	//m_err = avformat_write_header(m_ofmt_Ctx, &dictionary);
-	m_err = avformat_write_header(m_ofmt_Ctx, &m_options);
-	if (m_err < 0)
-	{
-		m_message.assign(av_err(m_err));
-		m_message += " Could not open " + m_url;
-		return m_err;
+		int64_t allocs = heap_allocations.load();
+		int64_t t_push = 0;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < packets; i++)
+		{
+			gen.next_packet(&pkt);
+			auto t = std::chrono::steady_clock::now();
+			cb->push_packet(&pkt);
+			t_push += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+			FfmpegLibrary::av_packet_unref(&pkt);
+		}
+		stop = true;
+		for (std::thread& t : threads)
+			t.join();
+		int64_t t_all = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		allocs = heap_allocations.load() - allocs;
+
+		int64_t total = 0, lost = 0;
+		for (int r = 0; r < readers; r++)
+		{
+			total += read[r];
+			lost += cb->get_reader_lost(handles[r]);
+		}
+		get_memory_usage(&rss, &peak);
+		fprintf(stderr, "%d readers: push %lldns/op, %.0f packets/s, %lld packets read, %lld lost, %s, %lldk resident\n",
+			readers, t_push / packets, packets * 1e9 / std::max<int64_t>(t_all, 1), total, lost, format_allocations(allocs, packets, "packet").c_str(), rss / 1024);
+		delete cb;
 	}
 
-	m_message = m_url + " is openned with return code " + std::to_string(m_err);
-	m_err = 0;
-
-	// update the time base factors used to rescale the time stamps of input packets to the output stream
-	m_tbf_audio = m_time_base_audio;
-	m_tbf_video = m_time_base_video;
-	m_defalt_duration_audio = 440;
-	m_defalt_duration_video = 3000;
-	
-	if (m_index_audio >= 0)
+	// peek alone, over packets kept in the buffer
 	{
-		m_tbf_audio.den *= m_ofmt_Ctx->streams[m_index_audio]->time_base.num;
-		m_tbf_audio.num *= m_ofmt_Ctx->streams[m_index_audio]->time_base.den;
-		m_defalt_duration_audio = m_ofmt_Ctx->streams[m_index_audio]->time_base.den / m_ofmt_Ctx->streams[m_index_audio]->time_base.num / 44000;
+		FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+		cb->set_options("arena", arena);
+		cb->open(3600, 2000 * 1000 * 1000, packets);
+		cb->add_stream(gen.get_stream());
+		int reader = cb->open_reader();
+		for (int i = 0; i < packets; i++)
+		{
+			gen.next_packet(&pkt);
+			cb->push_packet(&pkt);
+			FfmpegLibrary::av_packet_unref(&pkt);
+		}
+		cb->reset_reader(reader);
+
+		int64_t allocs = heap_allocations.load();
+		int n = 0;
+		auto t0 = std::chrono::steady_clock::now();
+		while (cb->peek_packet(&pkt, reader) > 0)
+		{
+			FfmpegLibrary::av_packet_unref(&pkt);
+			n++;
+		}
+		int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		allocs = heap_allocations.load() - allocs;
+		fprintf(stderr, "peek: %lldns/op, %.0f packets/s, %d packets, %s\n",
+			t / std::max(n, 1), n * 1e9 / std::max<int64_t>(t, 1), n, format_allocations(allocs, n, "peek").c_str());
+
+		// the same packets again as borrowed views, released after every batch
+		FfmpegLibrary::PacketView v[64];
+		cb->reset_reader(reader);
+		allocs = heap_allocations.load();
+		n = 0;
+		int ret;
+		t0 = std::chrono::steady_clock::now();
+		while ((ret = cb->peek_views(v, 64, reader)) > 0)
+		{
+			cb->release_views(reader);
+			n += ret;
+		}
+		t = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		allocs = heap_allocations.load() - allocs;
+		fprintf(stderr, "view: %lldns/op, %.0f packets/s, %d packets, %s\n",
+			t / std::max(n, 1), n * 1e9 / std::max<int64_t>(t, 1), n, format_allocations(allocs, n, "view").c_str());
+		delete cb;
 	}
 
-	if (m_index_video >= 0)
+	// push, peek and record every packet, the buffer cost and the muxing cost apart
+	if (mux != "none")
 	{
-		m_tbf_video.den *= m_ofmt_Ctx->streams[m_index_video]->time_base.num;
-		m_tbf_video.num *= m_ofmt_Ctx->streams[m_index_video]->time_base.den;
-		m_defalt_duration_video = m_ofmt_Ctx->streams[m_index_video]->time_base.den / m_ofmt_Ctx->streams[m_index_video]->time_base.num / 30;
+		FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+		cb->set_options("arena", arena);
+		cb->open(span, size);
+		cb->add_stream(gen.get_stream());
+		int reader = cb->open_reader();
+
+		FfmpegLibrary::VideoRecorder* recorder = new FfmpegLibrary::VideoRecorder();
+		if (mux == "null")
+			recorder->set_options("muxer", "null");
+		recorder->add_stream(cb->get_stream(0));
+		if (recorder->open(mux == "null" ? "null-" : mux, 3600) < 0)
+		{
+			fprintf(stderr, "Cannot open the recorder: %s\n", recorder->get_error_message().c_str());
+			delete recorder;
+			delete cb;
+			return -1;
+		}
+
+		int64_t t_buffer = 0, t_mux = 0;
+		for (int i = 0; i < packets; i++)
+		{
+			gen.next_packet(&pkt);
+			auto t = std::chrono::steady_clock::now();
+			cb->push_packet(&pkt);
+			FfmpegLibrary::av_packet_unref(&pkt);
+			FfmpegLibrary::PacketView v;
+			int ret = views ? cb->peek_views(&v, 1, reader) : cb->peek_packet(&pkt, reader);
+			auto t1 = std::chrono::steady_clock::now();
+			if (ret > 0 && views)
+				recorder->record_view(&v);
+			else if (ret > 0)
+				recorder->record(&pkt);
+			if (views)
+				cb->release_views(reader);
+			auto t2 = std::chrono::steady_clock::now();
+			t_buffer += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t).count();
+			t_mux += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+		}
+		auto t = std::chrono::steady_clock::now();
+		recorder->close();
+		int64_t t_close = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t).count();
+		std::string url = recorder->get_url();
+		FfmpegLibrary::RecorderMetrics m = recorder->get_metrics();
+		delete recorder;
+		if (mux != "null")
+			remove(url.c_str());
+
+		fprintf(stderr, "record (%s): buffer %lldns per packet, muxing %lldns per packet, %lld packets written, closed in %lldus\n",
+			mux.c_str(), t_buffer / packets, t_mux / packets, m.packets, t_close);
+		delete cb;
 	}
-	m_pts_offset_audio = 0;
-	m_pts_offset_video = 0;
 
-	return m_err;
+	get_memory_usage(&rss, &peak);
+	fprintf(stderr, "generator: %lld packets, %lldM payload allocated, resident memory %lldk before, %lldk peak\n",
+		gen.get_packets(), gen.get_bytes() / 1000000, rss0 / 1024, peak / 1024);
+	return 0;
 }
 
-int VideoRecorder::record(AVPacket* pkt, int stream_index)
+// Benchmark of the camera pool against one capturing thread per camera
+// The same url is opened by every camera, a local file is read as fast as it goes while a loopback rtsp server paces the cameras.
+// Every pass runs until the given seconds are over or all the cameras reach the end, then the cpu time per camera is shown.
+int benchmark_pool(std::string url, int cameras, int threads, int seconds)
 {
-	m_err = 0;
-	m_message = "";
-
-	// rescale the time stamp to the output stream
-	if (stream_index == m_index_audio)
+	std::string format = url.compare(0, 7, "rtsp://") ? "" : "rtsp";
+	for (int pass = 0; pass < 2; pass++)
 	{
-		pkt->pts *= m_tbf_audio.num / m_tbf_audio.den;
-		pkt->dts *= m_tbf_audio.num / m_tbf_audio.den;
+		std::vector<FfmpegLibrary::Camera*> cams(cameras);
+		std::vector<FfmpegLibrary::CircularBuffer*> bufs(cameras);
+		std::vector<std::thread> capturing;
+		std::vector<int64_t> packets(cameras, 0);
+		std::vector<bool> ok(cameras, false);
+		std::atomic<bool> stop(false);
+		std::atomic<int> finished(0);
+		FfmpegLibrary::CameraPool* camera_pool = new FfmpegLibrary::CameraPool();
+		camera_pool->set_options("threads", std::to_string(threads));
+
+		int opened = 0;
+		for (int i = 0; i < cameras; i++)
+		{
+			cams[i] = new FfmpegLibrary::Camera();
+			bufs[i] = new FfmpegLibrary::CircularBuffer();
+			cams[i]->set_options("format", format);
+			if (pass)
+				camera_pool->add_camera(cams[i], bufs[i]);
+			else
+				cams[i]->set_interrupt_callback([](void* opaque) -> int { return static_cast<std::atomic<bool>*>(opaque)->load() ? 1 : 0; }, &stop);
+			if (cams[i]->open(url) < 0)
+			{
+				fprintf(stderr, "Cannot open %s: %s\n", url.c_str(), cams[i]->get_error_message().c_str());
+				continue;
+			}
+			bufs[i]->open(10, 50 * 1000 * 1000);
+			if (cams[i]->get_video_index() >= 0)
+				bufs[i]->add_stream(cams[i]->get_stream(cams[i]->get_video_index()));
+			if (cams[i]->get_audio_index() >= 0)
+				bufs[i]->add_stream(cams[i]->get_stream(cams[i]->get_audio_index()));
+			ok[i] = true;
+			opened++;
+		}
 
-		if (pkt->duration)
+		int64_t cpu0, switches0, cpu1, switches1;
+		get_cpu_usage(&cpu0, &switches0);
+		int64_t t0 = FfmpegLibrary::av_gettime_relative();
+		if (pass)
 		{
-			pkt->duration *= m_tbf_audio.num / m_tbf_audio.den;
+			camera_pool->start();
 		}
 		else
 		{
-			pkt->duration = m_defalt_duration_audio;
+			// the way the capturing thread of the demo worked, blocking reads in a thread per camera
+			for (int i = 0; i < cameras; i++)
+			{
+				if (!ok[i])
+				{
+					finished++;
+					continue;
+				}
+				capturing.push_back(std::thread([&, i]()
+				{
+					FfmpegLibrary::AVPacket pkt;
+					memset(&pkt, 0, sizeof(pkt));
+					FfmpegLibrary::av_init_packet(&pkt);
+					while (!stop)
+					{
+						int ret = cams[i]->read_packet(&pkt);
+						if (ret == AVERROR_EOF)
+							finished++;
+						if (ret == AVERROR_EOF || ret == AVERROR_EXIT)
+							break;
+						if (ret >= 0 && (pkt.stream_index == cams[i]->get_video_index() || pkt.stream_index == cams[i]->get_audio_index()))
+						{
+							if (bufs[i]->push_packet(&pkt) >= 0)
+								packets[i]++;
+						}
+						FfmpegLibrary::av_packet_unref(&pkt);
+					}
+				}));
+			}
 		}
 
-		if (m_pts_offset_audio == 0)
+		// run until the time is over or all the cameras reach the end
+		bool running = true;
+		while (running && FfmpegLibrary::av_gettime_relative() - t0 < seconds * 1000000LL)
 		{
-			m_pts_offset_audio = -pkt->pts;
+			FfmpegLibrary::av_usleep(10000);
+			running = !pass && finished < cameras;
+			for (int i = 0; i < cameras && pass; i++)
+				running = running || !camera_pool->get_stats(i).finished;
 		}
-		pkt->pts += m_pts_offset_audio;
-		pkt->dts += m_pts_offset_audio;
-	}
-	else if (stream_index == m_index_video)
-	{
-		pkt->pts *= m_tbf_video.num / m_tbf_video.den;
-		pkt->dts *= m_tbf_video.num / m_tbf_video.den;
-		if (pkt->duration)
+		stop = true;
+		camera_pool->stop();
+		for (std::thread& t : capturing)
+			t.join();
+		int64_t t = FfmpegLibrary::av_gettime_relative() - t0;
+		get_cpu_usage(&cpu1, &switches1);
+
+		int64_t total = 0, polls = 0, reconnects = 0, dedicated = 0;
+		for (int i = 0; i < cameras; i++)
 		{
-			pkt->duration *= m_tbf_video.num / m_tbf_video.den;
+			if (pass)
+			{
+				FfmpegLibrary::CameraStats stats = camera_pool->get_stats(i);
+				packets[i] = stats.packets;
+				polls += stats.polls;
+				reconnects += stats.reconnects;
+				dedicated += stats.dedicated;
+			}
+			total += packets[i];
 		}
-		else
+		int64_t cpu = cpu1 - cpu0;
+		fprintf(stderr, "%s: %d cameras opened, %lld packets in %lldms, %.0f packets/s\n", pass ? "camera pool" : "thread per camera",
+			opened, total, t / 1000, total * 1e6 / std::max<int64_t>(t, 1));
+		fprintf(stderr, "cpu: %lldms in total, %.2f%% of a core per camera, %lldns per packet, %lld context switches\n",
+			cpu / 1000, cpu * 100.0 / std::max<int64_t>(t, 1) / std::max(cameras, 1), cpu * 1000 / std::max<int64_t>(total, 1), switches1 - switches0);
+		if (pass)
 		{
-			pkt->duration = m_defalt_duration_video;
+			fprintf(stderr, "pool: %d threads, %lld empty polls, %lld stalled reads reconnected, %lld cameras moved to their own thread\n",
+				std::min(threads, cameras), polls, reconnects, dedicated);
 		}
 
-		if (m_pts_offset_video == 0)
+		delete camera_pool;
+		for (int i = 0; i < cameras; i++)
 		{
-			m_pts_offset_video = -pkt->pts;
+			delete bufs[i];
+			delete cams[i];
 		}
-		pkt->pts += m_pts_offset_video;
-		pkt->dts += m_pts_offset_video;
 	}
+	return 0;
+}
 
-	pkt->stream_index = stream_index;
-	pkt->pos = -1;
-	
-	// check the interleaved flag
-	if (m_flag_interleaved)
-	{
-		m_err = av_interleaved_write_frame(m_ofmt_Ctx, pkt); // interleaved write will handle the packet unref
-	}
-	else
+// Benchmark of the payload arena against the per packet heap references
+// Synthetic packets at 30fps with a keyframe every 30 packets are allocated like the demuxer does, pushed into a 30s/100M buffer
+// and read by two readers. Run it once per mode in separate processes to compare the memory.
+int benchmark_arena(bool arena, int packets)
+{
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
+
+	int64_t rss0, peak0, rss1, peak1;
+	get_memory_usage(&rss0, &peak0);
+
+	FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+	cb->set_options("arena", arena ? "true" : "false");
+	cb->open(30, 100 * 1000 * 1000);
+	cb->add_stream(&st);
+	int bg = cb->open_reader();
+	int mn = cb->open_reader();
+
+	FfmpegLibrary::AVPacket src;
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&pkt);
+	std::vector<int64_t> latency(packets);
+	uint32_t random = 1;
+	for (int i = 0; i < packets; i++)
 	{
-		m_err = av_write_frame(m_ofmt_Ctx, pkt);
+		// keyframe of 100k, the others of 10k to 40k
+		random = random * 1103515245 + 12345;
+		int size = i % 30 ? 10000 + (random >> 8) % 30000 : 100000;
+		FfmpegLibrary::av_new_packet(&src, size);
+		memset(src.data, i & 0xff, size);
+		src.pts = src.dts = i * 3000;
+		src.flags = i % 30 ? 0 : AV_PKT_FLAG_KEY;
+
+		auto t0 = std::chrono::steady_clock::now();
+		cb->push_packet(&src);
+		latency[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		FfmpegLibrary::av_packet_unref(&src);
+
+		if (cb->peek_packet(&pkt, bg) > 0)
+			FfmpegLibrary::av_packet_unref(&pkt);
+		if (cb->peek_packet(&pkt, mn) > 0)
+			FfmpegLibrary::av_packet_unref(&pkt);
 	}
-	av_packet_unref(pkt);
+	get_memory_usage(&rss1, &peak1);
 
-	m_message = "packet written";
-	if (m_err)
+	int64_t total = 0;
+	for (int i = 0; i < packets; i++)
 	{
-		m_message.assign(av_err(m_err));
-		return m_err;
+		total += latency[i];
 	}
+	std::sort(latency.begin(), latency.end());
 
-	m_err = 0;
-	int64_t t = av_gettime() / 1000;
-	if (m_chunk_time && t >= m_chunk_time)
-	{
-		m_err = chunk();
-	}
-	//m_err = m_chunk_time && av_gettime() / 1000 >= m_chunk_time ? re_open() : 0;
+	fprintf(stderr, "%s: %d packets pushed, %d bytes in the buffer, %lld packets kept in the heap\n", 
+		arena ? "payload arena" : "heap references", packets, cb->get_size(), cb->get_arena_fallbacks());
+	fprintf(stderr, "push latency: average %lldns, median %lldns, 99%% %lldns, max %lldns\n",
+		total / packets, latency[packets / 2], latency[packets * 99 / 100], latency[packets - 1]);
+	fprintf(stderr, "resident memory: %lldk before, %lldk after, %lldk peak\n", rss0 / 1024, rss1 / 1024, peak1 / 1024);
 
-	return m_err;
+	delete cb;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	return 0;
 }
 
-int VideoRecorder::close()
+// Benchmark of the time record() holds the calling thread, writing synthetic packets in sync mode then in async mode
+// Point the prefix to a slow disk to see how a slow flush stalls the calling thread in sync mode.
+int benchmark_recorder(std::string prefix, int packets)
 {
-	// no close when no file is opened
-	if (m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE)
-		return -1;
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	par->codec_type = FfmpegLibrary::AVMEDIA_TYPE_VIDEO;
+	par->codec_id = FfmpegLibrary::AV_CODEC_ID_MPEG4;
+	par->width = 1280;
+	par->height = 720;
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
 
-	m_err = av_write_trailer(m_ofmt_Ctx);
-	if (m_err < 0)
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&pkt);
+	std::vector<int64_t> latency(packets);
+	for (int pass = 0; pass < 2; pass++)
 	{
-		m_message.assign(av_err(m_err));
-		return m_err;
-	}
+		FfmpegLibrary::VideoRecorder* recorder = new FfmpegLibrary::VideoRecorder();
+		recorder->add_stream(&st);
+		recorder->set_options("async", pass ? "true" : "false");
+		if (recorder->open(prefix + (pass ? "async-" : "sync-"), 3600) < 0)
+		{
+			fprintf(stderr, "Cannot open the recorder: %s\n", recorder->get_error_message().c_str());
+			delete recorder;
+			break;
+		}
 
-	avio_closep(&m_ofmt_Ctx->pb);
+		int64_t t0 = FfmpegLibrary::av_gettime_relative();
+		for (int i = 0; i < packets; i++)
+		{
+			int size = i % 30 ? 20000 : 200000;
+			FfmpegLibrary::av_new_packet(&pkt, size);
+			memset(pkt.data, i & 0xff, size);
+			pkt.pts = pkt.dts = i * 3000;
+			pkt.duration = 3000;
+			pkt.flags = i % 30 ? 0 : AV_PKT_FLAG_KEY;
+			pkt.stream_index = 0;
+			auto t = std::chrono::steady_clock::now();
+			recorder->record(&pkt);
+			latency[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+		}
+		int64_t t1 = FfmpegLibrary::av_gettime_relative();
+		FfmpegLibrary::RecorderStats stats = recorder->get_stats();
+		recorder->close();
+		int64_t t2 = FfmpegLibrary::av_gettime_relative();
+		std::string url = recorder->get_url();
+		delete recorder;
+		remove(url.c_str());
+
+		std::sort(latency.begin(), latency.end());
+		fprintf(stderr, "%s: %d packets recorded in %lldms, closed in %lldms\n", pass ? "async" : "sync", packets, (t1 - t0) / 1000, (t2 - t1) / 1000);
+		fprintf(stderr, "record latency: median %lldns, 99%% %lldns, max %lldns\n", latency[packets / 2], latency[packets * 99 / 100], latency[packets - 1]);
+		if (pass)
+		{
+			fprintf(stderr, "queue: max depth %d, %lld packets blocked for %lldus in total, longest write %lldus\n",
+				stats.max_depth, stats.blocked, stats.blocked_time, stats.max_write_time);
+		}
+	}
 
-	m_message = m_url + " is closed.";
-	return m_err;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	return 0;
 }
 
-// get the stream codec parameter
-AVFormatContext* VideoRecorder::get_output_format_context()
+// Benchmark of the chunk rotation, 1s chunks of synthetic packets at 30fps with a keyframe every 45 packets
+// The rotation at the chunk time is compared with the rotation at keyframes with the next chunk opened ahead of time.
+int benchmark_rotation(std::string prefix, int seconds)
 {
-	m_err = 0;
-	m_message = "";
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	par->codec_type = FfmpegLibrary::AVMEDIA_TYPE_VIDEO;
+	par->codec_id = FfmpegLibrary::AV_CODEC_ID_MPEG4;
+	par->width = 1280;
+	par->height = 720;
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
 
-	return m_ofmt_Ctx;
-};
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&pkt);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		FfmpegLibrary::VideoRecorder* recorder = new FfmpegLibrary::VideoRecorder();
+		recorder->add_stream(&st);
+		recorder->set_options("rotation", pass ? "keyframe" : "clock");
+		if (recorder->open(prefix + (pass ? "keyframe-" : "clock-"), 1) < 0)
+		{
+			fprintf(stderr, "Cannot open the recorder: %s\n", recorder->get_error_message().c_str());
+			delete recorder;
+			break;
+		}
 
-// get the stream time base
-AVRational VideoRecorder::get_stream_time_base(int stream_index)
-{
-	m_err = 0;
-	m_message = "";
+		int64_t max_latency = 0;
+		for (int i = 0; i < seconds * 30; i++)
+		{
+			int size = i % 45 ? 20000 : 200000;
+			FfmpegLibrary::av_new_packet(&pkt, size);
+			memset(pkt.data, i & 0xff, size);
+			pkt.pts = pkt.dts = i * 3000;
+			pkt.duration = 3000;
+			pkt.flags = i % 45 ? 0 : AV_PKT_FLAG_KEY;
+			pkt.stream_index = 0;
+			int64_t t = FfmpegLibrary::av_gettime_relative();
+			recorder->record(&pkt);
+			max_latency = std::max(max_latency, FfmpegLibrary::av_gettime_relative() - t);
+			FfmpegLibrary::av_usleep(33333);
+		}
+		recorder->close();
 
-	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ofmt_Ctx->nb_streams)
-	{
-		return m_ofmt_Ctx->streams[stream_index]->time_base;
+		FfmpegLibrary::Histogram* h = recorder->get_rotation_latency();
+		fprintf(stderr, "%s rotation: %lld rotations, median %lldus, 99%% %lldus, max %lldus, longest record %lldus\n", pass ? "keyframe" : "clock",
+			h->get_count(), h->get_percentile(50), h->get_percentile(99), h->get_max(), max_latency);
+		delete recorder;
 	}
 
-	return AVRational{ 1,1 };
-};
-
-// get the error message of last operation
-std::string VideoRecorder::get_error_message()
-{
-	return m_message;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	return 0;
 }
 
-// get the recording filename or url
-std::string VideoRecorder::get_url()
+// Benchmark of the spill file behind a short circular buffer in the memory
+// Synthetic packets at 30fps are pushed by a writer thread, the memory keeps 2s while the spill file keeps the rest.
+// Then a reader opened at the oldest keyframe reads the whole history back and checks the payloads.
+int benchmark_spill(std::string url, int packets)
 {
-	return m_url;
-}
-}
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	par->codec_type = FfmpegLibrary::AVMEDIA_TYPE_VIDEO;
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
+
+	FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+	cb->set_options("spill_file", url);
+	cb->set_options("spill_size", std::to_string(512LL * 1024 * 1024));
+	cb->set_options("spill_span", "600");
+	cb->open(2, 100 * 1000 * 1000);
+	if (cb->get_error_message() != "")
+	{
+		fprintf(stderr, "%s\n", cb->get_error_message().c_str());
+	}
+	cb->add_stream(&st);
 
+	std::vector<int64_t> latency(packets);
+	FfmpegLibrary::AVPacket src;
+	FfmpegLibrary::av_init_packet(&src);
+	for (int i = 0; i < packets; i++)
+	{
+		int size = i % 30 ? 10000 + (i * 7919) % 20000 : 100000;
+		FfmpegLibrary::av_new_packet(&src, size);
+		memset(src.data, i & 0xff, size);
+		src.pts = src.dts = i * 3000;
+		src.flags = i % 30 ? 0 : AV_PKT_FLAG_KEY;
+		auto t0 = std::chrono::steady_clock::now();
+		cb->push_packet(&src);
+		latency[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		FfmpegLibrary::av_packet_unref(&src);
+		if (i % 10 == 9)
+		{
+			FfmpegLibrary::av_usleep(1000);
+		}
+	}
+	FfmpegLibrary::av_usleep(100 * 1000); // let the spill thread catch up
 
-// global variables
-FfmpegLibrary::CircularBuffer* cbuf; // global shared the circular buffer
-FfmpegLibrary::Camera* ipCam; // global shared IP camera
-//AVFormatContext* ifmt_Ctx = NULL;  // global shared input format context
-int64_t lastReadPacktTime = 0; // global shared time stamp for call back
-std::string prefix_videofile = "C:\\Users\\georges\\Documents\\CopTraxTemp\\";
-int Debug = 2;
+	int rd = cb->open_reader();
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&pkt);
+	int read = 0;
+	int corrupted = 0;
+	int64_t t0 = FfmpegLibrary::av_gettime_relative();
+	while (cb->peek_packet(&pkt, rd) > 0)
+	{
+		int i = static_cast<int>(pkt.pts / 3000);
+		if (pkt.size < 1 || pkt.data[0] != (i & 0xff) || pkt.data[pkt.size - 1] != (i & 0xff))
+		{
+			corrupted++;
+		}
+		read++;
+		FfmpegLibrary::av_packet_unref(&pkt);
+	}
+	int64_t t_read = FfmpegLibrary::av_gettime_relative() - t0;
+	std::sort(latency.begin(), latency.end());
+
+	fprintf(stderr, "%d packets pushed, %d bytes in the memory, %d packets in the spill file, %lld lost before spilling\n",
+		packets, cb->get_size(), cb->get_spilled_packets(), cb->get_spill_lost());
+	fprintf(stderr, "push latency: median %lldns, 99%% %lldns, max %lldns\n",
+		latency[packets / 2], latency[packets * 99 / 100], latency[packets - 1]);
+	fprintf(stderr, "read back %d packets in %lldms, %d corrupted, %lld lost\n", read, t_read / 1000, corrupted, cb->get_reader_lost(rd));
+
+	delete cb;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	remove(url.c_str());
+	return 0;
+}
 
-// This is the sub thread that captures the video streams from specified IP camera and saves them into the circular buffer
-// void* videoCapture(void* myptr)
-DWORD WINAPI videoCapture(LPVOID myPtr)
+// Benchmark of draining a full circular buffer, like a recorder catching up on the pre-roll
+// The same packets are read again and again by a reset reader, one packet per call then a run of packets per call.
+int benchmark_batch(int packets, int count)
 {
-	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
+	count = std::max(count, 1);
+
+	FfmpegLibrary::CircularBuffer* cb = new FfmpegLibrary::CircularBuffer();
+	cb->open(3600, 1000 * 1000 * 1000);
+	cb->add_stream(&st);
+	int rd = cb->open_reader();
+
+	FfmpegLibrary::AVPacket src;
+	FfmpegLibrary::av_init_packet(&src);
+	FfmpegLibrary::av_new_packet(&src, 1000);
+	for (int i = 0; i < packets; i++)
+	{
+		src.pts = src.dts = i * 3000;
+		src.flags = i % 30 ? 0 : AV_PKT_FLAG_KEY;
+		cb->push_packet(&src);
+	}
+	FfmpegLibrary::av_packet_unref(&src);
+
+	std::vector<FfmpegLibrary::AVPacket> pkts(count);
+	for (int i = 0; i < count; i++)
+	{
+		FfmpegLibrary::av_init_packet(&pkts[i]);
+	}
+	int rounds = std::max(1, 10000000 / std::max(packets, 1));
+	int64_t elapsed[2];
+	int64_t read[2] = { 0, 0 };
+	for (int pass = 0; pass < 2; pass++)
+	{
+		int64_t t0 = FfmpegLibrary::av_gettime_relative();
+		for (int r = 0; r < rounds; r++)
+		{
+			cb->reset_reader(rd);
+			int n;
+			while ((n = pass ? cb->peek_packets(pkts.data(), count, rd) : (cb->peek_packet(pkts.data(), rd) > 0)) > 0)
+			{
+				for (int i = 0; i < n; i++)
+				{
+					FfmpegLibrary::av_packet_unref(&pkts[i]);
+				}
+				read[pass] += n;
+			}
+		}
+		elapsed[pass] = FfmpegLibrary::av_gettime_relative() - t0;
+	}
 
-	int ret;
+	fprintf(stderr, "%d packets drained %d times\n", packets, rounds);
+	fprintf(stderr, "peek_packet:       %lldns per packet, %.0f packets/s\n", elapsed[0] * 1000 / read[0], read[0] * 1e6 / elapsed[0]);
+	fprintf(stderr, "peek_packets(%3d): %lldns per packet, %.0f packets/s\n", count, elapsed[1] * 1000 / read[1], read[1] * 1e6 / elapsed[1]);
 
-	FfmpegLibrary::AVRational tb = ipCam->get_stream_time_base();
-	tb.num *= 1000; // change the time base to be ms based
-	int index_video = ipCam->get_video_index();
+	delete cb;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	return 0;
+}
 
-	// read packets from IP camera and save it into circular buffer
-	while (true)
+// Benchmark of the delivery latency from push to read with several cameras served by one thread
+// Every camera has its own circular buffer and writer pushing a packet every interval microseconds.
+// The first pass polls the readers and sleeps 5ms when there is nothing to read like main used to do,
+// the second pass blocks in wait_packets on the signal shared by the buffers.
+int benchmark_wait(int cameras, int packets, int interval)
+{
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 1000000 };
+	cameras = std::min(std::max(cameras, 1), MAX_WAIT_BUFFERS);
+
+	FfmpegLibrary::PacketSignal signal;
+	signal.waiters = 0;
+	signal.turn = 0;
+	FfmpegLibrary::CircularBuffer* buffers[MAX_WAIT_BUFFERS];
+	int readers[MAX_WAIT_BUFFERS];
+	for (int i = 0; i < cameras; i++)
 	{
-		//ret = av_read_frame(ifmt_Ctx, &pkt); // read a frame from the camera
-		ret = ipCam->read_packet(&pkt);
+		buffers[i] = new FfmpegLibrary::CircularBuffer();
+		buffers[i]->set_signal(&signal);
+		readers[i] = buffers[i]->open_reader();
+	}
 
-		// handle the timeout, blue screen shall be added here
-		if (ret < 0)
+	for (int pass = 0; pass < 2; pass++)
+	{
+		std::vector<int64_t> pushed(cameras * packets);
+		std::vector<int64_t> latency;
+		latency.reserve(cameras * packets);
+		for (int i = 0; i < cameras; i++)
 		{
-			fprintf(stderr, "%s, error code=%d.\n", ipCam->get_error_message().c_str(), ret);
-			continue;
+			buffers[i]->open(30, 100 * 1000 * 1000);
+			buffers[i]->add_stream(&st);
+			buffers[i]->reset_reader(readers[i]);
 		}
 
-		if (pkt.stream_index == index_video)
+		std::vector<std::thread> writers;
+		for (int c = 0; c < cameras; c++)
 		{
-			ret = cbuf->push_packet(&pkt);  // add the packet to the circular buffer
-			if (ret > 0)
+			writers.push_back(std::thread([&, c]()
+			{
+				FfmpegLibrary::AVPacket src;
+				FfmpegLibrary::av_init_packet(&src);
+				FfmpegLibrary::av_new_packet(&src, 1000);
+				src.flags = AV_PKT_FLAG_KEY;
+				for (int i = 0; i < packets; i++)
+				{
+					FfmpegLibrary::av_usleep(interval);
+					src.pts = src.dts = i;
+					pushed[c * packets + i] = FfmpegLibrary::av_gettime_relative();
+					buffers[c]->push_packet(&src);
+				}
+				FfmpegLibrary::av_packet_unref(&src);
+			}));
+		}
+
+		FfmpegLibrary::AVPacket pkt;
+		FfmpegLibrary::av_init_packet(&pkt);
+		int64_t sleeps = 0;
+		while (static_cast<int>(latency.size()) < cameras * packets)
+		{
+			int got = -1;
+			if (pass == 0)
 			{
-				if (Debug > 2)
+				for (int i = 0; i < cameras && got < 0; i++)
+				{
+					if (buffers[i]->peek_packet(&pkt, readers[i]) > 0)
+						got = i;
+				}
+				if (got < 0)
 				{
-					fprintf(stderr, "Added a new packet (%lldms, %d). The circular buffer has %d packets with size %d now.\n",
-						pkt.pts * tb.num / tb.den, pkt.size, ret, cbuf->get_size());
+					FfmpegLibrary::av_usleep(1000 * 5);
+					sleeps++;
+					continue;
 				}
 			}
 			else
 			{
-				fprintf(stderr, "Error %s while push new packet into the circular buffer.\n", cbuf->get_error_message().c_str());
+				got = FfmpegLibrary::CircularBuffer::wait_packets(buffers, readers, cameras, &pkt, 1000);
+				sleeps++;
+				if (got < 0)
+				{
+					continue;
+				}
 			}
+			latency.push_back(FfmpegLibrary::av_gettime_relative() - pushed[got * packets + pkt.pts]);
+			FfmpegLibrary::av_packet_unref(&pkt);
+		}
+		for (size_t i = 0; i < writers.size(); i++)
+		{
+			writers[i].join();
+		}
+
+		int64_t total = 0;
+		for (size_t i = 0; i < latency.size(); i++)
+		{
+			total += latency[i];
+		}
+		std::sort(latency.begin(), latency.end());
+		fprintf(stderr, "%s: %d cameras, %d packets each, every %dus, %lld %s\n", pass ? "wait_packets" : "poll and sleep",
+			cameras, packets, interval, sleeps, pass ? "calls" : "sleeps");
+		fprintf(stderr, "delivery latency: average %lldus, median %lldus, 99%% %lldus, max %lldus\n",
+			total / static_cast<int64_t>(latency.size()), latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+	}
+
+	for (int i = 0; i < cameras; i++)
+	{
+		delete buffers[i];
+	}
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	return 0;
+}
+
+// Benchmark of the circular buffer against the AVPacketList chain it replaced
+// Synthetic packets at 30fps are pushed into a 30s buffer, two readers follow the writer.
+// The first pass runs writer and readers in turn on one thread to compare the raw cost per operation,
+// the second pass runs the writer in its own thread like videoCapture does.
+int benchmark_ring(int packets, int packet_size)
+{
+	FfmpegLibrary::AVPacket src;
+	FfmpegLibrary::AVPacket pkt;
+	FfmpegLibrary::av_init_packet(&src);
+	FfmpegLibrary::av_init_packet(&pkt);
+	if (FfmpegLibrary::av_new_packet(&src, packet_size) < 0)
+	{
+		fprintf(stderr, "Cannot allocate the synthetic packet.\n");
+		return -1;
+	}
+	src.flags = AV_PKT_FLAG_KEY;
+	int64_t pts_step = 3000; // 1/30s in 90kHz
+	int64_t pts_span = 30 * 90000;
+
+	// the AVPacketList chain, the way push_packet and peek_packet used to work
+	FfmpegLibrary::AVPacketList* first = NULL;
+	FfmpegLibrary::AVPacketList* last = NULL;
+	FfmpegLibrary::AVPacketList* bg_pkt = NULL;
+	FfmpegLibrary::AVPacketList* mn_pkt = NULL;
+	int64_t t0 = FfmpegLibrary::av_gettime_relative();
+	for (int i = 0; i < packets; i++)
+	{
+		src.pts = src.dts = i * pts_step;
+		FfmpegLibrary::AVPacketList* pktl = (FfmpegLibrary::AVPacketList*)FfmpegLibrary::av_mallocz(sizeof(FfmpegLibrary::AVPacketList));
+		FfmpegLibrary::av_packet_ref(&pktl->pkt, &src);
+		if (!last)
+			first = pktl;
+		else
+			last->next = pktl;
+		last = pktl;
+		bg_pkt = bg_pkt ? bg_pkt : last;
+		mn_pkt = mn_pkt ? mn_pkt : last;
+		while (first->pkt.pts < src.pts - pts_span)
+		{
+			pktl = first;
+			first = first->next;
+			bg_pkt = bg_pkt == pktl ? first : bg_pkt;
+			mn_pkt = mn_pkt == pktl ? first : mn_pkt;
+			FfmpegLibrary::av_packet_unref(&pktl->pkt);
+			FfmpegLibrary::av_freep(&pktl);
+		}
+
+		if (bg_pkt)
+		{
+			FfmpegLibrary::av_packet_ref(&pkt, &bg_pkt->pkt);
+			FfmpegLibrary::av_packet_unref(&pkt);
+			bg_pkt = bg_pkt->next;
+		}
+		if (mn_pkt)
+		{
+			FfmpegLibrary::av_packet_ref(&pkt, &mn_pkt->pkt);
+			FfmpegLibrary::av_packet_unref(&pkt);
+			mn_pkt = mn_pkt->next;
+		}
+	}
+	int64_t t_list = FfmpegLibrary::av_gettime_relative() - t0;
+	while (first)
+	{
+		FfmpegLibrary::AVPacketList* pktl = first;
+		first = first->next;
+		FfmpegLibrary::av_packet_unref(&pktl->pkt);
+		FfmpegLibrary::av_freep(&pktl);
+	}
+
+	// the slot ring, same pattern
+	FfmpegLibrary::AVStream st;
+	FfmpegLibrary::AVCodecParameters* par = FfmpegLibrary::avcodec_parameters_alloc();
+	memset(&st, 0, sizeof(st));
+	st.codecpar = par;
+	st.time_base = FfmpegLibrary::AVRational{ 1, 90000 };
+
+	FfmpegLibrary::CircularBuffer* ring = new FfmpegLibrary::CircularBuffer();
+	ring->open(30, 1000 * 1000 * 1000);
+	ring->add_stream(&st);
+	int bg = ring->open_reader();
+	int mn = ring->open_reader();
+	t0 = FfmpegLibrary::av_gettime_relative();
+	for (int i = 0; i < packets; i++)
+	{
+		src.pts = src.dts = i * pts_step;
+		ring->push_packet(&src);
+		if (ring->peek_packet(&pkt, bg) > 0)
+			FfmpegLibrary::av_packet_unref(&pkt);
+		if (ring->peek_packet(&pkt, mn) > 0)
+			FfmpegLibrary::av_packet_unref(&pkt);
+	}
+	int64_t t_ring = FfmpegLibrary::av_gettime_relative() - t0;
+
+	// the slot ring with the writer in its own thread
+	ring->open(30, 1000 * 1000 * 1000);
+	ring->add_stream(&st);
+	ring->reset_reader(bg);
+	ring->reset_reader(mn);
+	std::atomic<bool> done(false);
+	int read = 0;
+	t0 = FfmpegLibrary::av_gettime_relative();
+	std::thread writer([&]()
+	{
+		FfmpegLibrary::AVPacket wpkt;
+		FfmpegLibrary::av_init_packet(&wpkt);
+		FfmpegLibrary::av_packet_ref(&wpkt, &src);
+		for (int i = 0; i < packets; i++)
+		{
+			wpkt.pts = wpkt.dts = i * pts_step;
+			ring->push_packet(&wpkt);
+		}
+		FfmpegLibrary::av_packet_unref(&wpkt);
+		done = true;
+	});
+	while (true)
+	{
+		bool finished = done; // the writer has finished before this round of reading
+		int got = 0;
+		if (ring->peek_packet(&pkt, bg) > 0)
+		{
+			FfmpegLibrary::av_packet_unref(&pkt);
+			got++;
+		}
+		if (ring->peek_packet(&pkt, mn) > 0)
+		{
+			FfmpegLibrary::av_packet_unref(&pkt);
+			got++;
+		}
+		read += got;
+		if (!got && finished)
+		{
+			break;
 		}
-		av_packet_unref(&pkt); // handle the release of the packet here
 	}
+	writer.join();
+	int64_t t_threaded = FfmpegLibrary::av_gettime_relative() - t0;
+
+	fprintf(stderr, "%d packets of %d bytes, one push and two peeks per packet\n", packets, packet_size);
+	fprintf(stderr, "AVPacketList chain: %lldns per packet, %.0f packets/s\n", t_list * 1000 / packets, packets * 1e6 / t_list);
+	fprintf(stderr, "slot ring:          %lldns per packet, %.0f packets/s\n", t_ring * 1000 / packets, packets * 1e6 / t_ring);
+	fprintf(stderr, "slot ring threaded: %lldns per packet, %.0f packets/s, %d packets read by the readers, %lld packets lost\n", 
+		t_threaded * 1000 / packets, packets * 1e6 / t_threaded, read, ring->get_reader_lost(bg) + ring->get_reader_lost(mn));
+
+	delete ring;
+	FfmpegLibrary::avcodec_parameters_free(&par);
+	FfmpegLibrary::av_packet_unref(&src);
+	return 0;
 }
 
 int main(int argc, char** argv)
@@ -1562,7 +11947,59 @@ int main(int argc, char** argv)
 	//CameraPath = "rtsp://10.25.50.21/h264";
 	CameraPath = "rtsp://10.0.9.111:554/user=admin_password=tlJwpbo6_channel=1_stream=0";
 	std::string filename_bg = ""; // file name of background recording
-	std::string filename_mn = ""; // file name of main recording
+
+	// run the benchmarks instead of the camera test
+	//  -bench ring [packets] [packet size], the slot ring against the AVPacketList chain
+	//  -bench arena <true|false> [packets], the payload arena against the heap references
+	//  -bench wait [cameras] [packets] [interval us], polling against waiting for the packets of several cameras in one thread
+	//  -bench batch [packets] [count], draining the buffer one packet per call against count packets per call
+	//  -bench spill [packets] [file], reading the history back from the spill file behind 2s in the memory
+	//  -bench recorder [packets] [prefix], the time record() takes in sync mode against async mode
+	//  -bench rotation [seconds] [prefix], the chunk rotation at the chunk time against the rotation at keyframes
+	//  -bench pool <url> [cameras] [threads] [seconds], the camera pool against one capturing thread per camera
+	//  -bench suite [name=value ...], push, read and record the packets of the synthetic generator, see benchmark_suite
+	//  -bench shared [readers] [seconds] [fps], the buffer shared with reader processes, one of them killed half way
+	//  -bench motion [width] [height] [frames] [fps], the motion detector kernels on the downscaled luma and on 1080p
+	//  -bench event [pre] [post] [prefix], an event with its pre-roll drained at once and extended by triggers while it goes on
+	//  -bench rescale [packets], the accuracy of the rescaler against av_rescale_q_rnd and its time per packet
+	//  -bench file [seconds] [bitrate] [file], the write system calls of a chunk through avio_open against the recording file
+	//  -bench sync [seconds] [prefix], the time of record() and the syncs with every durability policy, with the bytes at risk
+	//  -bench tuning [seconds] [period us] [MB], the wake-up jitter of a thread under load with every tuning, then the TLB misses with every kind of pages
+	if (argc > 2 && !strcmp(argv[1], "-bench"))
+	{
+		if (!strcmp(argv[2], "ring"))
+			return benchmark_ring(argc > 3 ? atoi(argv[3]) : 1000000, argc > 4 ? atoi(argv[4]) : 20000);
+		if (!strcmp(argv[2], "arena"))
+			return benchmark_arena(argc > 3 && !strcmp(argv[3], "true"), argc > 4 ? atoi(argv[4]) : 100000);
+		if (!strcmp(argv[2], "wait"))
+			return benchmark_wait(argc > 3 ? atoi(argv[3]) : 4, argc > 4 ? atoi(argv[4]) : 1000, argc > 5 ? atoi(argv[5]) : 2000);
+		if (!strcmp(argv[2], "batch"))
+			return benchmark_batch(argc > 3 ? atoi(argv[3]) : 900, argc > 4 ? atoi(argv[4]) : 64);
+		if (!strcmp(argv[2], "spill"))
+			return benchmark_spill(argc > 4 ? argv[4] : "spill.bin", argc > 3 ? atoi(argv[3]) : 5000);
+		if (!strcmp(argv[2], "recorder"))
+			return benchmark_recorder(argc > 4 ? argv[4] : "bench-", argc > 3 ? atoi(argv[3]) : 3000);
+		if (!strcmp(argv[2], "rotation"))
+			return benchmark_rotation(argc > 4 ? argv[4] : "bench-", argc > 3 ? atoi(argv[3]) : 5);
+		if (!strcmp(argv[2], "suite"))
+			return benchmark_suite(std::vector<std::string>(argv + 3, argv + argc));
+		if (!strcmp(argv[2], "shared"))
+			return benchmark_shared(argc > 3 ? atoi(argv[3]) : 3, argc > 4 ? atoi(argv[4]) : 4, argc > 5 ? atoi(argv[5]) : 250);
+		if (!strcmp(argv[2], "motion"))
+			return benchmark_motion(argc > 3 ? atoi(argv[3]) : 160, argc > 4 ? atoi(argv[4]) : 90, argc > 5 ? atoi(argv[5]) : 3000, argc > 6 ? atoi(argv[6]) : 30);
+		if (!strcmp(argv[2], "event"))
+			return benchmark_event(argc > 3 ? atoi(argv[3]) : 5, argc > 4 ? atoi(argv[4]) : 2, argc > 5 ? argv[5] : "bench-");
+		if (!strcmp(argv[2], "rescale"))
+			return benchmark_rescale(argc > 3 ? atoi(argv[3]) : 10000000);
+		if (!strcmp(argv[2], "file"))
+			return benchmark_file(argc > 3 ? atoi(argv[3]) : 60, argc > 4 ? atoll(argv[4]) : FILE_DEFAULT_BITRATE, argc > 5 ? argv[5] : "bench-file.mp4");
+		if (!strcmp(argv[2], "sync"))
+			return benchmark_sync(argc > 3 ? atoi(argv[3]) : 10, argc > 4 ? argv[4] : "bench-");
+		if (!strcmp(argv[2], "tuning"))
+			return benchmark_tuning(argc > 3 ? atoi(argv[3]) : 5, argc > 4 ? atoi(argv[4]) : 1000, argc > 5 ? atoi(argv[5]) : 1024);
+		if (!strcmp(argv[2], "pool") && argc > 3)
+			return benchmark_pool(argv[3], argc > 4 ? atoi(argv[4]) : 16, argc > 5 ? atoi(argv[5]) : 2, argc > 6 ? atoi(argv[6]) : 10);
+	}
 
 	if (argc > 1)
 		CameraPath.assign(argv[1]);
@@ -1581,6 +12018,18 @@ int main(int argc, char** argv)
 	//ipCam->set_options("framerate", "30");
 	//ipCam->set_options("vcodec", "h264");
 
+	// the camera is read by the camera pool into the circular buffer, it has to be added before it is opened
+	cbuf = new FfmpegLibrary::CircularBuffer();
+	pool = new FfmpegLibrary::CameraPool();
+	pool->set_options("threads", "1");
+
+	// on a loaded box, pin the capturing thread away from the muxing and keep the buffer on the NUMA node of its core
+	//pool->set_options("cpus", "2");
+	//pool->set_options("realtime", "50");
+	//cbuf->set_options("numa_node", std::to_string(FfmpegLibrary::get_cpu_node(2)));
+	//cbuf->set_options("hugepages", "transparent");
+	pool->add_camera(ipCam, cbuf);
+
 	int ret = ipCam->open(CameraPath);
 	if (ret < 0)
 	{
@@ -1603,31 +12052,38 @@ int main(int argc, char** argv)
 	}
 
 	// Open a circular buffer
-	cbuf = new FfmpegLibrary::CircularBuffer();
 	cbuf->open(30, 100 * 1000 * 1000); // 30s and 100M
-	cbuf->add_stream(ifmt_Ctx->streams[0]);
+	cbuf->add_stream(ipCam->get_stream(ipCam->get_video_index()));
+	if (ipCam->get_audio_index() >= 0)
+	{
+		cbuf->add_stream(ipCam->get_stream(ipCam->get_audio_index()));
+	}
+	int bg_reader = cbuf->open_reader(); // reader for background recording
 
+	// the recorder takes the streams in the same order as the circular buffer, so that the stream index of the packets read can be used directly
 	FfmpegLibrary::VideoRecorder* bg_recorder = new FfmpegLibrary::VideoRecorder();
-	//ret = bg_recorder->add_stream(ifmt_Ctx->streams[0]);
-	ret = bg_recorder->add_stream(ipCam->get_stream(ipCam->get_video_index()));
+	for (int i = 0; i < cbuf->get_stream_count(); i++)
+	{
+		ret = bg_recorder->add_stream(cbuf->get_stream(i));
+	}
 
-	FfmpegLibrary::VideoRecorder* mn_recorder = new FfmpegLibrary::VideoRecorder();
-	ret = mn_recorder->add_stream(ifmt_Ctx->streams[0]);
+	// dump the metrics every 10s for the textfile collector of node_exporter
+	FfmpegLibrary::MetricsExporter* exporter = new FfmpegLibrary::MetricsExporter();
+	exporter->add_buffer("camera", cbuf);
+	exporter->add_camera("camera", ipCam);
+	exporter->add_recorder("background", bg_recorder);
+	exporter->start(prefix_videofile + "metrics.prom", 10);
 
 	int64_t ChunkTime_bg = 0;  // Chunk time for background recording
-	int64_t ChunkTime_mn = 0;  // Chunk time for main recording
-	int64_t CurrentTime;
+	int64_t MotionTime = 0;  // wall clock time in miliseconds of the last motion event
+	int64_t StartTime_mn = 0;  // wall clock time in miliseconds to start the next main recording from
 	int number_bg = 0;
 	int number_mn = 0;
 
-	// Start a seperate thread to capture video stream from the IP camera
-	//pthread_t thread;
-	//ret = pthread_create(&thread, NULL, videoCapture, NULL);
-	DWORD myThreadID;
-	HANDLE myHandle = CreateThread(0, 0, videoCapture, 0, 0, &myThreadID);
-	if (myThreadID == 0)
+	// Start the camera pool to capture video stream from the IP camera
+	if (pool->start() < 0)
 	{
-		fprintf(stderr, "Cannot create the timer thread.");
+		fprintf(stderr, "Cannot start the camera pool: %s\n", pool->get_error_message().c_str());
 		exit(1);
 	}
 	FfmpegLibrary::av_usleep(10 * 1000 * 1000); // sleep for a while to have the circular buffer accumulated
@@ -1635,120 +12091,85 @@ int main(int argc, char** argv)
 	FfmpegLibrary::AVPacket pkt;
 	FfmpegLibrary::AVRational timebase = cbuf->get_time_base();
 	int64_t pts0 = 0;
-	bool no_data = true;
-	bool main_recorder_recording = false;
 
 	bg_recorder->set_options("movflags", "frag_keyframe");
 	bg_recorder->set_options("format", "mp4"); // self defined option
-
-	mn_recorder->set_options("movflags", "frag_keyframe");
-	int64_t MainStartTime = FfmpegLibrary::av_gettime() / 1000 + 15000;
-	ChunkTime_mn = MainStartTime - 100;
+	bg_recorder->set_options("async", "true"); // a slow flush of one recording does not stall the other
+	bg_recorder->set_options("rotation", "keyframe"); // every chunk starts with a keyframe, the next one is opened ahead of time
+	bg_recorder->set_options("sync_fragments", "2"); // a power cut loses about the last two fragments, synced in the background
+	bg_recorder->set_options("sync_close", "true");
+	//bg_recorder->set_options("cpus", "3"); // the muxing and the segment threads, off the core of the capturing thread
+
+	// the main recordings are events triggered by motion in the video
+	FfmpegLibrary::MotionTrigger* trigger = new FfmpegLibrary::MotionTrigger();
+	if (trigger->open(cbuf) < 0)
+	{
+		fprintf(stderr, "Cannot start the motion trigger: %s\n", trigger->get_error_message().c_str());
+	}
 
 	// Open a chunked recording for background recording, where chunk time is 60s
 	ret = bg_recorder->open(prefix_videofile + "background-", 60);
 	filename_bg = bg_recorder->get_url();
 	av_dump_format(bg_recorder->get_output_format_context(), 0, filename_bg.c_str(), 1);
 
+	// the background reader is served by this thread, it sleeps until the capturing thread pushes a packet
 	while (true)
 	{
-		CurrentTime = FfmpegLibrary::av_gettime() / 1000;  // read current time in miliseconds
-		no_data = true;
-
-		// read a background packet from the queue
-		ret = cbuf->peek_packet(&pkt);
-		if (ret > 0)
+		// every check with motion pushes the end of the main recording the hold of the trigger further
+		// the first one starts it at the time given by the trigger, the preroll back from the motion
+		// the backlog and the live packets are written by the worker of the event, not by this thread
+		while (int event = trigger->poll(&MotionTime))
 		{
-			if (pts0 == 0)
-			{
-				pts0 = pkt.pts;
-				if (Debug > 1)
-				{
-					fprintf(stderr, "The first packet: pts=%lld, pts_time=%lld \n",
-						pts0, pts0 * timebase.num / timebase.den);
-				}
-			}
-
-			if (Debug > 2)
-			{
-				fprintf(stderr, "Read a background packet pts time: %lldms, dt: %lldms, packet size %d, total size: %d.\n",
-					1000 * pkt.pts * timebase.num / timebase.den,
-					1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, ret);
-			}
-
-			if (pkt.pts < pts0)
+			fprintf(stderr, event == MOTION_START ? "Motion detected.\n" : "Motion is over.\n");
+			StartTime_mn = event == MOTION_START ? MotionTime : StartTime_mn;
+		}
+		if (trigger->get_metrics().motion)
+		{
+			int pre = trigger->get_preroll();
+			if (StartTime_mn > 0)
 			{
-				fprintf(stderr, "error.\n");
+				pre = (int)((FfmpegLibrary::av_gettime() / 1000 - StartTime_mn + 999) / 1000);
 			}
-			if (bg_recorder->record(&pkt) < 0)
+			if (cbuf->trigger_event(pre, trigger->get_hold(), prefix_videofile + "main-") > 0)
 			{
-				fprintf(stderr, "%s muxing packet in %s.\n",
-					bg_recorder->get_error_message().c_str(),
-					filename_bg.c_str());
-				break;
+				fprintf(stderr, "Main recording is started, the last one gave %d.\n", cbuf->get_event_result());
+				StartTime_mn = 0;
 			}
-			no_data = false;
 		}
 
-		// arbitrary set main recording starts 15s later
-		if (CurrentTime <= MainStartTime)
+		// wake up every 20ms at least to check the motion
+		if (cbuf->wait_packet(&pkt, bg_reader, 20) <= 0)
 		{
-			if (no_data)
-			{
-				FfmpegLibrary::av_usleep(1000 * 20); //sleep for 20ms
-			}
 			continue;
 		}
 
-		if (!main_recorder_recording)
-		{
-			//filename_mn = prefix_videofile + "main-" + get_date_time() + ".mp4";
-			ret = mn_recorder->open(prefix_videofile + "main-", 3600);
-			av_dump_format(mn_recorder->get_output_format_context(), 0, mn_recorder->get_url().c_str(), 1);
-			main_recorder_recording = true;
-			ChunkTime_mn = CurrentTime + 60000;
-		}
-
-		// simulate the external chunk signal
-		if (ChunkTime_mn && CurrentTime > ChunkTime_mn)
-		{
-			ChunkTime_mn += 120000;
-			mn_recorder->chunk();
-			av_dump_format(mn_recorder->get_output_format_context(), 0, mn_recorder->get_url().c_str(), 1);
-			fprintf(stderr, "Main recording get chunked.\n");
-		}
-
-		// handle the main stream reading
-		ret = cbuf->peek_packet(&pkt, false);
-		if (ret > 0)
+		if (pts0 == 0)
 		{
-			if (Debug > 2)
+			pts0 = pkt.pts;
+			if (Debug > 1)
 			{
-				fprintf(stderr, "Read a main packet pts time: %lld, dt: %lldms, packet size %d, total size: %d.\n",
-					pkt.pts * timebase.num / timebase.den,
-					1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, ret);
+				fprintf(stderr, "The first packet: pts=%lld, pts_time=%lld \n",
+					pts0, pts0 * timebase.num / timebase.den);
 			}
+		}
 
-			if (mn_recorder->record(&pkt) < 0)
-			{
-				fprintf(stderr, "%s muxing packet in %s.\n",
-					mn_recorder->get_error_message().c_str(),
-					filename_mn.c_str());
-				break;
-			}
-			//av_packet_unref(&pkt);
-
-			no_data = false;
+		if (Debug > 2)
+		{
+			fprintf(stderr, "Read a background packet pts time: %lldms, dt: %lldms, packet size %d, total size: %d.\n",
+				1000 * pkt.pts * timebase.num / timebase.den,
+				1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, cbuf->get_size());
 		}
 
-		// sleep to reduce the cpu usage
-		if (no_data)
+		if (pkt.pts < pts0)
 		{
-			FfmpegLibrary::av_usleep(1000 * 20); // sleep for extra 20ms when there is no more background reading
+			fprintf(stderr, "error.\n");
 		}
-		else
+		if ((ret = bg_recorder->record(&pkt)) < 0)
 		{
-			FfmpegLibrary::av_usleep(1000 * 5); // sleep for 5ms}
+			fprintf(stderr, "%s muxing packet in %s.\n",
+				bg_recorder->get_error_message().c_str(),
+				filename_bg.c_str());
+			break;
 		}
 	}
 